@@ -0,0 +1,43 @@
+# Compares the native merged iterator against collecting and sorting each
+# track's events in Ruby, for a sequence of 128 tracks.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'benchmark'
+
+include AudioToolbox
+
+TRACKS = 128
+EVENTS_PER_TRACK = 1_000
+
+sequence = MusicSequence.new
+TRACKS.times do |i|
+  track = sequence.tracks.new
+  track.offset = (i % 4) * 0.25
+  EVENTS_PER_TRACK.times do |j|
+    track.add j * 0.5 + (i % 7) * 0.01,
+      MIDINoteMessage.new(:note => 36 + i % 60, :channel => i % 16, :duration => 0.25)
+  end
+end
+total = TRACKS * EVENTS_PER_TRACK
+
+Benchmark.bm(24) do |bm|
+  bm.report('ruby each + sort_by') do
+    events = []
+    sequence.tracks.each_with_index do |track, index|
+      offset = track.offset
+      track.each_with_time { |ev, time| events << [time + offset, index, ev] }
+    end
+    events.sort_by { |time, index, ev| [time, index] }
+  end
+  
+  bm.report('native each') do
+    sequence.iterator(:tempo => false).each { |ev, time, index| }
+  end
+  
+  bm.report('native read(4096)') do
+    iter = sequence.iterator(:tempo => false)
+    while iter.read(4096); end
+  end
+end
+
+puts "#{total} events across #{TRACKS} tracks"
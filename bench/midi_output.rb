@@ -0,0 +1,30 @@
+# Compares writing a dense controller stream one message per system call
+# against coalescing each tick's messages into a single write.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'benchmark'
+
+include AudioToolbox
+
+TICKS = 2_000
+MESSAGES_PER_TICK = 32
+
+File.open(File::NULL, 'w') do |null|
+  messages = (0...MESSAGES_PER_TICK).map do |i|
+    MIDIControlChangeMessage.new(:channel => i % 16, :number => 1, :value => i)
+  end
+  
+  Benchmark.bm(20) do |bm|
+    output = MIDIOutput.new(null)
+    bm.report('flush per message') do
+      TICKS.times { messages.each { |message| output << message; output.flush } }
+    end
+    puts "#{' ' * 21}#{output.writes} writes"
+    
+    output = MIDIOutput.new(null)
+    bm.report('flush per tick') do
+      TICKS.times { output.write(*messages) }
+    end
+    puts "#{' ' * 21}#{output.writes} writes"
+  end
+end
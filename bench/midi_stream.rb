@@ -0,0 +1,52 @@
+# Streams files of increasing size, seeking near the end of each and playing
+# a few beats, reporting the time to index each file and the growth in
+# resident set size. Memory should stay flat however large the file.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'tempfile'
+
+include AudioToolbox
+
+SIZES = [100_000, 1_000_000, 10_000_000]
+
+def rss_kb
+  `ps -o rss= -p #{Process.pid}`.to_i
+end
+
+def write_smf(path, events)
+  # 6000 bpm, so a few beats pass quickly.
+  tempo = "\x00\xFF\x51\x03\x00\x27\x10\x00\xFF\x2F\x00".b
+  pair = "\x0C\x3C\x00\x0C\x3C\x40".b
+  File.open(path, 'wb') do |f|
+    f << ['MThd', 6, 1, 2, 480].pack('a4Nnnn') << ['MTrk', tempo.bytesize].pack('a4N') << tempo
+    f << ['MTrk', 4 + pair.bytesize * (events / 2) + 4].pack('a4N') << "\x00\x90\x3C\x40".b
+    (events / 2).times { f << pair }
+    f << "\x00\xFF\x2F\x00".b
+  end
+end
+
+File.open(File::NULL, 'w') do |null|
+  output = MIDIOutput.new(null)
+  player = MusicPlayer.new
+  baseline = rss_kb
+  
+  SIZES.each do |events|
+    smf = Tempfile.new(['midi_stream', '.mid'])
+    smf.close
+    write_smf(smf.path, events)
+    
+    started = Time.now
+    stream = MIDIStream.new(smf.path)
+    indexed = Time.now - started
+    stream.midi_endpoint = output
+    player.sequence = stream
+    player.time = stream.length - 10
+    player.start
+    sleep 0.05 while player.playing?
+    
+    printf("%9d events (%4d MB): indexed in %.3fs, RSS +%d KB\n",
+           events, File.size(smf.path) >> 20, indexed, rss_kb - baseline)
+    stream.close
+    smf.unlink
+  end
+end
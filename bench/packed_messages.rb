@@ -0,0 +1,37 @@
+# Adds a generated controller stream as message objects, as packed Integers
+# one at a time and as packed Integers in bulk, then reads it back as objects
+# and packed, reporting the time and the objects allocated by each.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+EVENTS = 200_000
+
+def measure(label)
+  GC.start
+  objects = GC.stat(:total_allocated_objects)
+  started = Time.now
+  yield
+  printf("%-24s %.3fs, %9d objects\n", label, Time.now - started,
+         GC.stat(:total_allocated_objects) - objects)
+end
+
+times = (0...EVENTS).map { |i| i * 0.01 }
+packed = (0...EVENTS).map { |i| 0xBA2000 | i % 128 }
+track = nil
+
+measure('add objects') do
+  track = MusicSequence.new.tracks.new
+  EVENTS.times { |i| track.add times[i], MIDIControlChangeMessage.new(:channel => 10, :number => 32, :value => i % 128) }
+end
+measure('add packed') do
+  track = MusicSequence.new.tracks.new
+  EVENTS.times { |i| track.add times[i], packed[i] }
+end
+measure('add_all packed') do
+  track = MusicSequence.new.tracks.new
+  track.add_all times, packed
+end
+measure('each objects') { track.each { |ev| } }
+measure('each packed') { track.each(:packed => true) { |ev| } }
@@ -0,0 +1,30 @@
+# Fills a track with SysEx and lyric events, reads it back without touching
+# the payloads and then reading every payload, reporting the time and the
+# objects allocated by each. Payloads read from a track share one arena, so
+# a scan allocates an object per event but none per payload until #data.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+EVENTS = 100_000
+
+def measure(label)
+  GC.start
+  objects = GC.stat(:total_allocated_objects)
+  started = Time.now
+  yield
+  printf("%-24s %.3fs, %9d objects\n", label, Time.now - started,
+         GC.stat(:total_allocated_objects) - objects)
+end
+
+sysex = MIDIRawData.new(:data => ("\xF0\x43\x10\x4C" + "\x00" * 40 + "\xF7").b)
+lyric = MIDIMetaEvent.new(:meta_type => 0x05, :data => 'la ')
+track = MusicSequence.new.tracks.new
+
+measure('add') do
+  EVENTS.times { |i| track.add i * 0.25, i.even? ? sysex : lyric }
+end
+measure('each') { track.each { |ev| } }
+measure('each with data') { track.each { |ev| ev.data } }
+measure('each :meta') { track.each(:type => :meta) { |ev| } }
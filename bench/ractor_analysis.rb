@@ -0,0 +1,50 @@
+# Analyzes a batch of sequences one after another in the main Ractor, then
+# hands each over with MusicSequence#detach to a pool of Ractors which attach
+# and analyze them in parallel, reporting the throughput of each. Analysis
+# runs on one thread per sequence, so any speedup comes from the Ractors.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'etc'
+
+include AudioToolbox
+
+Warning[:experimental] = false
+
+SEQUENCES = 32
+TRACKS = 8
+NOTES = 10_000
+
+def build
+  sequence = MusicSequence.new
+  TRACKS.times do |t|
+    track = sequence.tracks.new
+    NOTES.times do |i|
+      track.add i * 0.25, MIDINoteMessage.new(:channel => t, :note => 36 + (i * 5 + t) % 48,
+                                              :velocity => 40 + i % 80, :duration => 0.5)
+    end
+  end
+  sequence
+end
+
+def report(label, seconds)
+  printf("%-24s %6.2fs %8.1f sequences/s\n", label, seconds, SEQUENCES / seconds)
+end
+
+sequences = Array.new(SEQUENCES) { build }
+started = Time.now
+serial = sequences.map { |sequence| sequence.analyze(:threads => 1)[:notes] }
+report('serial', Time.now - started)
+
+workers = [Etc.nprocessors, SEQUENCES].min
+[2, 4, workers].uniq.select { |n| n <= workers }.each do |n|
+  detached = Array.new(SEQUENCES) { build.detach }
+  started = Time.now
+  ractors = detached.each_slice((SEQUENCES + n - 1) / n).map do |batch|
+    Ractor.new(batch) do |mine|
+      mine.map { |d| MusicSequence.attach(d).analyze(:threads => 1)[:notes] }
+    end
+  end
+  notes = ractors.flat_map(&:take)
+  report("#{n} ractors", Time.now - started)
+  raise 'Expected the same analysis in every Ractor.' unless notes == serial
+end
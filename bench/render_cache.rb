@@ -0,0 +1,36 @@
+# Compares re-rendering a one-minute, 8-track preview from scratch after a
+# one-bar edit against re-rendering it with a RenderCache.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'benchmark'
+
+include AudioToolbox
+
+sequence = MusicSequence.new
+sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => 120)
+tracks = (0...8).map do |t|
+  track = sequence.tracks.new
+  (0...480).each do |i|
+    track.add i * 0.25, MIDINoteMessage.new(:channel => t, :note => 36 + (i * 7 + t) % 48, :duration => 0.5)
+  end
+  track
+end
+
+def edit(track, beat, note)
+  iter = track.iterator
+  iter.seek beat
+  iter.event = MIDINoteMessage.new(:note => note, :duration => 0.5)
+end
+
+cache = RenderCache.new(128 * 1024 * 1024)
+sequence.render(:cache => cache)
+
+Benchmark.bm(20) do |bm|
+  bm.report('uncached') do
+    5.times { |i| edit(tracks[3], 100, 60 + i); sequence.render }
+  end
+  bm.report('cached') do
+    5.times { |i| edit(tracks[3], 100, 70 + i); sequence.render(:cache => cache) }
+  end
+end
+puts "#{cache.hits} hits, #{cache.misses} misses, #{cache.size / 1024 / 1024} MB cached"
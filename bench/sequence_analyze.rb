@@ -0,0 +1,34 @@
+# Compares computing catalog statistics with a Ruby loop over each track's
+# events against MusicSequence#analyze on one thread and on every CPU.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'benchmark'
+
+include AudioToolbox
+
+sequence = MusicSequence.new
+16.times do |t|
+  track = sequence.tracks.new
+  20_000.times do |i|
+    track.add i * 0.125, MIDINoteMessage.new(:channel => t, :note => 36 + (i * 7 + t) % 48,
+                                             :velocity => 40 + i % 80, :duration => 0.5)
+  end
+end
+
+Benchmark.bm(20) do |bm|
+  bm.report('ruby loop') do
+    pitches = Array.new(128, 0)
+    velocities = Array.new(128, 0)
+    channels = Array.new(16, 0)
+    sequence.tracks.each do |track|
+      track.each do |ev|
+        next unless MIDINoteMessage === ev
+        pitches[ev.note] += 1
+        velocities[ev.velocity] += 1
+        channels[ev.channel] += 1
+      end
+    end
+  end
+  bm.report('analyze, 1 thread') { sequence.analyze(:threads => 1) }
+  bm.report('analyze') { sequence.analyze }
+end
@@ -0,0 +1,40 @@
+# Builds sequences of many tracks, reading each track back and digesting it,
+# then drops them, reporting the time to build and to collect the garbage and
+# the peak resident set size. A sequence's tracks and their digest blocks
+# live in one arena, so collecting a sequence releases a few chunks rather
+# than a block per track, and reading a track back makes no new storage.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+SEQUENCES = 20
+TRACKS = 200
+NOTES = 50
+
+def rss_kb
+  `ps -o rss= -p #{Process.pid}`.to_i
+end
+
+GC.start
+peak = rss_kb
+build = collect = 0.0
+SEQUENCES.times do
+  started = Time.now
+  sequence = MusicSequence.new
+  TRACKS.times do |t|
+    track = sequence.tracks.new
+    NOTES.times { |i| track.add i * 0.5, MIDINoteMessage.new(:channel => t % 16, :note => 36 + i % 48) }
+  end
+  TRACKS.times { |t| sequence.tracks[t].digest }
+  build += Time.now - started
+  peak = [peak, rss_kb].max
+  
+  sequence = nil
+  started = Time.now
+  GC.start
+  collect += Time.now - started
+end
+
+printf("%d sequences of %d tracks: built in %.2fs, collected in %.3fs, peak RSS %d MB\n",
+       SEQUENCES, TRACKS, build, collect, peak / 1024)
@@ -0,0 +1,47 @@
+# Loads and discards a large sequence many times, reporting the peak resident
+# set size and how often the GC ran. Ruby's GC only learns of the memory
+# AudioToolbox holds for a sequence's events through the size each sequence
+# reports, so with accurate accounting garbage sequences are collected long
+# before they can pile up.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'tempfile'
+
+include AudioToolbox
+
+EVENTS = 200_000
+LOADS = 100
+
+def vlq(n)
+  bytes = [n & 0x7F]
+  bytes.unshift((n >>= 7) & 0x7F | 0x80) while n > 0x7F
+  bytes.pack('C*')
+end
+
+def rss_kb
+  `ps -o rss= -p #{Process.pid}`.to_i
+end
+
+track = ''
+(EVENTS / 2).times do |i|
+  track << vlq(i.zero? ? 0 : 12) << [0x90, 36 + i % 48, 100].pack('C*')
+  track << vlq(12) << [0x80, 36 + i % 48, 0].pack('C*')
+end
+track << vlq(0) << [0xFF, 0x2F, 0].pack('C*')
+
+smf = Tempfile.new(['sequence_memory', '.mid'])
+smf.binmode
+smf << ['MThd', 6, 0, 1, 480].pack('a4Nnnn') << ['MTrk', track.bytesize].pack('a4N') << track
+smf.close
+
+GC.start
+gc_count = GC.count
+peak = rss_kb
+started = Time.now
+LOADS.times do
+  MusicSequence.new.load(smf.path)
+  peak = [peak, rss_kb].max
+end
+
+printf("%d loads of %d events: peak RSS %d MB, %d GC runs, %.2fs\n",
+       LOADS, EVENTS, peak / 1024, GC.count - gc_count, Time.now - started)
@@ -0,0 +1,51 @@
+# Plays 500 sequences at once through MIDIOutputs, each on a player of its
+# own, reporting the threads used and the CPU time spent per second of
+# playback at a low and a high event rate. Players share the scheduler's
+# threads, so CPU use should follow the event rate, not the player count.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+PLAYERS = 500
+SECONDS = 3
+
+def threads
+  File.read('/proc/self/status')[/^Threads:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  Thread.list.size
+end
+
+def play(null, notes_per_beat)
+  players = Array.new(PLAYERS) do |i|
+    sequence = MusicSequence.new
+    sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => 120)
+    track = sequence.tracks.new
+    (SECONDS * 2 * notes_per_beat).times do |n|
+      track.add n.to_f / notes_per_beat, (0x900000 | (36 + n % 48) << 8 | 100)
+      track.add (n + 0.5) / notes_per_beat, (0x800000 | (36 + n % 48) << 8)
+    end
+    sequence.midi_endpoint = MIDIOutput.new(null)
+    player = MusicPlayer.new
+    player.sequence = sequence
+    # Spread the players' starts over a beat.
+    player.time = (i % 100) / 100.0
+    player
+  end
+  
+  cpu = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+  started = Time.now
+  players.each(&:start)
+  sleep 0.05 while players.any?(&:playing?)
+  elapsed = Time.now - started
+  cpu = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) - cpu
+  
+  printf("%d players, %5d events/s: %d scheduler threads (%d in all), %.1f%% CPU over %.1fs\n",
+         PLAYERS, PLAYERS * notes_per_beat * 4, MusicPlayer.scheduler_threads, threads,
+         cpu / elapsed * 100, elapsed)
+end
+
+File.open(File::NULL, 'w') do |null|
+  play(null, 1)
+  play(null, 8)
+end
@@ -0,0 +1,33 @@
+# Measures how many voices the internal synth renders per second of CPU on
+# a dense, one-minute piano texture of about 130 overlapping notes, with
+# and without enough polyphony to avoid stealing.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+require 'benchmark'
+
+include AudioToolbox
+
+RATE = 44100
+BEATS = 120
+NOTES_PER_BEAT = 16
+DURATION = 8.0
+
+sequence = MusicSequence.new
+track = sequence.tracks.new
+(BEATS * NOTES_PER_BEAT).times do |i|
+  track.add i.to_f / NOTES_PER_BEAT,
+            MIDINoteMessage.new(:note => 36 + (i * 11) % 60, :velocity => 30 + i % 90, :duration => DURATION)
+end
+
+# Voice-seconds requested, ignoring the short release.
+voice_secs = BEATS * NOTES_PER_BEAT * DURATION * 0.5
+
+Benchmark.bm(20) do |bm|
+  [256, 64, 16].each do |polyphony|
+    time = bm.report("polyphony #{polyphony}") do
+      sequence.render(:sample_rate => RATE, :polyphony => polyphony)
+    end
+    rendered = [voice_secs, polyphony * BEATS * 0.5].min
+    puts "#{' ' * 21}#{(rendered / time.real).round} voices per second"
+  end
+end
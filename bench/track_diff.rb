@@ -0,0 +1,31 @@
+# Compares two large tracks which differ in a single event, natively and by
+# zipping their enumerations in Ruby, then diffs them and compares them
+# again after an edit. Only the digest blocks an edit touched are reread.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+EVENTS = 200_000
+
+def time
+  started = Time.now
+  result = yield
+  [result, Time.now - started]
+end
+
+sequence = MusicSequence.new
+a, b = sequence.tracks.new, sequence.tracks.new
+[a, b].each do |track|
+  EVENTS.times { |i| track.add i * 0.25, MIDINoteMessage.new(:channel => 0, :note => 36 + i % 48, :duration => 0.25) }
+end
+b.add EVENTS * 0.125, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 100)
+
+zipped, ruby = time { a.to_enum(:each_with_time).zip(b.to_enum(:each_with_time)).all? { |x, y| x == y } }
+equal, native = time { a == b }
+diff, diffed = time { b.diff(a) }
+b.add 10, MIDINoteMessage.new(:channel => 0, :note => 60)
+_, edited = time { a == b }
+
+printf("%d events: Ruby %.3fs (%s), native %.3fs (%s), diff %.3fs (%d records), after an edit %.4fs\n",
+       EVENTS, ruby, zipped, native, equal, diffed, diff.size / MusicTrack::DIFF_SIZE, edited)
@@ -0,0 +1,59 @@
+# Plays notes with a user event on every beat through a MIDIOutput, first
+# with no handler and then with handlers which take longer and longer, and
+# reports how late the notes reached the output and how long each cue
+# waited for the dispatcher. Slow handlers should delay only their cues.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+BEATS = 64
+BPM = 1920.0
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def play(label, work)
+  reader, writer = IO.pipe
+  sequence = MusicSequence.new
+  sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => BPM)
+  track = sequence.tracks.new
+  BEATS.times do |beat|
+    track.add beat, MIDINoteMessage.new(:note => 60, :duration => 0.5)
+    track.add beat, MusicUserEvent.new(:data => beat.to_s)
+  end
+  sequence.midi_endpoint = output = MIDIOutput.new(writer)
+  player = MusicPlayer.new
+  player.sequence = sequence
+  
+  arrivals = []
+  listener = Thread.new do
+    while (bytes = reader.readpartial(3) rescue nil)
+      arrivals << now if bytes.getbyte(0) & 0xF0 == 0x90
+    end
+  end
+  latencies = []
+  sequence.on_user_event { |cue| sleep work if work > 0; latencies << cue.latency } if work
+  
+  player.start
+  started = now
+  player.wait_for_stop
+  sequence.on_user_event if work
+  writer.close
+  listener.join
+  
+  late = arrivals.each_with_index.map { |at, beat| at - (started + beat * 60.0 / BPM) }
+  printf("%-16s notes late %6.2fms worst %6.2fms", label, late.sum / late.size * 1000, late.max * 1000)
+  if work
+    printf(", cues late %7.2fms worst %7.2fms, dropped %d",
+           latencies.sum / latencies.size * 1000, latencies.max * 1000, sequence.dropped_cues)
+  end
+  puts
+ensure
+  output.close
+  reader.close
+end
+
+play('no handler', nil)
+[0, 0.001, 0.01, 0.05].each { |work| play("handler #{(work * 1000).round}ms", work) }
@@ -0,0 +1,48 @@
+# Waits for a series of beats which fall between events, first by polling
+# MusicPlayer#time in a sleep loop and then with MusicPlayer#wait_until,
+# reporting how late each wait returned and the CPU time spent waiting.
+$:.unshift File.join(File.dirname(__FILE__), '../lib')
+require 'music_player'
+
+include AudioToolbox
+
+BEATS = 40
+POLL = 0.005
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+def cpu
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+def play(label)
+  reader, writer = IO.pipe
+  sequence = MusicSequence.new
+  sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => 600)
+  sequence.tracks.new.add BEATS + 1, MIDINoteMessage.new(:note => 60)
+  sequence.midi_endpoint = output = MIDIOutput.new(writer)
+  player = MusicPlayer.new
+  player.sequence = sequence
+  
+  lateness = []
+  started_cpu = cpu
+  player.start
+  started = now
+  1.upto(BEATS) do |beat|
+    yield player, beat - 0.5
+    lateness << now - (started + (beat - 0.5) * 0.1)
+  end
+  used = cpu - started_cpu
+  player.stop
+  printf("%-12s mean late %6.3fms, worst %6.3fms, cpu %6.1fms\n", label,
+         lateness.sum / lateness.size * 1000, lateness.max * 1000, used * 1000)
+ensure
+  output.close
+  reader.close
+  writer.close
+end
+
+play('poll') { |player, beat| sleep POLL while player.time < beat }
+play('wait_until') { |player, beat| player.wait_until(beat) }
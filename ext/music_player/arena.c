@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    size_t used;
+    uint8_t *data;
+};
+
+static size_t
+arena_round (size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+void
+arena_init (Arena *arena, size_t chunk_size)
+{
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    arena->bytes = 0;
+    arena->last = NULL;
+}
+
+void
+arena_free (Arena *arena)
+{
+    ArenaChunk *chunk, *next;
+    for (chunk = arena->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena_init(arena, arena->chunk_size);
+}
+
+static ArenaChunk *
+arena_new_chunk (Arena *arena, size_t size)
+{
+    size_t header = arena_round(sizeof(ArenaChunk));
+    ArenaChunk *chunk;
+    
+    if (size < arena->chunk_size) size = arena->chunk_size;
+    if (!(chunk = calloc(1, header + size))) return NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->data = (uint8_t *) chunk + header;
+    arena->bytes += header + size;
+    return chunk;
+}
+
+void *
+arena_alloc (Arena *arena, size_t size)
+{
+    ArenaChunk *chunk = arena->chunks, *fresh;
+    void *ptr;
+    
+    size = arena_round(size ? size : 1);
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (!(fresh = arena_new_chunk(arena, size))) return NULL;
+        if (chunk && size > arena->chunk_size / 2) {
+            /* A large allocation gets a chunk of its own behind the current
+             * one, so that the current one's free space is not lost. */
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        } else {
+            fresh->next = chunk;
+            arena->chunks = fresh;
+        }
+        chunk = fresh;
+    }
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void *
+arena_grow (Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    ArenaChunk *chunk = arena->chunks;
+    size_t old_rounded = arena_round(old_size ? old_size : 1), new_rounded = arena_round(new_size);
+    void *grown;
+    
+    if (!ptr) return arena_alloc(arena, new_size);
+    if (new_size <= old_size) return ptr;
+    if (ptr == arena->last && chunk && (uint8_t *) ptr + old_rounded == chunk->data + chunk->used &&
+        chunk->size - chunk->used >= new_rounded - old_rounded) {
+        chunk->used += new_rounded - old_rounded;
+        return ptr;
+    }
+    if (!(grown = arena_alloc(arena, new_size))) return NULL;
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
@@ -0,0 +1,38 @@
+/*
+ * A chunked bump allocator for memory which lives exactly as long as its
+ * owner, such as the per-track state of a sequence.
+ *
+ * Allocations are carved from large chunks in turn and never freed one by
+ * one; arena_free releases every chunk at once. Memory comes back zeroed.
+ * Growing the most recent allocation extends it in place when its chunk
+ * has room, and otherwise copies it, leaving the old space unused until the
+ * arena is freed.
+ */
+
+#ifndef MUSIC_PLAYER_ARENA_H
+#define MUSIC_PLAYER_ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;     /* the newest first */
+    size_t chunk_size;
+    size_t bytes;           /* reserved by all chunks */
+    void *last;             /* the most recent allocation */
+} Arena;
+
+/* Chunks are chunk_size bytes unless an allocation needs more. */
+void arena_init (Arena *arena, size_t chunk_size);
+void arena_free (Arena *arena);
+
+/* Returns NULL if a chunk could not be allocated. */
+void *arena_alloc (Arena *arena, size_t size);
+
+/* Grow ptr, allocated from the arena with old_size bytes, to new_size
+ * bytes, returning the new location or NULL. The contents are kept and the
+ * new bytes zeroed. */
+void *arena_grow (Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+#endif
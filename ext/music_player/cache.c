@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct CacheEntry {
+    Digest key;
+    CacheEntry *chain;      /* next entry in the same bucket */
+    CacheEntry *newer;
+    CacheEntry *older;
+    uint32_t frames;
+    float samples[];
+};
+
+#define CACHE_MIN_BUCKETS 64
+
+/* Digests are already well mixed, so their leading bytes make the hash. */
+static size_t
+cache_bucket (const Cache *cache, const Digest *key)
+{
+    uint64_t h;
+    memcpy(&h, key->bytes, sizeof(h));
+    return (size_t) (h & (cache->bucket_count - 1));
+}
+
+static size_t
+entry_bytes (uint32_t frames)
+{
+    return (size_t) frames * sizeof(float);
+}
+
+static void
+lru_unlink (Cache *cache, CacheEntry *entry)
+{
+    if (entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void
+lru_push (Cache *cache, CacheEntry *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest) cache->newest->newer = entry;
+    cache->newest = entry;
+    if (!cache->oldest) cache->oldest = entry;
+}
+
+static void
+cache_remove (Cache *cache, CacheEntry *entry)
+{
+    CacheEntry **link = &cache->buckets[cache_bucket(cache, &entry->key)];
+    while (*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+    lru_unlink(cache, entry);
+    cache->count--;
+    cache->bytes -= entry_bytes(entry->frames);
+    free(entry);
+}
+
+static void
+cache_evict (Cache *cache, size_t max_bytes)
+{
+    while (cache->oldest && cache->bytes > max_bytes) {
+        cache_remove(cache, cache->oldest);
+        cache->evictions++;
+    }
+}
+
+/* Double the table once it averages more than one entry per bucket. */
+static int
+cache_grow (Cache *cache)
+{
+    size_t i, n = cache->bucket_count ? cache->bucket_count * 2 : CACHE_MIN_BUCKETS;
+    CacheEntry **old = cache->buckets, *entry, *next;
+    size_t old_count = cache->bucket_count;
+    
+    cache->buckets = (CacheEntry **) calloc(n, sizeof(CacheEntry *));
+    if (!cache->buckets) {
+        cache->buckets = old;
+        return -1;
+    }
+    cache->bucket_count = n;
+    for (i = 0; i < old_count; i++) {
+        for (entry = old[i]; entry; entry = next) {
+            next = entry->chain;
+            entry->chain = cache->buckets[cache_bucket(cache, &entry->key)];
+            cache->buckets[cache_bucket(cache, &entry->key)] = entry;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+void
+cache_init (Cache *cache, size_t max_bytes)
+{
+    memset(cache, 0, sizeof(Cache));
+    cache->max_bytes = max_bytes;
+}
+
+void
+cache_clear (Cache *cache)
+{
+    while (cache->oldest) cache_remove(cache, cache->oldest);
+}
+
+void
+cache_free (Cache *cache)
+{
+    cache_clear(cache);
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->bucket_count = 0;
+}
+
+void
+cache_set_max_bytes (Cache *cache, size_t max_bytes)
+{
+    cache->max_bytes = max_bytes;
+    cache_evict(cache, max_bytes);
+}
+
+const float *
+cache_get (Cache *cache, const Digest *key, uint32_t *frames)
+{
+    CacheEntry *entry = NULL;
+    
+    if (cache->bucket_count)
+        entry = cache->buckets[cache_bucket(cache, key)];
+    for (; entry; entry = entry->chain)
+        if (memcmp(entry->key.bytes, key->bytes, DIGEST_SIZE) == 0) break;
+    
+    if (!entry) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+    *frames = entry->frames;
+    return entry->samples;
+}
+
+int
+cache_put (Cache *cache, const Digest *key, const float *samples, uint32_t frames)
+{
+    size_t bytes = entry_bytes(frames), bucket;
+    CacheEntry *entry;
+    
+    if (bytes > cache->max_bytes) return 0;
+    if (cache->count >= cache->bucket_count && cache_grow(cache) < 0) return -1;
+    
+    for (entry = cache->buckets[cache_bucket(cache, key)]; entry; entry = entry->chain) {
+        if (memcmp(entry->key.bytes, key->bytes, DIGEST_SIZE) == 0) {
+            cache_remove(cache, entry);
+            break;
+        }
+    }
+    cache_evict(cache, cache->max_bytes - bytes);
+    
+    entry = (CacheEntry *) malloc(sizeof(CacheEntry) + bytes);
+    if (!entry) return -1;
+    entry->key = *key;
+    entry->frames = frames;
+    memcpy(entry->samples, samples, bytes);
+    
+    bucket = cache_bucket(cache, key);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    lru_push(cache, entry);
+    cache->count++;
+    cache->bytes += bytes;
+    return 0;
+}
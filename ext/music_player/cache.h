@@ -0,0 +1,51 @@
+/*
+ * A least-recently-used cache of rendered audio keyed by content digest,
+ * capped at a number of bytes of sample data.
+ */
+
+#ifndef MUSIC_PLAYER_CACHE_H
+#define MUSIC_PLAYER_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "digest.h"
+
+typedef struct CacheEntry CacheEntry;
+
+typedef struct {
+    CacheEntry **buckets;
+    size_t bucket_count;
+    CacheEntry *newest;
+    CacheEntry *oldest;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} Cache;
+
+void cache_init (Cache *cache, size_t max_bytes);
+void cache_free (Cache *cache);
+
+/* Drop every entry. The statistics are kept. */
+void cache_clear (Cache *cache);
+
+/* Change the cap, evicting entries until the cache fits. */
+void cache_set_max_bytes (Cache *cache, size_t max_bytes);
+
+/*
+ * Look up the samples stored under key, counting a hit or a miss. A hit
+ * makes the entry the most recently used. The samples remain valid until
+ * the next call which modifies the cache.
+ */
+const float *cache_get (Cache *cache, const Digest *key, uint32_t *frames);
+
+/*
+ * Store a copy of the samples under key, evicting the least recently used
+ * entries to stay within the cap. Samples larger than the cap are not
+ * stored. Returns -1 if memory could not be allocated.
+ */
+int cache_put (Cache *cache, const Digest *key, const float *samples, uint32_t frames);
+
+#endif
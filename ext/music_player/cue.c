@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "cue.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MASK (CUE_RING_SIZE - 1)
+
+static int
+set_flags (int fd, int fl)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | fl) < 0) return -1;
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+CueQueue *
+cue_queue_new (void)
+{
+    CueQueue *queue = calloc(1, sizeof(CueQueue));
+    size_t i;
+    int saved;
+    
+    if (!queue) return NULL;
+    if (pipe(queue->notify) < 0) {
+        saved = errno;
+        free(queue);
+        errno = saved;
+        return NULL;
+    }
+    /* A full pipe means the consumer has a wakeup pending already, so
+     * producers never wait to write. */
+    if (set_flags(queue->notify[0], O_NONBLOCK) < 0 || set_flags(queue->notify[1], O_NONBLOCK) < 0) {
+        saved = errno;
+        close(queue->notify[0]);
+        close(queue->notify[1]);
+        free(queue);
+        errno = saved;
+        return NULL;
+    }
+    for (i = 0; i < CUE_RING_SIZE; i++)
+        queue->slots[i].seq = i;
+    queue->refs = 1;
+    return queue;
+}
+
+void
+cue_queue_retain (CueQueue *queue)
+{
+    __atomic_add_fetch(&queue->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+cue_queue_release (CueQueue *queue)
+{
+    CueEvent ev;
+    
+    if (__atomic_sub_fetch(&queue->refs, 1, __ATOMIC_ACQ_REL)) return;
+    while (cue_drain(queue, &ev, 1)) cue_event_free(&ev);
+    close(queue->notify[0]);
+    close(queue->notify[1]);
+    free(queue);
+}
+
+void
+cue_queue_enable (CueQueue *queue, int on)
+{
+    __atomic_store_n(&queue->enabled, on, __ATOMIC_RELEASE);
+}
+
+int
+cue_push (CueQueue *queue, double beat, double scheduled, int32_t track,
+          const uint8_t *data, uint32_t length)
+{
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED), seq;
+    CueSlot *slot;
+    uint8_t byte = 0;
+    
+    if (!__atomic_load_n(&queue->enabled, __ATOMIC_ACQUIRE)) return -1;
+    for (;;) {
+        slot = &queue->slots[pos & RING_MASK];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if ((ptrdiff_t) (seq - pos) < 0) {
+            /* The slot still holds the cue from a lap ago. */
+            __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    
+    slot->ev.beat = beat;
+    slot->ev.scheduled = scheduled;
+    slot->ev.track = track;
+    slot->ev.length = length;
+    slot->ev.heap = NULL;
+    if (length > CUE_INLINE) {
+        /* Dropped payloads still publish the slot, empty, to keep order. */
+        if ((slot->ev.heap = malloc(length))) {
+            memcpy(slot->ev.heap, data, length);
+        } else {
+            slot->ev.length = 0;
+            __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        memcpy(slot->ev.data, data, length);
+    }
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    
+    /* As in recorder_push: if the consumer had taken everything before this
+     * cue it may be about to sleep, so wake it. */
+    if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == pos)
+        while (write(queue->notify[1], &byte, 1) < 0 && errno == EINTR);
+    return 0;
+}
+
+size_t
+cue_drain (CueQueue *queue, CueEvent *out, size_t max)
+{
+    size_t tail = queue->tail, n = 0;
+    uint8_t buf[64];
+    CueSlot *slot;
+    
+    while (read(queue->notify[0], buf, sizeof(buf)) > 0);
+    
+    while (n < max) {
+        slot = &queue->slots[tail & RING_MASK];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != tail + 1) {
+            /* Publish the tail and look again, so that a producer which
+             * missed it has published its cue by now. */
+            if (__atomic_load_n(&queue->tail, __ATOMIC_RELAXED) == tail) break;
+            __atomic_store_n(&queue->tail, tail, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        out[n++] = slot->ev;
+        __atomic_store_n(&slot->seq, tail + CUE_RING_SIZE, __ATOMIC_RELEASE);
+        tail++;
+    }
+    __atomic_store_n(&queue->tail, tail, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+const uint8_t *
+cue_event_data (const CueEvent *ev)
+{
+    return ev->heap ? ev->heap : ev->data;
+}
+
+void
+cue_event_free (CueEvent *ev)
+{
+    free(ev->heap);
+    ev->heap = NULL;
+}
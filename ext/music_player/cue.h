@@ -0,0 +1,70 @@
+/*
+ * User events, or cues, on their way from the threads which play a
+ * sequence to the Ruby thread which dispatches them.
+ *
+ * Any number of playback threads push cues into a bounded, lock-free ring,
+ * each claiming a slot by advancing the head and publishing it by setting
+ * the slot's sequence number, so a producer never waits on another or on
+ * the consumer. A single consumer drains the ring in batches. A producer
+ * writes to the notify descriptor whenever the consumer may have found the
+ * ring empty, so the consumer can sleep on it; when the ring is full, cues
+ * are dropped and counted rather than blocking playback.
+ */
+
+#ifndef MUSIC_PLAYER_CUE_H
+#define MUSIC_PLAYER_CUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CUE_RING_SIZE 256           /* must be a power of two */
+
+/* Payloads up to this many bytes are copied into the ring itself. */
+#define CUE_INLINE 40
+
+typedef struct {
+    double beat;
+    double scheduled;       /* seconds at which it was due, by the player's clock */
+    int32_t track;          /* index, or -1 for the tempo track */
+    uint32_t length;
+    uint8_t *heap;          /* the payload, if longer than CUE_INLINE bytes */
+    uint8_t data[CUE_INLINE];
+} CueEvent;
+
+typedef struct {
+    size_t seq;
+    CueEvent ev;
+} CueSlot;
+
+typedef struct {
+    int refs;
+    int enabled;            /* cues are dropped silently while zero */
+    int notify[2];
+    size_t head;            /* claimed by producers */
+    size_t tail;            /* written by the consumer */
+    uint64_t dropped;
+    CueSlot slots[CUE_RING_SIZE];
+} CueQueue;
+
+/* Queues are reference counted, so that a player can keep pushing to one
+ * after its sequence has been collected. A new queue holds one reference
+ * and is disabled. Returns NULL and sets errno on failure. */
+CueQueue *cue_queue_new (void);
+void cue_queue_retain (CueQueue *queue);
+void cue_queue_release (CueQueue *queue);
+
+void cue_queue_enable (CueQueue *queue, int on);
+
+/* Queue a copy of a payload. Returns 0, or -1 if the queue is disabled or
+ * the cue was dropped. Safe to call from any thread. */
+int cue_push (CueQueue *queue, double beat, double scheduled, int32_t track,
+              const uint8_t *data, uint32_t length);
+
+/* Take up to max cues. Only one thread may drain; it must pass each cue to
+ * cue_event_free once it has copied the payload. */
+size_t cue_drain (CueQueue *queue, CueEvent *out, size_t max);
+
+const uint8_t *cue_event_data (const CueEvent *ev);
+void cue_event_free (CueEvent *ev);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "digest.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t
+rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/* Read eight bytes as a little-endian integer, whatever the host order. */
+static uint64_t
+load64 (const uint8_t *p)
+{
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+void
+digest_compute (const void *data, size_t len, Digest *out)
+{
+    const uint8_t *bytes = (const uint8_t *) data, *tail;
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    size_t i, blocks = len / 16;
+    
+    for (i = 0; i < blocks; i++) {
+        k1 = load64(bytes + i * 16);
+        k2 = load64(bytes + i * 16 + 8);
+        
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+    
+    tail = bytes + blocks * 16;
+    k1 = k2 = 0;
+    switch (len & 15) {
+    case 15: k2 ^= (uint64_t) tail[14] << 48;
+    case 14: k2 ^= (uint64_t) tail[13] << 40;
+    case 13: k2 ^= (uint64_t) tail[12] << 32;
+    case 12: k2 ^= (uint64_t) tail[11] << 24;
+    case 11: k2 ^= (uint64_t) tail[10] << 16;
+    case 10: k2 ^= (uint64_t) tail[9] << 8;
+    case 9:  k2 ^= (uint64_t) tail[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    case 8:  k1 ^= (uint64_t) tail[7] << 56;
+    case 7:  k1 ^= (uint64_t) tail[6] << 48;
+    case 6:  k1 ^= (uint64_t) tail[5] << 40;
+    case 5:  k1 ^= (uint64_t) tail[4] << 32;
+    case 4:  k1 ^= (uint64_t) tail[3] << 24;
+    case 3:  k1 ^= (uint64_t) tail[2] << 16;
+    case 2:  k1 ^= (uint64_t) tail[1] << 8;
+    case 1:  k1 ^= (uint64_t) tail[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+    
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    
+    for (i = 0; i < 8; i++) {
+        out->bytes[i] = (uint8_t) (h1 >> (8 * i));
+        out->bytes[8 + i] = (uint8_t) (h2 >> (8 * i));
+    }
+}
+
+void
+digest_buffer_init (DigestBuffer *buf)
+{
+    memset(buf, 0, sizeof(DigestBuffer));
+}
+
+void
+digest_buffer_free (DigestBuffer *buf)
+{
+    free(buf->bytes);
+    digest_buffer_init(buf);
+}
+
+void
+digest_buffer_put (DigestBuffer *buf, const void *data, size_t len)
+{
+    if (buf->failed) return;
+    if (buf->length + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 1024;
+        uint8_t *bytes;
+        while (capacity < buf->length + len) capacity *= 2;
+        if (!(bytes = realloc(buf->bytes, capacity))) {
+            buf->failed = 1;
+            return;
+        }
+        buf->bytes = bytes;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->bytes + buf->length, data, len);
+    buf->length += len;
+}
+
+void
+digest_buffer_put_u8 (DigestBuffer *buf, uint8_t v)
+{
+    digest_buffer_put(buf, &v, 1);
+}
+
+void
+digest_buffer_put_u32 (DigestBuffer *buf, uint32_t v)
+{
+    uint8_t le[4];
+    int i;
+    for (i = 0; i < 4; i++) le[i] = (uint8_t) (v >> (8 * i));
+    digest_buffer_put(buf, le, 4);
+}
+
+void
+digest_buffer_put_u64 (DigestBuffer *buf, uint64_t v)
+{
+    uint8_t le[8];
+    int i;
+    for (i = 0; i < 8; i++) le[i] = (uint8_t) (v >> (8 * i));
+    digest_buffer_put(buf, le, 8);
+}
+
+void
+digest_buffer_put_f32 (DigestBuffer *buf, float v)
+{
+    uint32_t bits;
+    if (v == 0.0f) v = 0.0f;    /* -0.0 and 0.0 hash alike */
+    memcpy(&bits, &v, 4);
+    digest_buffer_put_u32(buf, bits);
+}
+
+void
+digest_buffer_put_f64 (DigestBuffer *buf, double v)
+{
+    uint64_t bits;
+    if (v == 0.0) v = 0.0;
+    memcpy(&bits, &v, 8);
+    digest_buffer_put_u64(buf, bits);
+}
+
+int
+digest_buffer_finish (DigestBuffer *buf, Digest *out)
+{
+    if (buf->failed) return -1;
+    digest_compute(buf->bytes, buf->length, out);
+    return 0;
+}
+
+void
+digest_hex (const Digest *digest, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < DIGEST_SIZE; i++) {
+        out[2 * i] = hex[digest->bytes[i] >> 4];
+        out[2 * i + 1] = hex[digest->bytes[i] & 0x0F];
+    }
+    out[2 * DIGEST_SIZE] = '\0';
+}
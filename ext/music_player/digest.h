@@ -0,0 +1,44 @@
+/*
+ * Content digests which are stable across processes and platforms.
+ *
+ * Values are serialized in a fixed little-endian layout into a
+ * DigestBuffer and hashed with MurmurHash3 (x64, 128 bit).
+ */
+
+#ifndef MUSIC_PLAYER_DIGEST_H
+#define MUSIC_PLAYER_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_SIZE 16
+
+typedef struct {
+    uint8_t bytes[DIGEST_SIZE];
+} Digest;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+    int failed;         /* set if an allocation failed */
+} DigestBuffer;
+
+void digest_compute (const void *data, size_t len, Digest *out);
+
+void digest_buffer_init (DigestBuffer *buf);
+void digest_buffer_free (DigestBuffer *buf);
+void digest_buffer_put (DigestBuffer *buf, const void *data, size_t len);
+void digest_buffer_put_u8 (DigestBuffer *buf, uint8_t v);
+void digest_buffer_put_u32 (DigestBuffer *buf, uint32_t v);
+void digest_buffer_put_u64 (DigestBuffer *buf, uint64_t v);
+void digest_buffer_put_f32 (DigestBuffer *buf, float v);
+void digest_buffer_put_f64 (DigestBuffer *buf, double v);
+
+/* Hash the buffer's contents. Returns -1 if any put failed. */
+int digest_buffer_finish (DigestBuffer *buf, Digest *out);
+
+/* Write the digest as 32 lowercase hex digits and a NUL. */
+void digest_hex (const Digest *digest, char *out);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "endpoint.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Endpoint *
+endpoint_new (void)
+{
+    Endpoint *ep = calloc(1, sizeof(Endpoint));
+    if (!ep) return NULL;
+    ep->fd = -1;
+    ep->refs = 1;
+    pthread_mutex_init(&ep->lock, NULL);
+    return ep;
+}
+
+void
+endpoint_retain (Endpoint *ep)
+{
+    pthread_mutex_lock(&ep->lock);
+    ep->refs++;
+    pthread_mutex_unlock(&ep->lock);
+}
+
+void
+endpoint_release (Endpoint *ep)
+{
+    int refs;
+    pthread_mutex_lock(&ep->lock);
+    refs = --ep->refs;
+    pthread_mutex_unlock(&ep->lock);
+    if (refs) return;
+    endpoint_close(ep);
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+}
+
+int
+endpoint_open (Endpoint *ep, const char *path)
+{
+    int fd, flags;
+    
+    /* Opening a FIFO without O_NONBLOCK would wait for a reader; fail
+     * instead. Writes are non-blocking too. */
+    if ((fd = open(path, O_WRONLY | O_NONBLOCK)) < 0) return -1;
+    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    endpoint_close(ep);
+    ep->fd = fd;
+    ep->owned = 1;
+    return 0;
+}
+
+void
+endpoint_attach (Endpoint *ep, int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    endpoint_close(ep);
+    ep->fd = fd;
+    ep->owned = 0;
+}
+
+void
+endpoint_close (Endpoint *ep)
+{
+    pthread_mutex_lock(&ep->lock);
+    if (ep->owned && ep->fd >= 0) close(ep->fd);
+    ep->fd = -1;
+    free(ep->bytes);
+    free(ep->packets);
+    ep->bytes = NULL;
+    ep->packets = NULL;
+    ep->length = ep->capacity = ep->count = ep->packets_capacity = ep->partial = 0;
+    ep->running_status = 0;
+    pthread_mutex_unlock(&ep->lock);
+}
+
+size_t
+endpoint_message_length (uint8_t status)
+{
+    switch (status & 0xF0) {
+    case 0x80: case 0x90: case 0xA0: case 0xB0: case 0xE0:
+        return 3;
+    case 0xC0: case 0xD0:
+        return 2;
+    }
+    switch (status) {
+    case 0xF1: case 0xF3: return 2;
+    case 0xF2: return 3;
+    case 0xF6: case 0xF8: case 0xFA: case 0xFB: case 0xFC: case 0xFE: case 0xFF:
+        return 1;
+    }
+    return 0;
+}
+
+int
+endpoint_add (Endpoint *ep, const uint8_t *msg, size_t len)
+{
+    EndpointPacket *packet;
+    int err = 0;
+    
+    if (len == 0) return 0;
+    pthread_mutex_lock(&ep->lock);
+    if (ep->fd < 0) {
+        err = EBADF;
+        goto done;
+    }
+    if (ep->length + len > ENDPOINT_MAX_PENDING) {
+        ep->dropped++;
+        err = ENOBUFS;
+        goto done;
+    }
+    
+    /* Channel messages drop a status byte that repeats the previous one.
+     * Anything else cancels running status. */
+    if (msg[0] >= 0x80 && msg[0] < 0xF0) {
+        if (msg[0] == ep->running_status && len > 1) {
+            msg++;
+            len--;
+        } else {
+            ep->running_status = msg[0];
+        }
+    } else if (msg[0] < 0xF8) {
+        ep->running_status = 0;
+    }
+    
+    if (ep->length + len > ep->capacity) {
+        size_t capacity = ep->capacity ? ep->capacity * 2 : 256;
+        uint8_t *bytes;
+        while (capacity < ep->length + len) capacity *= 2;
+        if (!(bytes = realloc(ep->bytes, capacity))) {
+            err = ENOMEM;
+            goto done;
+        }
+        ep->bytes = bytes;
+        ep->capacity = capacity;
+    }
+    if (ep->count == ep->packets_capacity) {
+        size_t capacity = ep->packets_capacity ? ep->packets_capacity * 2 : 64;
+        EndpointPacket *packets = realloc(ep->packets, capacity * sizeof(EndpointPacket));
+        if (!packets) {
+            err = ENOMEM;
+            goto done;
+        }
+        ep->packets = packets;
+        ep->packets_capacity = capacity;
+    }
+    
+    packet = &ep->packets[ep->count++];
+    packet->offset = (uint32_t) ep->length;
+    packet->length = (uint32_t) len;
+    memcpy(ep->bytes + ep->length, msg, len);
+    ep->length += len;
+    ep->messages++;
+    
+    done:
+    pthread_mutex_unlock(&ep->lock);
+    if (err) errno = err;
+    return err ? -1 : 0;
+}
+
+/* Move the messages still to be written to the front of the buffers. */
+static void
+endpoint_compact (Endpoint *ep, size_t next)
+{
+    size_t i, offset;
+    
+    if (next == 0) return;
+    offset = ep->packets[next].offset;
+    memmove(ep->bytes, ep->bytes + offset, ep->length - offset);
+    memmove(ep->packets, ep->packets + next, (ep->count - next) * sizeof(EndpointPacket));
+    ep->length -= offset;
+    ep->count -= next;
+    for (i = 0; i < ep->count; i++) ep->packets[i].offset -= (uint32_t) offset;
+}
+
+int
+endpoint_flush (Endpoint *ep)
+{
+    size_t next = 0, skip, start;
+    int err = 0;
+    ssize_t written;
+    
+    pthread_mutex_lock(&ep->lock);
+    skip = ep->partial;
+    while (next < ep->count) {
+        /* The packets lie end to end in the buffer, so everything left is
+         * written at once, resuming part way through a packet after a short
+         * write. The packets only account for what was written. */
+        start = ep->packets[next].offset + skip;
+        if ((written = write(ep->fd, ep->bytes + start, ep->length - start)) < 0) {
+            if (errno == EINTR) continue;
+            err = errno == EWOULDBLOCK ? EAGAIN : errno;
+            break;
+        }
+        ep->writes++;
+        ep->bytes_written += written;
+        
+        while (next < ep->count && (size_t) written >= ep->packets[next].length - skip) {
+            written -= ep->packets[next].length - skip;
+            next++;
+            skip = 0;
+        }
+        skip += written;
+    }
+    
+    /* Whatever the reader would not take yet waits for the next flush. The
+     * running status carries on, as the bytes still go out in order. */
+    if (err == EAGAIN) {
+        endpoint_compact(ep, next);
+        ep->partial = skip;
+    } else {
+        ep->length = 0;
+        ep->count = 0;
+        ep->partial = 0;
+        ep->running_status = 0;
+    }
+    pthread_mutex_unlock(&ep->lock);
+    if (err) errno = err;
+    return err ? -1 : 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * A portable MIDI output endpoint writing raw MIDI bytes to a file
+ * descriptor, such as an ALSA rawmidi device, a FIFO or a pipe.
+ *
+ * Messages are queued into a packet list and written together by
+ * endpoint_flush with a single write, so that everything due in one
+ * scheduling tick costs one system call. Within a packet list, channel
+ * messages sharing a status byte are sent with running status.
+ *
+ * The descriptor is put in non-blocking mode and a flush never waits for
+ * the reader: whatever it will not take yet stays queued for the next
+ * flush, up to ENDPOINT_MAX_PENDING bytes, beyond which messages are
+ * dropped and counted.
+ */
+
+#ifndef MUSIC_PLAYER_ENDPOINT_H
+#define MUSIC_PLAYER_ENDPOINT_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ENDPOINT_MAX_PENDING 65536
+
+typedef struct {
+    uint32_t offset;
+    uint32_t length;
+} EndpointPacket;
+
+typedef struct {
+    int fd;
+    int owned;              /* close fd when the endpoint is closed */
+    int refs;
+    pthread_mutex_t lock;
+    uint8_t *bytes;
+    size_t length;
+    size_t capacity;
+    EndpointPacket *packets;
+    size_t count;
+    size_t packets_capacity;
+    size_t partial;         /* bytes of the first packet already written */
+    uint8_t running_status;
+    /* Totals since the endpoint was opened. */
+    uint64_t writes;
+    uint64_t messages;
+    uint64_t bytes_written;
+    uint64_t dropped;
+} Endpoint;
+
+/* Endpoints are reference counted, so that a player can keep writing to
+ * one after the object which opened it has been collected. A new endpoint
+ * is closed and holds one reference. */
+Endpoint *endpoint_new (void);
+void endpoint_retain (Endpoint *ep);
+void endpoint_release (Endpoint *ep);
+
+/* Returns 0, or -1 and sets errno. */
+int endpoint_open (Endpoint *ep, const char *path);
+void endpoint_attach (Endpoint *ep, int fd);
+void endpoint_close (Endpoint *ep);
+
+/* Length of a channel or system common message with the given status,
+ * or 0 if the status byte does not start one. */
+size_t endpoint_message_length (uint8_t status);
+
+/* Queue one message. Returns 0, or -1 and sets errno, to ENOBUFS if too
+ * much is already waiting for the reader. */
+int endpoint_add (Endpoint *ep, const uint8_t *msg, size_t len);
+
+/* Write as many queued messages as the descriptor takes without blocking.
+ * Returns 0 once all are written, or -1 and sets errno: to EAGAIN if some
+ * are left queued for a later flush, or to anything else if the write
+ * failed, in which case the unwritten messages are discarded. */
+int endpoint_flush (Endpoint *ep);
+
+#endif
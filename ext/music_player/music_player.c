@@ -3,7 +3,29 @@
  */
 
 #include <ruby.h>
+#include <ruby/thread.h>
+#include <ruby/version.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "util.h"
+#include "arena.h"
+#include "digest.h"
+#include "cache.h"
+#include "cue.h"
+#include "endpoint.h"
+#include "pair.h"
+#include "pool.h"
+#include "recorder.h"
+#include "scheduler.h"
+#include "signature.h"
+#include "smf.h"
+#include "stream.h"
+#include "synth.h"
 #include <AudioToolbox/MusicPlayer.h>
 #include <CoreMIDI/MIDIServices.h>
 
@@ -21,6 +43,7 @@ static VALUE rb_eIllegalTrackDestination;
 
 static VALUE rb_cMusicPlayer;
 static VALUE rb_cMusicSequence;
+static VALUE rb_cMusicSequenceDetached;
 static VALUE rb_cMusicTrack;
 static VALUE rb_cMusicTrackCollection;
 static VALUE rb_cMIDINoteMessage;
@@ -30,30 +53,95 @@ static VALUE rb_cMIDIControlChangeMessage;
 static VALUE rb_cMIDIProgramChangeMessage;
 static VALUE rb_cMIDIChannelPressureMessage;
 static VALUE rb_cMIDIPitchBendMessage;
+static VALUE rb_cMIDIMetaEvent;
+static VALUE rb_cMIDIRawData;
+static VALUE rb_cMusicUserEvent;
 static VALUE rb_cExtendedTempoEvent;
 static VALUE rb_cMusicEventIterator;
+static VALUE rb_cMusicTimeline;
+static VALUE rb_cMusicSequenceIterator;
+static VALUE rb_cMIDIFile;
+static VALUE rb_cMIDIOutput;
+static VALUE rb_cMIDIRecorder;
+static VALUE rb_cRenderCache;
+static VALUE rb_cFileOperation;
+static VALUE rb_cMIDIStream;
+
+/* Ruby data types, defined alongside each wrapper's free function */
+static const rb_data_type_t player_type;
+static const rb_data_type_t sequence_type;
+static const rb_data_type_t track_type;
+static const rb_data_type_t note_message_type;
+static const rb_data_type_t channel_message_type;
+static const rb_data_type_t payload_event_type;
+static const rb_data_type_t timeline_type;
+static const rb_data_type_t seq_iter_type;
+static const rb_data_type_t iter_type;
+static const rb_data_type_t output_type;
+static const rb_data_type_t stream_type;
 
 /* Ruby symbols */
+static VALUE rb_sBar;
 static VALUE rb_sBeat;
 static VALUE rb_sBpm;
+static VALUE rb_sBytes;
+static VALUE rb_sCache;
 static VALUE rb_sChannel;
+static VALUE rb_sChannelPressure;
+static VALUE rb_sChannels;
+static VALUE rb_sControlChange;
+static VALUE rb_sData;
 static VALUE rb_sData1;
 static VALUE rb_sData2;
+static VALUE rb_sDenominator;
 static VALUE rb_sDuration;
+static VALUE rb_sError;
+static VALUE rb_sEvents;
+static VALUE rb_sFrom;
+static VALUE rb_sKeyPressure;
 static VALUE rb_sLength;
 static VALUE rb_sLoopInfo;
+static VALUE rb_sMaxPolyphony;
+static VALUE rb_sMeta;
+static VALUE rb_sMetaType;
 static VALUE rb_sMute;
 static VALUE rb_sNote;
+static VALUE rb_sNotes;
+static VALUE rb_sNotesPerSecond;
 static VALUE rb_sNumber;
+static VALUE rb_sNumerator;
+static VALUE rb_sOldest;
+static VALUE rb_sOutput;
+static VALUE rb_sPacked;
+static VALUE rb_sPath;
+static VALUE rb_sPitchBend;
+static VALUE rb_sPitches;
+static VALUE rb_sPolyphony;
 static VALUE rb_sPressure;
 static VALUE rb_sProgram;
+static VALUE rb_sProgramChange;
+static VALUE rb_sQuietest;
+static VALUE rb_sRawData;
 static VALUE rb_sReleaseVelocity;
 static VALUE rb_sSamp;
+static VALUE rb_sSampleRate;
+static VALUE rb_sSeconds;
 static VALUE rb_sSecs;
 static VALUE rb_sSolo;
 static VALUE rb_sStatus;
+static VALUE rb_sSteal;
+static VALUE rb_sTempo;
+static VALUE rb_sThreads;
+static VALUE rb_sTo;
+static VALUE rb_sTotalBytes;
+static VALUE rb_sTotalTracks;
+static VALUE rb_sTracks;
+static VALUE rb_sType;
+static VALUE rb_sUser;
 static VALUE rb_sValue;
+static VALUE rb_sVelocities;
 static VALUE rb_sVelocity;
+static VALUE rb_sWindow;
 
 /* Utils */
 
@@ -93,25 +181,148 @@ core_midi_get_destination (VALUE mod, VALUE idx)
 
 /* MusicPlayer defns */
 
+/*
+ * Sequences whose MIDI endpoint is a portable MIDIOutput are played by a
+ * native engine, created when first needed, instead of by AudioToolbox.
+ * The engine is defined below alongside MIDIOutput. As with TrackData, the
+ * AudioToolbox handle must remain the first member.
+ */
+typedef struct Engine Engine;
+typedef struct SequenceUser SequenceUser;
+
+/* A link in a sequence's list of users; see SequenceData. */
+struct SequenceUser {
+    struct SequenceData *seq;       /* NULL while unlinked */
+    SequenceUser *prev, *next;
+    void (*close) (void *owner);    /* NULL if it cannot be closed */
+    void (*abandon) (void *owner);  /* as the sequence is freed, or NULL */
+    void (*suspend) (void *owner, Boolean resume);  /* around track changes, or NULL */
+    void *owner;
+};
+
+typedef struct {
+    MusicPlayer player;
+    Engine *engine;
+    int refs;           /* the wrapper's, plus one per MIDIRecorder */
+    Boolean virtual_clock;  /* every sequence is played by the engine */
+    SequenceUser user;  /* of the sequence, unless it is a MIDIStream */
+    Boolean suspended;  /* the engine is to be restarted after a track change */
+} PlayerData;
+
+static Engine *engine_new (void);
+static void engine_free (Engine *engine);
+static size_t engine_memsize (const Engine *engine);
+static void engine_reset (Engine *engine);
+static void engine_set_stream (Engine *engine, Stream *stream, uint32_t window);
+static OSStatus engine_start (Engine *engine, struct SequenceData *seq, Endpoint *output, CueQueue *cues);
+static void engine_stop (Engine *engine);
+static void engine_abandon (Engine *engine);
+static void engine_suspend (Engine *engine, struct SequenceData *seq, Boolean resume, Boolean *suspended);
+static Boolean engine_is_playing (Engine *engine);
+static MusicTimeStamp engine_get_time (Engine *engine);
+static OSStatus engine_set_time (Engine *engine, MusicTimeStamp beat);
+static Float64 engine_get_rate (Engine *engine);
+static void engine_set_rate (Engine *engine, Float64 rate);
+static void engine_set_virtual (Engine *engine, Boolean on);
+static void engine_advance (Engine *engine, Float64 seconds);
+static VALUE engine_take_log (Engine *engine);
+static int engine_watch (Engine *engine, MusicTimeStamp beat, Boolean until_stop);
+static int engine_unwatch (Engine *engine, int fd);
+static Stream *midi_stream_get (VALUE self, uint32_t *window);
+static struct SequenceData *sequence_get (VALUE rb_seq);
+static MusicSequence sequence_use (VALUE rb_seq, SequenceUser *user);
+static void sequence_user_unlink (SequenceUser *user);
+static CueQueue *sequence_cues (VALUE rb_seq);
+
+/* References are only taken and released with the GVL held. */
 static void
-player_free (MusicPlayer *player)
+player_release (PlayerData *player)
 {
     OSStatus err;
-    if (player) {
-        require_noerr( err = DisposeMusicPlayer(*player), fail );
-        free(player);
-    }
+    if (--player->refs > 0) return;
+    if (player->engine) engine_free(player->engine);
+    sequence_user_unlink(&player->user);
+    require_noerr( err = DisposeMusicPlayer(player->player), fail );
+    xfree(player);
     return;
     
     fail:
     rb_warning("DisposeMusicPlayer() failed with OSStatus %i.", (int) err);
 }
 
+static void
+player_free (PlayerData *player)
+{
+    if (player) player_release(player);
+}
+
+static size_t
+player_memsize (const void *player)
+{
+    const Engine *engine = ((const PlayerData *) player)->engine;
+    return sizeof(PlayerData) + (engine ? engine_memsize(engine) : 0);
+}
+
+/* Not freed immediately, as disposal may stop playback and warn. */
+static const rb_data_type_t player_type = {
+    "AudioToolbox::MusicPlayer",
+    { 0, (RUBY_DATA_FUNC) player_free, player_memsize, },
+    0, 0, RUBY_TYPED_WB_PROTECTED
+};
+
+/* Called as the player's sequence is freed, which the GC may do first. */
+static void
+player_abandon (void *owner)
+{
+    PlayerData *player = (PlayerData *) owner;
+    if (player->engine) engine_abandon(player->engine);
+}
+
+/* Called with the GVL held around the deletion or replacement of tracks. */
+static void
+player_suspend (void *owner, Boolean resume)
+{
+    PlayerData *player = (PlayerData *) owner;
+    if (player->engine) engine_suspend(player->engine, player->user.seq, resume, &player->suspended);
+}
+
 static VALUE
 player_alloc (VALUE class)
 {
-    MusicPlayer *player;
-    return Data_Make_Struct(rb_cMusicPlayer, MusicPlayer, 0, player_free, player);
+    PlayerData *player;
+    VALUE rb_player = TypedData_Make_Struct(rb_cMusicPlayer, PlayerData, &player_type, player);
+    player->refs = 1;
+    player->user.abandon = player_abandon;
+    player->user.suspend = player_suspend;
+    player->user.owner = player;
+    return rb_player;
+}
+
+/* Create the player's engine if it has none. The pointer is published
+ * atomically, as a recorder's input thread may be reading it. */
+static Engine *
+player_make_engine (PlayerData *player)
+{
+    if (!player->engine) __atomic_store_n(&player->engine, engine_new(), __ATOMIC_RELEASE);
+    return player->engine;
+}
+
+/*
+ * Returns the engine if the player's sequence plays through a MIDIOutput
+ * or is a MIDIStream, or the player runs on a virtual clock, creating it on
+ * first use, or NULL if AudioToolbox should play it.
+ */
+static Engine *
+player_engine (VALUE self)
+{
+    VALUE rb_seq = rb_iv_get(self, "@sequence");
+    PlayerData *player;
+    
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    if (NIL_P(rb_seq)) return NULL;
+    if (!player->virtual_clock && !rb_obj_is_kind_of(rb_seq, rb_cMIDIStream) &&
+        NIL_P(rb_iv_get(rb_seq, "@midi_output"))) return NULL;
+    return player_make_engine(player);
 }
 
 static VALUE
@@ -119,7 +330,7 @@ player_init (VALUE self)
 {
     MusicPlayer *player;
     OSStatus err;
-    Data_Get_Struct(self, MusicPlayer, player);
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = NewMusicPlayer(player), fail );
     return self;
     
@@ -131,10 +342,12 @@ static VALUE
 player_is_playing (VALUE self)
 {
     MusicPlayer *player;
+    Engine *engine;
     Boolean playing;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self)) && engine_is_playing(engine)) return Qtrue;
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerIsPlaying(*player, &playing), fail );
     return playing ? Qtrue : Qfalse;
     
@@ -148,18 +361,30 @@ player_get_sequence (VALUE self)
     return rb_iv_get(self, "@sequence");
 }
 
+/* Accepts a MusicSequence, or a MIDIStream to be played by the engine. */
 static VALUE
 player_set_sequence (VALUE self, VALUE rb_seq)
 {
-    MusicPlayer *player;
-    MusicSequence *seq;
+    PlayerData *player;
+    MusicSequence seq;
+    Stream *stream;
+    uint32_t window;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
-    Data_Get_Struct(rb_seq, MusicSequence, seq);
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    if (rb_obj_is_kind_of(rb_seq, rb_cMIDIStream)) {
+        stream = midi_stream_get(rb_seq, &window);
+        engine_reset(player_make_engine(player));
+        engine_set_stream(player->engine, stream, window);
+        sequence_use(Qnil, &player->user);
+        rb_iv_set(self, "@sequence", rb_seq);
+        return rb_seq;
+    }
+    seq = sequence_use(rb_seq, &player->user);
+    if (player->engine) engine_reset(player->engine);
     rb_iv_set(self, "@sequence", rb_seq);
     
-    require_noerr( err = MusicPlayerSetSequence(*player, *seq), fail );
+    require_noerr( err = MusicPlayerSetSequence(player->player, seq), fail );
     return rb_seq;
     
     fail:
@@ -169,11 +394,30 @@ player_set_sequence (VALUE self, VALUE rb_seq)
 static VALUE
 player_start (VALUE self)
 {
-    MusicPlayer *player;
+    VALUE rb_seq, rb_output = Qnil;
+    PlayerData *player;
+    Engine *engine;
+    Endpoint *output = NULL;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
-    require_noerr( err = MusicPlayerStart(*player), fail );
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    rb_seq = rb_iv_get(self, "@sequence");
+    if (!NIL_P(rb_seq)) rb_output = rb_iv_get(rb_seq, "@midi_output");
+    if (!NIL_P(rb_seq) && rb_obj_is_kind_of(rb_seq, rb_cMIDIStream)) {
+        if (NIL_P(rb_output) && !player->virtual_clock)
+            rb_raise(rb_eArgError, "Expected a MIDIOutput as the stream's MIDI endpoint.");
+        engine = player_engine(self);
+        if (!NIL_P(rb_output)) TypedData_Get_Struct(rb_output, Endpoint, &output_type, output);
+        require_noerr( err = engine_start(engine, NULL, output, NULL), fail );
+        return Qnil;
+    }
+    if (!NIL_P(rb_seq) && (player->virtual_clock || !NIL_P(rb_output))) {
+        engine = player_engine(self);
+        if (!NIL_P(rb_output)) TypedData_Get_Struct(rb_output, Endpoint, &output_type, output);
+        require_noerr( err = engine_start(engine, sequence_get(rb_seq), output, sequence_cues(rb_seq)), fail );
+        return Qnil;
+    }
+    require_noerr( err = MusicPlayerStart(player->player), fail );
     return Qnil;
     
     fail:
@@ -184,9 +428,14 @@ static VALUE
 player_stop (VALUE self)
 {
     MusicPlayer *player;
+    Engine *engine;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self))) {
+        engine_stop(engine);
+        return Qnil;
+    }
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerStop(*player), fail );
     return Qnil;
     
@@ -199,9 +448,11 @@ player_get_time (VALUE self)
 {
     MusicPlayer *player;
     MusicTimeStamp ts;
+    Engine *engine;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self))) return rb_float_new(engine_get_time(engine));
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerGetTime(*player, &ts), fail );
     return rb_float_new((Float64) ts);
     
@@ -217,10 +468,15 @@ player_set_time (VALUE self, VALUE rb_ts)
     
     MusicPlayer *player;
     MusicTimeStamp ts;
+    Engine *engine;
     OSStatus err;
     
     ts = rb_num2dbl(rb_ts);
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self))) {
+        require_noerr( err = engine_set_time(engine, ts), fail );
+        return Qnil;
+    }
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerSetTime(*player, ts), fail );
     return Qnil;
     
@@ -233,9 +489,11 @@ player_get_play_rate_scalar (VALUE self)
 {
     MusicPlayer *player;
     Float64 scalar;
+    Engine *engine;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self))) return rb_float_new(engine_get_rate(engine));
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerGetPlayRateScalar(*player, &scalar), fail );
     return rb_float_new(scalar);
 
@@ -251,10 +509,16 @@ player_set_play_rate_scalar (VALUE self, VALUE rb_scalar)
     
     MusicPlayer *player;
     Float64 scalar;
+    Engine *engine;
     OSStatus err;
 
     scalar = NUM2DBL(rb_scalar);
-    Data_Get_Struct(self, MusicPlayer, player);
+    if ((engine = player_engine(self))) {
+        if (scalar <= 0.0) rb_raise(rb_eArgError, "Expected scalar to be positive.");
+        engine_set_rate(engine, scalar);
+        return Qnil;
+    }
+    TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
     require_noerr( err = MusicPlayerSetPlayRateScalar(*player, scalar), fail );
     return Qnil;
     
@@ -262,13 +526,101 @@ player_set_play_rate_scalar (VALUE self, VALUE rb_scalar)
     RAISE_OSSTATUS(err, "MusicPlayerSetPlayRateScalar()");
 }
 
+static VALUE
+player_get_virtual_clock (VALUE self)
+{
+    PlayerData *player;
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    return player->virtual_clock ? Qtrue : Qfalse;
+}
+
+/*
+ * Switching clocks stops the engine. On a virtual clock every sequence is
+ * played by the engine, whether or not it has a MIDIOutput, and time only
+ * passes in #advance.
+ */
+static VALUE
+player_set_virtual_clock (VALUE self, VALUE rb_on)
+{
+    PlayerData *player;
+    
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    engine_stop(player_make_engine(player));
+    engine_set_virtual(player->engine, RTEST(rb_on));
+    player->virtual_clock = RTEST(rb_on);
+    return rb_on;
+}
+
+/* Threads started so far by the scheduler shared by every player. */
+static VALUE
+player_s_scheduler_threads (VALUE class)
+{
+    return UINT2NUM(scheduler_threads());
+}
+
+static PlayerData *
+player_get_virtual (VALUE self)
+{
+    PlayerData *player;
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    if (!player->virtual_clock)
+        rb_raise(rb_eRuntimeError, "Expected a player on a virtual clock.");
+    return player;
+}
+
+/* Run the engine for seconds of the virtual clock, returning what it sent. */
+static VALUE
+player_advance (VALUE self, VALUE rb_secs)
+{
+    PlayerData *player = player_get_virtual(self);
+    Float64 secs;
+    
+    if (!PRIM_NUM_P(rb_secs) || (secs = NUM2DBL(rb_secs)) < 0.0)
+        rb_raise(rb_eArgError, "Expected a non-negative number of seconds.");
+    engine_advance(player->engine, secs);
+    return engine_take_log(player->engine);
+}
+
+/* What the engine has sent since the last #advance or #recorded. */
+static VALUE
+player_recorded (VALUE self)
+{
+    return engine_take_log(player_get_virtual(self)->engine);
+}
+
+/*
+ * Start waiting for the engine to reach a beat, or to stop if rb_beat is
+ * nil, returning a file descriptor which becomes readable when it does, or
+ * nil if AudioToolbox plays the sequence.
+ */
+static VALUE
+player_watch (VALUE self, VALUE rb_beat)
+{
+    Engine *engine;
+    
+    if (!NIL_P(rb_beat) && !PRIM_NUM_P(rb_beat))
+        rb_raise(rb_eArgError, "Expected first arg to be a number or nil.");
+    if (!(engine = player_engine(self))) return Qnil;
+    return INT2NUM(engine_watch(engine, NIL_P(rb_beat) ? 0.0 : NUM2DBL(rb_beat), NIL_P(rb_beat)));
+}
+
+/* Stop waiting on rb_fd, returning whether the beat or stop was reached. */
+static VALUE
+player_unwatch (VALUE self, VALUE rb_fd)
+{
+    PlayerData *player;
+    TypedData_Get_Struct(self, PlayerData, &player_type, player);
+    if (!player->engine) return Qfalse;
+    return engine_unwatch(player->engine, NUM2INT(rb_fd)) > 0 ? Qtrue : Qfalse;
+}
+
 static VALUE
 player_host_time_for_beats (VALUE self, VALUE rb_beats)
 {
   MusicTimeStamp beats = NUM2ULONG(rb_beats);
   
   MusicPlayer *player;
-  Data_Get_Struct(self, MusicPlayer, player);
+  TypedData_Get_Struct(self, MusicPlayer, &player_type, player);
 
   UInt64 host_time = 0;
   OSStatus err;
@@ -282,13 +634,180 @@ player_host_time_for_beats (VALUE self, VALUE rb_beats)
 
 /* Sequence defns */
 
+/*
+ * AudioToolbox allocates a sequence's events out of sight of Ruby's GC, so
+ * the wrapper keeps a count of them and reports an estimate of their size
+ * with rb_gc_adjust_memory_usage. Without it, a sequence holding millions of
+ * events looks as cheap as an empty one and is collected far too late. The
+ * handle must remain the first member, as for TrackData.
+ *
+ * signatures indexes the time signatures on the tempo track. It is built on
+ * the first bar:beat conversion and rebuilt after the tempo track changes.
+ *
+ * arena holds the TrackData of the sequence's tracks, along with their
+ * digest blocks, so that building a sequence allocates a few large chunks
+ * and freeing it releases them together. tracks lists that TrackData, newest
+ * first, so that wrappers for the same track share one.
+ *
+ * A sequence may be detached from its wrapper to be attached to another,
+ * typically in another Ractor, which can neither share nor move T_DATA
+ * objects. The wrapper keeps its arena, but its handle and those of its
+ * tracks are cleared, so that sequence_get and track_get raise for them.
+ *
+ * Objects which keep native state for the sequence between calls link
+ * themselves into users. Detaching the sequence closes those which can be
+ * closed, such as iterators, and is refused while others, such as players,
+ * remain. Freeing the sequence unlinks its users and freeing a user unlinks
+ * it, so the GC may free them in either order.
+ *
+ * Engines read the tracks from a scheduler thread, so every edit of their
+ * events holds lock, as the engine does while it dispatches. Tracks are only
+ * deleted or replaced with the engines suspended, as their iterators would
+ * not survive it.
+ */
+typedef struct SequenceData {
+    MusicSequence seq;
+    pthread_mutex_t lock;
+    size_t events;
+    SignatureMap signatures;
+    Boolean signatures_valid;
+    Arena arena;
+    struct TrackData *tracks;
+    SequenceUser *users;
+    CueQueue *cues;     /* user events played, NULL until first needed */
+} SequenceData;
+
+/* Halt the engines playing seq before its tracks are deleted or replaced,
+ * and restart them after. */
+static void
+sequence_suspend (SequenceData *seq, Boolean resume)
+{
+    SequenceUser *user;
+    for (user = seq->users; user; user = user->next)
+        if (user->suspend) user->suspend(user->owner, resume);
+}
+
+/* Link a user to seq, unlinking it from any other sequence. */
+static void
+sequence_user_link (SequenceUser *user, SequenceData *seq)
+{
+    sequence_user_unlink(user);
+    user->seq = seq;
+    user->prev = NULL;
+    user->next = seq->users;
+    if (seq->users) seq->users->prev = user;
+    seq->users = user;
+}
+
+static void
+sequence_user_unlink (SequenceUser *user)
+{
+    if (!user->seq) return;
+    if (user->prev) user->prev->next = user->next;
+    else user->seq->users = user->next;
+    if (user->next) user->next->prev = user->prev;
+    user->seq = NULL;
+    user->prev = user->next = NULL;
+}
+
+#define SEQUENCE_ARENA_CHUNK 16384
+
+/* Estimated bytes held by AudioToolbox for each event in a sequence. */
+#define EVENT_FOOTPRINT 32
+
+static void
+sequence_account (SequenceData *seq, ssize_t events)
+{
+    seq->events += events;
+    rb_gc_adjust_memory_usage(events * EVENT_FOOTPRINT);
+}
+
+/* Zeroed memory which lasts as long as the sequence. */
+static void *
+sequence_arena_alloc (SequenceData *seq, size_t size)
+{
+    size_t bytes = seq->arena.bytes;
+    void *ptr = arena_alloc(&seq->arena, size);
+    if (!ptr) rb_memerror();
+    rb_gc_adjust_memory_usage(seq->arena.bytes - bytes);
+    return ptr;
+}
+
+static void *
+sequence_arena_grow (SequenceData *seq, void *ptr, size_t old_size, size_t new_size)
+{
+    size_t bytes = seq->arena.bytes;
+    if (!(ptr = arena_grow(&seq->arena, ptr, old_size, new_size))) rb_memerror();
+    rb_gc_adjust_memory_usage(seq->arena.bytes - bytes);
+    return ptr;
+}
+
+static OSStatus
+sequence_count_track (MusicTrack track, size_t *count)
+{
+    MusicEventIterator iter;
+    Boolean has_current;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(track, &iter), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    while (has_current) {
+        (*count)++;
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    }
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/* Count every event in the sequence after a bulk change such as a load, and
+ * forget its time signatures. */
+static OSStatus
+sequence_recount (SequenceData *seq)
+{
+    MusicTrack track;
+    UInt32 i, track_count;
+    size_t count = 0;
+    OSStatus err;
+    
+    seq->signatures_valid = FALSE;
+    require_noerr( err = MusicSequenceGetTempoTrack(seq->seq, &track), fail );
+    require_noerr( err = sequence_count_track(track, &count), fail );
+    require_noerr( err = MusicSequenceGetTrackCount(seq->seq, &track_count), fail );
+    for (i = 0; i < track_count; i++) {
+        require_noerr( err = MusicSequenceGetIndTrack(seq->seq, i, &track), fail );
+        require_noerr( err = sequence_count_track(track, &count), fail );
+    }
+    sequence_account(seq, (ssize_t) count - (ssize_t) seq->events);
+    
+    fail:
+    return err;
+}
+
 static void
-sequence_free (MusicSequence *seq)
+sequence_free (SequenceData *seq)
 {
+    SequenceUser *user;
     OSStatus err;
     if (seq) {
-        require_noerr( err = DisposeMusicSequence(*seq), fail );
-        free(seq);
+        sequence_account(seq, -(ssize_t) seq->events);
+        rb_gc_adjust_memory_usage(-(ssize_t) seq->arena.bytes);
+        arena_free(&seq->arena);
+        signature_map_free(&seq->signatures);
+        /* Engines still playing the sequence are stopped before it goes. */
+        while ((user = seq->users)) {
+            sequence_user_unlink(user);
+            if (user->abandon) user->abandon(user->owner);
+        }
+        if (seq->seq)
+            require_noerr( err = DisposeMusicSequence(seq->seq), fail );
+        /* Engines hold their own reference to the cues. */
+        if (seq->cues) cue_queue_release(seq->cues);
+        pthread_mutex_destroy(&seq->lock);
+        xfree(seq);
     }
     return;
     
@@ -296,11 +815,68 @@ sequence_free (MusicSequence *seq)
     rb_warning("DisposeMusicSequence() failed with %i.", (int) err);
 }
 
+static size_t
+sequence_memsize (const void *ptr)
+{
+    const SequenceData *seq = (const SequenceData *) ptr;
+    return sizeof(SequenceData) + seq->events * EVENT_FOOTPRINT +
+           seq->signatures.capacity * sizeof(Signature) + seq->arena.bytes +
+           (seq->cues ? sizeof(CueQueue) : 0);
+}
+
+static const rb_data_type_t sequence_type = {
+    "AudioToolbox::MusicSequence",
+    { 0, (RUBY_DATA_FUNC) sequence_free, sequence_memsize, },
+    0, 0, RUBY_TYPED_WB_PROTECTED
+};
+
 static VALUE
 sequence_alloc (VALUE class)
 {
-  MusicSequence *seq;
-  return Data_Make_Struct(rb_cMusicSequence, MusicSequence, 0, sequence_free, seq);
+  SequenceData *seq;
+  VALUE rb_seq = TypedData_Make_Struct(rb_cMusicSequence, SequenceData, &sequence_type, seq);
+  arena_init(&seq->arena, SEQUENCE_ARENA_CHUNK);
+  pthread_mutex_init(&seq->lock, NULL);
+  return rb_seq;
+}
+
+/* The sequence's data, raising if it has been detached. */
+static SequenceData *
+sequence_get (VALUE rb_seq)
+{
+    SequenceData *seq;
+    TypedData_Get_Struct(rb_seq, SequenceData, &sequence_type, seq);
+    if (!seq->seq) rb_raise(rb_eIOError, "Sequence has been detached.");
+    return seq;
+}
+
+/* Link user to rb_seq in place of any other sequence, returning its
+ * handle. rb_seq may be nil to leave it unlinked. */
+static MusicSequence
+sequence_use (VALUE rb_seq, SequenceUser *user)
+{
+    SequenceData *seq;
+    if (NIL_P(rb_seq)) {
+        sequence_user_unlink(user);
+        return NULL;
+    }
+    seq = sequence_get(rb_seq);
+    sequence_user_link(user, seq);
+    return seq->seq;
+}
+
+/* Wrap a sequence made outside of Ruby, taking ownership of it. */
+static VALUE
+sequence_adopt (MusicSequence handle, size_t events)
+{
+    VALUE rb_seq = sequence_alloc(rb_cMusicSequence);
+    SequenceData *seq;
+    TypedData_Get_Struct(rb_seq, SequenceData, &sequence_type, seq);
+    seq->seq = handle;
+    sequence_account(seq, events);
+    rb_iv_set(rb_seq, "@tracks",
+              rb_funcall(rb_cMusicTrackCollection, rb_intern("new"), 1, rb_seq));
+    return rb_seq;
 }
 
 static VALUE
@@ -308,7 +884,7 @@ sequence_init (VALUE self)
 {
     MusicSequence *seq;
     OSStatus err;
-    Data_Get_Struct(self, MusicSequence, seq);
+    TypedData_Get_Struct(self, MusicSequence, &sequence_type, seq);
     require_noerr( err = NewMusicSequence(seq), fail );
     rb_iv_set(self, "@tracks",
               rb_funcall(rb_cMusicTrackCollection, rb_intern("new"), 1, self));
@@ -319,15 +895,26 @@ sequence_init (VALUE self)
     RAISE_OSSTATUS(err, "NewMusicSequence()");
 }
 
+/*
+ * Accepts a CoreMIDI endpoint reference, or a MIDIOutput to have the
+ * sequence played by the native engine.
+ */
 static VALUE
 sequence_set_midi_endpoint (VALUE self, VALUE rb_endpoint_ref)
 {
     MusicSequence *seq;
-    UInt32 ref = NUM2ULONG(rb_funcall(rb_mKernel, rb_intern("Integer"), 1, rb_endpoint_ref));
+    UInt32 ref;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicSequence, seq);
+    if (rb_obj_is_kind_of(rb_endpoint_ref, rb_cMIDIOutput)) {
+        rb_iv_set(self, "@midi_output", rb_endpoint_ref);
+        return Qnil;
+    }
+    
+    ref = NUM2ULONG(rb_funcall(rb_mKernel, rb_intern("Integer"), 1, rb_endpoint_ref));
+    seq = &sequence_get(self)->seq;
     require_noerr( err = MusicSequenceSetMIDIEndpoint(*seq, (MIDIEndpointRef) ref), fail);
+    rb_iv_set(self, "@midi_output", Qnil);
     return Qnil;
     
     fail:
@@ -341,7 +928,7 @@ sequence_get_type (VALUE self)
     MusicSequenceType type;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicSequence, seq);
+    seq = &sequence_get(self)->seq;
     require_noerr( err = MusicSequenceGetSequenceType(*seq, &type), fail );
     
     switch (type) {
@@ -373,7 +960,7 @@ sequence_set_type (VALUE self, VALUE rb_type)
     else
         rb_raise(rb_eArgError, "Expected :type to be one of :beat, :secs, :samp.");
     
-    Data_Get_Struct(self, MusicSequence, seq);
+    seq = &sequence_get(self)->seq;
     OSStatus err;
     require_noerr( err = MusicSequenceSetSequenceType(*seq, type), fail );
     return Qnil;
@@ -389,7 +976,7 @@ sequence_save (VALUE self, VALUE rb_path)
     MusicSequence *seq;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicSequence, seq);
+    seq = &sequence_get(self)->seq;
     require_noerr( err = MusicSequenceFileCreate(*seq, url, kMusicSequenceFile_MIDIType, kMusicSequenceFileFlags_EraseFile, 0), fail );
     CFRelease(url);
     
@@ -400,30 +987,282 @@ sequence_save (VALUE self, VALUE rb_path)
     RAISE_OSSTATUS(err, "MusicSequenceFileCreate()");
 }
 
+/* Defined below with the track data. */
+static void sequence_reindex (SequenceData *seq);
+
 static VALUE
 sequence_load (VALUE self, VALUE rb_path)
 {
     CFURLRef url = PATH2CFURL(StringValue(rb_path));
-    MusicSequence *seq;
+    SequenceData *seq;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicSequence, seq);
-    require_noerr( err = MusicSequenceFileLoad(*seq, url, kMusicSequenceFile_MIDIType, kMusicSequenceLoadSMF_ChannelsToTracks), fail );
+    seq = sequence_get(self);
+    sequence_suspend(seq, FALSE);
+    pthread_mutex_lock(&seq->lock);
+    err = MusicSequenceFileLoad(seq->seq, url, kMusicSequenceFile_MIDIType, kMusicSequenceLoadSMF_ChannelsToTracks);
+    pthread_mutex_unlock(&seq->lock);
     CFRelease(url);
+    sequence_reindex(seq);
+    sequence_suspend(seq, TRUE);
+    require_noerr( err, fail );
+    require_noerr( err = sequence_recount(seq), count_fail );
     
     return Qnil;
     
     fail:
-    CFRelease(url);
     RAISE_OSSTATUS(err, "MusicSequenceFileLoad()");
+    
+    count_fail:
+    RAISE_OSSTATUS(err, "MusicSequence#load");
 }
 
 /* Track defns */
 
+/*
+ * Per-track state kept alongside the AudioToolbox handle. The handle must
+ * remain the first member so that accessors which only need the handle can
+ * fetch it as a MusicTrack.
+ *
+ * kinds and channels form a bitmap index of the events in the track. It is
+ * built by the first complete scan and only ever widened by later edits, so
+ * it may over-approximate the track's contents but never misses an event.
+ *
+ * blocks caches the digest of the events in each DIGEST_BLOCK_BEATS span of
+ * the track, so that #digest only rehashes the spans an edit touched.
+ *
+ * scratch is where meta and raw events are laid out for AudioToolbox, which
+ * copies them, so adding one allocates nothing once it has grown to fit.
+ */
+typedef struct {
+    Digest digest;
+    UInt32 events;
+    Boolean valid;
+} DigestBlock;
+
+#define DIGEST_BLOCK_BEATS 16.0
+
+typedef struct TrackData {
+    MusicTrack track;
+    SequenceData *sequence;     /* kept alive by the track's @sequence */
+    struct TrackData *next;     /* in the sequence's list */
+    Boolean tempo;              /* the sequence's tempo track */
+    UInt32 generation;
+    Boolean indexed;
+    UInt32 kinds;
+    UInt32 channels;
+    DigestBlock *blocks;
+    UInt32 block_count;
+    UInt32 block_capacity;
+    UInt8 *scratch;
+    UInt32 scratch_capacity;
+} TrackData;
+
+/* Event kinds, as recorded in the track index and selected by filters. */
+#define EV_NOTE             (1 << 0)
+#define EV_KEY_PRESSURE     (1 << 1)
+#define EV_CONTROL_CHANGE   (1 << 2)
+#define EV_PROGRAM_CHANGE   (1 << 3)
+#define EV_CHANNEL_PRESSURE (1 << 4)
+#define EV_PITCH_BEND       (1 << 5)
+#define EV_TEMPO            (1 << 6)
+#define EV_META             (1 << 7)
+#define EV_RAW_DATA         (1 << 8)
+#define EV_USER             (1 << 9)
+#define EV_OTHER            (1 << 10)
+#define EV_CHANNEL_MESSAGE  (EV_KEY_PRESSURE | EV_CONTROL_CHANGE | EV_PROGRAM_CHANGE | \
+                             EV_CHANNEL_PRESSURE | EV_PITCH_BEND)
+#define EV_ALL              0x7FF
+
+/* Channels 0-15 have a bit each; events without a valid channel share one. */
+#define CH_NONE             (1 << 16)
+#define CH_ALL              0x1FFFF
+#define CH_BIT(ch)          (((ch) >= 0 && (ch) < 16) ? (1 << (ch)) : CH_NONE)
+
+/* Classify raw event data without creating any Ruby objects. The channel and
+ * note are set to -1 for events which do not carry one. */
+static UInt32
+event_classify (MusicEventType type, const void *data, int *channel, int *note)
+{
+    *channel = -1;
+    *note = -1;
+    
+    switch (type) {
+    case kMusicEventType_MIDINoteMessage: {
+        const MIDINoteMessage *msg = (const MIDINoteMessage *) data;
+        *channel = msg->channel;
+        *note = msg->note;
+        return EV_NOTE;
+    }
+    case kMusicEventType_MIDIChannelMessage: {
+        const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+        if (msg->status < 0x80 || msg->status >= 0xF0) return EV_OTHER;
+        *channel = msg->status & 0x0F;
+        switch (msg->status >> 4) {
+        case 0xA:
+            *note = msg->data1;
+            return EV_KEY_PRESSURE;
+        case 0xB: return EV_CONTROL_CHANGE;
+        case 0xC: return EV_PROGRAM_CHANGE;
+        case 0xD: return EV_CHANNEL_PRESSURE;
+        case 0xE: return EV_PITCH_BEND;
+        default:  return EV_OTHER;
+        }
+    }
+    case kMusicEventType_ExtendedTempo:
+        return EV_TEMPO;
+    case kMusicEventType_Meta:
+        return EV_META;
+    case kMusicEventType_MIDIRawData:
+        return EV_RAW_DATA;
+    case kMusicEventType_User:
+        return EV_USER;
+    default:
+        return EV_OTHER;
+    }
+}
+
+/* Note that an event at beat ts was written to or removed from the track,
+ * widening its index and invalidating the digest of its block, and the
+ * sequence's time signatures if this is the tempo track. */
+static void
+track_touch (TrackData *data, MusicTimeStamp ts, MusicEventType type, const void *ev)
+{
+    int channel, note;
+    double block = floor(ts / DIGEST_BLOCK_BEATS);
+    
+    data->generation++;
+    if (data->tempo && data->sequence)
+        data->sequence->signatures_valid = FALSE;
+    if (data->indexed && ev) {
+        data->kinds |= event_classify(type, ev, &channel, &note);
+        data->channels |= CH_BIT(channel);
+    }
+    if (block >= 0.0 && block < data->block_count)
+        data->blocks[(UInt32) block].valid = FALSE;
+}
+
+/* Unlink the data of a disposed track from its sequence and clear it, so
+ * that a later track given the same handle gets data of its own, and the
+ * wrappers of the disposed one raise. */
+static void
+track_data_dispose (TrackData *track)
+{
+    TrackData **link;
+    
+    for (link = &track->sequence->tracks; *link; link = &(*link)->next) {
+        if (*link != track) continue;
+        *link = track->next;
+        break;
+    }
+    track->next = NULL;
+    track->track = NULL;
+    track->generation++;
+    track->indexed = FALSE;
+    track->block_count = 0;
+}
+
+/* Whether handle is still one of the sequence's tracks. */
+static Boolean
+sequence_has_track (SequenceData *seq, MusicTrack handle)
+{
+    MusicTrack track;
+    UInt32 i, track_count;
+    
+    if (MusicSequenceGetTempoTrack(seq->seq, &track) == noErr && track == handle) return TRUE;
+    if (MusicSequenceGetTrackCount(seq->seq, &track_count) != noErr) return FALSE;
+    for (i = 0; i < track_count; i++)
+        if (MusicSequenceGetIndTrack(seq->seq, i, &track) == noErr && track == handle) return TRUE;
+    return FALSE;
+}
+
+/* Drop every track's index and block digests, as after a file is loaded
+ * into the sequence, which may change any track without touching it, and
+ * dispose of the data of tracks which the load replaced. */
 static void
-track_free (MusicTrack *track)
+sequence_reindex (SequenceData *seq)
+{
+    TrackData *track, *next;
+    UInt32 i;
+    
+    seq->signatures_valid = FALSE;
+    for (track = seq->tracks; track; track = next) {
+        next = track->next;
+        if (!sequence_has_track(seq, track->track)) {
+            track_data_dispose(track);
+            continue;
+        }
+        track->generation++;
+        track->indexed = FALSE;
+        track->kinds = track->channels = 0;
+        for (i = 0; i < track->block_count; i++)
+            track->blocks[i].valid = FALSE;
+        track->block_count = 0;
+    }
+}
+
+/*
+ * TrackData lives in its sequence's arena and is released with it, so the
+ * wrapper frees nothing and reports no memory of its own; the sequence
+ * counts the arena. A wrapper keeps its sequence alive through @sequence,
+ * so the two are only ever collected together.
+ */
+static const rb_data_type_t track_type = {
+    "AudioToolbox::MusicTrack",
+    { 0, RUBY_NEVER_FREE, 0, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static TrackData *
+track_data_new (VALUE rb_seq, MusicTrack handle)
+{
+    SequenceData *seq;
+    TrackData *track;
+    seq = sequence_get(rb_seq);
+    track = sequence_arena_alloc(seq, sizeof(TrackData));
+    track->track = handle;
+    track->sequence = seq;
+    track->next = seq->tracks;
+    seq->tracks = track;
+    return track;
+}
+
+/* The TrackData already made for handle, if any. A disposed track's data
+ * is unlinked, so a track reusing its handle gets fresh data. */
+static TrackData *
+track_data_get (VALUE rb_seq, MusicTrack handle)
+{
+    SequenceData *seq;
+    TrackData *track;
+    seq = sequence_get(rb_seq);
+    for (track = seq->tracks; track; track = track->next)
+        if (track->track == handle) return track;
+    return track_data_new(rb_seq, handle);
+}
+
+/* The track's data, raising if it has been deleted or its sequence has
+ * been detached. */
+static TrackData *
+track_get (VALUE rb_track)
+{
+    TrackData *track;
+    TypedData_Get_Struct(rb_track, TrackData, &track_type, track);
+    if (!track->track) rb_raise(rb_eIOError, "Track has been deleted or its sequence detached.");
+    return track;
+}
+
+/* The track's scratch space, grown to at least size bytes. */
+static void *
+track_scratch (TrackData *track, size_t size)
 {
-    if(track) free(track);
+    size_t capacity = track->scratch_capacity ? track->scratch_capacity : 64;
+    if (size > track->scratch_capacity) {
+        while (capacity < size) capacity *= 2;
+        track->scratch = sequence_arena_grow(track->sequence, track->scratch,
+                                             track->scratch_capacity, capacity);
+        track->scratch_capacity = capacity;
+    }
+    return track->scratch;
 }
 
 static VALUE
@@ -454,10 +1293,10 @@ track_init (int argc, VALUE *argv, VALUE self)
 }
 
 static VALUE
-track_internal_new (VALUE rb_seq, MusicTrack *track)
+track_internal_new (VALUE rb_seq, TrackData *track)
 {
     VALUE rb_track, argv[1];
-    rb_track = Data_Wrap_Struct(rb_cMusicTrack, 0, track_free, track);
+    rb_track = TypedData_Wrap_Struct(rb_cMusicTrack, &track_type, track);
     argv[0] = rb_seq;
     rb_obj_call_init(rb_track, 1, argv);
     return rb_track;
@@ -467,15 +1306,20 @@ static VALUE
 track_new (int argc, VALUE *argv, VALUE class)
 {
     VALUE rb_seq, rb_options, rb_track, init_argv[2];
-    MusicSequence *seq;
-    MusicTrack *track;
+    SequenceData *seq;
+    MusicTrack handle;
+    TrackData *track;
     OSStatus err;
     
     rb_scan_args(argc, argv, "11", &rb_seq, &rb_options);
-    Data_Get_Struct(rb_seq, MusicSequence, seq);
+    seq = sequence_get(rb_seq);
     
-    rb_track = Data_Make_Struct(rb_cMusicTrack, MusicTrack, 0, track_free, track);
-    require_noerr( err = MusicSequenceNewTrack(*seq, track), fail );
+    pthread_mutex_lock(&seq->lock);
+    err = MusicSequenceNewTrack(seq->seq, &handle);
+    pthread_mutex_unlock(&seq->lock);
+    require_noerr( err, fail );
+    track = track_data_new(rb_seq, handle);
+    rb_track = TypedData_Wrap_Struct(rb_cMusicTrack, &track_type, track);
     init_argv[0] = rb_seq;
     init_argv[1] = rb_options;
     rb_obj_call_init(rb_track, 2, init_argv);
@@ -485,17 +1329,102 @@ track_new (int argc, VALUE *argv, VALUE class)
     RAISE_OSSTATUS(err, "MusicSequenceNewTrack()");
 }
 
+/*
+ * A channel message may be given as an Integer packing its status, data1
+ * and data2 into 24 bits, status highest, so that generated streams need
+ * neither an options Hash nor a message object per event.
+ */
+static void
+packed_message_get (VALUE rb_packed, MIDIChannelMessage *msg)
+{
+    long packed = FIX2LONG(rb_packed);
+    
+    if (packed < 0x800000 || packed > 0xEFFFFF || (packed & 0x8080))
+        rb_raise(rb_eArgError, "Expected a packed channel message within 0x800000..0xEF7F7F.");
+    msg->status = (UInt8) (packed >> 16);
+    msg->data1 = (UInt8) (packed >> 8);
+    msg->data2 = (UInt8) packed;
+    msg->reserved = 0;
+}
+
+static OSStatus
+track_add_packed (TrackData *track, MusicTimeStamp ts, VALUE rb_packed)
+{
+    MIDIChannelMessage msg;
+    OSStatus err;
+    
+    packed_message_get(rb_packed, &msg);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewMIDIChannelEvent(track->track, ts, &msg);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, kMusicEventType_MIDIChannelMessage, &msg);
+    sequence_account(track->sequence, 1);
+    
+    fail:
+    return err;
+}
+
+/* Adds a message object, or a channel message packed in an Integer. */
+static VALUE
+track_add (VALUE self, VALUE rb_at, VALUE rb_msg)
+{
+    TrackData *track;
+    OSStatus err;
+    
+    if (!FIXNUM_P(rb_msg)) return rb_funcall(rb_msg, rb_intern("add"), 2, rb_at, self);
+    track = track_get(self);
+    require_noerr( err = track_add_packed(track, NUM2DBL(rb_at), rb_msg), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrackNewMIDIChannelEvent()");
+}
+
+/* Adds each message at the time at the same index. */
+static VALUE
+track_add_all (VALUE self, VALUE rb_times, VALUE rb_msgs)
+{
+    TrackData *track;
+    VALUE rb_msg;
+    long i;
+    OSStatus err;
+    
+    Check_Type(rb_times, T_ARRAY);
+    Check_Type(rb_msgs, T_ARRAY);
+    if (RARRAY_LEN(rb_times) != RARRAY_LEN(rb_msgs))
+        rb_raise(rb_eArgError, "Expected as many times as messages.");
+    track = track_get(self);
+    
+    for (i = 0; i < RARRAY_LEN(rb_msgs) && i < RARRAY_LEN(rb_times); i++) {
+        rb_msg = RARRAY_AREF(rb_msgs, i);
+        if (FIXNUM_P(rb_msg))
+            require_noerr( err = track_add_packed(track, NUM2DBL(RARRAY_AREF(rb_times, i)), rb_msg), fail );
+        else
+            rb_funcall(rb_msg, rb_intern("add"), 2, RARRAY_AREF(rb_times, i), self);
+    }
+    return self;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrackNewMIDIChannelEvent()");
+}
+
 static VALUE
 track_add_midi_note_message (VALUE self, VALUE rb_at, VALUE rb_msg)
 {
-    MusicTrack *track;
+    TrackData *track;
     MIDINoteMessage *msg;
     MusicTimeStamp ts = (MusicTimeStamp) NUM2DBL(rb_at);
     OSStatus err;
     
-    Data_Get_Struct(self, MusicTrack, track);
-    Data_Get_Struct(rb_msg, MIDINoteMessage, msg);
-    require_noerr( err = MusicTrackNewMIDINoteEvent(*track, ts, msg), fail );
+    track = track_get(self);
+    TypedData_Get_Struct(rb_msg, MIDINoteMessage, &note_message_type, msg);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewMIDINoteEvent(track->track, ts, msg);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, kMusicEventType_MIDINoteMessage, msg);
+    sequence_account(track->sequence, 1);
     return Qnil;
 
     fail:
@@ -505,14 +1434,19 @@ track_add_midi_note_message (VALUE self, VALUE rb_at, VALUE rb_msg)
 static VALUE
 track_add_midi_channel_message (VALUE self, VALUE rb_at, VALUE rb_msg)
 {
-    MusicTrack *track;
+    TrackData *track;
     MIDIChannelMessage *msg;
     MusicTimeStamp ts = (MusicTimeStamp) NUM2DBL(rb_at);
     OSStatus err;
     
-    Data_Get_Struct(self, MusicTrack, track);
-    Data_Get_Struct(rb_msg, MIDIChannelMessage, msg);
-    require_noerr( err = MusicTrackNewMIDIChannelEvent(*track, ts, msg), fail );
+    track = track_get(self);
+    TypedData_Get_Struct(rb_msg, MIDIChannelMessage, &channel_message_type, msg);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewMIDIChannelEvent(track->track, ts, msg);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, kMusicEventType_MIDIChannelMessage, msg);
+    sequence_account(track->sequence, 1);
     return Qnil;
     
     fail:
@@ -522,12 +1456,12 @@ track_add_midi_channel_message (VALUE self, VALUE rb_at, VALUE rb_msg)
 static VALUE
 track_add_extended_tempo_event (VALUE self, VALUE rb_at, VALUE rb_bpm)
 {
-    MusicTrack *track;
+    TrackData *track;
     MusicTimeStamp ts;
-    Float64 bpm;
+    ExtendedTempoEvent ev;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicTrack, track);
+    track = track_get(self);
     
     if (PRIM_NUM_P(rb_at))
         ts = NUM2DBL(rb_at);
@@ -535,25 +1469,273 @@ track_add_extended_tempo_event (VALUE self, VALUE rb_at, VALUE rb_bpm)
         rb_raise(rb_eArgError, "Expected first arg to be a number.");
     
     if (PRIM_NUM_P(rb_bpm))
-        bpm = NUM2DBL(rb_bpm);
+        ev.bpm = NUM2DBL(rb_bpm);
     else
         rb_raise(rb_eArgError, "Expected second arg to be a number.");
     
-    require_noerr( err = MusicTrackNewExtendedTempoEvent(*track, ts, bpm), fail );
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewExtendedTempoEvent(track->track, ts, ev.bpm);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, kMusicEventType_ExtendedTempo, &ev);
+    sequence_account(track->sequence, 1);
     return Qnil;
     
     fail:
     RAISE_OSSTATUS(err, "MusicTrackNewExtendedTempoEvent()");
 }
 
+/* Meta, raw and user events are defined below with the other messages. */
+static const void *payload_event_to_const (VALUE rb_msg, TrackData *track, MusicEventType *type);
+
 static VALUE
-track_get_loop_info (VALUE self)
+track_add_meta_event (VALUE self, VALUE rb_at, VALUE rb_msg)
 {
-    MusicTrack *track;
-    UInt32 sz;
-    MusicTrackLoopInfo loop_info;
+    TrackData *track;
+    MusicTimeStamp ts = (MusicTimeStamp) NUM2DBL(rb_at);
+    MusicEventType type;
+    const void *ev;
+    OSStatus err;
+    
+    track = track_get(self);
+    if (!THRQL(rb_cMIDIMetaEvent, rb_msg))
+        rb_raise(rb_eArgError, "Expected second arg to be a MIDIMetaEvent.");
+    ev = payload_event_to_const(rb_msg, track, &type);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewMetaEvent(track->track, ts, ev);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, type, ev);
+    sequence_account(track->sequence, 1);
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrackNewMetaEvent()");
+}
+
+static VALUE
+track_add_midi_raw_data (VALUE self, VALUE rb_at, VALUE rb_msg)
+{
+    TrackData *track;
+    MusicTimeStamp ts = (MusicTimeStamp) NUM2DBL(rb_at);
+    MusicEventType type;
+    const void *ev;
+    OSStatus err;
+    
+    track = track_get(self);
+    if (!THRQL(rb_cMIDIRawData, rb_msg))
+        rb_raise(rb_eArgError, "Expected second arg to be a MIDIRawData.");
+    ev = payload_event_to_const(rb_msg, track, &type);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewMIDIRawDataEvent(track->track, ts, ev);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, type, ev);
+    sequence_account(track->sequence, 1);
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrackNewMIDIRawDataEvent()");
+}
+
+static VALUE
+track_add_user_event (VALUE self, VALUE rb_at, VALUE rb_msg)
+{
+    TrackData *track;
+    MusicTimeStamp ts = (MusicTimeStamp) NUM2DBL(rb_at);
+    MusicEventType type;
+    const void *ev;
+    OSStatus err;
+    
+    track = track_get(self);
+    if (!THRQL(rb_cMusicUserEvent, rb_msg))
+        rb_raise(rb_eArgError, "Expected second arg to be a MusicUserEvent.");
+    ev = payload_event_to_const(rb_msg, track, &type);
+    pthread_mutex_lock(&track->sequence->lock);
+    err = MusicTrackNewUserEvent(track->track, ts, ev);
+    pthread_mutex_unlock(&track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(track, ts, type, ev);
+    sequence_account(track->sequence, 1);
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrackNewUserEvent()");
+}
+
+/* A note on or note off held as a raw channel message, as collected by
+ * MusicTrack#pair_notes!. partner is the index of the other half of its
+ * note, or NOTE_PAIRS_NONE. */
+typedef struct {
+    MusicTimeStamp ts;
+    MIDIChannelMessage msg;
+    uint32_t partner;
+} RawNote;
+
+typedef struct {
+    RawNote *raws;
+    size_t count;
+    size_t capacity;
+    NotePairs pairs;
+} NotePairing;
+
+static Boolean
+raw_note_p (MusicEventType type, const void *data)
+{
+    const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+    return type == kMusicEventType_MIDIChannelMessage &&
+           ((msg->status & 0xF0) == 0x80 || (msg->status & 0xF0) == 0x90);
+}
+
+/* Collect the track's note ons and offs and pair them. */
+static OSStatus
+note_pairing_collect (NotePairing *pairing, MusicTrack track)
+{
+    MusicEventIterator iter;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    RawNote *raws;
+    uint32_t on;
+    size_t i;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(track, &iter), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    while (has_current) {
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), dispose );
+        if (raw_note_p(type, data)) {
+            if (pairing->count == pairing->capacity) {
+                size_t capacity = pairing->capacity ? pairing->capacity * 2 : 256;
+                if (!(raws = realloc(pairing->raws, capacity * sizeof(RawNote)))) {
+                    err = kAudio_MemFullError;
+                    goto dispose;
+                }
+                pairing->raws = raws;
+                pairing->capacity = capacity;
+            }
+            pairing->raws[pairing->count].ts = ts;
+            pairing->raws[pairing->count].msg = *(const MIDIChannelMessage *) data;
+            pairing->raws[pairing->count].partner = NOTE_PAIRS_NONE;
+            pairing->count++;
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    }
+    
+    if (note_pairs_reset(&pairing->pairs, pairing->count)) {
+        err = kAudio_MemFullError;
+        goto dispose;
+    }
+    for (i = 0; i < pairing->count; i++) {
+        const MIDIChannelMessage *msg = &pairing->raws[i].msg;
+        on = note_pairs_feed(&pairing->pairs, i, msg->status, msg->data1, msg->data2);
+        if (on == NOTE_PAIRS_NONE) continue;
+        pairing->raws[on].partner = i;
+        pairing->raws[i].partner = on;
+    }
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/* Replace each paired note on and off with a note, returning how many were
+ * made. The events are visited in the same order as they were collected. */
+static OSStatus
+note_pairing_replace (NotePairing *pairing, TrackData *track, size_t *made)
+{
+    MusicEventIterator iter;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    MIDINoteMessage note;
+    const RawNote *on, *off;
+    size_t i = 0;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(track->track, &iter), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    while (has_current) {
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), dispose );
+        if (raw_note_p(type, data) && pairing->raws[i++].partner != NOTE_PAIRS_NONE) {
+            require_noerr( err = MusicEventIteratorDeleteEvent(iter), dispose );
+            track_touch(track, ts, kMusicEventType_NULL, NULL);
+        } else {
+            require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+        }
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    }
+    
+    for (i = 0; i < pairing->count; i++) {
+        on = &pairing->raws[i];
+        if (on->partner == NOTE_PAIRS_NONE || on->partner < i) continue;
+        off = &pairing->raws[on->partner];
+        note.channel = on->msg.status & 0x0F;
+        note.note = on->msg.data1;
+        note.velocity = on->msg.data2;
+        note.releaseVelocity = (off->msg.status & 0xF0) == 0x80 ? off->msg.data2 : 0;
+        note.duration = (Float32) (off->ts - on->ts);
+        require_noerr( err = MusicTrackNewMIDINoteEvent(track->track, on->ts, &note), dispose );
+        track_touch(track, on->ts, kMusicEventType_MIDINoteMessage, &note);
+        (*made)++;
+    }
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/*
+ * Converts raw note on and note off channel messages into notes with
+ * durations, in one pass over the track as described in pair.h. Note ons
+ * and offs left unpaired are kept as they are. Returns the number of notes
+ * made.
+ */
+static VALUE
+track_pair_notes (VALUE self)
+{
+    NotePairing pairing;
+    TrackData *track;
+    size_t made = 0;
+    OSStatus err;
+    
+    track = track_get(self);
+    MEMZERO(&pairing, NotePairing, 1);
+    note_pairs_init(&pairing.pairs);
+    err = note_pairing_collect(&pairing, track->track);
+    if (!err && pairing.count > 0) {
+        pthread_mutex_lock(&track->sequence->lock);
+        err = note_pairing_replace(&pairing, track, &made);
+        pthread_mutex_unlock(&track->sequence->lock);
+    }
+    note_pairs_free(&pairing.pairs);
+    free(pairing.raws);
+    require_noerr( err, fail );
+    /* Each note replaces two events. */
+    sequence_account(track->sequence, -(ssize_t) made);
+    return SIZET2NUM(made);
+    
+    fail:
+    /* The track may have been partly converted. */
+    sequence_recount(track->sequence);
+    RAISE_OSSTATUS(err, "MusicTrack#pair_notes!");
+}
+
+static VALUE
+track_get_loop_info (VALUE self)
+{
+    MusicTrack *track;
+    UInt32 sz;
+    MusicTrackLoopInfo loop_info;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     require_noerr( err = MusicTrackGetProperty(*track, kSequenceTrackProperty_LoopInfo, &loop_info, &sz), fail );
 
     if (sz == sizeof(MusicTrackLoopInfo)) {
@@ -576,7 +1758,7 @@ track_set_loop_info (VALUE self, VALUE rb_loop_info)
     MusicTrack *track;
     MusicTrackLoopInfo loop_info;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     loop_info.loopDuration = NUM2DBL(rb_hash_aref(rb_loop_info, rb_sDuration));
     loop_info.numberOfLoops = NUM2DBL(rb_hash_aref(rb_loop_info, rb_sNumber));
     
@@ -598,7 +1780,7 @@ track_get_offset (VALUE self)
     UInt32 sz;
     MusicTimeStamp offset;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     require_noerr( err = MusicTrackGetProperty(*track, kSequenceTrackProperty_OffsetTime, &offset, &sz), fail );
     
     if (sz == sizeof(MusicTimeStamp))
@@ -618,7 +1800,7 @@ track_set_offset (VALUE self, VALUE rb_offset)
     MusicTrack *track;
     MusicTimeStamp offset = NUM2DBL(rb_offset);
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackSetProperty(*track, kSequenceTrackProperty_OffsetTime,
@@ -638,7 +1820,7 @@ track_get_mute (VALUE self)
     UInt32 sz;
     Boolean status;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     require_noerr( err = MusicTrackGetProperty(*track, kSequenceTrackProperty_MuteStatus, &status, &sz), fail );
     
     if (sz == sizeof(Boolean))
@@ -656,7 +1838,7 @@ track_set_mute (VALUE self, VALUE rb_status)
     MusicTrack *track;
     Boolean status = RTEST(rb_status);
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackSetProperty(*track, kSequenceTrackProperty_MuteStatus,
@@ -676,7 +1858,7 @@ track_get_solo (VALUE self)
     UInt32 sz;
     Boolean status;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     require_noerr(
         err = MusicTrackGetProperty(*track, kSequenceTrackProperty_SoloStatus,
                                     &status, &sz),
@@ -697,7 +1879,7 @@ track_set_solo (VALUE self, VALUE rb_status)
     MusicTrack *track;
     Boolean status = RTEST(rb_status);
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackSetProperty(*track, kSequenceTrackProperty_SoloStatus,
@@ -717,7 +1899,7 @@ track_get_length (VALUE self)
     MusicTimeStamp length;
     UInt32 sz;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackGetProperty(*track, kSequenceTrackProperty_TrackLength,
@@ -741,7 +1923,7 @@ track_set_length (VALUE self, VALUE rb_length)
     MusicTrack *track;
     MusicTimeStamp length = NUM2DBL(rb_length);
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackSetProperty(*track, kSequenceTrackProperty_TrackLength,
@@ -761,7 +1943,7 @@ track_get_resolution (VALUE self)
     SInt16 res;
     UInt32 sz;
     OSStatus err;
-    Data_Get_Struct(self, MusicTrack, track);
+    track = &track_get(self)->track;
     
     require_noerr(
         err = MusicTrackGetProperty(*track, kSequenceTrackProperty_TimeResolution, &res, &sz),
@@ -779,6 +1961,239 @@ track_get_resolution (VALUE self)
         RAISE_OSSTATUS(err, "MusicTrackGetProperty()");
 }
 
+/* Digest defns */
+
+/*
+ * Digests hash a canonical serialization of each event: its time, type and
+ * the fields of its data (not the raw struct, whose padding and reserved
+ * fields are not part of the content). Block digests are combined with the
+ * track's properties into the track digest, and track digests in index
+ * order into the sequence digest.
+ */
+
+static void
+digest_put_event (DigestBuffer *buf, MusicTimeStamp ts, MusicEventType type, const void *data, UInt32 size)
+{
+    digest_buffer_put_f64(buf, ts);
+    digest_buffer_put_u32(buf, type);
+    switch (type) {
+    case kMusicEventType_MIDINoteMessage: {
+        const MIDINoteMessage *msg = (const MIDINoteMessage *) data;
+        digest_buffer_put_u8(buf, msg->channel);
+        digest_buffer_put_u8(buf, msg->note);
+        digest_buffer_put_u8(buf, msg->velocity);
+        digest_buffer_put_u8(buf, msg->releaseVelocity);
+        digest_buffer_put_f32(buf, msg->duration);
+        break;
+    }
+    case kMusicEventType_MIDIChannelMessage: {
+        const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+        digest_buffer_put_u8(buf, msg->status);
+        digest_buffer_put_u8(buf, msg->data1);
+        digest_buffer_put_u8(buf, msg->data2);
+        break;
+    }
+    case kMusicEventType_ExtendedTempo:
+        digest_buffer_put_f64(buf, ((const ExtendedTempoEvent *) data)->bpm);
+        break;
+    default:
+        digest_buffer_put_u32(buf, size);
+        digest_buffer_put(buf, data, size);
+        break;
+    }
+}
+
+/* Find the number of blocks spanned by the track's events. */
+static OSStatus
+track_block_span (MusicEventIterator iter, UInt32 *count)
+{
+    MusicTimeStamp last;
+    Boolean has_prev;
+    OSStatus err;
+    
+    *count = 0;
+    require_noerr( err = MusicEventIteratorSeek(iter, kMusicTimeStamp_EndOfTrack), fail );
+    require_noerr( err = MusicEventIteratorHasPreviousEvent(iter, &has_prev), fail );
+    if (!has_prev) return noErr;
+    require_noerr( err = MusicEventIteratorPreviousEvent(iter), fail );
+    require_noerr( err = MusicEventIteratorGetEventInfo(iter, &last, NULL, NULL, NULL), fail );
+    *count = (UInt32) floor((last > 0.0 ? last : 0.0) / DIGEST_BLOCK_BEATS) + 1;
+    
+    fail:
+    return err;
+}
+
+static OSStatus
+track_digest_block (MusicEventIterator iter, UInt32 index, DigestBuffer *buf, DigestBlock *block)
+{
+    MusicTimeStamp ts, end = (index + 1) * DIGEST_BLOCK_BEATS;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    OSStatus err;
+    
+    buf->length = 0;
+    block->events = 0;
+    require_noerr( err = MusicEventIteratorSeek(iter, index * DIGEST_BLOCK_BEATS), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), fail );
+    while (has_current) {
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), fail );
+        if (ts >= end) break;
+        digest_put_event(buf, ts, type, data, size);
+        block->events++;
+        require_noerr( err = MusicEventIteratorNextEvent(iter), fail );
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), fail );
+    }
+    if (digest_buffer_finish(buf, &block->digest) < 0) return kAudio_MemFullError;
+    block->valid = TRUE;
+    
+    fail:
+    return err;
+}
+
+/* Bring every block digest up to date. */
+static OSStatus
+track_update_blocks (TrackData *track)
+{
+    MusicEventIterator iter;
+    DigestBuffer buf;
+    UInt32 i, count;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(track->track, &iter), fail );
+    require_noerr( err = track_block_span(iter, &count), dispose );
+    if (count > track->block_capacity) {
+        track->blocks = sequence_arena_grow(track->sequence, track->blocks,
+                                            track->block_capacity * sizeof(DigestBlock),
+                                            count * sizeof(DigestBlock));
+        track->block_capacity = count;
+    }
+    for (i = track->block_count; i < count; i++)
+        track->blocks[i].valid = FALSE;
+    track->block_count = count;
+    
+    digest_buffer_init(&buf);
+    for (i = 0; i < count; i++) {
+        if (track->blocks[i].valid) continue;
+        if ((err = track_digest_block(iter, i, &buf, &track->blocks[i]))) break;
+    }
+    digest_buffer_free(&buf);
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+static OSStatus
+track_digest (TrackData *track, Digest *out)
+{
+    MusicTrackLoopInfo loop_info;
+    MusicTimeStamp offset = 0.0, length = 0.0;
+    Boolean mute = FALSE, solo = FALSE;
+    DigestBuffer buf;
+    UInt32 i, sz;
+    OSStatus err;
+    
+    memset(&loop_info, 0, sizeof(loop_info));
+    require_noerr( err = track_update_blocks(track), fail );
+    sz = sizeof(loop_info);
+    require_noerr( err = MusicTrackGetProperty(track->track, kSequenceTrackProperty_LoopInfo, &loop_info, &sz), fail );
+    sz = sizeof(offset);
+    require_noerr( err = MusicTrackGetProperty(track->track, kSequenceTrackProperty_OffsetTime, &offset, &sz), fail );
+    sz = sizeof(mute);
+    require_noerr( err = MusicTrackGetProperty(track->track, kSequenceTrackProperty_MuteStatus, &mute, &sz), fail );
+    sz = sizeof(solo);
+    require_noerr( err = MusicTrackGetProperty(track->track, kSequenceTrackProperty_SoloStatus, &solo, &sz), fail );
+    sz = sizeof(length);
+    require_noerr( err = MusicTrackGetProperty(track->track, kSequenceTrackProperty_TrackLength, &length, &sz), fail );
+    
+    digest_buffer_init(&buf);
+    digest_buffer_put(&buf, "MusicTrack/1", 12);
+    digest_buffer_put_f64(&buf, offset);
+    digest_buffer_put_u8(&buf, mute ? 1 : 0);
+    digest_buffer_put_u8(&buf, solo ? 1 : 0);
+    digest_buffer_put_f64(&buf, loop_info.loopDuration);
+    digest_buffer_put_u32(&buf, (UInt32) loop_info.numberOfLoops);
+    digest_buffer_put_f64(&buf, length);
+    for (i = 0; i < track->block_count; i++) {
+        if (track->blocks[i].events == 0) continue;
+        digest_buffer_put_u32(&buf, i);
+        digest_buffer_put_u32(&buf, track->blocks[i].events);
+        digest_buffer_put(&buf, track->blocks[i].digest.bytes, DIGEST_SIZE);
+    }
+    if (digest_buffer_finish(&buf, out) < 0) err = kAudio_MemFullError;
+    digest_buffer_free(&buf);
+    
+    fail:
+    return err;
+}
+
+static VALUE
+digest_to_rb (const Digest *digest)
+{
+    char hex[2 * DIGEST_SIZE + 1];
+    digest_hex(digest, hex);
+    return rb_str_new(hex, 2 * DIGEST_SIZE);
+}
+
+/* A hex digest of the track's events and properties. Equal content yields
+ * equal digests in any process. */
+static VALUE
+track_get_digest (VALUE self)
+{
+    TrackData *track;
+    Digest digest;
+    OSStatus err;
+    
+    track = track_get(self);
+    require_noerr( err = track_digest(track, &digest), fail );
+    return digest_to_rb(&digest);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrack#digest");
+}
+
+/* A hex digest of the sequence's type, tempo track and tracks. */
+static VALUE
+sequence_get_digest (VALUE self)
+{
+    VALUE rb_tracks = rb_iv_get(self, "@tracks"), rb_track;
+    MusicSequence *seq;
+    MusicSequenceType type;
+    TrackData *track;
+    Digest digest;
+    DigestBuffer buf;
+    UInt32 i, track_count;
+    OSStatus err;
+    
+    seq = &sequence_get(self)->seq;
+    require_noerr( err = MusicSequenceGetSequenceType(*seq, &type), fail );
+    require_noerr( err = MusicSequenceGetTrackCount(*seq, &track_count), fail );
+    
+    digest_buffer_init(&buf);
+    digest_buffer_put(&buf, "MusicSequence/1", 15);
+    digest_buffer_put_u32(&buf, type);
+    digest_buffer_put_u32(&buf, track_count);
+    for (i = 0; i <= track_count; i++) {
+        /* The tempo track comes first, then the tracks by index; the
+         * collection's cached wrappers keep their block digests. */
+        rb_track = i == 0 ? rb_funcall(rb_tracks, rb_intern("tempo"), 0)
+                          : rb_funcall(rb_tracks, rb_intern("[]"), 1, UINT2NUM(i - 1));
+        track = track_get(rb_track);
+        if ((err = track_digest(track, &digest))) break;
+        digest_buffer_put(&buf, digest.bytes, DIGEST_SIZE);
+    }
+    if (!err && digest_buffer_finish(&buf, &digest) < 0) err = kAudio_MemFullError;
+    digest_buffer_free(&buf);
+    require_noerr( err, fail );
+    return digest_to_rb(&digest);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequence#digest");
+}
+
 /* TrackCollection defns */
 
 static MusicSequence*
@@ -786,7 +2201,7 @@ tracks_get_seq (VALUE rb_tracks)
 {
     MusicSequence *seq;
     VALUE rb_seq = rb_iv_get(rb_tracks, "@sequence");
-    Data_Get_Struct(rb_seq, MusicSequence, seq);
+    seq = &sequence_get(rb_seq)->seq;
     return seq;
 }
 
@@ -809,11 +2224,13 @@ tracks_get_ind_track_internal (VALUE self, VALUE rb_key)
 {
     if (!FIXNUM_P(rb_key)) rb_raise(rb_eArgError, "Expected key to be a Fixnum.");
     MusicSequence *seq = tracks_get_seq(self);
-    MusicTrack *track = ALLOC(MusicTrack);
     VALUE rb_seq = rb_iv_get(self, "@sequence");
+    MusicTrack handle;
+    TrackData *track;
     OSStatus err;
     
-    require_noerr( err = MusicSequenceGetIndTrack(*seq, FIX2INT(rb_key), track), fail );
+    require_noerr( err = MusicSequenceGetIndTrack(*seq, FIX2INT(rb_key), &handle), fail );
+    track = track_data_get(rb_seq, handle);
     return track_internal_new(rb_seq, track);
     
     fail:
@@ -835,7 +2252,7 @@ tracks_index (VALUE self, VALUE rb_track)
     UInt32 i;
     OSStatus err;
     
-    Data_Get_Struct(rb_track, MusicTrack, track);
+    track = &track_get(rb_track)->track;
     require_noerr( err = MusicSequenceGetTrackIndex(*seq, *track, &i), fail );
     return UINT2NUM(i);
     
@@ -848,10 +2265,13 @@ tracks_tempo_internal (VALUE self)
 {
     MusicSequence *seq = tracks_get_seq(self);
     VALUE rb_seq = rb_iv_get(self, "@sequence");
-    MusicTrack *track = ALLOC(MusicTrack);
+    MusicTrack handle;
+    TrackData *track;
     OSStatus err;
     
-    require_noerr( err = MusicSequenceGetTempoTrack(*seq, track), fail );
+    require_noerr( err = MusicSequenceGetTempoTrack(*seq, &handle), fail );
+    track = track_data_get(rb_seq, handle);
+    track->tempo = TRUE;
     return track_internal_new(rb_seq, track);
     
     fail:
@@ -861,31 +2281,252 @@ tracks_tempo_internal (VALUE self)
 static VALUE
 tracks_delete_internal (VALUE self, VALUE rb_track)
 {
-    MusicSequence *seq = tracks_get_seq(self);
-    MusicTrack *track;
+    SequenceData *seq = (SequenceData *) tracks_get_seq(self);
+    TrackData *track;
     OSStatus err;
     
-    Data_Get_Struct(rb_track, MusicTrack, track);
-    require_noerr( err = MusicSequenceDisposeTrack(*seq, *track), fail );
+    track = track_get(rb_track);
+    sequence_suspend(seq, FALSE);
+    pthread_mutex_lock(&seq->lock);
+    err = MusicSequenceDisposeTrack(seq->seq, track->track);
+    pthread_mutex_unlock(&seq->lock);
+    if (!err) track_data_dispose(track);
+    sequence_suspend(seq, TRUE);
+    require_noerr( err, fail );
+    require_noerr( err = sequence_recount(seq), count_fail );
     return Qnil;
     
     fail:
     RAISE_OSSTATUS(err, "MusicSequenceDisposeTrack()");
+    
+    count_fail:
+    RAISE_OSSTATUS(err, "MusicTrackCollection#delete");
 }
 
-/* MIDINoteMessage */
+/* MusicSequence::Detached defns */
+
+/*
+ * A detached sequence owns the handle taken from its wrapper until it is
+ * attached to a new one. It is frozen, and so may be passed to any Ractor,
+ * which is why attaching takes the handle atomically.
+ */
+typedef struct {
+    MusicSequence seq;
+    size_t events;
+} DetachedData;
+
+static void
+detached_free (DetachedData *detached)
+{
+    if (detached->seq) {
+        rb_gc_adjust_memory_usage(-(ssize_t) (detached->events * EVENT_FOOTPRINT));
+        DisposeMusicSequence(detached->seq);
+    }
+    xfree(detached);
+}
+
+static size_t
+detached_memsize (const void *ptr)
+{
+    const DetachedData *detached = (const DetachedData *) ptr;
+    return sizeof(DetachedData) + (detached->seq ? detached->events * EVENT_FOOTPRINT : 0);
+}
+
+#if RUBY_API_VERSION_CODE >= 30000
+#define DETACHED_TYPED_FLAGS \
+    (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE)
+#else
+#define DETACHED_TYPED_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED)
+#endif
+
+static const rb_data_type_t detached_type = {
+    "AudioToolbox::MusicSequence::Detached",
+    { 0, (RUBY_DATA_FUNC) detached_free, detached_memsize, },
+    0, 0, DETACHED_TYPED_FLAGS
+};
+
+/*
+ * Hands the sequence's events over to a MusicSequence::Detached, leaving
+ * the receiver, its tracks and their iterators closed. Raises while the
+ * sequence is set on a player, recorded into or being scanned.
+ */
+static VALUE
+sequence_detach (VALUE self)
+{
+    SequenceData *seq = sequence_get(self);
+    SequenceUser *user;
+    DetachedData *detached;
+    TrackData *track;
+    VALUE rb_detached;
+    
+    for (user = seq->users; user; user = user->next)
+        if (!user->close)
+            rb_raise(rb_eRuntimeError, "Expected the sequence not to be in use by a player, recorder or scan.");
+    
+    rb_detached = TypedData_Make_Struct(rb_cMusicSequenceDetached, DetachedData, &detached_type, detached);
+    while ((user = seq->users)) {
+        sequence_user_unlink(user);
+        user->close(user->owner);
+    }
+    if (seq->cues) {
+        MusicSequenceSetUserCallback(seq->seq, NULL, NULL);
+        cue_queue_enable(seq->cues, FALSE);
+    }
+    detached->seq = seq->seq;
+    detached->events = seq->events;
+    seq->seq = NULL;
+    seq->events = 0;
+    seq->signatures_valid = FALSE;
+    for (track = seq->tracks; track; track = track->next)
+        track->track = NULL;
+    return rb_obj_freeze(rb_detached);
+}
+
+/* A new MusicSequence holding the events of a MusicSequence::Detached,
+ * which can be attached only once. */
+static VALUE
+sequence_attach (VALUE class, VALUE rb_detached)
+{
+    DetachedData *detached;
+    MusicSequence handle;
+    
+    TypedData_Get_Struct(rb_detached, DetachedData, &detached_type, detached);
+    if (!(handle = __atomic_exchange_n(&detached->seq, NULL, __ATOMIC_ACQ_REL)))
+        rb_raise(rb_eArgError, "Expected a sequence which has not been attached.");
+    rb_gc_adjust_memory_usage(-(ssize_t) (detached->events * EVENT_FOOTPRINT));
+    return sequence_adopt(handle, detached->events);
+}
+
+/*
+ * User events, or cues, are queued by whichever thread plays them, either
+ * AudioToolbox's or the engine's, and drained by a dispatcher thread in
+ * Ruby, so a slow handler never holds up playback. See cue.h.
+ */
+
+/* Cues drained by one call to drain_cues. */
+#define CUE_BATCH 64
+
+/* User events are defined below with the other payload events. */
+static VALUE payload_event_from_const (VALUE class, VALUE *arena, const UInt8 *bytes,
+                                       UInt32 length, UInt8 meta_type);
 
+/* The sequence's queue, created on first use. */
+static CueQueue *
+sequence_cues (VALUE rb_seq)
+{
+    SequenceData *seq = sequence_get(rb_seq);
+    if (!seq->cues && !(seq->cues = cue_queue_new()))
+        rb_sys_fail("cue_queue_new");
+    return seq->cues;
+}
+
+/* Called by AudioToolbox on its playback thread, so Ruby is out of bounds.
+ * Cues are pushed as they are played, a little before they are due. */
 static void
-midi_note_message_free (MIDINoteMessage *msg)
+sequence_cue_callback (void *ctx, MusicSequence seq, MusicTrack track, MusicTimeStamp ts,
+                       const MusicEventUserData *data, MusicTimeStamp start, MusicTimeStamp end)
+{
+    UInt32 index;
+    int32_t track_index = -1;
+    
+    if (MusicSequenceGetTrackIndex(seq, track, &index) == noErr)
+        track_index = (int32_t) index;
+    cue_push((CueQueue *) ctx, ts, scheduler_now(), track_index, data->data, data->length);
+}
+
+static VALUE
+sequence_enable_cues (VALUE self, VALUE rb_on)
+{
+    CueQueue *cues = sequence_cues(self);
+    SequenceData *seq = sequence_get(self);
+    OSStatus err;
+    
+    if (RTEST(rb_on))
+        require_noerr( err = MusicSequenceSetUserCallback(seq->seq, sequence_cue_callback, cues), fail );
+    else
+        require_noerr( err = MusicSequenceSetUserCallback(seq->seq, NULL, NULL), fail );
+    cue_queue_enable(cues, RTEST(rb_on));
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequenceSetUserCallback()");
+}
+
+/* The descriptor which becomes readable when cues are queued, or nil. */
+static VALUE
+sequence_cue_notify_fd (VALUE self)
+{
+    SequenceData *seq;
+    TypedData_Get_Struct(self, SequenceData, &sequence_type, seq);
+    return seq->cues ? INT2FIX(seq->cues->notify[0]) : Qnil;
+}
+
+/* Take up to CUE_BATCH cues as a flat Array of MusicUserEvent, beat, track
+ * index and scheduled time for each. This works after the sequence has been
+ * detached, so the dispatcher can finish with what was queued. */
+static VALUE
+sequence_drain_cues (VALUE self)
+{
+    SequenceData *seq;
+    CueEvent cues[CUE_BATCH];
+    VALUE rb_cues, payloads = Qnil;
+    size_t i, count;
+    
+    TypedData_Get_Struct(self, SequenceData, &sequence_type, seq);
+    if (!seq->cues) return rb_ary_new();
+    count = cue_drain(seq->cues, cues, CUE_BATCH);
+    rb_cues = rb_ary_new_capa(count * 4);
+    for (i = 0; i < count; i++) {
+        rb_ary_push(rb_cues, payload_event_from_const(rb_cMusicUserEvent, &payloads,
+                                                      cue_event_data(&cues[i]), cues[i].length, 0));
+        rb_ary_push(rb_cues, rb_float_new(cues[i].beat));
+        rb_ary_push(rb_cues, cues[i].track < 0 ? Qnil : INT2FIX(cues[i].track));
+        rb_ary_push(rb_cues, rb_float_new(cues[i].scheduled));
+        cue_event_free(&cues[i]);
+    }
+    return rb_cues;
+}
+
+/* Cues dropped because the dispatcher fell a whole queue behind. */
+static VALUE
+sequence_dropped_cues (VALUE self)
+{
+    SequenceData *seq;
+    TypedData_Get_Struct(self, SequenceData, &sequence_type, seq);
+    return ULL2NUM(seq->cues ? __atomic_load_n(&seq->cues->dropped, __ATOMIC_RELAXED) : 0);
+}
+
+/*
+ * Messages are small and made in great numbers when a track is read, so
+ * where Ruby can embed typed data they are kept in the object's own slot
+ * rather than in a separate malloc'd block.
+ */
+#if RUBY_API_VERSION_CODE >= 30300
+#define MESSAGE_TYPED_FLAGS \
+    (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_EMBEDDABLE)
+#else
+#define MESSAGE_TYPED_FLAGS (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED)
+#endif
+
+/* MIDINoteMessage */
+
+static size_t
+midi_note_message_memsize (const void *msg)
 {
-    if (msg) free(msg);
+    return sizeof(MIDINoteMessage);
 }
 
+static const rb_data_type_t note_message_type = {
+    "AudioToolbox::MIDINoteMessage",
+    { 0, RUBY_TYPED_DEFAULT_FREE, midi_note_message_memsize, },
+    0, 0, MESSAGE_TYPED_FLAGS
+};
+
 static VALUE
 midi_note_message_alloc (VALUE class)
 {
     MIDINoteMessage *msg;
-    return Data_Make_Struct(class, MIDINoteMessage, 0, midi_note_message_free, msg);
+    return TypedData_Make_Struct(class, MIDINoteMessage, &note_message_type, msg);
 }
 
 static VALUE
@@ -895,7 +2536,7 @@ midi_note_message_init (VALUE self, VALUE rb_opts)
     MIDINoteMessage *msg;
     VALUE rb_chn, rb_note, rb_vel, rb_rel_vel, rb_dur;
 
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
 
     rb_chn = rb_hash_aref(rb_opts, rb_sChannel);
     msg->channel = FIXNUM_P(rb_chn) ? FIX2UINT(rb_chn) : 1;
@@ -922,7 +2563,7 @@ static VALUE
 midi_note_message_channel (VALUE self)
 {
     MIDINoteMessage *msg;
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
     return UINT2NUM(msg->channel);
 }
 
@@ -930,7 +2571,7 @@ static VALUE
 midi_note_message_note (VALUE self)
 {
     MIDINoteMessage *msg;
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
     return UINT2NUM(msg->note);
 }
 
@@ -938,7 +2579,7 @@ static VALUE
 midi_note_message_velocity (VALUE self)
 {
     MIDINoteMessage *msg;
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
     return UINT2NUM(msg->velocity);
 }
 
@@ -946,7 +2587,7 @@ static VALUE
 midi_note_message_release_velocity (VALUE self)
 {
     MIDINoteMessage *msg;
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
     return UINT2NUM(msg->releaseVelocity);
 }
 
@@ -954,7 +2595,7 @@ static VALUE
 midi_note_message_duration (VALUE self)
 {
     MIDINoteMessage *msg;
-    Data_Get_Struct(self, MIDINoteMessage, msg);
+    TypedData_Get_Struct(self, MIDINoteMessage, &note_message_type, msg);
     return UINT2NUM(msg->duration);
 }
 
@@ -973,17 +2614,23 @@ midi_note_message_from_const (MIDINoteMessage *msg)
 
 /* MIDIChannelMessage */
 
-static void
-midi_channel_message_free (MIDIChannelMessage *msg)
+static size_t
+midi_channel_message_memsize (const void *msg)
 {
-    if (msg) free(msg);
+    return sizeof(MIDIChannelMessage);
 }
 
+static const rb_data_type_t channel_message_type = {
+    "AudioToolbox::MIDIChannelMessage",
+    { 0, RUBY_TYPED_DEFAULT_FREE, midi_channel_message_memsize, },
+    0, 0, MESSAGE_TYPED_FLAGS
+};
+
 static VALUE
 midi_channel_message_alloc (VALUE class)
 {
     MIDIChannelMessage *msg;
-    return Data_Make_Struct(class, MIDIChannelMessage, 0, midi_channel_message_free, msg);
+    return TypedData_Make_Struct(class, MIDIChannelMessage, &channel_message_type, msg);
 }
 
 static VALUE
@@ -993,7 +2640,7 @@ midi_channel_message_init (VALUE self, VALUE rb_opts)
     MIDIChannelMessage *msg;
     VALUE rb_status, rb_data1, rb_data2;
     
-    Data_Get_Struct(self, MIDIChannelMessage, msg);
+    TypedData_Get_Struct(self, MIDIChannelMessage, &channel_message_type, msg);
     
     rb_status = rb_hash_aref(rb_opts, rb_sStatus);
     if (!FIXNUM_P(rb_status))
@@ -1014,7 +2661,7 @@ static VALUE
 midi_channel_message_status (VALUE self)
 {
     MIDIChannelMessage *msg;
-    Data_Get_Struct(self, MIDIChannelMessage, msg);
+    TypedData_Get_Struct(self, MIDIChannelMessage, &channel_message_type, msg);
     return UINT2NUM(msg->status);
 }
 
@@ -1022,7 +2669,7 @@ static VALUE
 midi_channel_message_data1 (VALUE self)
 {
     MIDIChannelMessage *msg;
-    Data_Get_Struct(self, MIDIChannelMessage, msg);
+    TypedData_Get_Struct(self, MIDIChannelMessage, &channel_message_type, msg);
     return UINT2NUM(msg->data1);
 }
 
@@ -1030,7 +2677,7 @@ static VALUE
 midi_channel_message_data2 (VALUE self)
 {
     MIDIChannelMessage *msg;
-    Data_Get_Struct(self, MIDIChannelMessage, msg);
+    TypedData_Get_Struct(self, MIDIChannelMessage, &channel_message_type, msg);
     return UINT2NUM(msg->data2);
 }
 
@@ -1066,43 +2713,4286 @@ midi_channel_message_from_const (MIDIChannelMessage *msg)
     }
 }
 
-/* ExtendedTempoEvent defns */
-static VALUE
-tempo_from_const (ExtendedTempoEvent *ev)
+/* MIDIMetaEvent, MIDIRawData and MusicUserEvent */
+
+/*
+ * Meta, raw and user events carry a payload of any length. Those read from a
+ * track are appended to a byte arena, a binary String shared by every such
+ * event of the scan, and refer to their bytes by offset and length, so a
+ * scan makes neither a String nor a malloc'd block per payload. #data makes
+ * a frozen String of the bytes the first time it is called. An event made
+ * in Ruby refers to a frozen copy of the String it was given instead.
+ */
+typedef struct {
+    VALUE bytes;
+    long offset;
+    long length;
+    VALUE data;         /* nil until #data is first called */
+    UInt8 meta_type;
+} PayloadEvent;
+
+/* Arenas start with room for this many bytes and double as they fill. */
+#define PAYLOAD_ARENA_SIZE 1024
+
+static void
+payload_event_mark (void *ptr)
 {
-  VALUE rb_opts = rb_hash_new();
-  rb_hash_aset(rb_opts, rb_sBpm, rb_float_new(ev->bpm));
-  return rb_funcall(rb_cExtendedTempoEvent, rb_intern("new"), 1, rb_opts);
+    PayloadEvent *ev = (PayloadEvent *) ptr;
+    rb_gc_mark(ev->bytes);
+    rb_gc_mark(ev->data);
 }
 
-/* MusicEventIterator defns */
-static void
-iter_free (MusicEventIterator *iter)
+static size_t
+payload_event_memsize (const void *ev)
 {
-    OSStatus err;
-    require_noerr( err = DisposeMusicEventIterator(*iter), fail );
-    return;
-    
+    return sizeof(PayloadEvent);
+}
+
+static const rb_data_type_t payload_event_type = {
+    "AudioToolbox::MIDIPayloadEvent",
+    { payload_event_mark, RUBY_TYPED_DEFAULT_FREE, payload_event_memsize, },
+    0, 0, MESSAGE_TYPED_FLAGS
+};
+
+static VALUE
+payload_event_alloc (VALUE class)
+{
+    PayloadEvent *ev;
+    VALUE rb_ev = TypedData_Make_Struct(class, PayloadEvent, &payload_event_type, ev);
+    ev->bytes = ev->data = Qnil;
+    return rb_ev;
+}
+
+static void
+payload_event_set_data (VALUE self, VALUE rb_data)
+{
+    PayloadEvent *ev;
+    TypedData_Get_Struct(self, PayloadEvent, &payload_event_type, ev);
+    if (T_STRING != TYPE(rb_data))
+        rb_raise(rb_eArgError, ":data is required.");
+    rb_data = rb_str_new_frozen(rb_data);
+    RB_OBJ_WRITE(self, &ev->bytes, rb_data);
+    RB_OBJ_WRITE(self, &ev->data, rb_data);
+    ev->offset = 0;
+    ev->length = RSTRING_LEN(rb_data);
+}
+
+static VALUE
+midi_meta_event_init (VALUE self, VALUE rb_opts)
+{
+    Check_Type(rb_opts, T_HASH);
+    PayloadEvent *ev;
+    VALUE rb_type;
+    
+    TypedData_Get_Struct(self, PayloadEvent, &payload_event_type, ev);
+    
+    rb_type = rb_hash_aref(rb_opts, rb_sMetaType);
+    if (!FIXNUM_P(rb_type))
+        rb_raise(rb_eArgError, ":meta_type is required.");
+    if (FIX2INT(rb_type) < 0 || FIX2INT(rb_type) > 127)
+        rb_raise(rb_eArgError, "Expected :meta_type to be within 0..127.");
+    ev->meta_type = (UInt8) FIX2INT(rb_type);
+    
+    payload_event_set_data(self, rb_hash_aref(rb_opts, rb_sData));
+    return self;
+}
+
+static VALUE
+payload_event_init (VALUE self, VALUE rb_opts)
+{
+    Check_Type(rb_opts, T_HASH);
+    payload_event_set_data(self, rb_hash_aref(rb_opts, rb_sData));
+    return self;
+}
+
+static VALUE
+midi_meta_event_meta_type (VALUE self)
+{
+    PayloadEvent *ev;
+    TypedData_Get_Struct(self, PayloadEvent, &payload_event_type, ev);
+    return UINT2NUM(ev->meta_type);
+}
+
+static VALUE
+payload_event_data (VALUE self)
+{
+    PayloadEvent *ev;
+    TypedData_Get_Struct(self, PayloadEvent, &payload_event_type, ev);
+    if (NIL_P(ev->data))
+        RB_OBJ_WRITE(self, &ev->data,
+                     rb_obj_freeze(rb_str_new(RSTRING_PTR(ev->bytes) + ev->offset, ev->length)));
+    return ev->data;
+}
+
+static VALUE
+payload_event_length (VALUE self)
+{
+    PayloadEvent *ev;
+    TypedData_Get_Struct(self, PayloadEvent, &payload_event_type, ev);
+    return LONG2NUM(ev->length);
+}
+
+/* Append a payload to the arena in *arena, starting one if need be, and
+ * make an event of class which refers to it. */
+static VALUE
+payload_event_from_const (VALUE class, VALUE *arena, const UInt8 *bytes, UInt32 length, UInt8 meta_type)
+{
+    PayloadEvent *ev;
+    VALUE rb_ev = payload_event_alloc(class);
+    TypedData_Get_Struct(rb_ev, PayloadEvent, &payload_event_type, ev);
+    if (NIL_P(*arena))
+        *arena = rb_str_buf_new(PAYLOAD_ARENA_SIZE);
+    RB_OBJ_WRITE(rb_ev, &ev->bytes, *arena);
+    ev->offset = RSTRING_LEN(*arena);
+    ev->length = length;
+    ev->meta_type = meta_type;
+    rb_str_cat(*arena, (const char *) bytes, length);
+    return rb_ev;
+}
+
+/* Lay out an event in the track's scratch space as AudioToolbox expects it. */
+static const void *
+payload_event_to_const (VALUE rb_msg, TrackData *track, MusicEventType *type)
+{
+    PayloadEvent *ev;
+    MIDIMetaEvent *meta;
+    MIDIRawData *raw;
+    MusicEventUserData *user;
+    const char *bytes;
+    
+    TypedData_Get_Struct(rb_msg, PayloadEvent, &payload_event_type, ev);
+    if (THRQL(rb_cMIDIMetaEvent, rb_msg)) {
+        meta = track_scratch(track, sizeof(MIDIMetaEvent) + ev->length);
+        bytes = RSTRING_PTR(ev->bytes) + ev->offset;
+        MEMZERO(meta, MIDIMetaEvent, 1);
+        meta->metaEventType = ev->meta_type;
+        meta->dataLength = (UInt32) ev->length;
+        memcpy(meta->data, bytes, ev->length);
+        *type = kMusicEventType_Meta;
+        return meta;
+    }
+    if (THRQL(rb_cMusicUserEvent, rb_msg)) {
+        user = track_scratch(track, sizeof(MusicEventUserData) + ev->length);
+        bytes = RSTRING_PTR(ev->bytes) + ev->offset;
+        user->length = (UInt32) ev->length;
+        memcpy(user->data, bytes, ev->length);
+        *type = kMusicEventType_User;
+        return user;
+    }
+    raw = track_scratch(track, sizeof(MIDIRawData) + ev->length);
+    bytes = RSTRING_PTR(ev->bytes) + ev->offset;
+    raw->length = (UInt32) ev->length;
+    memcpy(raw->data, bytes, ev->length);
+    *type = kMusicEventType_MIDIRawData;
+    return raw;
+}
+
+/* ExtendedTempoEvent defns */
+static VALUE
+tempo_from_const (ExtendedTempoEvent *ev)
+{
+  VALUE rb_opts = rb_hash_new();
+  rb_hash_aset(rb_opts, rb_sBpm, rb_float_new(ev->bpm));
+  return rb_funcall(rb_cExtendedTempoEvent, rb_intern("new"), 1, rb_opts);
+}
+
+/* Convert raw event data to its Ruby representation. The payloads of meta,
+ * raw and user events are appended to the arena in *payloads. */
+static VALUE
+event_from_const (MusicEventType type, const void *data, VALUE *payloads)
+{
+    const MIDIMetaEvent *meta = (const MIDIMetaEvent *) data;
+    const MIDIRawData *raw = (const MIDIRawData *) data;
+    const MusicEventUserData *user = (const MusicEventUserData *) data;
+    
+    switch(type) {
+    case kMusicEventType_NULL:
+        return Qnil;
+    case kMusicEventType_MIDINoteMessage:
+        return midi_note_message_from_const((MIDINoteMessage*) data);
+    case kMusicEventType_MIDIChannelMessage:
+        return midi_channel_message_from_const((MIDIChannelMessage*) data);
+    case kMusicEventType_ExtendedTempo:
+        return tempo_from_const((ExtendedTempoEvent*) data);
+    case kMusicEventType_Meta:
+        return payload_event_from_const(rb_cMIDIMetaEvent, payloads, meta->data,
+                                        meta->dataLength, meta->metaEventType);
+    case kMusicEventType_MIDIRawData:
+        return payload_event_from_const(rb_cMIDIRawData, payloads, raw->data, raw->length, 0);
+    case kMusicEventType_User:
+        return payload_event_from_const(rb_cMusicUserEvent, payloads, user->data, user->length, 0);
+    default:
+        rb_raise(rb_eNotImpError, "Unsupported event type.");
+    }
+}
+
+/* Track enumeration */
+
+/*
+ * A filter is evaluated against raw event data so that only matching events
+ * are converted to Ruby objects. Unset criteria match everything; the time
+ * range is half-open, [from, to).
+ */
+typedef struct {
+    UInt32 kinds;
+    UInt32 channels;
+    Boolean by_note;
+    int note_min, note_max;
+    MusicTimeStamp from, to;
+    Boolean packed;     /* yield channel messages as packed Integers */
+    VALUE payloads;     /* arena of the payloads read by this scan */
+} EventFilter;
+
+static VALUE
+filter_event (EventFilter *filter, MusicEventType type, const void *data)
+{
+    const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+    if (filter->packed && type == kMusicEventType_MIDIChannelMessage)
+        return INT2FIX((msg->status << 16) | (msg->data1 << 8) | msg->data2);
+    return event_from_const(type, data, &filter->payloads);
+}
+
+static UInt32
+filter_kind_for (VALUE rb_kind)
+{
+    if (rb_kind == rb_sNote)            return EV_NOTE;
+    if (rb_kind == rb_sChannel)         return EV_CHANNEL_MESSAGE;
+    if (rb_kind == rb_sKeyPressure)     return EV_KEY_PRESSURE;
+    if (rb_kind == rb_sControlChange)   return EV_CONTROL_CHANGE;
+    if (rb_kind == rb_sProgramChange)   return EV_PROGRAM_CHANGE;
+    if (rb_kind == rb_sChannelPressure) return EV_CHANNEL_PRESSURE;
+    if (rb_kind == rb_sPitchBend)       return EV_PITCH_BEND;
+    if (rb_kind == rb_sTempo)           return EV_TEMPO;
+    if (rb_kind == rb_sMeta)            return EV_META;
+    if (rb_kind == rb_sRawData)         return EV_RAW_DATA;
+    if (rb_kind == rb_sUser)            return EV_USER;
+    rb_raise(rb_eArgError, "Expected :type to be one of :note, :channel, :key_pressure, "
+             ":control_change, :program_change, :channel_pressure, :pitch_bend, :tempo, "
+             ":meta, :raw_data, :user.");
+}
+
+/* Read an Integer or Range of Integers into an inclusive [min, max]. */
+static void
+filter_bounds (VALUE rb_val, const char *what, int limit, int *min, int *max)
+{
+    VALUE rb_beg, rb_end;
+    int excl;
+    
+    if (FIXNUM_P(rb_val)) {
+        *min = *max = FIX2INT(rb_val);
+    } else if (rb_range_values(rb_val, &rb_beg, &rb_end, &excl)) {
+        *min = NIL_P(rb_beg) ? 0 : NUM2INT(rb_beg);
+        *max = NIL_P(rb_end) ? limit : NUM2INT(rb_end) - (excl ? 1 : 0);
+    } else {
+        rb_raise(rb_eArgError, "Expected %s to be an Integer or a Range.", what);
+    }
+    if (*min < 0 || *max > limit)
+        rb_raise(rb_eArgError, "Expected %s to be within 0..%i.", what, limit);
+}
+
+static void
+filter_init (EventFilter *filter, VALUE rb_filter)
+{
+    VALUE rb_types, rb_chn, rb_note, rb_from, rb_to;
+    int i, min, max;
+    
+    filter->kinds = EV_ALL;
+    filter->channels = CH_ALL;
+    filter->by_note = FALSE;
+    filter->note_min = 0;
+    filter->note_max = 127;
+    filter->from = 0.0;
+    filter->to = -1.0;
+    filter->packed = FALSE;
+    filter->payloads = Qnil;
+    
+    if (NIL_P(rb_filter)) return;
+    Check_Type(rb_filter, T_HASH);
+    
+    rb_types = rb_hash_aref(rb_filter, rb_sType);
+    if (T_ARRAY == TYPE(rb_types)) {
+        filter->kinds = 0;
+        for (i = 0; i < RARRAY_LEN(rb_types); i++)
+            filter->kinds |= filter_kind_for(RARRAY_PTR(rb_types)[i]);
+    } else if (!NIL_P(rb_types)) {
+        filter->kinds = filter_kind_for(rb_types);
+    }
+    
+    rb_chn = rb_hash_aref(rb_filter, rb_sChannel);
+    if (T_ARRAY == TYPE(rb_chn)) {
+        filter->channels = 0;
+        for (i = 0; i < RARRAY_LEN(rb_chn); i++) {
+            filter_bounds(RARRAY_PTR(rb_chn)[i], ":channel", 15, &min, &max);
+            for (; min <= max; min++) filter->channels |= 1 << min;
+        }
+    } else if (!NIL_P(rb_chn)) {
+        filter->channels = 0;
+        filter_bounds(rb_chn, ":channel", 15, &min, &max);
+        for (; min <= max; min++) filter->channels |= 1 << min;
+    }
+    
+    rb_note = rb_hash_aref(rb_filter, rb_sNote);
+    if (!NIL_P(rb_note)) {
+        filter->by_note = TRUE;
+        filter_bounds(rb_note, ":note", 127, &filter->note_min, &filter->note_max);
+    }
+    
+    rb_from = rb_hash_aref(rb_filter, rb_sFrom);
+    if (!NIL_P(rb_from)) {
+        if (!PRIM_NUM_P(rb_from))
+            rb_raise(rb_eArgError, "Expected :from to be a number.");
+        filter->from = NUM2DBL(rb_from);
+    }
+    
+    rb_to = rb_hash_aref(rb_filter, rb_sTo);
+    if (!NIL_P(rb_to)) {
+        if (!PRIM_NUM_P(rb_to))
+            rb_raise(rb_eArgError, "Expected :to to be a number.");
+        filter->to = NUM2DBL(rb_to);
+    }
+    
+    filter->packed = RTEST(rb_hash_aref(rb_filter, rb_sPacked));
+}
+
+static Boolean
+filter_match (const EventFilter *filter, UInt32 kind, int channel, int note)
+{
+    if (!(filter->kinds & kind)) return FALSE;
+    if (!(filter->channels & CH_BIT(channel))) return FALSE;
+    if (filter->by_note && (note < filter->note_min || note > filter->note_max)) return FALSE;
+    return TRUE;
+}
+
+/* Whether the filter selects the whole track, so a scan may rebuild the index. */
+static Boolean
+filter_is_complete (const EventFilter *filter)
+{
+    return filter->from <= 0.0 && filter->to < 0.0;
+}
+
+typedef struct {
+    TrackData *track;
+    MusicEventIterator iter;
+    EventFilter filter;
+    Boolean with_time;
+    SequenceUser user;  /* while the block runs */
+} TrackScan;
+
+static VALUE
+track_scan_body (VALUE arg)
+{
+    TrackScan *scan = (TrackScan *) arg;
+    TrackData *track = scan->track;
+    UInt32 generation = track->generation, kinds = 0, channels = 0, kind;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    Boolean has_cur;
+    int channel, note;
+    VALUE rb_ev;
+    OSStatus err;
+    
+    if (scan->filter.from > 0.0)
+        require_noerr( err = MusicEventIteratorSeek(scan->iter, scan->filter.from), fail );
+    
+    for (;;) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(scan->iter, &has_cur), fail );
+        if (!has_cur) break;
+        require_noerr( err = MusicEventIteratorGetEventInfo(scan->iter, &ts, &type, &data, NULL), fail );
+        if (scan->filter.to >= 0.0 && ts >= scan->filter.to) break;
+        
+        kind = event_classify(type, data, &channel, &note);
+        kinds |= kind;
+        channels |= CH_BIT(channel);
+        
+        if (filter_match(&scan->filter, kind, channel, note)) {
+            rb_ev = filter_event(&scan->filter, type, data);
+            if (scan->with_time)
+                rb_yield(rb_assoc_new(rb_ev, rb_float_new(ts)));
+            else
+                rb_yield(rb_ev);
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(scan->iter), fail );
+    }
+    
+    /* Only a scan of the whole track, unchanged by the block, is exact. */
+    if (filter_is_complete(&scan->filter) && generation == track->generation) {
+        track->kinds = kinds;
+        track->channels = channels;
+        track->indexed = TRUE;
+    }
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIterator");
+}
+
+static VALUE
+track_scan_ensure (VALUE arg)
+{
+    TrackScan *scan = (TrackScan *) arg;
+    DisposeMusicEventIterator(scan->iter);
+    sequence_user_unlink(&scan->user);
+    return Qnil;
+}
+
+static VALUE
+track_each_internal (VALUE self, VALUE rb_filter, VALUE rb_with_time)
+{
+    TrackScan scan;
+    OSStatus err;
+    
+    scan.track = track_get(self);
+    filter_init(&scan.filter, rb_filter);
+    scan.with_time = RTEST(rb_with_time);
+    
+    /* Skip tracks whose index shows that nothing can match. */
+    if (scan.track->indexed &&
+        (!(scan.track->kinds & scan.filter.kinds) ||
+         !(scan.track->channels & scan.filter.channels)))
+        return Qnil;
+    
+    require_noerr( err = NewMusicEventIterator(scan.track->track, &scan.iter), fail );
+    MEMZERO(&scan.user, SequenceUser, 1);
+    sequence_user_link(&scan.user, scan.track->sequence);
+    rb_ensure(track_scan_body, (VALUE) &scan, track_scan_ensure, (VALUE) &scan);
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "NewMusicEventIterator()");
+}
+
+/* MusicTimeline defns */
+
+/*
+ * A timeline presents a track the way it plays back: shifted by its offset
+ * and with its loop unrolled. The first pass plays the whole track and each
+ * further pass repeats its last loopDuration beats, as AudioToolbox does.
+ * Nothing is copied; repetitions are computed as the cursor moves.
+ */
+typedef struct {
+    MusicEventIterator iter;
+    MusicTimeStamp offset;
+    MusicTimeStamp length;       /* track length */
+    MusicTimeStamp loop_start;   /* start of the repeated region */
+    MusicTimeStamp loop_length;  /* zero when the track does not loop */
+    SInt32 loops;                /* number of passes, zero for unbounded */
+    SInt32 pass;
+    Boolean done;
+} Timeline;
+
+static OSStatus
+timeline_init (Timeline *tl, MusicTrack track)
+{
+    MusicTrackLoopInfo loop_info;
+    UInt32 sz;
+    OSStatus err;
+    
+    MEMZERO(tl, Timeline, 1);
+    require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_OffsetTime, &tl->offset, &sz), fail );
+    require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_TrackLength, &tl->length, &sz), fail );
+    require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_LoopInfo, &loop_info, &sz), fail );
+    
+    tl->loops = loop_info.numberOfLoops;
+    if (loop_info.loopDuration > 0.0 && tl->loops != 1 && tl->length > 0.0) {
+        tl->loop_length = loop_info.loopDuration < tl->length ? loop_info.loopDuration : tl->length;
+        tl->loop_start = tl->length - tl->loop_length;
+    } else {
+        tl->loops = 1;
+    }
+    
+    require_noerr( err = NewMusicEventIterator(track, &tl->iter), fail );
+    return noErr;
+    
+    fail:
+    tl->iter = NULL;
+    return err;
+}
+
+static void
+timeline_dispose (Timeline *tl)
+{
+    if (tl->iter) DisposeMusicEventIterator(tl->iter);
+    tl->iter = NULL;
+}
+
+/* Timeline position at which the current pass begins, excluding the offset. */
+static MusicTimeStamp
+timeline_pass_start (const Timeline *tl, SInt32 pass)
+{
+    return pass == 0 ? 0.0 : tl->length + (pass - 1) * tl->loop_length;
+}
+
+/* Unrolled duration, or a negative number when the loop is unbounded. */
+static MusicTimeStamp
+timeline_length (const Timeline *tl)
+{
+    if (tl->loops == 0) return -1.0;
+    return tl->offset + timeline_pass_start(tl, tl->loops);
+}
+
+/* Move on to the next pass whenever the current one has run out of events. */
+static OSStatus
+timeline_settle (Timeline *tl)
+{
+    MusicTimeStamp ts;
+    Boolean has_cur, fresh = FALSE;
+    OSStatus err;
+    
+    while (!tl->done) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(tl->iter, &has_cur), fail );
+        if (has_cur) {
+            require_noerr( err = MusicEventIteratorGetEventInfo(tl->iter, &ts, NULL, NULL, NULL), fail );
+            if (tl->pass == 0 || ts < tl->length) return noErr;
+        }
+        /* A pass which starts out empty would repeat forever. */
+        if (fresh || (tl->loops != 0 && tl->pass + 1 >= tl->loops)) {
+            tl->done = TRUE;
+        } else {
+            tl->pass++;
+            fresh = TRUE;
+            require_noerr( err = MusicEventIteratorSeek(tl->iter, tl->loop_start), fail );
+        }
+    }
+    return noErr;
+    
+    fail:
+    return err;
+}
+
+static OSStatus
+timeline_seek (Timeline *tl, MusicTimeStamp beat)
+{
+    MusicTimeStamp pos = beat - tl->offset;
+    SInt32 pass;
+    OSStatus err;
+    
+    tl->done = FALSE;
+    if (pos < tl->length || tl->loops == 1) {
+        tl->pass = 0;
+        require_noerr( err = MusicEventIteratorSeek(tl->iter, pos > 0.0 ? pos : 0.0), fail );
+    } else {
+        pass = 1 + (SInt32) floor((pos - tl->length) / tl->loop_length);
+        if (tl->loops != 0 && pass >= tl->loops) {
+            tl->done = TRUE;
+            return noErr;
+        }
+        tl->pass = pass;
+        require_noerr( err = MusicEventIteratorSeek(tl->iter, tl->loop_start + pos - timeline_pass_start(tl, pass)), fail );
+    }
+    return timeline_settle(tl);
+    
+    fail:
+    return err;
+}
+
+static OSStatus
+timeline_next (Timeline *tl)
+{
+    OSStatus err;
+    if (tl->done) return kAudioToolboxErr_EndOfTrack;
+    require_noerr( err = MusicEventIteratorNextEvent(tl->iter), fail );
+    return timeline_settle(tl);
+    
+    fail:
+    return err;
+}
+
+/* Fetch the current event, with its time on the unrolled timeline. */
+static OSStatus
+timeline_current (Timeline *tl, MusicTimeStamp *ts, MusicEventType *type, const void **data)
+{
+    MusicTimeStamp at;
+    OSStatus err;
+    
+    if (tl->done) return kAudioToolboxErr_EndOfTrack;
+    require_noerr( err = MusicEventIteratorGetEventInfo(tl->iter, &at, type, data, NULL), fail );
+    if (ts) {
+        if (tl->pass > 0) at -= tl->loop_start;
+        *ts = tl->offset + timeline_pass_start(tl, tl->pass) + at;
+    }
+    return noErr;
+    
+    fail:
+    return err;
+}
+
+typedef struct {
+    Timeline tl;
+    TrackData *track;
+    VALUE rb_track;
+    SequenceUser user;
+} TimelineData;
+
+static void
+timeline_mark (TimelineData *timeline)
+{
+    rb_gc_mark(timeline->rb_track);
+}
+
+static void
+timeline_free (TimelineData *timeline)
+{
+    timeline_dispose(&timeline->tl);
+    sequence_user_unlink(&timeline->user);
+    xfree(timeline);
+}
+
+/* Called as the sequence is detached. */
+static void
+timeline_close (void *owner)
+{
+    TimelineData *timeline = (TimelineData *) owner;
+    timeline_dispose(&timeline->tl);
+    timeline->track = NULL;
+}
+
+static size_t
+timeline_memsize (const void *timeline)
+{
+    return sizeof(TimelineData);
+}
+
+static const rb_data_type_t timeline_type = {
+    "AudioToolbox::MusicTimeline",
+    { (RUBY_DATA_FUNC) timeline_mark, (RUBY_DATA_FUNC) timeline_free, timeline_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+timeline_alloc (VALUE class)
+{
+    TimelineData *timeline;
+    VALUE rb_timeline = TypedData_Make_Struct(rb_cMusicTimeline, TimelineData, &timeline_type, timeline);
+    timeline->rb_track = Qnil;
+    timeline->user.close = timeline_close;
+    timeline->user.owner = timeline;
+    return rb_timeline;
+}
+
+/* The timeline's data, raising if its sequence has been detached. */
+static TimelineData *
+timeline_get (VALUE self)
+{
+    TimelineData *timeline;
+    TypedData_Get_Struct(self, TimelineData, &timeline_type, timeline);
+    if (!timeline->track) rb_raise(rb_eIOError, "Timeline's sequence has been detached.");
+    return timeline;
+}
+
+static VALUE
+timeline_init_rb (VALUE self, VALUE rb_track)
+{
+    TimelineData *timeline;
+    OSStatus err;
+    
+    if (rb_cMusicTrack != rb_class_of(rb_track))
+        rb_raise(rb_eArgError, "Expected arg to be a MusicTrack.");
+    
+    TypedData_Get_Struct(self, TimelineData, &timeline_type, timeline);
+    timeline->track = track_get(rb_track);
+    RB_OBJ_WRITE(self, &timeline->rb_track, rb_track);
+    sequence_user_link(&timeline->user, timeline->track->sequence);
+    require_noerr( err = timeline_init(&timeline->tl, timeline->track->track), fail );
+    require_noerr( err = timeline_settle(&timeline->tl), fail );
+    return self;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTimeline");
+}
+
+static VALUE
+timeline_seek_rb (VALUE self, VALUE rb_time)
+{
+    TimelineData *timeline;
+    OSStatus err;
+    if (!PRIM_NUM_P(rb_time))
+        rb_raise(rb_eArgError, "Expected first arg to be a number.");
+    timeline = timeline_get(self);
+    require_noerr( err = timeline_seek(&timeline->tl, NUM2DBL(rb_time)), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorSeek()");
+}
+
+static VALUE
+timeline_next_rb (VALUE self)
+{
+    TimelineData *timeline;
+    OSStatus err;
+    timeline = timeline_get(self);
+    require_noerr( err = timeline_next(&timeline->tl), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorNextEvent()");
+}
+
+static VALUE
+timeline_has_current (VALUE self)
+{
+    TimelineData *timeline;
+    timeline = timeline_get(self);
+    return timeline->tl.done ? Qfalse : Qtrue;
+}
+
+static VALUE
+timeline_get_time (VALUE self)
+{
+    TimelineData *timeline;
+    MusicTimeStamp ts;
+    OSStatus err;
+    timeline = timeline_get(self);
+    require_noerr( err = timeline_current(&timeline->tl, &ts, NULL, NULL), fail );
+    return rb_float_new(ts);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
+}
+
+static VALUE
+timeline_get_event (VALUE self)
+{
+    TimelineData *timeline;
+    MusicEventType type;
+    const void *data;
+    VALUE payloads = Qnil;
+    OSStatus err;
+    timeline = timeline_get(self);
+    require_noerr( err = timeline_current(&timeline->tl, NULL, &type, &data), fail );
+    return event_from_const(type, data, &payloads);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
+}
+
+static VALUE
+timeline_get_pass (VALUE self)
+{
+    TimelineData *timeline;
+    timeline = timeline_get(self);
+    return INT2NUM(timeline->tl.pass);
+}
+
+static VALUE
+timeline_get_length (VALUE self)
+{
+    TimelineData *timeline;
+    MusicTimeStamp length;
+    timeline = timeline_get(self);
+    length = timeline_length(&timeline->tl);
+    return length < 0.0 ? Qnil : rb_float_new(length);
+}
+
+typedef struct {
+    Timeline tl;
+    TrackData *track;
+    EventFilter filter;
+    Boolean with_time;
+    SequenceUser user;  /* while the block runs */
+} TimelineScan;
+
+static VALUE
+timeline_scan_body (VALUE arg)
+{
+    TimelineScan *scan = (TimelineScan *) arg;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    int channel, note;
+    UInt32 kind;
+    VALUE rb_ev;
+    OSStatus err;
+    
+    require_noerr( err = timeline_seek(&scan->tl, scan->filter.from), fail );
+    while (!scan->tl.done) {
+        require_noerr( err = timeline_current(&scan->tl, &ts, &type, &data), fail );
+        if (scan->filter.to >= 0.0 && ts >= scan->filter.to) break;
+        
+        kind = event_classify(type, data, &channel, &note);
+        if (filter_match(&scan->filter, kind, channel, note)) {
+            rb_ev = filter_event(&scan->filter, type, data);
+            if (scan->with_time)
+                rb_yield(rb_assoc_new(rb_ev, rb_float_new(ts)));
+            else
+                rb_yield(rb_ev);
+        }
+        require_noerr( err = timeline_next(&scan->tl), fail );
+    }
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTimeline");
+}
+
+static VALUE
+timeline_scan_ensure (VALUE arg)
+{
+    TimelineScan *scan = (TimelineScan *) arg;
+    timeline_dispose(&scan->tl);
+    sequence_user_unlink(&scan->user);
+    return Qnil;
+}
+
+static VALUE
+timeline_each_internal (VALUE self, VALUE rb_filter, VALUE rb_with_time)
+{
+    TimelineData *timeline;
+    TimelineScan scan;
+    OSStatus err;
+    
+    timeline = timeline_get(self);
+    filter_init(&scan.filter, rb_filter);
+    scan.with_time = RTEST(rb_with_time);
+    scan.track = timeline->track;
+    
+    if (timeline->tl.loops == 0 && scan.filter.to < 0.0)
+        rb_raise(rb_eArgError, "Expected :to for a track which loops indefinitely.");
+    if (scan.track->indexed &&
+        (!(scan.track->kinds & scan.filter.kinds) ||
+         !(scan.track->channels & scan.filter.channels)))
+        return Qnil;
+    
+    require_noerr( err = timeline_init(&scan.tl, scan.track->track), fail );
+    MEMZERO(&scan.user, SequenceUser, 1);
+    sequence_user_link(&scan.user, scan.track->sequence);
+    rb_ensure(timeline_scan_body, (VALUE) &scan, timeline_scan_ensure, (VALUE) &scan);
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTimeline");
+}
+
+/* MusicSequenceIterator defns */
+
+/*
+ * Packed event record, as produced by MusicSequenceIterator#read. The value
+ * is a note's duration or a tempo event's bpm. Notes are packed as note-on
+ * status bytes with the release velocity in data3. The tempo track has
+ * index -1.
+ */
+typedef struct {
+    Float64 time;
+    Float64 value;
+    SInt16 track;
+    UInt8 type;
+    UInt8 status;
+    UInt8 data1;
+    UInt8 data2;
+    UInt8 data3;
+    UInt8 reserved;
+} EventRecord;
+
+#define EVENT_RECORD_FORMAT "ddsC5x"
+
+static void
+event_pack (EventRecord *rec, MusicTimeStamp ts, SInt16 track, MusicEventType type, const void *data)
+{
+    MEMZERO(rec, EventRecord, 1);
+    rec->time = ts;
+    rec->track = track;
+    rec->type = (UInt8) type;
+    
+    switch (type) {
+    case kMusicEventType_MIDINoteMessage: {
+        const MIDINoteMessage *msg = (const MIDINoteMessage *) data;
+        rec->value = msg->duration;
+        rec->status = 0x90 | (msg->channel & 0x0F);
+        rec->data1 = msg->note;
+        rec->data2 = msg->velocity;
+        rec->data3 = msg->releaseVelocity;
+        break;
+    }
+    case kMusicEventType_MIDIChannelMessage: {
+        const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+        rec->status = msg->status;
+        rec->data1 = msg->data1;
+        rec->data2 = msg->data2;
+        break;
+    }
+    case kMusicEventType_ExtendedTempo:
+        rec->value = ((const ExtendedTempoEvent *) data)->bpm;
+        break;
+    }
+}
+
+/*
+ * Merges the timelines of every audible track into one stream ordered by
+ * time, then by track index. Each track contributes a cursor to a binary
+ * min-heap, so advancing costs O(log k) for k tracks.
+ */
+typedef struct {
+    Timeline tl;
+    SInt16 index;
+    MusicTimeStamp ts;
+} MergeCursor;
+
+typedef struct {
+    MergeCursor *cursors;
+    MergeCursor **heap;
+    int size;
+    int count;
+    Boolean unbounded;
+} Merge;
+
+static Boolean
+merge_less (const MergeCursor *a, const MergeCursor *b)
+{
+    return a->ts < b->ts || (a->ts == b->ts && a->index < b->index);
+}
+
+static void
+merge_sift_down (Merge *merge, int i)
+{
+    MergeCursor **heap = merge->heap, *tmp;
+    int least, left, right;
+    
+    for (;;) {
+        least = i;
+        left = 2 * i + 1;
+        right = left + 1;
+        if (left < merge->count && merge_less(heap[left], heap[least])) least = left;
+        if (right < merge->count && merge_less(heap[right], heap[least])) least = right;
+        if (least == i) return;
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* Rebuild the heap from every cursor which still has a current event. */
+static OSStatus
+merge_heapify (Merge *merge)
+{
+    MergeCursor *cur;
+    OSStatus err;
+    int i;
+    
+    merge->count = 0;
+    for (i = 0; i < merge->size; i++) {
+        cur = &merge->cursors[i];
+        if (cur->tl.done) continue;
+        require_noerr( err = timeline_current(&cur->tl, &cur->ts, NULL, NULL), fail );
+        merge->heap[merge->count++] = cur;
+    }
+    for (i = merge->count / 2 - 1; i >= 0; i--)
+        merge_sift_down(merge, i);
+    return noErr;
+    
+    fail:
+    return err;
+}
+
+static void
+merge_dispose (Merge *merge)
+{
+    int i;
+    for (i = 0; i < merge->size; i++)
+        timeline_dispose(&merge->cursors[i].tl);
+    xfree(merge->cursors);
+    xfree(merge->heap);
+    merge->cursors = NULL;
+    merge->heap = NULL;
+    merge->size = merge->count = 0;
+}
+
+static OSStatus
+merge_add_track (Merge *merge, MusicTrack track, SInt16 index)
+{
+    MergeCursor *cur = &merge->cursors[merge->size];
+    OSStatus err;
+    
+    require_noerr( err = timeline_init(&cur->tl, track), fail );
+    merge->size++;
+    cur->index = index;
+    if (cur->tl.loops == 0) merge->unbounded = TRUE;
+    return timeline_settle(&cur->tl);
+    
+    fail:
+    return err;
+}
+
+/* Open a cursor on each track, honouring mute and solo. */
+static OSStatus
+merge_init (Merge *merge, MusicSequence seq, Boolean with_tempo)
+{
+    MusicTrack track;
+    UInt32 i, track_count, sz;
+    Boolean mute, solo, any_solo = FALSE;
+    OSStatus err;
+    
+    MEMZERO(merge, Merge, 1);
+    require_noerr( err = MusicSequenceGetTrackCount(seq, &track_count), fail );
+    merge->cursors = ALLOC_N(MergeCursor, track_count + 1);
+    merge->heap = ALLOC_N(MergeCursor *, track_count + 1);
+    
+    for (i = 0; i < track_count; i++) {
+        require_noerr( err = MusicSequenceGetIndTrack(seq, i, &track), fail );
+        require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_SoloStatus, &solo, &sz), fail );
+        if (solo) any_solo = TRUE;
+    }
+    
+    if (with_tempo) {
+        require_noerr( err = MusicSequenceGetTempoTrack(seq, &track), fail );
+        require_noerr( err = merge_add_track(merge, track, -1), fail );
+    }
+    
+    for (i = 0; i < track_count; i++) {
+        require_noerr( err = MusicSequenceGetIndTrack(seq, i, &track), fail );
+        require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_MuteStatus, &mute, &sz), fail );
+        require_noerr( err = MusicTrackGetProperty(track, kSequenceTrackProperty_SoloStatus, &solo, &sz), fail );
+        if (mute || (any_solo && !solo)) continue;
+        require_noerr( err = merge_add_track(merge, track, (SInt16) i), fail );
+    }
+    
+    return merge_heapify(merge);
+    
+    fail:
+    merge_dispose(merge);
+    return err;
+}
+
+static OSStatus
+merge_seek (Merge *merge, MusicTimeStamp beat)
+{
+    OSStatus err;
+    int i;
+    for (i = 0; i < merge->size; i++)
+        require_noerr( err = timeline_seek(&merge->cursors[i].tl, beat), fail );
+    return merge_heapify(merge);
+    
+    fail:
+    return err;
+}
+
+static OSStatus
+merge_current (Merge *merge, MusicTimeStamp *ts, SInt16 *index, MusicEventType *type, const void **data)
+{
+    if (merge->count == 0) return kAudioToolboxErr_EndOfTrack;
+    if (index) *index = merge->heap[0]->index;
+    return timeline_current(&merge->heap[0]->tl, ts, type, data);
+}
+
+static OSStatus
+merge_next (Merge *merge)
+{
+    MergeCursor *top;
+    OSStatus err;
+    
+    if (merge->count == 0) return kAudioToolboxErr_EndOfTrack;
+    top = merge->heap[0];
+    require_noerr( err = timeline_next(&top->tl), fail );
+    if (top->tl.done) {
+        merge->heap[0] = merge->heap[--merge->count];
+    } else {
+        require_noerr( err = timeline_current(&top->tl, &top->ts, NULL, NULL), fail );
+    }
+    merge_sift_down(merge, 0);
+    return noErr;
+    
+    fail:
+    return err;
+}
+
+typedef struct {
+    Merge merge;
+    VALUE rb_seq;
+    SequenceUser user;  /* unlinked once closed */
+} SequenceIterData;
+
+static void
+seq_iter_mark (SequenceIterData *iter)
+{
+    rb_gc_mark(iter->rb_seq);
+}
+
+static void
+seq_iter_free (SequenceIterData *iter)
+{
+    merge_dispose(&iter->merge);
+    sequence_user_unlink(&iter->user);
+    xfree(iter);
+}
+
+/* Called as the sequence is detached. */
+static void
+seq_iter_close (void *owner)
+{
+    merge_dispose(&((SequenceIterData *) owner)->merge);
+}
+
+static size_t
+seq_iter_memsize (const void *ptr)
+{
+    const SequenceIterData *iter = (const SequenceIterData *) ptr;
+    return sizeof(SequenceIterData) + iter->merge.size * (sizeof(MergeCursor) + sizeof(MergeCursor *));
+}
+
+static const rb_data_type_t seq_iter_type = {
+    "AudioToolbox::MusicSequenceIterator",
+    { (RUBY_DATA_FUNC) seq_iter_mark, (RUBY_DATA_FUNC) seq_iter_free, seq_iter_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+seq_iter_alloc (VALUE class)
+{
+    SequenceIterData *iter;
+    VALUE rb_iter = TypedData_Make_Struct(rb_cMusicSequenceIterator, SequenceIterData, &seq_iter_type, iter);
+    iter->rb_seq = Qnil;
+    iter->user.close = seq_iter_close;
+    iter->user.owner = iter;
+    return rb_iter;
+}
+
+/* The iterator's data, raising if its sequence has been detached. */
+static SequenceIterData *
+seq_iter_get (VALUE self)
+{
+    SequenceIterData *iter;
+    TypedData_Get_Struct(self, SequenceIterData, &seq_iter_type, iter);
+    if (!iter->user.seq) rb_raise(rb_eIOError, "Iterator's sequence has been detached.");
+    return iter;
+}
+
+static VALUE
+seq_iter_init (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_seq, rb_options, rb_tempo;
+    SequenceIterData *iter;
+    MusicSequence seq;
+    Boolean with_tempo = TRUE;
+    OSStatus err;
+    
+    rb_scan_args(argc, argv, "11", &rb_seq, &rb_options);
+    if (rb_cMusicSequence != rb_class_of(rb_seq))
+        rb_raise(rb_eArgError, "Expected arg to be a MusicSequence.");
+    if (T_HASH == TYPE(rb_options)) {
+        rb_tempo = rb_hash_aref(rb_options, rb_sTempo);
+        if (!NIL_P(rb_tempo)) with_tempo = RTEST(rb_tempo);
+    }
+    
+    TypedData_Get_Struct(self, SequenceIterData, &seq_iter_type, iter);
+    seq = sequence_use(rb_seq, &iter->user);
+    merge_dispose(&iter->merge);
+    RB_OBJ_WRITE(self, &iter->rb_seq, rb_seq);
+    require_noerr( err = merge_init(&iter->merge, seq, with_tempo), fail );
+    return self;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequenceIterator");
+}
+
+static VALUE
+seq_iter_seek (VALUE self, VALUE rb_time)
+{
+    SequenceIterData *iter;
+    OSStatus err;
+    if (!PRIM_NUM_P(rb_time))
+        rb_raise(rb_eArgError, "Expected first arg to be a number.");
+    iter = seq_iter_get(self);
+    require_noerr( err = merge_seek(&iter->merge, NUM2DBL(rb_time)), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorSeek()");
+}
+
+static VALUE
+seq_iter_next (VALUE self)
+{
+    SequenceIterData *iter;
+    OSStatus err;
+    iter = seq_iter_get(self);
+    require_noerr( err = merge_next(&iter->merge), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorNextEvent()");
+}
+
+static VALUE
+seq_iter_has_current (VALUE self)
+{
+    SequenceIterData *iter;
+    iter = seq_iter_get(self);
+    return iter->merge.count > 0 ? Qtrue : Qfalse;
+}
+
+static VALUE
+seq_iter_get_time (VALUE self)
+{
+    SequenceIterData *iter;
+    MusicTimeStamp ts;
+    OSStatus err;
+    iter = seq_iter_get(self);
+    require_noerr( err = merge_current(&iter->merge, &ts, NULL, NULL, NULL), fail );
+    return rb_float_new(ts);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
+}
+
+static VALUE
+seq_iter_get_event (VALUE self)
+{
+    SequenceIterData *iter;
+    MusicEventType type;
+    const void *data;
+    VALUE payloads = Qnil;
+    OSStatus err;
+    iter = seq_iter_get(self);
+    require_noerr( err = merge_current(&iter->merge, NULL, NULL, &type, &data), fail );
+    return event_from_const(type, data, &payloads);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
+}
+
+static VALUE
+seq_iter_get_track_index (VALUE self)
+{
+    SequenceIterData *iter;
+    SInt16 index;
+    OSStatus err;
+    iter = seq_iter_get(self);
+    require_noerr( err = merge_current(&iter->merge, NULL, &index, NULL, NULL), fail );
+    return index < 0 ? Qnil : INT2FIX(index);
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
+}
+
+/* Records first allocated for a read, doubled as they fill up to the count
+ * asked for, as the events left are not known in advance. */
+#define SEQ_ITER_READ_CHUNK 1024
+
+/* Read up to max events as packed EventRecords, or nil at the end. */
+static VALUE
+seq_iter_read (VALUE self, VALUE rb_max)
+{
+    SequenceIterData *iter;
+    EventRecord *recs;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    SInt16 index;
+    long i, capacity, max = NUM2LONG(rb_max);
+    VALUE rb_str;
+    OSStatus err;
+    
+    iter = seq_iter_get(self);
+    if (max < 0) rb_raise(rb_eArgError, "Expected a non-negative count.");
+    if (max > LONG_MAX / (long) sizeof(EventRecord))
+        rb_raise(rb_eArgError, "Expected a count of at most %ld.", LONG_MAX / (long) sizeof(EventRecord));
+    if (iter->merge.count == 0) return Qnil;
+    
+    capacity = max < SEQ_ITER_READ_CHUNK ? max : SEQ_ITER_READ_CHUNK;
+    rb_str = rb_str_new(NULL, capacity * sizeof(EventRecord));
+    for (i = 0; i < max && iter->merge.count > 0; i++) {
+        if (i == capacity) {
+            capacity = capacity > max - capacity ? max : 2 * capacity;
+            rb_str_resize(rb_str, capacity * sizeof(EventRecord));
+        }
+        recs = (EventRecord *) RSTRING_PTR(rb_str);
+        require_noerr( err = merge_current(&iter->merge, &ts, &index, &type, &data), fail );
+        event_pack(&recs[i], ts, index, type, data);
+        require_noerr( err = merge_next(&iter->merge), fail );
+    }
+    rb_str_set_len(rb_str, i * sizeof(EventRecord));
+    return rb_str;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequenceIterator");
+}
+
+typedef struct {
+    Merge *merge;
+    EventFilter filter;
+    SequenceUser user;  /* while the block runs */
+} MergeScan;
+
+static VALUE
+merge_scan_body (VALUE arg)
+{
+    MergeScan *scan = (MergeScan *) arg;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    SInt16 index;
+    int channel, note;
+    UInt32 kind;
+    OSStatus err;
+    
+    require_noerr( err = merge_seek(scan->merge, scan->filter.from), fail );
+    while (scan->merge->count > 0) {
+        require_noerr( err = merge_current(scan->merge, &ts, &index, &type, &data), fail );
+        if (scan->filter.to >= 0.0 && ts >= scan->filter.to) break;
+        kind = event_classify(type, data, &channel, &note);
+        if (filter_match(&scan->filter, kind, channel, note))
+            rb_yield_values(3, filter_event(&scan->filter, type, data), rb_float_new(ts),
+                            index < 0 ? Qnil : INT2FIX(index));
+        require_noerr( err = merge_next(scan->merge), fail );
+    }
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequenceIterator");
+}
+
+static VALUE
+merge_scan_ensure (VALUE arg)
+{
+    sequence_user_unlink(&((MergeScan *) arg)->user);
+    return Qnil;
+}
+
+static VALUE
+seq_iter_each_internal (VALUE self, VALUE rb_filter)
+{
+    SequenceIterData *iter;
+    MergeScan scan;
+    
+    iter = seq_iter_get(self);
+    filter_init(&scan.filter, rb_filter);
+    if (iter->merge.unbounded && scan.filter.to < 0.0)
+        rb_raise(rb_eArgError, "Expected :to for a sequence with a track which loops indefinitely.");
+    scan.merge = &iter->merge;
+    MEMZERO(&scan.user, SequenceUser, 1);
+    sequence_user_link(&scan.user, iter->user.seq);
+    rb_ensure(merge_scan_body, (VALUE) &scan, merge_scan_ensure, (VALUE) &scan);
+    return Qnil;
+}
+
+/* Track comparison defns */
+
+/*
+ * Tracks are compared a digest block at a time. Blocks whose digests agree
+ * are taken to be equal without being read again; the events of the rest
+ * are packed, sorted and walked in step, so a comparison is linear in the
+ * events of the blocks which differ. Events at the same time are ordered by
+ * type, status and first data byte, so that the order in which they were
+ * added does not matter, and so that an event which differs only in its
+ * remaining fields meets its counterpart and is reported as one change.
+ */
+typedef struct {
+    EventRecord rec;
+    Digest data;        /* of the bytes of an event a record cannot hold */
+} DiffEvent;
+
+typedef struct {
+    DiffEvent *events;
+    size_t count;
+    size_t capacity;
+} DiffEvents;
+
+/*
+ * Packed change record, as produced by MusicTrack#diff. op is '-' for an
+ * event only in the receiver, '+' for one only in the other track, and '~'
+ * for one whose value, data2 or data3 differ; the fields which identify the
+ * event are shared, the rest are given for each side.
+ */
+typedef struct {
+    Float64 time;
+    Float64 value;
+    Float64 other_value;
+    char op;
+    UInt8 type;
+    UInt8 status;
+    UInt8 data1;
+    UInt8 data2;
+    UInt8 data3;
+    UInt8 other_data2;
+    UInt8 other_data3;
+} DiffRecord;
+
+#define DIFF_RECORD_FORMAT "ddda1C7"
+
+typedef struct {
+    DiffRecord *records;
+    size_t count;
+    size_t capacity;
+    size_t limit;       /* stop after this many records */
+} DiffResult;
+
+static int
+diff_key_cmp (const DiffEvent *a, const DiffEvent *b)
+{
+    if (a->rec.time != b->rec.time) return a->rec.time < b->rec.time ? -1 : 1;
+    return memcmp(&a->rec.type, &b->rec.type, 3);
+}
+
+static int
+diff_event_cmp (const void *x, const void *y)
+{
+    const DiffEvent *a = x, *b = y;
+    int c;
+    
+    if ((c = diff_key_cmp(a, b))) return c;
+    if ((c = memcmp(&a->rec.data2, &b->rec.data2, 2))) return c;
+    if (a->rec.value != b->rec.value) return a->rec.value < b->rec.value ? -1 : 1;
+    return memcmp(a->data.bytes, b->data.bytes, DIGEST_SIZE);
+}
+
+/* Read the events of one block, sorting each run of events at one time. */
+static OSStatus
+diff_read_block (MusicEventIterator iter, UInt32 index, DiffEvents *out)
+{
+    MusicTimeStamp ts, end = (index + 1) * DIGEST_BLOCK_BEATS;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    DiffEvent *ev, *grown;
+    size_t run, i;
+    OSStatus err;
+    
+    out->count = 0;
+    require_noerr( err = MusicEventIteratorSeek(iter, index * DIGEST_BLOCK_BEATS), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), fail );
+    while (has_current) {
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), fail );
+        if (ts >= end) break;
+        if (out->count == out->capacity) {
+            size_t capacity = out->capacity ? out->capacity * 2 : 256;
+            if (!(grown = realloc(out->events, capacity * sizeof(DiffEvent)))) return kAudio_MemFullError;
+            out->events = grown;
+            out->capacity = capacity;
+        }
+        ev = &out->events[out->count++];
+        event_pack(&ev->rec, ts, 0, type, data);
+        memset(&ev->data, 0, sizeof(Digest));
+        if (type != kMusicEventType_MIDINoteMessage && type != kMusicEventType_MIDIChannelMessage &&
+            type != kMusicEventType_ExtendedTempo)
+            digest_compute(data, size, &ev->data);
+        require_noerr( err = MusicEventIteratorNextEvent(iter), fail );
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), fail );
+    }
+    
+    for (i = 0; i < out->count; i += run) {
+        for (run = 1; i + run < out->count && out->events[i + run].rec.time == out->events[i].rec.time; run++);
+        if (run > 1) qsort(&out->events[i], run, sizeof(DiffEvent), diff_event_cmp);
+    }
+    
+    fail:
+    return err;
+}
+
+static OSStatus
+diff_emit (DiffResult *res, char op, const DiffEvent *a, const DiffEvent *b)
+{
+    const DiffEvent *key = a ? a : b;
+    DiffRecord *rec, *grown;
+    
+    if (res->count == res->capacity) {
+        size_t capacity = res->capacity ? res->capacity * 2 : 64;
+        if (!(grown = realloc(res->records, capacity * sizeof(DiffRecord)))) return kAudio_MemFullError;
+        res->records = grown;
+        res->capacity = capacity;
+    }
+    rec = &res->records[res->count++];
+    memset(rec, 0, sizeof(DiffRecord));
+    rec->time = key->rec.time;
+    rec->op = op;
+    rec->type = key->rec.type;
+    rec->status = key->rec.status;
+    rec->data1 = key->rec.data1;
+    if (a) {
+        rec->value = a->rec.value;
+        rec->data2 = a->rec.data2;
+        rec->data3 = a->rec.data3;
+    }
+    if (b) {
+        rec->other_value = b->rec.value;
+        rec->other_data2 = b->rec.data2;
+        rec->other_data3 = b->rec.data3;
+    }
+    return noErr;
+}
+
+static OSStatus
+diff_walk (const DiffEvents *a, const DiffEvents *b, DiffResult *res)
+{
+    size_t i = 0, j = 0;
+    OSStatus err = noErr;
+    int c;
+    
+    while ((i < a->count || j < b->count) && res->count < res->limit && !err) {
+        if (i == a->count) c = 1;
+        else if (j == b->count) c = -1;
+        else c = diff_event_cmp(&a->events[i], &b->events[j]);
+        
+        if (c == 0) {
+            i++;
+            j++;
+        } else if (i < a->count && j < b->count && !diff_key_cmp(&a->events[i], &b->events[j])) {
+            err = diff_emit(res, '~', &a->events[i++], &b->events[j++]);
+        } else if (c < 0) {
+            err = diff_emit(res, '-', &a->events[i++], NULL);
+        } else {
+            err = diff_emit(res, '+', NULL, &b->events[j++]);
+        }
+    }
+    return err;
+}
+
+static Boolean
+diff_block_equal (const TrackData *a, const TrackData *b, UInt32 index)
+{
+    const DigestBlock *x = index < a->block_count ? &a->blocks[index] : NULL;
+    const DigestBlock *y = index < b->block_count ? &b->blocks[index] : NULL;
+    
+    if (!x || !y) return (x ? x->events : y->events) == 0;
+    return x->events == y->events && memcmp(x->digest.bytes, y->digest.bytes, DIGEST_SIZE) == 0;
+}
+
+static OSStatus
+track_compare (TrackData *a, TrackData *b, DiffResult *res)
+{
+    MusicEventIterator iter_a, iter_b;
+    DiffEvents events_a, events_b;
+    UInt32 i, count;
+    OSStatus err;
+    
+    require_noerr( err = track_update_blocks(a), fail );
+    require_noerr( err = track_update_blocks(b), fail );
+    require_noerr( err = NewMusicEventIterator(a->track, &iter_a), fail );
+    require_noerr( err = NewMusicEventIterator(b->track, &iter_b), dispose_a );
+    
+    memset(&events_a, 0, sizeof(DiffEvents));
+    memset(&events_b, 0, sizeof(DiffEvents));
+    count = a->block_count > b->block_count ? a->block_count : b->block_count;
+    for (i = 0; i < count && res->count < res->limit; i++) {
+        if (diff_block_equal(a, b, i)) continue;
+        if ((err = diff_read_block(iter_a, i, &events_a))) break;
+        if ((err = diff_read_block(iter_b, i, &events_b))) break;
+        if ((err = diff_walk(&events_a, &events_b, res))) break;
+    }
+    free(events_a.events);
+    free(events_b.events);
+    
+    DisposeMusicEventIterator(iter_b);
+    dispose_a:
+    DisposeMusicEventIterator(iter_a);
+    fail:
+    return err;
+}
+
+/* Equal when both hold the same events; properties are not compared. */
+static VALUE
+track_equal (VALUE self, VALUE rb_other)
+{
+    TrackData *track, *other;
+    DiffResult res;
+    OSStatus err;
+    
+    if (!rb_typeddata_is_kind_of(rb_other, &track_type)) return Qfalse;
+    track = track_get(self);
+    other = track_get(rb_other);
+    if (track == other) return Qtrue;
+    
+    memset(&res, 0, sizeof(DiffResult));
+    res.limit = 1;
+    err = track_compare(track, other, &res);
+    free(res.records);
+    require_noerr( err, fail );
+    return res.count == 0 ? Qtrue : Qfalse;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicTrack#==");
+}
+
+static VALUE
+track_diff (VALUE self, VALUE rb_other)
+{
+    TrackData *track, *other;
+    DiffResult res;
+    VALUE rb_str;
+    OSStatus err;
+    
+    if (!rb_typeddata_is_kind_of(rb_other, &track_type))
+        rb_raise(rb_eArgError, "Expected a MusicTrack.");
+    track = track_get(self);
+    other = track_get(rb_other);
+    
+    memset(&res, 0, sizeof(DiffResult));
+    res.limit = SIZE_MAX;
+    if (track != other && (err = track_compare(track, other, &res))) {
+        free(res.records);
+        RAISE_OSSTATUS(err, "MusicTrack#diff");
+    }
+    rb_str = rb_str_new((const char *) res.records, res.count * sizeof(DiffRecord));
+    free(res.records);
+    return rb_str;
+}
+
+/* Engine defns */
+
+/*
+ * Plays a sequence to a portable MIDIOutput in place of AudioToolbox's
+ * player, as a task on the shared scheduler's threads. Events are pulled in
+ * time order from a Merge, and everything due before the end of the current
+ * scheduling tick is queued and written with a single flush; the task then
+ * sleeps until the next event is due.
+ *
+ * The position is kept as the beat and time in seconds of the last event
+ * dispatched together with the tempo in effect there; tempo events are
+ * dispatched like any other. Note offs are kept in a heap ordered by beat
+ * and are sent before other events due at the same beat.
+ *
+ * A MIDIStream is played the same way, pulling from a StreamCursor over
+ * the file instead. Its notes are plain channel messages, so the notes
+ * sounding are counted by key to be released when the engine stops.
+ *
+ * The engine's task never calls into Ruby: the Merge or cursor is created
+ * and disposed by the Ruby thread while the engine is stopped.
+ *
+ * On a virtual clock nothing is scheduled. Time stands still until the Ruby
+ * thread advances the clock, when engine_dispatch runs just as the task
+ * would have at each wakeup, and every message sent is logged with the
+ * virtual time it was due, so that playback can be checked exactly and far
+ * faster than real time.
+ *
+ * Threads waiting for a beat or for the engine to stop are woken through a
+ * pipe each, written by the task after it dispatches the events due. The
+ * task sleeps no later than the earliest beat waited for, so a waiter wakes
+ * on time even between events.
+ */
+
+#define ENGINE_TICK     0.001   /* seconds */
+#define ENGINE_MAX_WAIT 0.1     /* seconds */
+#define ENGINE_RETRY    0.002   /* seconds until an output which was full is tried again */
+#define ENGINE_DEFAULT_BPM 120.0
+
+typedef struct {
+    MusicTimeStamp beat;
+    UInt8 msg[3];
+} NoteOff;
+
+/* Packed message record, as produced by MusicPlayer#advance. */
+typedef struct {
+    Float64 time;           /* on the virtual clock, in seconds */
+    MusicTimeStamp beat;
+    UInt8 msg[3];
+    UInt8 reserved[5];
+} EngineRecord;
+
+#define ENGINE_RECORD_FORMAT "ddC3x5"
+
+/* Beats by which a position may fall short of a waiter's and still count,
+ * for rounding in the conversion to seconds and back. */
+#define ENGINE_WAIT_SLACK 1e-9
+
+/*
+ * A Ruby thread or fiber waiting for the engine to reach a beat, or to
+ * stop, on the read end of its own pipe. Once the engine writes to the
+ * pipe the waiter is fired and stays in the list, untouched, until the
+ * waiting thread removes it.
+ */
+typedef struct EngineWaiter {
+    MusicTimeStamp beat;
+    Boolean until_stop;
+    Boolean fired;
+    Boolean reached;        /* the beat, or the stop, that was waited for */
+    int fds[2];
+    struct EngineWaiter *next;
+} EngineWaiter;
+
+struct Engine {
+    SchedulerTask task;
+    pthread_mutex_t lock;
+    Boolean started;        /* task was scheduled and must be cancelled */
+    Boolean playing;
+    SequenceData *seq;      /* whose lock is held while dispatching */
+    Endpoint *output;
+    CueQueue *cues;
+    Merge merge;
+    Boolean merged;
+    SInt16 track;           /* index of the current event's track */
+    Stream *stream;         /* played in place of seq, if set */
+    StreamCursor cursor;
+    Boolean cursored;
+    uint32_t window;
+    MIDIChannelMessage chmsg;   /* the cursor's current event, converted */
+    ExtendedTempoEvent tempo;
+    UInt8 held[16][128];    /* note ons sent without a matching note off */
+    MusicTimeStamp beat;
+    Float64 secs;
+    Float64 bpm;
+    Float64 rate;
+    Float64 origin_secs;    /* sequence time when the clock was last set */
+    struct timespec origin;
+    Boolean virtual;
+    Float64 clock;          /* virtual time, in seconds */
+    Float64 origin_clock;
+    EngineRecord *log;      /* messages sent on the virtual clock */
+    size_t log_count;
+    size_t log_capacity;
+    NoteOff *offs;
+    size_t offs_count;
+    size_t offs_capacity;
+    EngineWaiter *waiters;
+};
+
+static Float64
+engine_elapsed (const Engine *engine)
+{
+    struct timespec now;
+    if (engine->virtual) return engine->clock - engine->origin_clock;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - engine->origin.tv_sec) + (now.tv_nsec - engine->origin.tv_nsec) / 1e9;
+}
+
+/* The current time on the sequence's clock, in seconds. */
+static Float64
+engine_now (Engine *engine)
+{
+    return engine->origin_secs + engine_elapsed(engine) * engine->rate;
+}
+
+static void
+engine_set_origin (Engine *engine, Float64 secs)
+{
+    engine->origin_secs = secs;
+    engine->origin_clock = engine->clock;
+    clock_gettime(CLOCK_MONOTONIC, &engine->origin);
+}
+
+/* Queue a message to the output, logging it on a virtual clock at the time
+ * the position was due. */
+static void
+engine_send (Engine *engine, const UInt8 *msg, size_t len)
+{
+    EngineRecord *rec;
+    
+    if (engine->output) endpoint_add(engine->output, msg, len);
+    if (!engine->virtual) return;
+    if (engine->log_count == engine->log_capacity) {
+        size_t capacity = engine->log_capacity ? engine->log_capacity * 2 : 256;
+        if (!(rec = realloc(engine->log, capacity * sizeof(EngineRecord)))) return;
+        engine->log = rec;
+        engine->log_capacity = capacity;
+    }
+    rec = &engine->log[engine->log_count++];
+    memset(rec, 0, sizeof(EngineRecord));
+    rec->time = engine->origin_clock + (engine->secs - engine->origin_secs) / engine->rate;
+    rec->beat = engine->beat;
+    memcpy(rec->msg, msg, len);
+}
+
+/* The monotonic time at which the position was due, or on a virtual clock
+ * the time at which it was played. */
+static Float64
+engine_due (Engine *engine)
+{
+    if (engine->virtual) return scheduler_now();
+    return engine->origin.tv_sec + engine->origin.tv_nsec / 1e9 +
+        (engine->secs - engine->origin_secs) / engine->rate;
+}
+
+/* Write what the output takes without blocking. Returns 0 once everything
+ * is written, 1 if some is left queued for the reader, or -1 on error. */
+static int
+engine_flush (Engine *engine)
+{
+    if (!engine->output || endpoint_flush(engine->output) == 0) return 0;
+    return errno == EAGAIN ? 1 : -1;
+}
+
+static Boolean
+noteoff_less (const NoteOff *a, const NoteOff *b)
+{
+    return a->beat < b->beat;
+}
+
+static int
+engine_push_off (Engine *engine, MusicTimeStamp beat, UInt8 status, UInt8 note, UInt8 velocity)
+{
+    NoteOff *offs = engine->offs, tmp;
+    size_t i;
+    
+    if (engine->offs_count == engine->offs_capacity) {
+        size_t capacity = engine->offs_capacity ? engine->offs_capacity * 2 : 64;
+        if (!(offs = realloc(engine->offs, capacity * sizeof(NoteOff)))) return -1;
+        engine->offs = offs;
+        engine->offs_capacity = capacity;
+    }
+    
+    i = engine->offs_count++;
+    offs[i].beat = beat;
+    offs[i].msg[0] = status;
+    offs[i].msg[1] = note;
+    offs[i].msg[2] = velocity;
+    for (; i > 0 && noteoff_less(&offs[i], &offs[(i - 1) / 2]); i = (i - 1) / 2) {
+        tmp = offs[i];
+        offs[i] = offs[(i - 1) / 2];
+        offs[(i - 1) / 2] = tmp;
+    }
+    return 0;
+}
+
+static void
+engine_pop_off (Engine *engine)
+{
+    NoteOff *offs = engine->offs, tmp;
+    size_t i = 0, least, left, right, count = --engine->offs_count;
+    
+    offs[0] = offs[count];
+    for (;;) {
+        least = i;
+        left = 2 * i + 1;
+        right = left + 1;
+        if (left < count && noteoff_less(&offs[left], &offs[least])) least = left;
+        if (right < count && noteoff_less(&offs[right], &offs[least])) least = right;
+        if (least == i) break;
+        tmp = offs[i];
+        offs[i] = offs[least];
+        offs[least] = tmp;
+        i = least;
+    }
+}
+
+/* Count a note on sent as a channel message, or uncount its note off. */
+static void
+engine_hold (Engine *engine, const UInt8 *msg)
+{
+    UInt8 *held = &engine->held[msg[0] & 0x0F][msg[1]];
+    
+    if ((msg[0] & 0xF0) == 0x90 && msg[2] > 0) {
+        if (*held < 0xFF) (*held)++;
+    } else if (((msg[0] & 0xF0) == 0x80 || (msg[0] & 0xF0) == 0x90) && *held > 0) {
+        (*held)--;
+    }
+}
+
+/* The next event from the sequence or stream, converted for engine_emit. */
+static Boolean
+engine_current (Engine *engine, MusicTimeStamp *ts, MusicEventType *type, const void **data)
+{
+    const StreamEvent *ev;
+    
+    if (!engine->stream) return merge_current(&engine->merge, ts, &engine->track, type, data) == noErr;
+    if (!(ev = stream_cursor_current(&engine->cursor))) return FALSE;
+    *ts = (MusicTimeStamp) ev->tick / engine->stream->division;
+    if (ev->status == SMF_META) {
+        engine->tempo.bpm = 6e7 / ev->usecs;
+        *type = kMusicEventType_ExtendedTempo;
+        *data = &engine->tempo;
+    } else {
+        engine->chmsg.status = ev->status;
+        engine->chmsg.data1 = ev->data1;
+        engine->chmsg.data2 = ev->data2;
+        *type = kMusicEventType_MIDIChannelMessage;
+        *data = &engine->chmsg;
+    }
+    return TRUE;
+}
+
+static void
+engine_next (Engine *engine)
+{
+    if (engine->stream) stream_cursor_next(&engine->cursor);
+    else if (merge_next(&engine->merge) != noErr) engine->merge.count = 0;
+}
+
+static void
+engine_emit (Engine *engine, MusicTimeStamp beat, MusicEventType type, const void *data)
+{
+    UInt8 msg[3];
+    size_t len;
+    
+    switch (type) {
+    case kMusicEventType_ExtendedTempo:
+        engine->bpm = ((const ExtendedTempoEvent *) data)->bpm;
+        break;
+    case kMusicEventType_MIDINoteMessage: {
+        const MIDINoteMessage *note = (const MIDINoteMessage *) data;
+        msg[0] = 0x90 | (note->channel & 0x0F);
+        msg[1] = note->note & 0x7F;
+        msg[2] = note->velocity & 0x7F;
+        engine_send(engine, msg, 3);
+        engine_push_off(engine, beat + note->duration, 0x80 | (note->channel & 0x0F),
+                        msg[1], note->releaseVelocity & 0x7F);
+        break;
+    }
+    case kMusicEventType_MIDIChannelMessage: {
+        const MIDIChannelMessage *chmsg = (const MIDIChannelMessage *) data;
+        msg[0] = chmsg->status;
+        msg[1] = chmsg->data1 & 0x7F;
+        msg[2] = chmsg->data2 & 0x7F;
+        if ((len = endpoint_message_length(msg[0])))
+            engine_send(engine, msg, len);
+        engine_hold(engine, msg);
+        break;
+    }
+    case kMusicEventType_User: {
+        const MusicEventUserData *user = (const MusicEventUserData *) data;
+        if (engine->cues)
+            cue_push(engine->cues, beat, engine_due(engine), engine->track, user->data, user->length);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*
+ * Queue every event due no later than horizon, to be flushed together.
+ * Returns FALSE once the sequence and its note offs are exhausted, or
+ * otherwise sets *due to the time of the next event, which is now if the
+ * stream's cursor stopped for a refill. Called with the lock held.
+ */
+static Boolean
+engine_dispatch (Engine *engine, Float64 horizon, Float64 *due)
+{
+    MusicTimeStamp ts, beat;
+    MusicEventType type;
+    const void *data;
+    Boolean has_event, is_off;
+    Float64 secs;
+    
+    for (;;) {
+        if (engine->stream && stream_cursor_pending(&engine->cursor)) {
+            *due = engine->secs;
+            break;
+        }
+        has_event = engine_current(engine, &ts, &type, &data);
+        if (!has_event && engine->offs_count == 0) return FALSE;
+        is_off = engine->offs_count > 0 && (!has_event || engine->offs[0].beat <= ts);
+        beat = is_off ? engine->offs[0].beat : ts;
+        secs = engine->secs + (beat - engine->beat) * 60.0 / engine->bpm;
+        if (secs > horizon) {
+            *due = secs;
+            break;
+        }
+        
+        engine->beat = beat;
+        engine->secs = secs;
+        if (is_off) {
+            engine_send(engine, engine->offs[0].msg, 3);
+            engine_pop_off(engine);
+        } else {
+            engine_emit(engine, beat, type, data);
+            engine_next(engine);
+        }
+    }
+    
+    return TRUE;
+}
+
+/* The position in beats, with the lock held. */
+static MusicTimeStamp
+engine_position (Engine *engine)
+{
+    MusicTimeStamp beat = engine->beat;
+    if (engine->playing)
+        beat += (engine_now(engine) - engine->secs) * engine->bpm / 60.0;
+    return beat;
+}
+
+/* Fire every waiter whose beat has been reached, and every other waiter if
+ * the engine has stopped. Called with the lock held. */
+static void
+engine_wake (Engine *engine)
+{
+    MusicTimeStamp beat = engine_position(engine);
+    EngineWaiter *waiter;
+    char byte = 0;
+    
+    for (waiter = engine->waiters; waiter; waiter = waiter->next) {
+        if (waiter->fired) continue;
+        if (!waiter->until_stop && beat + ENGINE_WAIT_SLACK >= waiter->beat)
+            waiter->reached = TRUE;
+        else if (engine->playing)
+            continue;
+        else
+            waiter->reached = waiter->until_stop;
+        waiter->fired = TRUE;
+        while (write(waiter->fds[1], &byte, 1) < 0 && errno == EINTR);
+    }
+}
+
+/* The time in seconds at which the earliest beat waited for falls, if the
+ * tempo holds, or HUGE_VAL. Called with the lock held. */
+static Float64
+engine_next_wake (Engine *engine)
+{
+    Float64 secs, earliest = HUGE_VAL;
+    EngineWaiter *waiter;
+    
+    for (waiter = engine->waiters; waiter; waiter = waiter->next) {
+        if (waiter->fired || waiter->until_stop) continue;
+        secs = engine->secs + (waiter->beat - engine->beat) * 60.0 / engine->bpm;
+        if (secs < earliest) earliest = secs;
+    }
+    return earliest;
+}
+
+/* Dispatch what is due within a tick, reading the stream's next windows
+ * outside the lock whenever its cursor runs dry. A sequence is locked
+ * against edits first. */
+static Boolean
+engine_step (Engine *engine, Float64 *due)
+{
+    Boolean more;
+    
+    do {
+        if (engine->stream) stream_cursor_refill(&engine->cursor);
+        else pthread_mutex_lock(&engine->seq->lock);
+        pthread_mutex_lock(&engine->lock);
+        more = engine_dispatch(engine, engine_now(engine) + ENGINE_TICK, due);
+        pthread_mutex_unlock(&engine->lock);
+        if (!engine->stream) pthread_mutex_unlock(&engine->seq->lock);
+    } while (more && engine->stream && stream_cursor_pending(&engine->cursor));
+    return more;
+}
+
+/* The scheduler task: dispatch what is due, wake any waiters and say when
+ * to run next. The output is never waited on: what it will not take yet is
+ * tried again after ENGINE_RETRY, so a slow reader holds up no other task,
+ * and playback ends once the sequence is exhausted and fully written. The
+ * lock is never held across a read or a write. */
+static double
+engine_run (void *arg)
+{
+    Engine *engine = (Engine *) arg;
+    Float64 due, wait;
+    Boolean more;
+    double next = -1.0;
+    int flushed;
+    
+    more = engine_step(engine, &due);
+    flushed = engine_flush(engine);
+    pthread_mutex_lock(&engine->lock);
+    if (flushed < 0 || (!more && flushed == 0)) {
+        engine->playing = FALSE;
+    } else {
+        wait = more ? (fmin(due, engine_next_wake(engine)) - engine_now(engine)) / engine->rate : ENGINE_RETRY;
+        if (wait > ENGINE_MAX_WAIT) wait = ENGINE_MAX_WAIT;
+        if (flushed > 0 && wait > ENGINE_RETRY) wait = ENGINE_RETRY;
+        next = scheduler_now() + (wait > 0.0 ? wait : 0.0);
+    }
+    engine_wake(engine);
+    pthread_mutex_unlock(&engine->lock);
+    return next;
+}
+
+static Engine *
+engine_new (void)
+{
+    Engine *engine = ALLOC(Engine);
+    MEMZERO(engine, Engine, 1);
+    pthread_mutex_init(&engine->lock, NULL);
+    scheduler_task_init(&engine->task, engine_run, engine);
+    engine->bpm = ENGINE_DEFAULT_BPM;
+    engine->rate = 1.0;
+    return engine;
+}
+
+/* The current position in beats. */
+static MusicTimeStamp
+engine_get_time (Engine *engine)
+{
+    MusicTimeStamp beat;
+    pthread_mutex_lock(&engine->lock);
+    beat = engine_position(engine);
+    pthread_mutex_unlock(&engine->lock);
+    return beat;
+}
+
+static Boolean
+engine_is_playing (Engine *engine)
+{
+    Boolean playing;
+    pthread_mutex_lock(&engine->lock);
+    playing = engine->playing;
+    pthread_mutex_unlock(&engine->lock);
+    return playing;
+}
+
+static void
+engine_release_held (Engine *engine)
+{
+    UInt8 msg[3];
+    int channel, note;
+    
+    for (channel = 0; channel < 16; channel++) {
+        for (note = 0; note < 128; note++) {
+            if (!engine->held[channel][note]) continue;
+            msg[0] = 0x80 | channel;
+            msg[1] = note;
+            msg[2] = 0;
+            while (engine->held[channel][note]) {
+                engine_send(engine, msg, 3);
+                engine->held[channel][note]--;
+            }
+        }
+    }
+}
+
+/* Release any notes still sounding. */
+static void
+engine_release (Engine *engine)
+{
+    while (engine->offs_count > 0) {
+        engine_send(engine, engine->offs[0].msg, 3);
+        engine_pop_off(engine);
+    }
+    engine_release_held(engine);
+    engine_flush(engine);
+}
+
+static void *
+engine_join (void *arg)
+{
+    Engine *engine = (Engine *) arg;
+    
+    scheduler_cancel(&engine->task);
+    engine->started = FALSE;
+    pthread_mutex_lock(&engine->lock);
+    engine->playing = FALSE;
+    pthread_mutex_unlock(&engine->lock);
+    engine_release(engine);
+    return NULL;
+}
+
+/* Stop the engine's task, keeping the position it reached, without waking
+ * waiters, as when moving to another beat. */
+static void
+engine_halt (Engine *engine)
+{
+    MusicTimeStamp beat;
+    
+    if (engine->virtual && engine->playing) {
+        pthread_mutex_lock(&engine->lock);
+        engine->beat = engine_position(engine);
+        engine->secs = engine_now(engine);
+        engine->playing = FALSE;
+        pthread_mutex_unlock(&engine->lock);
+        engine_release(engine);
+        return;
+    }
+    if (!engine->started) return;
+    /* The task may still move the position until it is joined. */
+    beat = engine_get_time(engine);
+    rb_thread_call_without_gvl(engine_join, engine, RUBY_UBF_IO, NULL);
+    pthread_mutex_lock(&engine->lock);
+    engine->beat = beat;
+    pthread_mutex_unlock(&engine->lock);
+    engine->offs_count = 0;
+}
+
+static void
+engine_stop (Engine *engine)
+{
+    engine_halt(engine);
+    pthread_mutex_lock(&engine->lock);
+    engine_wake(engine);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+/* Compute the time in seconds and the tempo at a beat from the tempo track,
+ * or from the stream's index of tempo changes. */
+static OSStatus
+engine_locate (Engine *engine, MusicTimeStamp target)
+{
+    MusicTimeStamp ts, beat = 0.0;
+    MusicEventIterator iter;
+    MusicTrack tempo;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    Float64 secs = 0.0, bpm = ENGINE_DEFAULT_BPM;
+    OSStatus err;
+    
+    if (engine->stream) {
+        engine->secs = stream_seconds(engine->stream, target, &engine->bpm);
+        engine->beat = target;
+        return noErr;
+    }
+    require_noerr( err = MusicSequenceGetTempoTrack(engine->seq->seq, &tempo), fail );
+    require_noerr( err = NewMusicEventIterator(tempo, &iter), fail );
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    while (has_current) {
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), dispose );
+        if (ts > target) break;
+        if (type == kMusicEventType_ExtendedTempo) {
+            secs += (ts - beat) * 60.0 / bpm;
+            beat = ts;
+            bpm = ((const ExtendedTempoEvent *) data)->bpm;
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+    }
+    
+    engine->secs = secs + (target - beat) * 60.0 / bpm;
+    engine->beat = target;
+    engine->bpm = bpm;
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/* Position the stream's cursor at a beat, creating it on first use. */
+static OSStatus
+engine_seek_stream (Engine *engine, MusicTimeStamp beat)
+{
+    Float64 tick = ceil(beat * engine->stream->division - 1e-9);
+    
+    if (!engine->cursored) {
+        if (stream_cursor_init(&engine->cursor, engine->stream, engine->window) == SMF_ERR_NOMEM)
+            return kAudio_MemFullError;
+        engine->cursored = TRUE;
+        engine->cursor.defer = 1;
+    }
+    /* A track which cannot be read is played as far as it goes. */
+    stream_cursor_seek(&engine->cursor, tick < 0.0 ? 0 : tick > UINT32_MAX ? UINT32_MAX : (uint32_t) tick);
+    return noErr;
+}
+
+/* Start playing seq, or the stream if one is set, to output from the
+ * current position, queueing its user events to cues. */
+static OSStatus
+engine_start (Engine *engine, SequenceData *seq, Endpoint *output, CueQueue *cues)
+{
+    OSStatus err;
+    int sys_err;
+    
+    if (engine_is_playing(engine)) return noErr;
+    if (engine->started) engine_halt(engine);
+    
+    if (engine->merged) merge_dispose(&engine->merge);
+    engine->merged = FALSE;
+    engine->seq = seq;
+    if (output != engine->output) {
+        if (output) endpoint_retain(output);
+        if (engine->output) endpoint_release(engine->output);
+        engine->output = output;
+    }
+    if (cues != engine->cues) {
+        if (cues) cue_queue_retain(cues);
+        if (engine->cues) cue_queue_release(engine->cues);
+        engine->cues = cues;
+    }
+    if (engine->stream) {
+        require_noerr( err = engine_locate(engine, engine->beat), fail );
+        require_noerr( err = engine_seek_stream(engine, engine->beat), fail );
+    } else {
+        require_noerr( err = merge_init(&engine->merge, seq->seq, TRUE), fail );
+        engine->merged = TRUE;
+        require_noerr( err = engine_locate(engine, engine->beat), fail );
+        require_noerr( err = merge_seek(&engine->merge, engine->beat), fail );
+    }
+    
+    engine_set_origin(engine, engine->secs);
+    engine->playing = TRUE;
+    if (engine->virtual) return noErr;
+    if ((sys_err = scheduler_start(&engine->task, scheduler_now()))) {
+        engine->playing = FALSE;
+        rb_syserr_fail(sys_err, "scheduler_start");
+    }
+    engine->started = TRUE;
+    
+    fail:
+    return err;
+}
+
+/* Move to a beat, restarting playback there if the engine is playing. */
+static OSStatus
+engine_set_time (Engine *engine, MusicTimeStamp beat)
+{
+    Boolean playing = engine_is_playing(engine);
+    engine_halt(engine);
+    engine->beat = beat;
+    return playing ? engine_start(engine, engine->seq, engine->output, engine->cues) : noErr;
+}
+
+static Float64
+engine_get_rate (Engine *engine)
+{
+    return engine->rate;
+}
+
+static void
+engine_set_rate (Engine *engine, Float64 rate)
+{
+    pthread_mutex_lock(&engine->lock);
+    engine_set_origin(engine, engine_now(engine));
+    engine->rate = rate;
+    pthread_mutex_unlock(&engine->lock);
+    if (engine->started) scheduler_reschedule(&engine->task, scheduler_now());
+}
+
+/* Restart the clock at zero, virtual or not. The engine must be stopped. */
+static void
+engine_set_virtual (Engine *engine, Boolean on)
+{
+    engine->virtual = on;
+    engine->clock = 0.0;
+    engine->log_count = 0;
+}
+
+/*
+ * Move the virtual clock forward, dispatching as the engine thread would:
+ * everything due within a tick of the clock is sent together, and the clock
+ * then jumps to the next event or to the end of the interval.
+ */
+static void
+engine_advance (Engine *engine, Float64 seconds)
+{
+    Float64 until = engine->clock + seconds, due, wait;
+    Boolean more;
+    
+    while (engine->playing) {
+        more = engine_step(engine, &due);
+        if (engine_flush(engine) < 0 || !more) {
+            pthread_mutex_lock(&engine->lock);
+            engine->playing = FALSE;
+            pthread_mutex_unlock(&engine->lock);
+            break;
+        }
+        wait = (due - engine_now(engine)) / engine->rate;
+        /* Overdue events are sent now, never before the clock. */
+        if (wait < 0) wait = 0;
+        if (engine->clock + wait > until) break;
+        engine->clock += wait;
+    }
+    engine->clock = until;
+    pthread_mutex_lock(&engine->lock);
+    engine_wake(engine);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+static VALUE
+engine_take_log (Engine *engine)
+{
+    VALUE rb_str = rb_str_new((const char *) engine->log, engine->log_count * sizeof(EngineRecord));
+    engine->log_count = 0;
+    return rb_str;
+}
+
+static void
+engine_forget_stream (Engine *engine)
+{
+    if (engine->cursored) stream_cursor_free(&engine->cursor);
+    engine->cursored = FALSE;
+    if (engine->stream) stream_release(engine->stream);
+    engine->stream = NULL;
+}
+
+/* Forget the sequence, as when the player is given another. */
+static void
+engine_reset (Engine *engine)
+{
+    engine_stop(engine);
+    if (engine->merged) merge_dispose(&engine->merge);
+    engine->merged = FALSE;
+    engine->seq = NULL;
+    engine_forget_stream(engine);
+    if (engine->output) endpoint_release(engine->output);
+    engine->output = NULL;
+    if (engine->cues) cue_queue_release(engine->cues);
+    engine->cues = NULL;
+    engine->beat = 0.0;
+}
+
+/* Play a stream in place of a sequence, decoding window events of each
+ * track at a time. The engine must have been reset. */
+static void
+engine_set_stream (Engine *engine, Stream *stream, uint32_t window)
+{
+    stream_retain(stream);
+    engine->stream = stream;
+    engine->window = window;
+}
+
+/*
+ * Add a waiter for beat, or for the engine to stop if until_stop, returning
+ * the file descriptor it is woken on. A waiter whose beat has already been
+ * reached, or which waits on a stopped engine, is woken at once.
+ */
+static int
+engine_watch (Engine *engine, MusicTimeStamp beat, Boolean until_stop)
+{
+    EngineWaiter *waiter = ALLOC(EngineWaiter);
+    Boolean fired;
+    
+    MEMZERO(waiter, EngineWaiter, 1);
+    if (rb_pipe(waiter->fds) < 0) {
+        xfree(waiter);
+        rb_sys_fail("pipe");
+    }
+    waiter->beat = beat;
+    waiter->until_stop = until_stop;
+    
+    pthread_mutex_lock(&engine->lock);
+    waiter->next = engine->waiters;
+    engine->waiters = waiter;
+    engine_wake(engine);
+    fired = waiter->fired;
+    pthread_mutex_unlock(&engine->lock);
+    /* Have the task work out its next wakeup again, now no later than beat. */
+    if (engine->started && !fired) scheduler_reschedule(&engine->task, scheduler_now());
+    return waiter->fds[0];
+}
+
+static void
+engine_waiter_free (EngineWaiter *waiter)
+{
+    close(waiter->fds[0]);
+    close(waiter->fds[1]);
+    xfree(waiter);
+}
+
+/* Remove the waiter woken on fd, returning whether it saw what it waited
+ * for, or -1 if there is no such waiter. */
+static int
+engine_unwatch (Engine *engine, int fd)
+{
+    EngineWaiter **link, *waiter;
+    int reached = -1;
+    
+    pthread_mutex_lock(&engine->lock);
+    for (link = &engine->waiters; (waiter = *link); link = &waiter->next) {
+        if (waiter->fds[0] != fd) continue;
+        *link = waiter->next;
+        reached = waiter->fired && waiter->reached;
+        break;
+    }
+    pthread_mutex_unlock(&engine->lock);
+    if (waiter) engine_waiter_free(waiter);
+    return reached;
+}
+
+static size_t
+engine_memsize (const Engine *engine)
+{
+    return sizeof(Engine) + engine->offs_capacity * sizeof(NoteOff) +
+        engine->log_capacity * sizeof(EngineRecord) +
+        engine->merge.size * (sizeof(MergeCursor) + sizeof(MergeCursor *)) +
+        (engine->cursored ? stream_cursor_memsize(&engine->cursor) : 0);
+}
+
+/* Called while collecting the sequence, so the thread is joined in place,
+ * and nothing which reads the sequence is kept. */
+static void
+engine_abandon (Engine *engine)
+{
+    if (engine->started) engine_join(engine);
+    pthread_mutex_lock(&engine->lock);
+    engine->playing = FALSE;
+    pthread_mutex_unlock(&engine->lock);
+    if (engine->merged) merge_dispose(&engine->merge);
+    engine->merged = FALSE;
+    engine->seq = NULL;
+}
+
+/* Halt the engine if it is playing seq, noting so in *suspended, or restart
+ * it once resumed. A restart which fails leaves the engine stopped. */
+static void
+engine_suspend (Engine *engine, SequenceData *seq, Boolean resume, Boolean *suspended)
+{
+    if (!resume) {
+        *suspended = engine->seq == seq && engine_is_playing(engine);
+        if (*suspended) engine_halt(engine);
+    } else if (*suspended) {
+        *suspended = FALSE;
+        engine_start(engine, seq, engine->output, engine->cues);
+    }
+}
+
+/* Called while collecting the player, so the thread is joined in place. */
+static void
+engine_free (Engine *engine)
+{
+    EngineWaiter *waiter;
+    
+    if (engine->started) engine_join(engine);
+    if (engine->merged) merge_dispose(&engine->merge);
+    engine_forget_stream(engine);
+    if (engine->output) endpoint_release(engine->output);
+    if (engine->cues) cue_queue_release(engine->cues);
+    while ((waiter = engine->waiters)) {
+        engine->waiters = waiter->next;
+        engine_waiter_free(waiter);
+    }
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->offs);
+    free(engine->log);
+    xfree(engine);
+}
+
+/* MIDIOutput defns */
+
+static void
+output_free (Endpoint *ep)
+{
+    if (ep) endpoint_release(ep);
+}
+
+static size_t
+output_memsize (const void *ptr)
+{
+    const Endpoint *ep = (const Endpoint *) ptr;
+    return ep ? sizeof(Endpoint) + ep->capacity + ep->packets_capacity * sizeof(EndpointPacket) : 0;
+}
+
+static const rb_data_type_t output_type = {
+    "AudioToolbox::MIDIOutput",
+    { 0, (RUBY_DATA_FUNC) output_free, output_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+output_alloc (VALUE class)
+{
+    Endpoint *ep = endpoint_new();
+    if (!ep) rb_memerror();
+    return TypedData_Wrap_Struct(class, &output_type, ep);
+}
+
+/*
+ * Accepts a path to a device file or FIFO, which is opened for writing, an
+ * IO, or a file descriptor. IOs and descriptors are not closed by #close.
+ */
+static VALUE
+output_init (VALUE self, VALUE rb_target)
+{
+    Endpoint *ep;
+    VALUE rb_path;
+    
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    if (ep->fd >= 0) rb_raise(rb_eIOError, "MIDI output is already open");
+    if (FIXNUM_P(rb_target)) {
+        endpoint_attach(ep, FIX2INT(rb_target));
+    } else if (rb_respond_to(rb_target, rb_intern("fileno"))) {
+        rb_iv_set(self, "@io", rb_target);
+        endpoint_attach(ep, NUM2INT(rb_funcall(rb_target, rb_intern("fileno"), 0)));
+    } else {
+        rb_path = rb_get_path(rb_target);
+        if (endpoint_open(ep, StringValueCStr(rb_path)) < 0)
+            rb_sys_fail(StringValueCStr(rb_path));
+    }
+    return self;
+}
+
+static Endpoint *
+output_get (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    if (ep->fd < 0) rb_raise(rb_eIOError, "closed MIDI output");
+    return ep;
+}
+
+/* Queues a channel message, the note on of a note message, or a String of
+ * raw MIDI bytes until the next #flush. */
+static VALUE
+output_add (VALUE self, VALUE rb_msg)
+{
+    Endpoint *ep = output_get(self);
+    const UInt8 *bytes;
+    UInt8 msg[3];
+    size_t len;
+    
+    if (T_STRING == TYPE(rb_msg)) {
+        bytes = (const UInt8 *) RSTRING_PTR(rb_msg);
+        len = RSTRING_LEN(rb_msg);
+    } else if (rb_obj_is_kind_of(rb_msg, rb_cMIDINoteMessage)) {
+        MIDINoteMessage *note;
+        TypedData_Get_Struct(rb_msg, MIDINoteMessage, &note_message_type, note);
+        msg[0] = 0x90 | (note->channel & 0x0F);
+        msg[1] = note->note & 0x7F;
+        msg[2] = note->velocity & 0x7F;
+        bytes = msg;
+        len = 3;
+    } else if (rb_obj_is_kind_of(rb_msg, rb_cMIDIChannelMessage)) {
+        MIDIChannelMessage *chmsg;
+        TypedData_Get_Struct(rb_msg, MIDIChannelMessage, &channel_message_type, chmsg);
+        msg[0] = chmsg->status;
+        msg[1] = chmsg->data1 & 0x7F;
+        msg[2] = chmsg->data2 & 0x7F;
+        bytes = msg;
+        if (!(len = endpoint_message_length(msg[0])))
+            rb_raise(rb_eArgError, "Expected a channel message with a valid status.");
+    } else {
+        rb_raise(rb_eArgError, "Expected a MIDIChannelMessage, MIDINoteMessage or String.");
+    }
+    
+    if (endpoint_add(ep, bytes, len) < 0) rb_sys_fail("MIDIOutput#<<");
+    return self;
+}
+
+/* Writes the queued messages, with as few write calls as the reader
+ * allows, waiting without the GVL while the descriptor is full. */
+static VALUE
+output_flush (VALUE self)
+{
+    Endpoint *ep = output_get(self);
+    
+    while (endpoint_flush(ep) < 0) {
+        if (errno != EAGAIN) rb_sys_fail("write");
+        rb_thread_fd_writable(ep->fd);
+    }
+    return self;
+}
+
+static VALUE
+output_close (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    endpoint_close(ep);
+    return Qnil;
+}
+
+static VALUE
+output_is_closed (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    return ep->fd < 0 ? Qtrue : Qfalse;
+}
+
+/* Number of writes made, each of which may carry many messages. */
+static VALUE
+output_get_writes (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    return ULL2NUM(ep->writes);
+}
+
+static VALUE
+output_get_messages (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    return ULL2NUM(ep->messages);
+}
+
+static VALUE
+output_get_bytes_written (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    return ULL2NUM(ep->bytes_written);
+}
+
+/* Number of messages dropped because too many were waiting for the reader. */
+static VALUE
+output_get_dropped (VALUE self)
+{
+    Endpoint *ep;
+    TypedData_Get_Struct(self, Endpoint, &output_type, ep);
+    return ULL2NUM(ep->dropped);
+}
+
+/* MIDIStream defns */
+
+/*
+ * Wraps a stream.c Stream, which holds an open file and its index. Closing
+ * the wrapper drops its reference only, so a player given the stream keeps
+ * reading until it is given another.
+ */
+
+typedef struct {
+    Stream *stream;
+    uint32_t window;
+} StreamData;
+
+static void
+midi_stream_free (StreamData *data)
+{
+    if (data->stream) stream_release(data->stream);
+    xfree(data);
+}
+
+static size_t
+midi_stream_memsize (const void *ptr)
+{
+    const StreamData *data = (const StreamData *) ptr;
+    return sizeof(StreamData) + (data->stream ? stream_memsize(data->stream) : 0);
+}
+
+static const rb_data_type_t stream_type = {
+    "AudioToolbox::MIDIStream",
+    { 0, (RUBY_DATA_FUNC) midi_stream_free, midi_stream_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+midi_stream_alloc (VALUE class)
+{
+    StreamData *data;
+    return TypedData_Make_Struct(class, StreamData, &stream_type, data);
+}
+
+typedef struct {
+    Stream *stream;
+    const char *path;
+    int error;
+    int sys_errno;
+} StreamOpen;
+
+static void *
+midi_stream_open_nogvl (void *arg)
+{
+    StreamOpen *open = (StreamOpen *) arg;
+    open->error = stream_open(&open->stream, open->path);
+    open->sys_errno = errno;
+    return NULL;
+}
+
+/*
+ * Opens a Standard MIDI File for streaming, scanning it once to index its
+ * tracks. Accepts :window, the number of events to decode ahead for each
+ * track.
+ */
+static VALUE
+midi_stream_init (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_path, rb_options, rb_window;
+    StreamData *data;
+    StreamOpen open;
+    uint32_t window = STREAM_DEFAULT_WINDOW;
+    
+    rb_scan_args(argc, argv, "11", &rb_path, &rb_options);
+    TypedData_Get_Struct(self, StreamData, &stream_type, data);
+    if (data->stream) rb_raise(rb_eIOError, "MIDI stream is already open");
+    if (!NIL_P(rb_options)) {
+        Check_Type(rb_options, T_HASH);
+        if (!NIL_P(rb_window = rb_hash_aref(rb_options, rb_sWindow))) {
+            window = NUM2UINT(rb_window);
+            if (window == 0) rb_raise(rb_eArgError, "Expected :window to be positive.");
+        }
+    }
+    
+    rb_path = rb_get_path(rb_path);
+    open.stream = NULL;
+    open.path = StringValueCStr(rb_path);
+    rb_thread_call_without_gvl(midi_stream_open_nogvl, &open, RUBY_UBF_IO, NULL);
+    RB_GC_GUARD(rb_path);
+    if (open.error == SMF_ERR_IO) rb_syserr_fail(open.sys_errno, open.path);
+    if (open.error) rb_raise(rb_eRuntimeError, "%s: %s", open.path, smf_strerror(open.error));
+    data->stream = open.stream;
+    data->window = window;
+    return self;
+}
+
+static Stream *
+midi_stream_get (VALUE self, uint32_t *window)
+{
+    StreamData *data;
+    TypedData_Get_Struct(self, StreamData, &stream_type, data);
+    if (!data->stream) rb_raise(rb_eIOError, "closed MIDI stream");
+    if (window) *window = data->window;
+    return data->stream;
+}
+
+/* Accepts a MIDIOutput, through which a player plays the stream. */
+static VALUE
+midi_stream_set_midi_endpoint (VALUE self, VALUE rb_output)
+{
+    if (!rb_obj_is_kind_of(rb_output, rb_cMIDIOutput))
+        rb_raise(rb_eArgError, "Expected a MIDIOutput.");
+    rb_iv_set(self, "@midi_output", rb_output);
+    return rb_output;
+}
+
+static VALUE
+midi_stream_close (VALUE self)
+{
+    StreamData *data;
+    TypedData_Get_Struct(self, StreamData, &stream_type, data);
+    if (data->stream) stream_release(data->stream);
+    data->stream = NULL;
+    return Qnil;
+}
+
+static VALUE
+midi_stream_is_closed (VALUE self)
+{
+    StreamData *data;
+    TypedData_Get_Struct(self, StreamData, &stream_type, data);
+    return data->stream ? Qfalse : Qtrue;
+}
+
+static VALUE
+midi_stream_get_tracks (VALUE self)
+{
+    return UINT2NUM(midi_stream_get(self, NULL)->track_count);
+}
+
+/* Ticks per quarter note. */
+static VALUE
+midi_stream_get_division (VALUE self)
+{
+    return UINT2NUM(midi_stream_get(self, NULL)->division);
+}
+
+/* The beat of the last event. */
+static VALUE
+midi_stream_get_length (VALUE self)
+{
+    Stream *stream = midi_stream_get(self, NULL);
+    return rb_float_new((Float64) stream->length / stream->division);
+}
+
+/* The number of channel messages and tempo changes to be played. */
+static VALUE
+midi_stream_get_events (VALUE self)
+{
+    return ULL2NUM(midi_stream_get(self, NULL)->event_count);
+}
+
+/* MIDIRecorder defns */
+
+/*
+ * Records from a recorder.c input thread into a track. The thread reads the
+ * player's clock, so the recorder holds a reference to the player's data
+ * until the thread has been joined; the track is only touched while
+ * draining, with the GVL held.
+ */
+typedef struct {
+    Recorder rec;
+    PlayerData *player;
+    TrackData *track;
+    SequenceUser user;
+} RecorderData;
+
+#define RECORDER_BATCH 256
+
+static double
+recorder_clock (void *ctx)
+{
+    PlayerData *player = (PlayerData *) ctx;
+    Engine *engine = __atomic_load_n(&player->engine, __ATOMIC_ACQUIRE);
+    MusicTimeStamp ts = 0.0;
+    
+    if (engine) return engine_get_time(engine);
+    MusicPlayerGetTime(player->player, &ts);
+    return ts;
+}
+
+static void
+recorder_free (RecorderData *recorder)
+{
+    recorder_close(&recorder->rec);
+    if (recorder->player) player_release(recorder->player);
+    sequence_user_unlink(&recorder->user);
+    xfree(recorder);
+}
+
+static size_t
+recorder_memsize (const void *recorder)
+{
+    return sizeof(RecorderData);
+}
+
+/* Not freed immediately, as closing joins the input thread and may release
+ * the player. */
+static const rb_data_type_t recorder_type = {
+    "AudioToolbox::MIDIRecorder",
+    { 0, (RUBY_DATA_FUNC) recorder_free, recorder_memsize, },
+    0, 0, RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+recorder_alloc (VALUE class)
+{
+    RecorderData *recorder;
+    VALUE rb_recorder = TypedData_Make_Struct(class, RecorderData, &recorder_type, recorder);
+    if (recorder_init(&recorder->rec) < 0) rb_sys_fail("pipe");
+    return rb_recorder;
+}
+
+/*
+ * Records from source, which may be a path to a device file or FIFO, an
+ * IO, or a file descriptor, into track, timestamping events by player's
+ * clock.
+ */
+static VALUE
+recorder_init_rb (VALUE self, VALUE rb_source, VALUE rb_track, VALUE rb_player)
+{
+    RecorderData *recorder;
+    VALUE rb_path;
+    
+    if (rb_cMusicTrack != rb_class_of(rb_track))
+        rb_raise(rb_eArgError, "Expected second arg to be a MusicTrack.");
+    if (rb_cMusicPlayer != rb_class_of(rb_player))
+        rb_raise(rb_eArgError, "Expected third arg to be a MusicPlayer.");
+    
+    TypedData_Get_Struct(self, RecorderData, &recorder_type, recorder);
+    if (recorder->player) rb_raise(rb_eRuntimeError, "MIDIRecorder is already initialized.");
+    
+    if (FIXNUM_P(rb_source)) {
+        recorder_attach(&recorder->rec, FIX2INT(rb_source));
+    } else if (rb_respond_to(rb_source, rb_intern("fileno"))) {
+        rb_iv_set(self, "@io", rb_source);
+        recorder_attach(&recorder->rec, NUM2INT(rb_funcall(rb_source, rb_intern("fileno"), 0)));
+    } else {
+        rb_path = rb_get_path(rb_source);
+        if (recorder_open(&recorder->rec, StringValueCStr(rb_path)) < 0)
+            rb_sys_fail(StringValueCStr(rb_path));
+    }
+    
+    rb_iv_set(self, "@track", rb_track);
+    rb_iv_set(self, "@player", rb_player);
+    recorder->track = track_get(rb_track);
+    sequence_user_link(&recorder->user, recorder->track->sequence);
+    TypedData_Get_Struct(rb_player, PlayerData, &player_type, recorder->player);
+    recorder->player->refs++;
+    return self;
+}
+
+static RecorderData *
+recorder_get (VALUE self)
+{
+    RecorderData *recorder;
+    TypedData_Get_Struct(self, RecorderData, &recorder_type, recorder);
+    if (!recorder->player) rb_raise(rb_eRuntimeError, "MIDIRecorder is not initialized.");
+    return recorder;
+}
+
+static VALUE
+recorder_start_rb (VALUE self)
+{
+    RecorderData *recorder = recorder_get(self);
+    if (recorder->rec.fd < 0) rb_raise(rb_eIOError, "closed MIDI recorder");
+    /* Settle which clock to read before the thread starts reading it. */
+    player_engine(rb_iv_get(self, "@player"));
+    if (recorder_start(&recorder->rec, recorder_clock, recorder->player) < 0)
+        rb_sys_fail("pthread_create");
+    return Qnil;
+}
+
+static void *
+recorder_stop_nogvl (void *rec)
+{
+    recorder_stop((Recorder *) rec);
+    return NULL;
+}
+
+static VALUE
+recorder_stop_rb (VALUE self)
+{
+    RecorderData *recorder = recorder_get(self);
+    rb_thread_call_without_gvl(recorder_stop_nogvl, &recorder->rec, RUBY_UBF_IO, NULL);
+    return Qnil;
+}
+
+static VALUE
+recorder_is_recording (VALUE self)
+{
+    return recorder_get(self)->rec.running ? Qtrue : Qfalse;
+}
+
+/* Inserts every recorded event waiting in the ring into the track, and
+ * returns how many were inserted. Each batch is inserted under the
+ * sequence's lock, as the player's engine may be playing the track. */
+static VALUE
+recorder_drain_rb (VALUE self)
+{
+    RecorderData *recorder = recorder_get(self);
+    RecorderEvent events[RECORDER_BATCH], *ev;
+    MIDINoteMessage note;
+    MIDIChannelMessage msg;
+    size_t n, i, total = 0;
+    OSStatus err;
+    
+    while ((n = recorder_drain(&recorder->rec, events, RECORDER_BATCH)) > 0) {
+        pthread_mutex_lock(&recorder->track->sequence->lock);
+        for (i = 0; i < n; i++) {
+            ev = &events[i];
+            if ((ev->status & 0xF0) == 0x90) {
+                note.channel = ev->status & 0x0F;
+                note.note = ev->data1;
+                note.velocity = ev->data2;
+                note.releaseVelocity = ev->release;
+                note.duration = ev->duration;
+                require_noerr( err = MusicTrackNewMIDINoteEvent(recorder->track->track, ev->beat, &note), fail );
+                track_touch(recorder->track, ev->beat, kMusicEventType_MIDINoteMessage, &note);
+            } else {
+                msg.status = ev->status;
+                msg.data1 = ev->data1;
+                msg.data2 = ev->data2;
+                msg.reserved = 0;
+                require_noerr( err = MusicTrackNewMIDIChannelEvent(recorder->track->track, ev->beat, &msg), fail );
+                track_touch(recorder->track, ev->beat, kMusicEventType_MIDIChannelMessage, &msg);
+            }
+        }
+        pthread_mutex_unlock(&recorder->track->sequence->lock);
+        sequence_account(recorder->track->sequence, n);
+        total += n;
+    }
+    return ULONG2NUM(total);
+    
+    fail:
+    pthread_mutex_unlock(&recorder->track->sequence->lock);
+    sequence_account(recorder->track->sequence, i);
+    RAISE_OSSTATUS(err, "MIDIRecorder#drain");
+}
+
+/* Number of events dropped because the ring was full. */
+static VALUE
+recorder_get_overruns (VALUE self)
+{
+    return ULL2NUM(recorder_get(self)->rec.overruns);
+}
+
+/* The descriptor which becomes readable when there are events to drain. */
+static VALUE
+recorder_get_notify_fd (VALUE self)
+{
+    return INT2FIX(recorder_get(self)->rec.notify[0]);
+}
+
+static VALUE
+recorder_close_rb (VALUE self)
+{
+    RecorderData *recorder = recorder_get(self);
+    rb_thread_call_without_gvl(recorder_stop_nogvl, &recorder->rec, RUBY_UBF_IO, NULL);
+    recorder_close(&recorder->rec);
+    return Qnil;
+}
+
+/* TempoMap defns */
+
+/*
+ * The tempo track as a table of (beat, seconds, bpm) entries, for
+ * converting beats to seconds with a binary search. The first entry is
+ * always at beat zero.
+ */
+typedef struct {
+    MusicTimeStamp *beats;
+    Float64 *secs;
+    Float64 *bpm;
+    UInt32 count;
+    UInt32 capacity;
+} TempoMap;
+
+#define TEMPO_MAP_DEFAULT_BPM 120.0
+
+static void
+tempo_map_free (TempoMap *map)
+{
+    xfree(map->beats);
+    xfree(map->secs);
+    xfree(map->bpm);
+    MEMZERO(map, TempoMap, 1);
+}
+
+static void
+tempo_map_push (TempoMap *map, MusicTimeStamp beat, Float64 bpm)
+{
+    UInt32 n = map->count;
+    Float64 secs = 0.0;
+    
+    if (n > 0) {
+        secs = map->secs[n - 1] + (beat - map->beats[n - 1]) * 60.0 / map->bpm[n - 1];
+        if (beat == map->beats[n - 1]) {
+            map->bpm[n - 1] = bpm;
+            return;
+        }
+    }
+    if (n == map->capacity) {
+        map->capacity = map->capacity ? map->capacity * 2 : 16;
+        REALLOC_N(map->beats, MusicTimeStamp, map->capacity);
+        REALLOC_N(map->secs, Float64, map->capacity);
+        REALLOC_N(map->bpm, Float64, map->capacity);
+    }
+    map->beats[n] = beat;
+    map->secs[n] = secs;
+    map->bpm[n] = bpm;
+    map->count++;
+}
+
+static OSStatus
+tempo_map_init (TempoMap *map, MusicSequence seq)
+{
+    MusicTrack track;
+    MusicEventIterator iter;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    Boolean has_current;
+    OSStatus err;
+    
+    MEMZERO(map, TempoMap, 1);
+    tempo_map_push(map, 0.0, TEMPO_MAP_DEFAULT_BPM);
+    require_noerr( err = MusicSequenceGetTempoTrack(seq, &track), fail );
+    require_noerr( err = NewMusicEventIterator(track, &iter), fail );
+    for (;;) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+        if (!has_current) break;
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, NULL), dispose );
+        if (type == kMusicEventType_ExtendedTempo && ts >= 0.0)
+            tempo_map_push(map, ts, ((const ExtendedTempoEvent *) data)->bpm);
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+    }
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+static Float64
+tempo_map_secs (const TempoMap *map, MusicTimeStamp beat)
+{
+    UInt32 lo = 0, hi = map->count, mid;
+    
+    /* Find the last entry at or before the beat. */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (map->beats[mid] <= beat) lo = mid;
+        else hi = mid;
+    }
+    return map->secs[lo] + (beat - map->beats[lo]) * 60.0 / map->bpm[lo];
+}
+
+/* TimeSignature defns */
+
+/* A time signature meta event carries the numerator, the denominator as a
+ * power of two, MIDI clocks per click and 32nd notes per quarter note. */
+#define META_TIME_SIGNATURE 0x58
+
+#define BAR_BEAT_TIME_FORMAT "lSS"
+#define DEFAULT_SUBBEAT_DIVISOR 480
+
+static OSStatus
+signatures_build (SequenceData *seq)
+{
+    MusicTrack track;
+    MusicEventIterator iter;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    const MIDIMetaEvent *meta;
+    Boolean has_current;
+    OSStatus err;
+    
+    signature_map_free(&seq->signatures);
+    if (signature_map_init(&seq->signatures) < 0) return kAudio_MemFullError;
+    require_noerr( err = MusicSequenceGetTempoTrack(seq->seq, &track), fail );
+    require_noerr( err = NewMusicEventIterator(track, &iter), fail );
+    for (;;) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+        if (!has_current) break;
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, NULL), dispose );
+        meta = (const MIDIMetaEvent *) data;
+        if (type == kMusicEventType_Meta && ts >= 0.0 &&
+            meta->metaEventType == META_TIME_SIGNATURE && meta->dataLength >= 2 && meta->data[1] < 8) {
+            if (signature_map_push(&seq->signatures, ts, meta->data[0], 1 << meta->data[1]) < 0) {
+                err = kAudio_MemFullError;
+                goto dispose;
+            }
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+    }
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/* The sequence's time signatures, rebuilt if the tempo track has changed. */
+static const SignatureMap *
+sequence_signatures (SequenceData *seq)
+{
+    OSStatus err;
+    
+    if (!seq->signatures_valid) {
+        require_noerr( err = signatures_build(seq), fail );
+        seq->signatures_valid = TRUE;
+    }
+    return &seq->signatures;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequence time signatures");
+}
+
+static UInt16
+subbeat_divisor (VALUE rb_divisor)
+{
+    long divisor;
+    if (NIL_P(rb_divisor)) return DEFAULT_SUBBEAT_DIVISOR;
+    divisor = NUM2LONG(rb_divisor);
+    if (divisor < 1 || divisor > 0xFFFF)
+        rb_raise(rb_eArgError, "Expected a subbeat divisor from 1 to 65535.");
+    return (UInt16) divisor;
+}
+
+static VALUE
+sequence_time_signatures (VALUE self)
+{
+    SequenceData *seq;
+    const SignatureMap *map;
+    VALUE rb_sigs, rb_sig;
+    UInt32 i;
+    
+    seq = sequence_get(self);
+    map = sequence_signatures(seq);
+    rb_sigs = rb_ary_new2(map->count);
+    for (i = 0; i < map->count; i++) {
+        rb_sig = rb_hash_new();
+        rb_hash_aset(rb_sig, rb_sBeat, rb_float_new(map->entries[i].beat));
+        rb_hash_aset(rb_sig, rb_sBar, LL2NUM(map->entries[i].bar + 1));
+        rb_hash_aset(rb_sig, rb_sNumerator, UINT2NUM(map->entries[i].numerator));
+        rb_hash_aset(rb_sig, rb_sDenominator, UINT2NUM(map->entries[i].denominator));
+        rb_ary_push(rb_sigs, rb_sig);
+    }
+    return rb_sigs;
+}
+
+static VALUE
+sequence_beats_to_bar_beat_time (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_beats, rb_divisor;
+    SequenceData *seq;
+    BarBeatTime pos;
+    UInt16 divisor;
+    
+    rb_scan_args(argc, argv, "11", &rb_beats, &rb_divisor);
+    if (!PRIM_NUM_P(rb_beats)) rb_raise(rb_eArgError, "Expected first arg to be a number.");
+    divisor = subbeat_divisor(rb_divisor);
+    seq = sequence_get(self);
+    signature_map_bar_beat(sequence_signatures(seq), NUM2DBL(rb_beats), divisor, &pos);
+    return rb_ary_new3(3, INT2NUM(pos.bar), UINT2NUM(pos.beat), UINT2NUM(pos.subbeat));
+}
+
+/* Convert a String of packed native doubles to packed BarBeatTimes. */
+static VALUE
+sequence_beats_to_bar_beat_times (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_packed, rb_divisor, rb_str;
+    SequenceData *seq;
+    const SignatureMap *map;
+    const char *src;
+    BarBeatTime *pos;
+    MusicTimeStamp beats;
+    UInt16 divisor;
+    long i, count;
+    
+    rb_scan_args(argc, argv, "11", &rb_packed, &rb_divisor);
+    StringValue(rb_packed);
+    if (RSTRING_LEN(rb_packed) % sizeof(MusicTimeStamp))
+        rb_raise(rb_eArgError, "Expected a String of packed doubles.");
+    divisor = subbeat_divisor(rb_divisor);
+    seq = sequence_get(self);
+    map = sequence_signatures(seq);
+    
+    count = RSTRING_LEN(rb_packed) / sizeof(MusicTimeStamp);
+    rb_str = rb_str_new(NULL, count * sizeof(BarBeatTime));
+    src = RSTRING_PTR(rb_packed);
+    pos = (BarBeatTime *) RSTRING_PTR(rb_str);
+    for (i = 0; i < count; i++) {
+        memcpy(&beats, src + i * sizeof(MusicTimeStamp), sizeof(MusicTimeStamp));
+        signature_map_bar_beat(map, beats, divisor, &pos[i]);
+    }
+    return rb_str;
+}
+
+static VALUE
+sequence_bar_beat_time_to_beats (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_pos, rb_divisor;
+    SequenceData *seq;
+    BarBeatTime pos;
+    UInt16 divisor;
+    long len;
+    
+    rb_scan_args(argc, argv, "11", &rb_pos, &rb_divisor);
+    Check_Type(rb_pos, T_ARRAY);
+    len = RARRAY_LEN(rb_pos);
+    if (len < 1 || len > 3)
+        rb_raise(rb_eArgError, "Expected [bar, beat, subbeat].");
+    divisor = subbeat_divisor(rb_divisor);
+    pos.bar = NUM2INT(rb_ary_entry(rb_pos, 0));
+    pos.beat = len > 1 ? NUM2USHORT(rb_ary_entry(rb_pos, 1)) : 1;
+    pos.subbeat = len > 2 ? NUM2USHORT(rb_ary_entry(rb_pos, 2)) : 0;
+    seq = sequence_get(self);
+    return rb_float_new(signature_map_beats(sequence_signatures(seq), &pos, divisor));
+}
+
+/* RenderCache defns */
+
+static void
+render_cache_free (Cache *cache)
+{
+    if (cache) {
+        cache_free(cache);
+        xfree(cache);
+    }
+}
+
+static size_t
+render_cache_memsize (const void *ptr)
+{
+    const Cache *cache = (const Cache *) ptr;
+    return sizeof(Cache) + cache->bucket_count * sizeof(void *) + cache->bytes;
+}
+
+static const rb_data_type_t render_cache_type = {
+    "AudioToolbox::RenderCache",
+    { 0, (RUBY_DATA_FUNC) render_cache_free, render_cache_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+#define RENDER_CACHE_DEFAULT_BYTES (64 * 1024 * 1024)
+
+static VALUE
+render_cache_alloc (VALUE class)
+{
+    Cache *cache = ALLOC(Cache);
+    cache_init(cache, RENDER_CACHE_DEFAULT_BYTES);
+    return TypedData_Wrap_Struct(class, &render_cache_type, cache);
+}
+
+/* Accepts the cap on cached sample data in bytes. */
+static VALUE
+render_cache_init (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_max;
+    Cache *cache;
+    
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    rb_scan_args(argc, argv, "01", &rb_max);
+    if (!NIL_P(rb_max)) cache_set_max_bytes(cache, NUM2SIZET(rb_max));
+    return self;
+}
+
+static VALUE
+render_cache_get_max_size (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return SIZET2NUM(cache->max_bytes);
+}
+
+static VALUE
+render_cache_set_max_size (VALUE self, VALUE rb_max)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    cache_set_max_bytes(cache, NUM2SIZET(rb_max));
+    return rb_max;
+}
+
+static VALUE
+render_cache_get_size (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return SIZET2NUM(cache->bytes);
+}
+
+static VALUE
+render_cache_get_count (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return SIZET2NUM(cache->count);
+}
+
+static VALUE
+render_cache_get_hits (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return ULL2NUM(cache->hits);
+}
+
+static VALUE
+render_cache_get_misses (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return ULL2NUM(cache->misses);
+}
+
+static VALUE
+render_cache_get_evictions (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    return ULL2NUM(cache->evictions);
+}
+
+static VALUE
+render_cache_clear (VALUE self)
+{
+    Cache *cache;
+    TypedData_Get_Struct(self, Cache, &render_cache_type, cache);
+    cache_clear(cache);
+    return self;
+}
+
+/* Render defns */
+
+/*
+ * Sequences are rendered track by track in segments of RENDER_SEGMENT_FRAMES.
+ * Voice stealing is decided once for the whole track, by playing it through
+ * the voice pool without rendering, which finds the frame at which each
+ * stolen note is cut off. Each segment then starts with a silent voice pool
+ * and replays the notes sounding in it from the earliest one's start,
+ * together with the controller changes from there on and the controller
+ * state there, cutting off stolen notes where the whole track did, so a
+ * segment sounds the same whether or not its neighbours are rendered. A
+ * segment's samples therefore depend only on those events, and they are
+ * cached under a digest of the events' positions relative to the segment,
+ * which takes in tempo changes, the release tails of earlier notes and the
+ * cuts.
+ *
+ * Every event is positioned in frames from the tempo map, and the synth
+ * renders in spans which end exactly at the next event, so notes and
+ * controllers land on their sample however long the segment is.
+ */
+#define RENDER_SEGMENT_FRAMES 32768
+#define RENDER_DEFAULT_RATE 44100
+#define RENDER_DEFAULT_POLYPHONY 64
+#define RENDER_MAX_POLYPHONY 4096
+
+typedef struct {
+    int64_t frame;
+    UInt8 channel;
+    UInt8 control;      /* a SynthControl */
+    UInt16 value;
+} RenderControl;
+
+typedef struct {
+    SynthNote *notes;
+    size_t count;
+    size_t capacity;
+    RenderControl *controls;
+    size_t control_count;
+    size_t control_capacity;
+} RenderTrack;
+
+typedef struct {
+    RenderTrack *tracks;
+    UInt32 track_count;
+    UInt32 rate;
+    int64_t frames;
+    Cache *cache;
+    Synth synth;
+    float *out;
+} Render;
+
+/* The events replayed to render one segment of a track. */
+typedef struct {
+    const size_t *notes;            /* indices, in order of start */
+    size_t count;
+    const int64_t *stolen;          /* frame each note is cut off, or INT64_MAX */
+    const int64_t *victims;         /* note each one steals the voice of, or -1 */
+    const RenderControl *controls;  /* from the first note's start on */
+    size_t control_count;
+    SynthChannel channels[SYNTH_CHANNELS];
+    int64_t from;
+    uint32_t frames;
+} RenderSegment;
+
+static void
+render_add_note (RenderTrack *track, const SynthNote *note)
+{
+    if (track->count == track->capacity) {
+        track->capacity = track->capacity ? track->capacity * 2 : 64;
+        REALLOC_N(track->notes, SynthNote, track->capacity);
+    }
+    track->notes[track->count++] = *note;
+}
+
+static void
+render_add_control (RenderTrack *track, int64_t frame, const MIDIChannelMessage *msg)
+{
+    RenderControl *ctl;
+    
+    switch (msg->status & 0xF0) {
+    case 0xB0:
+        if (msg->data1 != 7 && msg->data1 != 11) return;
+        break;
+    case 0xE0:
+        break;
+    default:
+        return;
+    }
+    if (track->control_count == track->control_capacity) {
+        track->control_capacity = track->control_capacity ? track->control_capacity * 2 : 64;
+        REALLOC_N(track->controls, RenderControl, track->control_capacity);
+    }
+    ctl = &track->controls[track->control_count++];
+    ctl->frame = frame;
+    ctl->channel = msg->status & 0x0F;
+    if ((msg->status & 0xF0) == 0xE0) {
+        ctl->control = SYNTH_PITCH_BEND;
+        ctl->value = (UInt16) (((msg->data2 & 0x7F) << 7) | (msg->data1 & 0x7F));
+    } else {
+        ctl->control = msg->data1 == 7 ? SYNTH_VOLUME : SYNTH_EXPRESSION;
+        ctl->value = msg->data2 & 0x7F;
+    }
+}
+
+static void
+render_apply_control (SynthChannel *channels, const RenderControl *ctl)
+{
+    SynthChannel *ch = &channels[ctl->channel];
+    switch (ctl->control) {
+    case SYNTH_VOLUME:     ch->volume = (uint8_t) ctl->value; break;
+    case SYNTH_EXPRESSION: ch->expression = (uint8_t) ctl->value; break;
+    case SYNTH_PITCH_BEND: ch->bend = ctl->value; break;
+    }
+}
+
+/* Gather the audible notes and controller changes of every track,
+ * positioned in frames. */
+static OSStatus
+render_collect (Render *render, MusicSequence seq, MusicTimeStamp length)
+{
+    TempoMap map;
+    Merge merge;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    const MIDINoteMessage *msg;
+    SInt16 index;
+    SynthNote note;
+    int64_t end;
+    OSStatus err;
+    
+    require_noerr( err = tempo_map_init(&map, seq), fail );
+    require_noerr( err = merge_init(&merge, seq, FALSE), free_map );
+    
+    while (merge.count > 0) {
+        require_noerr( err = merge_current(&merge, &ts, &index, &type, &data), dispose );
+        if (length >= 0.0 && ts >= length) break;
+        if (type == kMusicEventType_MIDINoteMessage) {
+            msg = (const MIDINoteMessage *) data;
+            note.start = llround(tempo_map_secs(&map, ts) * render->rate);
+            note.length = llround(tempo_map_secs(&map, ts + msg->duration) * render->rate) - note.start;
+            note.channel = msg->channel & 0x0F;
+            note.note = msg->note & 0x7F;
+            note.velocity = msg->velocity & 0x7F;
+            if (note.velocity > 0 && note.length > 0) {
+                render_add_note(&render->tracks[index], &note);
+                end = synth_note_end(&note, render->rate);
+                if (length < 0.0 && end > render->frames) render->frames = end;
+            }
+        } else if (type == kMusicEventType_MIDIChannelMessage) {
+            render_add_control(&render->tracks[index], llround(tempo_map_secs(&map, ts) * render->rate),
+                               (const MIDIChannelMessage *) data);
+        }
+        require_noerr( err = merge_next(&merge), dispose );
+    }
+    if (length >= 0.0)
+        render->frames = llround(tempo_map_secs(&map, length) * render->rate);
+    
+    dispose:
+    merge_dispose(&merge);
+    free_map:
+    tempo_map_free(&map);
+    fail:
+    return err;
+}
+
+/* Returns -1 if the key could not be computed. */
+static int
+render_segment_key (const Render *render, const RenderTrack *track, const RenderSegment *segment,
+                    DigestBuffer *buf, Digest *key)
+{
+    const SynthNote *note;
+    const RenderControl *ctl;
+    size_t i;
+    
+    buf->length = 0;
+    digest_buffer_put(buf, "Render/4", 8);
+    digest_buffer_put_u32(buf, render->rate);
+    digest_buffer_put_u32(buf, render->synth.polyphony);
+    digest_buffer_put_u8(buf, (uint8_t) render->synth.steal);
+    digest_buffer_put_u32(buf, segment->frames);
+    for (i = 0; i < SYNTH_CHANNELS; i++) {
+        digest_buffer_put_u8(buf, segment->channels[i].volume);
+        digest_buffer_put_u8(buf, segment->channels[i].expression);
+        digest_buffer_put_u32(buf, segment->channels[i].bend);
+    }
+    for (i = 0; i < segment->count; i++) {
+        note = &track->notes[segment->notes[i]];
+        digest_buffer_put_u64(buf, (uint64_t) (note->start - segment->from));
+        digest_buffer_put_u64(buf, (uint64_t) note->length);
+        digest_buffer_put_u64(buf, segment->stolen[segment->notes[i]] == INT64_MAX ? UINT64_MAX :
+                              (uint64_t) (segment->stolen[segment->notes[i]] - segment->from));
+        digest_buffer_put_u8(buf, note->channel);
+        digest_buffer_put_u8(buf, note->note);
+        digest_buffer_put_u8(buf, note->velocity);
+    }
+    for (i = 0; i < segment->control_count; i++) {
+        ctl = &segment->controls[i];
+        digest_buffer_put_u64(buf, (uint64_t) (ctl->frame - segment->from));
+        digest_buffer_put_u8(buf, ctl->channel);
+        digest_buffer_put_u8(buf, ctl->control);
+        digest_buffer_put_u32(buf, ctl->value);
+    }
+    return digest_buffer_finish(buf, key);
+}
+
+/* Run the synth up to frame, rendering whatever falls within the segment. */
+static void
+render_advance (Synth *synth, float *out, int64_t from, int64_t frame)
+{
+    if (synth->clock < from && synth->clock < frame)
+        synth_render(synth, NULL, (uint32_t) ((frame < from ? frame : from) - synth->clock));
+    if (synth->clock < frame)
+        synth_render(synth, out + (synth->clock - from), (uint32_t) (frame - synth->clock));
+}
+
+static void
+render_segment (Render *render, const RenderTrack *track, const RenderSegment *segment, float *out)
+{
+    Synth *synth = &render->synth;
+    const SynthNote *note;
+    const RenderControl *ctl;
+    size_t i = 0, k = 0;
+    int64_t victim;
+    
+    synth_reset(synth, track->notes[segment->notes[0]].start);
+    MEMCPY(synth->channels, segment->channels, SynthChannel, SYNTH_CHANNELS);
+    
+    /* Controllers apply before notes which start on the same frame. */
+    while (i < segment->count || k < segment->control_count) {
+        note = i < segment->count ? &track->notes[segment->notes[i]] : NULL;
+        ctl = k < segment->control_count ? &segment->controls[k] : NULL;
+        if (ctl && (!note || ctl->frame <= note->start)) {
+            render_advance(synth, out, segment->from, ctl->frame);
+            synth_control(synth, ctl->channel, (SynthControl) ctl->control, ctl->value);
+            k++;
+        } else {
+            render_advance(synth, out, segment->from, note->start);
+            /* The pool holds no more than the whole track's did, so the
+             * note only takes the voice the whole track gave it. */
+            if ((victim = segment->victims[segment->notes[i]]) >= 0) synth_cut(synth, (uint32_t) victim);
+            synth_note_on(synth, note, (uint32_t) segment->notes[i]);
+            i++;
+        }
+    }
+    render_advance(synth, out, segment->from, segment->from + segment->frames);
+}
+
+/* Play the whole track through the voice pool without rendering, noting
+ * for each note the frame its voice is stolen and the note it steals from. */
+static void
+render_steal (Render *render, const RenderTrack *track, int64_t *stolen, int64_t *victims)
+{
+    Synth *synth = &render->synth;
+    const SynthNote *note;
+    const RenderControl *ctl;
+    size_t i, k = 0;
+    int64_t victim;
+    
+    for (i = 0; i < track->count; i++) {
+        stolen[i] = INT64_MAX;
+        victims[i] = -1;
+    }
+    synth_reset(synth, 0);
+    i = 0;
+    while (i < track->count || k < track->control_count) {
+        note = i < track->count ? &track->notes[i] : NULL;
+        ctl = k < track->control_count ? &track->controls[k] : NULL;
+        if (ctl && (!note || ctl->frame <= note->start)) {
+            if (synth->clock < ctl->frame) synth_render(synth, NULL, (uint32_t) (ctl->frame - synth->clock));
+            synth_control(synth, ctl->channel, (SynthControl) ctl->control, ctl->value);
+            k++;
+        } else {
+            if (synth->clock < note->start) synth_render(synth, NULL, (uint32_t) (note->start - synth->clock));
+            if ((victim = synth_note_on(synth, note, (uint32_t) i)) >= 0) {
+                stolen[victim] = note->start;
+                victims[i] = victim;
+            }
+            i++;
+        }
+    }
+}
+
+static void
+render_track (Render *render, const RenderTrack *track, float *scratch, DigestBuffer *buf)
+{
+    int64_t segments = (render->frames + RENDER_SEGMENT_FRAMES - 1) / RENDER_SEGMENT_FRAMES;
+    int64_t seg, first, last, start, end, *stolen, *victims;
+    size_t *offsets, *notes, *fill, i, applied = 0, due = 0;
+    SynthChannel channels[SYNTH_CHANNELS];
+    RenderSegment segment;
+    const float *cached;
+    uint32_t cached_frames, j;
+    Boolean keyed;
+    Digest key;
+    
+    stolen = ALLOC_N(int64_t, track->count ? track->count : 1);
+    victims = ALLOC_N(int64_t, track->count ? track->count : 1);
+    render_steal(render, track, stolen, victims);
+    segment.stolen = stolen;
+    segment.victims = victims;
+    
+    /* Bucket the notes by the segments they sound in, up to any cut. */
+    offsets = ZALLOC_N(size_t, segments + 1);
+    for (i = 0; i < track->count; i++) {
+        end = synth_note_end(&track->notes[i], render->rate);
+        if (stolen[i] < end) end = stolen[i];
+        if (end <= track->notes[i].start) continue;
+        first = track->notes[i].start / RENDER_SEGMENT_FRAMES;
+        last = (end - 1) / RENDER_SEGMENT_FRAMES;
+        if (last >= segments) last = segments - 1;
+        for (seg = first; seg <= last; seg++) offsets[seg + 1]++;
+    }
+    for (seg = 0; seg < segments; seg++) offsets[seg + 1] += offsets[seg];
+    notes = ALLOC_N(size_t, offsets[segments] ? offsets[segments] : 1);
+    fill = ALLOC_N(size_t, segments ? segments : 1);
+    MEMCPY(fill, offsets, size_t, segments);
+    for (i = 0; i < track->count; i++) {
+        end = synth_note_end(&track->notes[i], render->rate);
+        if (stolen[i] < end) end = stolen[i];
+        if (end <= track->notes[i].start) continue;
+        first = track->notes[i].start / RENDER_SEGMENT_FRAMES;
+        last = (end - 1) / RENDER_SEGMENT_FRAMES;
+        if (last >= segments) last = segments - 1;
+        for (seg = first; seg <= last; seg++) notes[fill[seg]++] = i;
+    }
+    
+    synth_reset(&render->synth, 0);
+    MEMCPY(channels, render->synth.channels, SynthChannel, SYNTH_CHANNELS);
+    for (seg = 0; seg < segments; seg++) {
+        if (offsets[seg] == offsets[seg + 1]) continue;
+        segment.notes = notes + offsets[seg];
+        segment.count = offsets[seg + 1] - offsets[seg];
+        segment.from = seg * RENDER_SEGMENT_FRAMES;
+        segment.frames = (uint32_t) (render->frames - segment.from < RENDER_SEGMENT_FRAMES ?
+                                     render->frames - segment.from : RENDER_SEGMENT_FRAMES);
+        
+        /* Any note sounding in a later segment which started before this
+         * one also sounds in this one, so the replay starts never move
+         * back and the controller state can be carried forward. */
+        start = track->notes[segment.notes[0]].start;
+        for (; applied < track->control_count && track->controls[applied].frame < start; applied++)
+            render_apply_control(channels, &track->controls[applied]);
+        if (due < applied) due = applied;
+        while (due < track->control_count && track->controls[due].frame < segment.from + segment.frames) due++;
+        MEMCPY(segment.channels, channels, SynthChannel, SYNTH_CHANNELS);
+        segment.controls = track->controls + applied;
+        segment.control_count = due - applied;
+        
+        keyed = render->cache && render_segment_key(render, track, &segment, buf, &key) == 0;
+        if (keyed) {
+            cached = cache_get(render->cache, &key, &cached_frames);
+            if (cached && cached_frames == segment.frames) {
+                for (j = 0; j < segment.frames; j++) render->out[segment.from + j] += cached[j];
+                continue;
+            }
+        }
+        
+        MEMZERO(scratch, float, segment.frames);
+        render_segment(render, track, &segment, scratch);
+        for (j = 0; j < segment.frames; j++) render->out[segment.from + j] += scratch[j];
+        /* The cache is an optimization, so running out of memory for it is
+         * not an error. */
+        if (keyed) cache_put(render->cache, &key, scratch, segment.frames);
+    }
+    
+    xfree(fill);
+    xfree(notes);
+    xfree(offsets);
+    xfree(victims);
+    xfree(stolen);
+}
+
+/*
+ * Renders the audible tracks to a String of native-endian 32-bit float
+ * mono samples. Options are :sample_rate, :length in beats, which is
+ * required when a track loops forever, :cache, a RenderCache which lets
+ * unchanged segments be reused from earlier renders, :polyphony, the
+ * number of voices per track, and :steal, which is :oldest or :quietest
+ * and picks the voice a note takes when all are busy. Channel volume (7),
+ * expression (11) and pitch bend, over two semitones, are applied.
+ */
+static VALUE
+sequence_render (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_options, rb_rate = Qnil, rb_length = Qnil, rb_cache = Qnil, rb_out;
+    VALUE rb_polyphony = Qnil, rb_steal = Qnil;
+    MusicSequence *seq;
+    MusicTimeStamp length = -1.0;
+    UInt32 polyphony = RENDER_DEFAULT_POLYPHONY;
+    SynthSteal steal = SYNTH_STEAL_OLDEST;
+    Render render;
+    DigestBuffer buf;
+    UInt32 i;
+    float *scratch;
+    Boolean unbounded;
+    Merge merge;
+    OSStatus err;
+    
+    seq = &sequence_get(self)->seq;
+    rb_scan_args(argc, argv, "01", &rb_options);
+    MEMZERO(&render, Render, 1);
+    render.rate = RENDER_DEFAULT_RATE;
+    if (!NIL_P(rb_options)) {
+        rb_rate = rb_hash_aref(rb_options, rb_sSampleRate);
+        rb_length = rb_hash_aref(rb_options, rb_sLength);
+        rb_cache = rb_hash_aref(rb_options, rb_sCache);
+        rb_polyphony = rb_hash_aref(rb_options, rb_sPolyphony);
+        rb_steal = rb_hash_aref(rb_options, rb_sSteal);
+    }
+    if (!NIL_P(rb_rate)) {
+        if (NUM2LONG(rb_rate) <= 0)
+            rb_raise(rb_eArgError, "Expected :sample_rate to be positive.");
+        render.rate = NUM2UINT(rb_rate);
+    }
+    if (!NIL_P(rb_length)) {
+        length = NUM2DBL(rb_length);
+        if (length < 0.0) rb_raise(rb_eArgError, "Expected :length to be non-negative.");
+    }
+    if (!NIL_P(rb_cache))
+        TypedData_Get_Struct(rb_cache, Cache, &render_cache_type, render.cache);
+    if (!NIL_P(rb_polyphony)) {
+        if (NUM2LONG(rb_polyphony) < 1 || NUM2LONG(rb_polyphony) > RENDER_MAX_POLYPHONY)
+            rb_raise(rb_eArgError, "Expected :polyphony to be between 1 and %d.", RENDER_MAX_POLYPHONY);
+        polyphony = NUM2UINT(rb_polyphony);
+    }
+    if (rb_steal == rb_sQuietest)
+        steal = SYNTH_STEAL_QUIETEST;
+    else if (!NIL_P(rb_steal) && rb_steal != rb_sOldest)
+        rb_raise(rb_eArgError, "Expected :steal to be :oldest or :quietest.");
+    
+    require_noerr( err = merge_init(&merge, *seq, FALSE), fail );
+    unbounded = merge.unbounded;
+    merge_dispose(&merge);
+    if (unbounded && length < 0.0)
+        rb_raise(rb_eArgError, "Expected :length for a sequence which loops forever.");
+    
+    require_noerr( err = MusicSequenceGetTrackCount(*seq, &render.track_count), fail );
+    render.tracks = ZALLOC_N(RenderTrack, render.track_count ? render.track_count : 1);
+    require_noerr( err = render_collect(&render, *seq, length), free_tracks );
+    
+    rb_out = rb_str_new(NULL, render.frames * sizeof(float));
+    render.out = (float *) RSTRING_PTR(rb_out);
+    MEMZERO(render.out, float, render.frames);
+    if (synth_init(&render.synth, polyphony, render.rate, steal) < 0) {
+        err = kAudio_MemFullError;
+        goto free_tracks;
+    }
+    scratch = ALLOC_N(float, RENDER_SEGMENT_FRAMES);
+    digest_buffer_init(&buf);
+    for (i = 0; i < render.track_count; i++)
+        if (render.tracks[i].count > 0) render_track(&render, &render.tracks[i], scratch, &buf);
+    digest_buffer_free(&buf);
+    xfree(scratch);
+    synth_free(&render.synth);
+    
+    free_tracks:
+    for (i = 0; i < render.track_count; i++) {
+        xfree(render.tracks[i].notes);
+        xfree(render.tracks[i].controls);
+    }
+    xfree(render.tracks);
+    require_noerr( err, fail );
+    return rb_out;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequence#render");
+}
+
+/* Analysis defns */
+
+/*
+ * MusicSequence#analyze scans each track on a thread of the pool, keeping
+ * per-track counts and the sorted start and end beats of its notes, then
+ * sums the counts and sweeps the merged note boundaries for the peak
+ * polyphony across all tracks.
+ *
+ * The pool runs without the GVL, holding the sequence's lock so that no
+ * Ruby thread can edit the tracks being read. Jobs allocate with malloc,
+ * since the GVL is not theirs.
+ */
+typedef struct {
+    MusicTrack track;
+    OSStatus err;
+    size_t events;
+    size_t pitches[128];
+    size_t velocities[128];
+    size_t channels[16];
+    MusicTimeStamp *starts;
+    MusicTimeStamp *ends;
+    size_t notes;
+    size_t capacity;
+    MusicTimeStamp end;
+} AnalyzeJob;
+
+static int
+analyze_compare (const void *a, const void *b)
+{
+    MusicTimeStamp x = *(const MusicTimeStamp *) a, y = *(const MusicTimeStamp *) b;
+    return x < y ? -1 : x > y;
+}
+
+static OSStatus
+analyze_add_note (AnalyzeJob *job, MusicTimeStamp start, MusicTimeStamp end)
+{
+    MusicTimeStamp *starts, *ends;
+    size_t capacity;
+    
+    if (job->notes == job->capacity) {
+        capacity = job->capacity ? job->capacity * 2 : 256;
+        if (!(starts = (MusicTimeStamp *) realloc(job->starts, capacity * sizeof(MusicTimeStamp))))
+            return kAudio_MemFullError;
+        job->starts = starts;
+        if (!(ends = (MusicTimeStamp *) realloc(job->ends, capacity * sizeof(MusicTimeStamp))))
+            return kAudio_MemFullError;
+        job->ends = ends;
+        job->capacity = capacity;
+    }
+    job->starts[job->notes] = start;
+    job->ends[job->notes] = end;
+    job->notes++;
+    return noErr;
+}
+
+static OSStatus
+analyze_track (AnalyzeJob *job)
+{
+    MusicEventIterator iter;
+    MusicTimeStamp ts, end;
+    MusicEventType type;
+    const void *data;
+    const MIDINoteMessage *note;
+    Boolean has_current;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(job->track, &iter), fail );
+    for (;;) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+        if (!has_current) break;
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, NULL), dispose );
+        job->events++;
+        if (ts > job->end) job->end = ts;
+        
+        switch (type) {
+        case kMusicEventType_MIDINoteMessage:
+            note = (const MIDINoteMessage *) data;
+            job->pitches[note->note & 0x7F]++;
+            job->velocities[note->velocity & 0x7F]++;
+            job->channels[note->channel & 0x0F]++;
+            end = ts + note->duration;
+            if (end > job->end) job->end = end;
+            require_noerr( err = analyze_add_note(job, ts, end), dispose );
+            break;
+        case kMusicEventType_MIDIChannelMessage:
+            job->channels[((const MIDIChannelMessage *) data)->status & 0x0F]++;
+            break;
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+    }
+    /* Events come in order of their start; only the ends need sorting. */
+    qsort(job->ends, job->notes, sizeof(MusicTimeStamp), analyze_compare);
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+static void
+analyze_job (void *ctx, size_t index)
+{
+    AnalyzeJob *job = &((AnalyzeJob *) ctx)[index];
+    job->err = analyze_track(job);
+}
+
+typedef struct {
+    SequenceData *seq;
+    AnalyzeJob *jobs;
+    size_t count;
+    unsigned threads;
+} Analyze;
+
+/* Runs to completion, as the counts are of no use until every track is in. */
+static void *
+analyze_run (void *ctx)
+{
+    Analyze *analyze = (Analyze *) ctx;
+    pthread_mutex_lock(&analyze->seq->lock);
+    pool_run(analyze->threads, analyze->count, analyze_job, analyze->jobs, NULL);
+    pthread_mutex_unlock(&analyze->seq->lock);
+    return NULL;
+}
+
+/* The unread part of one track's sorted beats. The runs of every track are
+ * kept in a min-heap on their next beat, as Merge keeps its cursors. */
+typedef struct {
+    const MusicTimeStamp *next;
+    const MusicTimeStamp *last;     /* one past the end */
+} AnalyzeRun;
+
+typedef struct {
+    AnalyzeRun *heap;
+    size_t count;
+} AnalyzeRuns;
+
+static void
+analyze_sift_down (AnalyzeRuns *runs, size_t i)
+{
+    AnalyzeRun *heap = runs->heap, tmp;
+    size_t least, left, right;
+    
+    for (;;) {
+        least = i;
+        left = 2 * i + 1;
+        right = left + 1;
+        if (left < runs->count && *heap[left].next < *heap[least].next) least = left;
+        if (right < runs->count && *heap[right].next < *heap[least].next) least = right;
+        if (least == i) return;
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+static void
+analyze_runs_init (AnalyzeRuns *runs, AnalyzeJob *jobs, size_t count, Boolean use_ends)
+{
+    size_t i;
+    
+    runs->heap = ALLOC_N(AnalyzeRun, count ? count : 1);
+    runs->count = 0;
+    for (i = 0; i < count; i++) {
+        if (jobs[i].notes == 0) continue;
+        runs->heap[runs->count].next = use_ends ? jobs[i].ends : jobs[i].starts;
+        runs->heap[runs->count].last = runs->heap[runs->count].next + jobs[i].notes;
+        runs->count++;
+    }
+    for (i = runs->count / 2; i-- > 0; )
+        analyze_sift_down(runs, i);
+}
+
+/* Take the least of the heads of each track's sorted beats. */
+static Boolean
+analyze_next (AnalyzeRuns *runs, MusicTimeStamp *beat)
+{
+    AnalyzeRun *top = &runs->heap[0];
+    
+    if (runs->count == 0) return FALSE;
+    *beat = *top->next;
+    if (++top->next == top->last) *top = runs->heap[--runs->count];
+    analyze_sift_down(runs, 0);
+    return TRUE;
+}
+
+/* The most notes sounding at once. A note ending at a beat does not overlap
+ * one starting there. */
+static size_t
+analyze_polyphony (AnalyzeJob *jobs, size_t count)
+{
+    AnalyzeRuns starts, ends;
+    size_t sounding = 0, peak = 0;
+    MusicTimeStamp start = 0.0, end = 0.0;
+    Boolean has_start, has_end;
+    
+    analyze_runs_init(&starts, jobs, count, FALSE);
+    analyze_runs_init(&ends, jobs, count, TRUE);
+    has_start = analyze_next(&starts, &start);
+    has_end = analyze_next(&ends, &end);
+    while (has_start) {
+        if (has_end && end <= start) {
+            sounding--;
+            has_end = analyze_next(&ends, &end);
+        } else {
+            if (++sounding > peak) peak = sounding;
+            has_start = analyze_next(&starts, &start);
+        }
+    }
+    xfree(starts.heap);
+    xfree(ends.heap);
+    return peak;
+}
+
+static VALUE
+analyze_histogram (const size_t *counts, size_t n)
+{
+    VALUE rb_ary = rb_ary_new2(n);
+    size_t i;
+    for (i = 0; i < n; i++) rb_ary_push(rb_ary, SIZET2NUM(counts[i]));
+    return rb_ary;
+}
+
+/*
+ * Computes statistics over the events of every track, as stored, in
+ * parallel. Returns a Hash with :tracks, :events, :notes, :pitches and
+ * :velocities (128-element histograms of notes), :channels (event counts
+ * per channel), :max_polyphony, :seconds (to the end of the last note or
+ * event) and :notes_per_second. Accepts :threads.
+ */
+static VALUE
+sequence_analyze (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_options, rb_threads = Qnil, rb_result;
+    MusicSequence *seq;
+    AnalyzeJob *jobs;
+    Analyze analyze;
+    TempoMap map;
+    UInt32 i, j, count;
+    size_t events = 0, notes = 0, pitches[128], velocities[128], channels[16];
+    MusicTimeStamp end = 0.0;
+    Float64 secs;
+    unsigned threads;
+    OSStatus err;
+    
+    seq = &sequence_get(self)->seq;
+    rb_scan_args(argc, argv, "01", &rb_options);
+    if (!NIL_P(rb_options)) rb_threads = rb_hash_aref(rb_options, rb_sThreads);
+    threads = NIL_P(rb_threads) ? pool_default_threads() : NUM2UINT(rb_threads);
+    
+    require_noerr( err = MusicSequenceGetTrackCount(*seq, &count), fail );
+    jobs = ZALLOC_N(AnalyzeJob, count ? count : 1);
+    for (i = 0; i < count; i++)
+        require_noerr( err = MusicSequenceGetIndTrack(*seq, i, &jobs[i].track), free_jobs );
+    
+    analyze.seq = (SequenceData *) seq;
+    analyze.jobs = jobs;
+    analyze.count = count;
+    analyze.threads = threads;
+    rb_thread_call_without_gvl(analyze_run, &analyze, NULL, NULL);
+    
+    MEMZERO(pitches, size_t, 128);
+    MEMZERO(velocities, size_t, 128);
+    MEMZERO(channels, size_t, 16);
+    for (i = 0; i < count; i++) {
+        if (!err) err = jobs[i].err;
+        events += jobs[i].events;
+        notes += jobs[i].notes;
+        for (j = 0; j < 128; j++) pitches[j] += jobs[i].pitches[j];
+        for (j = 0; j < 128; j++) velocities[j] += jobs[i].velocities[j];
+        for (j = 0; j < 16; j++) channels[j] += jobs[i].channels[j];
+        if (jobs[i].end > end) end = jobs[i].end;
+    }
+    require_noerr( err, free_jobs );
+    
+    require_noerr( err = tempo_map_init(&map, *seq), free_jobs );
+    secs = tempo_map_secs(&map, end);
+    tempo_map_free(&map);
+    
+    rb_result = rb_hash_new();
+    rb_hash_aset(rb_result, rb_sTracks, UINT2NUM(count));
+    rb_hash_aset(rb_result, rb_sEvents, SIZET2NUM(events));
+    rb_hash_aset(rb_result, rb_sNotes, SIZET2NUM(notes));
+    rb_hash_aset(rb_result, rb_sPitches, analyze_histogram(pitches, 128));
+    rb_hash_aset(rb_result, rb_sVelocities, analyze_histogram(velocities, 128));
+    rb_hash_aset(rb_result, rb_sChannels, analyze_histogram(channels, 16));
+    rb_hash_aset(rb_result, rb_sMaxPolyphony, SIZET2NUM(analyze_polyphony(jobs, count)));
+    rb_hash_aset(rb_result, rb_sSeconds, rb_float_new(secs));
+    rb_hash_aset(rb_result, rb_sNotesPerSecond, rb_float_new(secs > 0.0 ? notes / secs : 0.0));
+    
+    free_jobs:
+    for (i = 0; i < count; i++) {
+        free(jobs[i].starts);
+        free(jobs[i].ends);
+    }
+    xfree(jobs);
+    require_noerr( err, fail );
+    return rb_result;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequence#analyze");
+}
+
+/* MusicEventIterator defns */
+
+/* The iterator keeps its track alive and reports edits to the track index. */
+typedef struct {
+    MusicEventIterator iter;
+    TrackData *track;
+    VALUE rb_track;
+    SequenceUser user;
+} IterData;
+
+static void
+iter_mark (IterData *iter)
+{
+    rb_gc_mark(iter->rb_track);
+}
+
+static void
+iter_free (IterData *iter)
+{
+    OSStatus err;
+    sequence_user_unlink(&iter->user);
+    if (iter->iter)
+        require_noerr( err = DisposeMusicEventIterator(iter->iter), fail );
+    xfree(iter);
+    return;
+    
     fail:
+    xfree(iter);
     rb_warning("DisposeMusicEventIterator() failed with OSStatus %i.", (int) err);
 }
 
+/* Called as the sequence is detached. */
+static void
+iter_close (void *owner)
+{
+    IterData *iter = (IterData *) owner;
+    DisposeMusicEventIterator(iter->iter);
+    iter->iter = NULL;
+}
+
+static size_t
+iter_memsize (const void *iter)
+{
+    return sizeof(IterData);
+}
+
+/* Not freed immediately, as disposal may warn. */
+static const rb_data_type_t iter_type = {
+    "AudioToolbox::MusicEventIterator",
+    { (RUBY_DATA_FUNC) iter_mark, (RUBY_DATA_FUNC) iter_free, iter_memsize, },
+    0, 0, RUBY_TYPED_WB_PROTECTED
+};
+
 static VALUE
 iter_alloc (VALUE class)
 {
-    MusicEventIterator *iter;
-    return Data_Make_Struct(rb_cMusicEventIterator, MusicEventIterator, 0, iter_free, iter);
+    IterData *iter;
+    VALUE rb_iter = TypedData_Make_Struct(rb_cMusicEventIterator, IterData, &iter_type, iter);
+    iter->rb_track = Qnil;
+    iter->user.close = iter_close;
+    iter->user.owner = iter;
+    return rb_iter;
+}
+
+/* The iterator's data, raising if its sequence has been detached. */
+static IterData *
+iter_get (VALUE self)
+{
+    IterData *iter;
+    TypedData_Get_Struct(self, IterData, &iter_type, iter);
+    if (!iter->iter) rb_raise(rb_eIOError, "Iterator's sequence has been detached.");
+    return iter;
 }
 
 static VALUE
 iter_init (VALUE self, VALUE rb_track)
 {
-    MusicTrack *track;
-    MusicEventIterator *iter;
+    TrackData *track;
+    IterData *iter;
     OSStatus err;
-    Data_Get_Struct(rb_track, MusicTrack, track);
-    Data_Get_Struct(self, MusicEventIterator, iter);
-    require_noerr( err = NewMusicEventIterator(*track, iter), fail );
+    track = track_get(rb_track);
+    TypedData_Get_Struct(self, IterData, &iter_type, iter);
+    require_noerr( err = NewMusicEventIterator(track->track, &iter->iter), fail );
+    iter->track = track;
+    RB_OBJ_WRITE(self, &iter->rb_track, rb_track);
+    sequence_user_link(&iter->user, track->sequence);
     return self;
     
     fail:
@@ -1115,7 +7005,7 @@ iter_seek (VALUE self, VALUE rb_time)
     MusicEventIterator *iter;
     MusicTimeStamp ts;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     if (PRIM_NUM_P(rb_time))
         ts = NUM2DBL(rb_time);
     else
@@ -1127,12 +7017,34 @@ iter_seek (VALUE self, VALUE rb_time)
     RAISE_OSSTATUS(err, "MusicEventIteratorSeek()");
 }
 
+/* Seek to the first beat of a bar, numbered from one as by
+ * MusicSequence#beats_to_bar_beat_time. */
+static VALUE
+iter_seek_bar (VALUE self, VALUE rb_bar)
+{
+    IterData *iter;
+    BarBeatTime pos;
+    MusicTimeStamp ts;
+    OSStatus err;
+    
+    iter = iter_get(self);
+    pos.bar = NUM2INT(rb_bar);
+    pos.beat = 1;
+    pos.subbeat = 0;
+    ts = signature_map_beats(sequence_signatures(iter->track->sequence), &pos, 1);
+    require_noerr( err = MusicEventIteratorSeek(iter->iter, ts), fail );
+    return Qnil;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicEventIteratorSeek()");
+}
+
 static VALUE
 iter_next (VALUE self)
 {
     MusicEventIterator *iter;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorNextEvent(*iter), fail );
     return Qnil;
     
@@ -1145,7 +7057,7 @@ iter_prev (VALUE self)
 {
     MusicEventIterator *iter;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorPreviousEvent(*iter), fail );
     return Qnil;
     
@@ -1159,7 +7071,7 @@ iter_has_current (VALUE self)
     MusicEventIterator *iter;
     Boolean has_cur;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorHasCurrentEvent(*iter, &has_cur), fail );
     return has_cur ? Qtrue : Qfalse;
     
@@ -1173,7 +7085,7 @@ iter_has_prev (VALUE self)
     MusicEventIterator *iter;
     Boolean has_prev;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorHasPreviousEvent(*iter, &has_prev), fail );
     return has_prev ? Qtrue : Qfalse;
     
@@ -1187,7 +7099,7 @@ iter_has_next (VALUE self)
     MusicEventIterator *iter;
     Boolean has_next;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorHasNextEvent(*iter, &has_next), fail );
     return has_next ? Qtrue : Qfalse;
     
@@ -1201,7 +7113,7 @@ iter_get_time (VALUE self)
     MusicEventIterator *iter;
     MusicTimeStamp ts;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorGetEventInfo(*iter, &ts, NULL, NULL, NULL), fail );
     return rb_float_new(ts);
     
@@ -1212,11 +7124,17 @@ iter_get_time (VALUE self)
 static VALUE
 iter_set_time (VALUE self, VALUE rb_time)
 {
-    MusicEventIterator *iter;
-    MusicTimeStamp ts = NUM2DBL(rb_time);
+    IterData *iter;
+    MusicTimeStamp ts = NUM2DBL(rb_time), old_ts;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
-    require_noerr( err = MusicEventIteratorSetEventTime(*iter, ts), fail );
+    iter = iter_get(self);
+    require_noerr( err = MusicEventIteratorGetEventInfo(iter->iter, &old_ts, NULL, NULL, NULL), fail );
+    pthread_mutex_lock(&iter->track->sequence->lock);
+    err = MusicEventIteratorSetEventTime(iter->iter, ts);
+    pthread_mutex_unlock(&iter->track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(iter->track, old_ts, kMusicEventType_NULL, NULL);
+    track_touch(iter->track, ts, kMusicEventType_NULL, NULL);
     return Qnil;
     
     fail:
@@ -1229,23 +7147,11 @@ iter_get_event (VALUE self)
     MusicEventIterator *iter;
     MusicEventType type;
     const void *data;
+    VALUE payloads = Qnil;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = &iter_get(self)->iter;
     require_noerr( err = MusicEventIteratorGetEventInfo(*iter, NULL, &type, &data, NULL), fail );
-    
-    switch(type) {
-    case kMusicEventType_NULL:
-        return Qnil;
-    case kMusicEventType_MIDINoteMessage:
-        return midi_note_message_from_const((MIDINoteMessage*) data);
-    case kMusicEventType_MIDIChannelMessage:
-        return midi_channel_message_from_const((MIDIChannelMessage*) data);
-    case kMusicEventType_ExtendedTempo:
-        return tempo_from_const((ExtendedTempoEvent*) data);
-    default:
-        rb_raise(rb_eNotImpError, "Unsupported event type.");
-        break;
-    }
+    return event_from_const(type, data, &payloads);
     
     fail:
     RAISE_OSSTATUS(err, "MusicEventIteratorGetEventInfo()");
@@ -1254,29 +7160,38 @@ iter_get_event (VALUE self)
 static VALUE
 iter_set_event (VALUE self, VALUE rb_msg)
 {
-    MusicEventIterator *iter;
+    IterData *iter;
+    MusicTimeStamp ts;
     MusicEventType type;
     const void *data;
+    ExtendedTempoEvent tmp;
     OSStatus err;
     
-    Data_Get_Struct(self, MusicEventIterator, iter);
+    iter = iter_get(self);
     
     if (THRQL(rb_cMIDINoteMessage, rb_msg)) {
         type = kMusicEventType_MIDINoteMessage;
-        Data_Get_Struct(rb_msg, MIDINoteMessage, data);
+        TypedData_Get_Struct(rb_msg, MIDINoteMessage, &note_message_type, data);
     } else if (THRQL(rb_cMIDIChannelMessage, rb_msg)) {
         type = kMusicEventType_MIDIChannelMessage;
-        Data_Get_Struct(rb_msg, MIDIChannelMessage, data);
+        TypedData_Get_Struct(rb_msg, MIDIChannelMessage, &channel_message_type, data);
     } else if (THRQL(rb_cExtendedTempoEvent, rb_msg)) {
         type = kMusicEventType_ExtendedTempo;
-        ExtendedTempoEvent tmp;
         tmp.bpm = NUM2DBL(rb_funcall(rb_msg, rb_intern("bpm"), 0));
         data = &tmp;
+    } else if (THRQL(rb_cMIDIMetaEvent, rb_msg) || THRQL(rb_cMIDIRawData, rb_msg) ||
+               THRQL(rb_cMusicUserEvent, rb_msg)) {
+        data = payload_event_to_const(rb_msg, iter->track, &type);
     } else {
         rb_raise(rb_eTypeError, "Unrecognized event type");
     }
     
-    require_noerr( err = MusicEventIteratorSetEventInfo(*iter, type, data), fail );
+    require_noerr( err = MusicEventIteratorGetEventInfo(iter->iter, &ts, NULL, NULL, NULL), fail );
+    pthread_mutex_lock(&iter->track->sequence->lock);
+    err = MusicEventIteratorSetEventInfo(iter->iter, type, data);
+    pthread_mutex_unlock(&iter->track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(iter->track, ts, type, data);
     return Qnil;
     
     fail:
@@ -1286,21 +7201,763 @@ iter_set_event (VALUE self, VALUE rb_msg)
 static VALUE
 iter_delete_event (VALUE self)
 {
-    MusicEventIterator *iter;
+    IterData *iter;
+    MusicTimeStamp ts = -1.0;
+    Boolean has_current;
     OSStatus err;
-    Data_Get_Struct(self, MusicEventIterator, iter);
-    require_noerr( err = MusicEventIteratorDeleteEvent(*iter), fail );
+    iter = iter_get(self);
+    require_noerr( err = MusicEventIteratorHasCurrentEvent(iter->iter, &has_current), fail );
+    if (has_current)
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter->iter, &ts, NULL, NULL, NULL), fail );
+    pthread_mutex_lock(&iter->track->sequence->lock);
+    err = MusicEventIteratorDeleteEvent(iter->iter);
+    pthread_mutex_unlock(&iter->track->sequence->lock);
+    require_noerr( err, fail );
+    track_touch(iter->track, ts, kMusicEventType_NULL, NULL);
+    if (has_current) sequence_account(iter->track->sequence, -1);
     return Qnil;
     
     fail:
     RAISE_OSSTATUS(err, "MusicEventIteratorDeleteEvent()");
 }
 
+/* MIDIFile defns */
+
+/*
+ * Batch conversion of Standard MIDI Files. Files are decoded with the
+ * portable reader in smf.c rather than through MusicSequence, which can
+ * neither write format 0 nor run outside the GVL, and are converted
+ * concurrently on a thread pool.
+ *
+ * The memory budget bounds the decoded size of the files in flight, which
+ * is estimated from the size on disk. A file larger than the whole budget
+ * is still converted, but only once nothing else is in flight.
+ */
+
+#define CONVERT_MEMORY_PER_BYTE 8
+
+typedef struct {
+    const char *path;
+    const char *output;
+    double seconds;
+    int error;
+    int sys_errno;
+    size_t tracks;
+    size_t events;
+} ConvertJob;
+
+typedef struct {
+    ConvertJob *jobs;
+    size_t count;
+    int format;         /* 0, 1 or -1 to keep the input's format */
+    uint16_t division;  /* 0 to keep the input's resolution */
+    int split_channels;
+    unsigned threads;
+    size_t memory;
+    size_t reserved;
+    size_t in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volatile int cancel;
+} Convert;
+
+static size_t
+convert_reserve (Convert *conv, const char *path)
+{
+    struct stat st;
+    size_t cost = stat(path, &st) ? 0 : (size_t) st.st_size * CONVERT_MEMORY_PER_BYTE;
+    
+    pthread_mutex_lock(&conv->lock);
+    while (conv->in_flight > 0 && conv->reserved + cost > conv->memory && !conv->cancel)
+        pthread_cond_wait(&conv->cond, &conv->lock);
+    conv->reserved += cost;
+    conv->in_flight++;
+    pthread_mutex_unlock(&conv->lock);
+    return cost;
+}
+
+static void
+convert_release (Convert *conv, size_t cost)
+{
+    pthread_mutex_lock(&conv->lock);
+    conv->reserved -= cost;
+    conv->in_flight--;
+    pthread_cond_broadcast(&conv->cond);
+    pthread_mutex_unlock(&conv->lock);
+}
+
+static int
+convert_file (Convert *conv, ConvertJob *job)
+{
+    int input_format, err;
+    SMF smf;
+    
+    smf_init(&smf);
+    if ((err = smf_read_file(&smf, job->path))) {
+        if (err == SMF_ERR_IO) job->sys_errno = errno;
+        goto done;
+    }
+    input_format = smf.format;
+    
+    if (conv->cancel) {
+        err = SMF_ERR_CANCELLED;
+        goto done;
+    }
+    
+    smf_requantize(&smf, conv->division);
+    if (conv->format == 0)
+        err = smf_merge_tracks(&smf);
+    else if (conv->split_channels || (conv->format == 1 && input_format == 0))
+        err = smf_split_channels(&smf);
+    if (err) goto done;
+    
+    if (!(err = smf_write_file(&smf, job->output))) {
+        job->tracks = smf.track_count;
+        job->events = smf_event_count(&smf);
+    } else if (err == SMF_ERR_IO) {
+        job->sys_errno = errno;
+    }
+    
+    done:
+    smf_free(&smf);
+    return err;
+}
+
+static void
+convert_job (void *ctx, size_t index)
+{
+    Convert *conv = (Convert *) ctx;
+    ConvertJob *job = &conv->jobs[index];
+    struct timespec start, end;
+    size_t cost;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cost = convert_reserve(conv, job->path);
+    job->error = conv->cancel ? SMF_ERR_CANCELLED : convert_file(conv, job);
+    convert_release(conv, cost);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void *
+convert_run (void *ctx)
+{
+    Convert *conv = (Convert *) ctx;
+    pool_run(conv->threads, conv->count, convert_job, conv, &conv->cancel);
+    return NULL;
+}
+
+static void
+convert_unblock (void *ctx)
+{
+    Convert *conv = (Convert *) ctx;
+    pthread_mutex_lock(&conv->lock);
+    conv->cancel = 1;
+    pthread_cond_broadcast(&conv->cond);
+    pthread_mutex_unlock(&conv->lock);
+}
+
+static VALUE
+convert_result (ConvertJob *job)
+{
+    VALUE rb_result = rb_hash_new();
+    rb_hash_aset(rb_result, rb_sPath, rb_str_new2(job->path));
+    rb_hash_aset(rb_result, rb_sOutput, rb_str_new2(job->output));
+    rb_hash_aset(rb_result, rb_sSeconds, rb_float_new(job->seconds));
+    if (job->error) {
+        rb_hash_aset(rb_result, rb_sError, rb_str_new2(job->sys_errno ? strerror(job->sys_errno) : smf_strerror(job->error)));
+    } else {
+        rb_hash_aset(rb_result, rb_sTracks, ULONG2NUM(job->tracks));
+        rb_hash_aset(rb_result, rb_sEvents, ULONG2NUM(job->events));
+    }
+    return rb_result;
+}
+
+/*
+ * Takes an Array of [input, output] path pairs and the conversion options,
+ * already validated by MIDIFile.convert, and returns a result Hash per pair.
+ */
+static VALUE
+midi_file_convert_internal (VALUE self, VALUE rb_pairs, VALUE rb_format, VALUE rb_division,
+                            VALUE rb_split, VALUE rb_threads, VALUE rb_memory)
+{
+    VALUE rb_results, rb_paths, rb_pair;
+    Convert conv;
+    size_t i;
+    
+    Check_Type(rb_pairs, T_ARRAY);
+    conv.count = RARRAY_LEN(rb_pairs);
+    conv.format = NIL_P(rb_format) ? -1 : NUM2INT(rb_format);
+    conv.division = NIL_P(rb_division) ? 0 : (uint16_t) NUM2UINT(rb_division);
+    conv.split_channels = RTEST(rb_split);
+    conv.threads = NIL_P(rb_threads) ? pool_default_threads() : NUM2UINT(rb_threads);
+    conv.memory = NUM2SIZET(rb_memory);
+    conv.reserved = 0;
+    conv.in_flight = 0;
+    conv.cancel = 0;
+    
+    /* Keep the path Strings reachable and unmodified while the pool runs. */
+    rb_paths = rb_ary_new2(conv.count * 2);
+    conv.jobs = ALLOC_N(ConvertJob, conv.count);
+    MEMZERO(conv.jobs, ConvertJob, conv.count);
+    for (i = 0; i < conv.count; i++) {
+        rb_pair = rb_ary_entry(rb_pairs, i);
+        Check_Type(rb_pair, T_ARRAY);
+        rb_ary_push(rb_paths, rb_str_new_frozen(rb_ary_entry(rb_pair, 0)));
+        rb_ary_push(rb_paths, rb_str_new_frozen(rb_ary_entry(rb_pair, 1)));
+        conv.jobs[i].path = StringValueCStr(RARRAY_PTR(rb_paths)[i * 2]);
+        conv.jobs[i].output = StringValueCStr(RARRAY_PTR(rb_paths)[i * 2 + 1]);
+    }
+    
+    pthread_mutex_init(&conv.lock, NULL);
+    pthread_cond_init(&conv.cond, NULL);
+    rb_thread_call_without_gvl(convert_run, &conv, convert_unblock, &conv);
+    pthread_cond_destroy(&conv.cond);
+    pthread_mutex_destroy(&conv.lock);
+    
+    rb_results = rb_ary_new2(conv.count);
+    for (i = 0; i < conv.count; i++)
+        rb_ary_push(rb_results, convert_result(&conv.jobs[i]));
+    xfree(conv.jobs);
+    RB_GC_GUARD(rb_paths);
+    
+    if (conv.cancel) rb_thread_check_ints();
+    return rb_results;
+}
+
+/* FileOperation defns */
+
+/*
+ * Loads and saves sequences on a native thread. A load decodes the file
+ * with smf.c and builds a new MusicSequence from it, which Ruby only sees
+ * once the thread has finished. A save writes a snapshot of the sequence
+ * taken when it starts, so the sequence may be edited while it runs.
+ *
+ * As with MusicSequence#load, each channel of the file gets its own track.
+ * Tempo and other meta events go on the tempo track, and SysEx on a last
+ * track of its own.
+ *
+ * The thread writes a byte to the notify pipe when it finishes, so that
+ * FileOperation#join can wait for it with IO#wait_readable, which leaves
+ * the thread free for other fibers under a Fiber scheduler.
+ */
+typedef struct {
+    pthread_t thread;
+    Boolean started;        /* created and not yet joined */
+    volatile int done;
+    int notify[2];
+    Boolean save;
+    char *path;
+    SMFProgress progress;
+    SMF smf;
+    MusicSequence seq;      /* built by a load, until it is handed to Ruby */
+    size_t events;
+    int error;              /* an SMF error */
+    int sys_errno;
+    OSStatus status;        /* an AudioToolbox error */
+    VALUE rb_value;
+} FileOp;
+
+/* The resolution of a saved file, as MusicSequence#save uses by default. */
+#define FILE_OP_DIVISION 480
+
+#define META_TEMPO 0x51
+
+typedef struct {
+    FileOp *op;
+    MusicTrack tempo;
+    MusicTrack sysex;
+    UInt8 *buf;             /* scratch space for meta and SysEx events */
+    size_t buf_size;
+    NotePairs pairs;
+} FileBuild;
+
+static void *
+file_build_scratch (FileBuild *build, size_t size)
+{
+    UInt8 *buf;
+    if (size > build->buf_size) {
+        if (!(buf = realloc(build->buf, size))) return NULL;
+        build->buf = buf;
+        build->buf_size = size;
+    }
+    return build->buf;
+}
+
+static OSStatus
+file_build_note (FileBuild *build, MusicTrack dest, const SMFEvent *on, uint32_t tick, UInt8 release)
+{
+    UInt16 division = build->op->smf.division;
+    MIDINoteMessage msg;
+    OSStatus err;
+    
+    msg.channel = on->status & 0x0F;
+    msg.note = on->data1;
+    msg.velocity = on->data2;
+    msg.releaseVelocity = release;
+    msg.duration = (Float32) (tick - on->tick) / division;
+    require_noerr( err = MusicTrackNewMIDINoteEvent(dest, (MusicTimeStamp) on->tick / division, &msg), fail );
+    build->op->events++;
+    
+    fail:
+    return err;
+}
+
+/* Insert a track's events into dest, pairing note ons with note offs as
+ * described in pair.h. */
+static OSStatus
+file_build_track (FileBuild *build, const SMFTrack *track, MusicTrack dest)
+{
+    const SMF *smf = &build->op->smf;
+    const SMFEvent *ev;
+    const UInt8 *payload;
+    MusicTimeStamp ts;
+    MIDIMetaEvent *meta;
+    MIDIRawData *raw;
+    MIDIChannelMessage msg;
+    UInt8 channel, kind;
+    uint32_t us, on, last = 0;
+    size_t i;
+    int note;
+    OSStatus err = noErr;
+    
+    if (note_pairs_reset(&build->pairs, track->count)) return kAudio_MemFullError;
+    for (i = 0; i < track->count; i++) {
+        ev = &track->events[i];
+        ts = (MusicTimeStamp) ev->tick / smf->division;
+        payload = smf->bytes + ev->offset;
+        channel = ev->status & 0x0F;
+        kind = ev->status & 0xF0;
+        last = ev->tick;
+        
+        if (ev->status == SMF_META) {
+            if (ev->meta == META_TEMPO && ev->length == 3) {
+                us = (payload[0] << 16) | (payload[1] << 8) | payload[2];
+                if (!us) continue;
+                require_noerr( err = MusicTrackNewExtendedTempoEvent(build->tempo, ts, 60e6 / us), fail );
+            } else {
+                if (!(meta = file_build_scratch(build, offsetof(MIDIMetaEvent, data) + ev->length + 1)))
+                    return kAudio_MemFullError;
+                MEMZERO(meta, MIDIMetaEvent, 1);
+                meta->metaEventType = ev->meta;
+                meta->dataLength = ev->length;
+                memcpy(meta->data, payload, ev->length);
+                require_noerr( err = MusicTrackNewMetaEvent(build->tempo, ts, meta), fail );
+            }
+        } else if (ev->status == SMF_SYSEX || ev->status == SMF_ESCAPE) {
+            if (!build->sysex)
+                require_noerr( err = MusicSequenceNewTrack(build->op->seq, &build->sysex), fail );
+            if (!(raw = file_build_scratch(build, offsetof(MIDIRawData, data) + ev->length + 1)))
+                return kAudio_MemFullError;
+            raw->length = 0;
+            if (ev->status == SMF_SYSEX) raw->data[raw->length++] = SMF_SYSEX;
+            memcpy(raw->data + raw->length, payload, ev->length);
+            raw->length += ev->length;
+            require_noerr( err = MusicTrackNewMIDIRawDataEvent(build->sysex, ts, raw), fail );
+        } else if (kind == 0x80 || kind == 0x90) {
+            on = note_pairs_feed(&build->pairs, i, ev->status, ev->data1, ev->data2);
+            if (on != NOTE_PAIRS_NONE)
+                require_noerr( err = file_build_note(build, dest, &track->events[on], ev->tick,
+                                                     kind == 0x80 ? ev->data2 : 0), fail );
+            continue;
+        } else {
+            msg.status = ev->status;
+            msg.data1 = ev->data1;
+            msg.data2 = ev->data2;
+            msg.reserved = 0;
+            require_noerr( err = MusicTrackNewMIDIChannelEvent(dest, ts, &msg), fail );
+        }
+        build->op->events++;
+    }
+    
+    /* End any notes still held at the track's last event. */
+    for (channel = 0; channel < 16; channel++)
+        for (note = 0; note < 128; note++)
+            while ((on = note_pairs_pop(&build->pairs, channel, note)) != NOTE_PAIRS_NONE)
+                require_noerr( err = file_build_note(build, dest, &track->events[on], last, 0), fail );
+    
+    fail:
+    return err;
+}
+
+static void
+file_op_load (FileOp *op)
+{
+    FileBuild *build;
+    MusicTrack dest;
+    UInt16 i, count;
+    
+    errno = 0;
+    if ((op->error = smf_read_file_progress(&op->smf, op->path, &op->progress))) {
+        if (op->error == SMF_ERR_IO) op->sys_errno = errno;
+        return;
+    }
+    if ((op->error = smf_split_channels(&op->smf))) return;
+    if (!(build = calloc(1, sizeof(FileBuild)))) {
+        op->error = SMF_ERR_NOMEM;
+        return;
+    }
+    build->op = op;
+    note_pairs_init(&build->pairs);
+    count = op->smf.track_count;
+    op->progress.total_tracks = count;
+    
+    require_noerr( op->status = NewMusicSequence(&op->seq), done );
+    require_noerr( op->status = MusicSequenceGetTempoTrack(op->seq, &build->tempo), done );
+    /* The conductor track comes first in the file but last here, so that
+     * the SysEx track follows the channel tracks. */
+    for (i = 1; i <= count; i++) {
+        if (op->progress.cancel) {
+            op->error = SMF_ERR_CANCELLED;
+            break;
+        }
+        dest = NULL;
+        if (i < count)
+            require_noerr( op->status = MusicSequenceNewTrack(op->seq, &dest), done );
+        require_noerr( op->status = file_build_track(build, &op->smf.tracks[i % count], dest), done );
+        op->progress.tracks = i;
+    }
+    
+    done:
+    note_pairs_free(&build->pairs);
+    free(build->buf);
+    free(build);
+    smf_free(&op->smf);
+}
+
+static void
+file_op_save (FileOp *op)
+{
+    errno = 0;
+    op->error = smf_write_file_progress(&op->smf, op->path, &op->progress);
+    if (op->error == SMF_ERR_IO) op->sys_errno = errno;
+    if (op->error) unlink(op->path);
+    smf_free(&op->smf);
+}
+
+static void *
+file_op_run (void *ctx)
+{
+    FileOp *op = (FileOp *) ctx;
+    char byte = 0;
+    
+    if (op->save) file_op_save(op);
+    else file_op_load(op);
+    op->done = 1;
+    while (write(op->notify[1], &byte, 1) < 0 && errno == EINTR);
+    return NULL;
+}
+
+static uint32_t
+file_op_tick (MusicTimeStamp beat)
+{
+    double tick = floor(beat * FILE_OP_DIVISION + 0.5);
+    if (tick <= 0.0) return 0;
+    return tick >= UINT32_MAX ? UINT32_MAX : (uint32_t) tick;
+}
+
+/* Append a track's events to an SMF track, as they would be saved. */
+static OSStatus
+file_op_snapshot_track (SMF *smf, UInt16 index, MusicTrack track)
+{
+    MusicEventIterator iter;
+    MusicTimeStamp ts;
+    MusicEventType type;
+    const void *data;
+    UInt32 size;
+    Boolean has_current;
+    SMFEvent ev;
+    UInt8 tempo[3];
+    const UInt8 *payload;
+    uint32_t us;
+    int smf_err = SMF_OK;
+    OSStatus err;
+    
+    require_noerr( err = NewMusicEventIterator(track, &iter), fail );
+    for (;;) {
+        require_noerr( err = MusicEventIteratorHasCurrentEvent(iter, &has_current), dispose );
+        if (!has_current) break;
+        require_noerr( err = MusicEventIteratorGetEventInfo(iter, &ts, &type, &data, &size), dispose );
+        MEMZERO(&ev, SMFEvent, 1);
+        ev.tick = file_op_tick(ts);
+        payload = NULL;
+        
+        switch (type) {
+        case kMusicEventType_MIDINoteMessage: {
+            const MIDINoteMessage *msg = (const MIDINoteMessage *) data;
+            ev.status = 0x90 | (msg->channel & 0x0F);
+            ev.data1 = msg->note & 0x7F;
+            ev.data2 = msg->velocity & 0x7F;
+            if (!ev.data2) break;
+            if ((smf_err = smf_push_event(smf, &smf->tracks[index], &ev, NULL))) break;
+            ev.status = 0x80 | (msg->channel & 0x0F);
+            ev.data2 = msg->releaseVelocity & 0x7F;
+            ev.tick = file_op_tick(ts + msg->duration);
+            smf_err = smf_push_event(smf, &smf->tracks[index], &ev, NULL);
+            break;
+        }
+        case kMusicEventType_MIDIChannelMessage: {
+            const MIDIChannelMessage *msg = (const MIDIChannelMessage *) data;
+            if (msg->status < 0xA0 || msg->status >= 0xF0) break;
+            ev.status = msg->status;
+            ev.data1 = msg->data1 & 0x7F;
+            ev.data2 = msg->data2 & 0x7F;
+            smf_err = smf_push_event(smf, &smf->tracks[index], &ev, NULL);
+            break;
+        }
+        case kMusicEventType_ExtendedTempo: {
+            const ExtendedTempoEvent *tempo_ev = (const ExtendedTempoEvent *) data;
+            if (tempo_ev->bpm <= 0.0) break;
+            us = (uint32_t) (60e6 / tempo_ev->bpm + 0.5);
+            tempo[0] = us >> 16;
+            tempo[1] = us >> 8;
+            tempo[2] = us;
+            ev.status = SMF_META;
+            ev.meta = META_TEMPO;
+            ev.length = 3;
+            smf_err = smf_push_event(smf, &smf->tracks[index], &ev, tempo);
+            break;
+        }
+        case kMusicEventType_Meta: {
+            const MIDIMetaEvent *meta = (const MIDIMetaEvent *) data;
+            if (meta->metaEventType == SMF_META_END_OF_TRACK) break;
+            ev.status = SMF_META;
+            ev.meta = meta->metaEventType;
+            ev.length = meta->dataLength;
+            smf_err = smf_push_event(smf, &smf->tracks[index], &ev, meta->data);
+            break;
+        }
+        case kMusicEventType_MIDIRawData: {
+            const MIDIRawData *raw = (const MIDIRawData *) data;
+            payload = raw->data;
+            ev.length = raw->length;
+            ev.status = SMF_ESCAPE;
+            if (raw->length > 0 && raw->data[0] == SMF_SYSEX) {
+                ev.status = SMF_SYSEX;
+                payload++;
+                ev.length--;
+            }
+            smf_err = smf_push_event(smf, &smf->tracks[index], &ev, payload);
+            break;
+        }
+        default:
+            break;
+        }
+        if (smf_err) {
+            err = kAudio_MemFullError;
+            goto dispose;
+        }
+        require_noerr( err = MusicEventIteratorNextEvent(iter), dispose );
+    }
+    if (smf_sort_track(&smf->tracks[index])) err = kAudio_MemFullError;
+    
+    dispose:
+    DisposeMusicEventIterator(iter);
+    fail:
+    return err;
+}
+
+/* Copy the sequence into smf as a format 1 file with the tempo track first. */
+static OSStatus
+file_op_snapshot (SMF *smf, MusicSequence seq)
+{
+    MusicTrack track;
+    UInt32 i, count;
+    OSStatus err;
+    
+    smf->format = 1;
+    smf->division = FILE_OP_DIVISION;
+    require_noerr( err = MusicSequenceGetTrackCount(seq, &count), fail );
+    if (count >= UINT16_MAX || smf_add_tracks(smf, count + 1)) return kAudio_MemFullError;
+    require_noerr( err = MusicSequenceGetTempoTrack(seq, &track), fail );
+    require_noerr( err = file_op_snapshot_track(smf, 0, track), fail );
+    for (i = 0; i < count; i++) {
+        require_noerr( err = MusicSequenceGetIndTrack(seq, i, &track), fail );
+        require_noerr( err = file_op_snapshot_track(smf, i + 1, track), fail );
+    }
+    
+    fail:
+    return err;
+}
+
+static void
+file_op_mark (FileOp *op)
+{
+    rb_gc_mark(op->rb_value);
+}
+
+static void
+file_op_free (FileOp *op)
+{
+    if (op->started) {
+        op->progress.cancel = 1;
+        pthread_join(op->thread, NULL);
+    }
+    if (op->seq) DisposeMusicSequence(op->seq);
+    smf_free(&op->smf);
+    if (op->notify[0] >= 0) close(op->notify[0]);
+    if (op->notify[1] >= 0) close(op->notify[1]);
+    free(op->path);
+    xfree(op);
+}
+
+static size_t
+file_op_memsize (const void *op)
+{
+    return sizeof(FileOp);
+}
+
+/* Not freed immediately, as freeing waits for the thread. */
+static const rb_data_type_t file_op_type = {
+    "AudioToolbox::FileOperation",
+    { (RUBY_DATA_FUNC) file_op_mark, (RUBY_DATA_FUNC) file_op_free, file_op_memsize, },
+    0, 0, RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE
+file_op_new (VALUE rb_path, Boolean save, FileOp **out)
+{
+    FileOp *op;
+    VALUE rb_op = TypedData_Make_Struct(rb_cFileOperation, FileOp, &file_op_type, op);
+    
+    op->notify[0] = op->notify[1] = -1;
+    op->rb_value = Qnil;
+    op->save = save;
+    smf_init(&op->smf);
+    rb_path = rb_file_expand_path(rb_get_path(rb_path), Qnil);
+    if (!(op->path = strdup(StringValueCStr(rb_path)))) rb_memerror();
+    if (rb_pipe(op->notify) < 0) rb_sys_fail("pipe");
+    *out = op;
+    return rb_op;
+}
+
+static void
+file_op_start (FileOp *op)
+{
+    int err;
+    if ((err = pthread_create(&op->thread, NULL, file_op_run, op)))
+        rb_syserr_fail(err, "pthread_create");
+    op->started = TRUE;
+}
+
+/* Reads path into a new MusicSequence on a native thread, and returns a
+ * FileOperation whose value is the sequence. */
+static VALUE
+sequence_load_async (VALUE class, VALUE rb_path)
+{
+    FileOp *op;
+    VALUE rb_op = file_op_new(rb_path, FALSE, &op);
+    file_op_start(op);
+    return rb_op;
+}
+
+/* Writes the sequence to path on a native thread, and returns a
+ * FileOperation whose value is the sequence. */
+static VALUE
+sequence_save_async (VALUE self, VALUE rb_path)
+{
+    MusicSequence *seq;
+    FileOp *op;
+    VALUE rb_op = file_op_new(rb_path, TRUE, &op);
+    OSStatus err;
+    
+    seq = &sequence_get(self)->seq;
+    require_noerr( err = file_op_snapshot(&op->smf, *seq), fail );
+    op->progress.total_tracks = op->smf.track_count;
+    RB_OBJ_WRITE(rb_op, &op->rb_value, self);
+    file_op_start(op);
+    return rb_op;
+    
+    fail:
+    RAISE_OSSTATUS(err, "MusicSequence#save_async");
+}
+
+static FileOp *
+file_op_get (VALUE self)
+{
+    FileOp *op;
+    TypedData_Get_Struct(self, FileOp, &file_op_type, op);
+    return op;
+}
+
+static VALUE
+file_op_is_done (VALUE self)
+{
+    return file_op_get(self)->done ? Qtrue : Qfalse;
+}
+
+/* Asks the thread to stop at the next chunk or track. */
+static VALUE
+file_op_cancel (VALUE self)
+{
+    file_op_get(self)->progress.cancel = 1;
+    return self;
+}
+
+/* Bytes read or written and tracks processed so far. A total is nil until
+ * it is known, and a save never knows its total bytes. */
+static VALUE
+file_op_get_progress (VALUE self)
+{
+    FileOp *op = file_op_get(self);
+    size_t total_bytes = op->progress.total_bytes;
+    UInt32 total_tracks = op->progress.total_tracks;
+    VALUE rb_progress = rb_hash_new();
+    
+    rb_hash_aset(rb_progress, rb_sBytes, SIZET2NUM(op->progress.bytes));
+    rb_hash_aset(rb_progress, rb_sTotalBytes, op->save || (!total_bytes && !op->done) ? Qnil : SIZET2NUM(total_bytes));
+    rb_hash_aset(rb_progress, rb_sTracks, UINT2NUM(op->progress.tracks));
+    rb_hash_aset(rb_progress, rb_sTotalTracks, total_tracks ? UINT2NUM(total_tracks) : Qnil);
+    return rb_progress;
+}
+
+/* The descriptor which becomes readable when the operation has finished. */
+static VALUE
+file_op_get_notify_fd (VALUE self)
+{
+    return INT2FIX(file_op_get(self)->notify[0]);
+}
+
+/* The result of a finished operation, raising its error if it failed. */
+static VALUE
+file_op_result (VALUE self)
+{
+    FileOp *op = file_op_get(self);
+    VALUE rb_seq;
+    
+    if (!op->done) rb_raise(rb_eRuntimeError, "FileOperation has not finished.");
+    if (op->started) {
+        pthread_join(op->thread, NULL);
+        op->started = FALSE;
+    }
+    if (op->sys_errno) rb_syserr_fail(op->sys_errno, op->path);
+    if (op->error) rb_raise(rb_eRuntimeError, "%s: %s", op->path, smf_strerror(op->error));
+    if (op->status) {
+        RAISE_OSSTATUS(op->status, op->save ? "MusicSequence#save_async" : "MusicSequence.load_async");
+    }
+    
+    if (op->seq) {
+        rb_seq = sequence_adopt(op->seq, op->events);
+        op->seq = NULL;
+        RB_OBJ_WRITE(self, &op->rb_value, rb_seq);
+    }
+    return op->rb_value;
+}
+
 /* Initialize extension */
 
 void
 Init_music_player ()
 {
+    /*
+     * Classes and symbols are made once here and are shareable. Everything
+     * else belongs to one object, or, like the scheduler, does its own
+     * locking.
+     */
+#if RUBY_API_VERSION_CODE >= 30000
+    rb_ext_ractor_safe(true);
+#endif
+    
     /*
      * CoreMIDI
      */
@@ -1335,6 +7992,15 @@ Init_music_player ()
     rb_define_method(rb_cMusicPlayer, "time=", player_set_time, 1);
     rb_define_method(rb_cMusicPlayer, "play_rate_scalar", player_get_play_rate_scalar, 0);
     rb_define_method(rb_cMusicPlayer, "play_rate_scalar=", player_set_play_rate_scalar, 1);
+    rb_define_singleton_method(rb_cMusicPlayer, "scheduler_threads", player_s_scheduler_threads, 0);
+    rb_define_method(rb_cMusicPlayer, "virtual_clock", player_get_virtual_clock, 0);
+    rb_define_method(rb_cMusicPlayer, "virtual_clock=", player_set_virtual_clock, 1);
+    rb_define_method(rb_cMusicPlayer, "advance", player_advance, 1);
+    rb_define_method(rb_cMusicPlayer, "recorded", player_recorded, 0);
+    rb_define_private_method(rb_cMusicPlayer, "watch", player_watch, 1);
+    rb_define_private_method(rb_cMusicPlayer, "unwatch", player_unwatch, 1);
+    rb_define_const(rb_cMusicPlayer, "RECORD_FORMAT", rb_str_freeze(rb_str_new2(ENGINE_RECORD_FORMAT)));
+    rb_define_const(rb_cMusicPlayer, "RECORD_SIZE", INT2FIX(sizeof(EngineRecord)));
     rb_define_method(rb_cMusicPlayer, "host_time_for_beats", player_host_time_for_beats, 1);
     
     /* AudioToolbox::MusicSequence */
@@ -1342,18 +8008,42 @@ Init_music_player ()
     rb_define_alloc_func(rb_cMusicSequence, sequence_alloc);
     rb_define_method(rb_cMusicSequence, "initialize", sequence_init, 0);
     rb_define_private_method(rb_cMusicSequence, "load_internal", sequence_load, 1);
+    rb_define_singleton_method(rb_cMusicSequence, "load_async", sequence_load_async, 1);
+    rb_define_method(rb_cMusicSequence, "save_async", sequence_save_async, 1);
     rb_define_method(rb_cMusicSequence, "midi_endpoint=", sequence_set_midi_endpoint, 1);
     rb_define_method(rb_cMusicSequence, "type", sequence_get_type, 0);
     rb_define_method(rb_cMusicSequence, "type=", sequence_set_type, 1);
     rb_define_method(rb_cMusicSequence, "save", sequence_save, 1);
+    rb_define_method(rb_cMusicSequence, "digest", sequence_get_digest, 0);
+    rb_define_method(rb_cMusicSequence, "render", sequence_render, -1);
+    rb_define_method(rb_cMusicSequence, "analyze", sequence_analyze, -1);
+    rb_define_method(rb_cMusicSequence, "time_signatures", sequence_time_signatures, 0);
+    rb_define_method(rb_cMusicSequence, "beats_to_bar_beat_time", sequence_beats_to_bar_beat_time, -1);
+    rb_define_method(rb_cMusicSequence, "beats_to_bar_beat_times", sequence_beats_to_bar_beat_times, -1);
+    rb_define_method(rb_cMusicSequence, "bar_beat_time_to_beats", sequence_bar_beat_time_to_beats, -1);
+    rb_define_method(rb_cMusicSequence, "dropped_cues", sequence_dropped_cues, 0);
+    rb_define_private_method(rb_cMusicSequence, "detach_internal", sequence_detach, 0);
+    rb_define_private_method(rb_cMusicSequence, "enable_cues", sequence_enable_cues, 1);
+    rb_define_private_method(rb_cMusicSequence, "cue_notify_fd", sequence_cue_notify_fd, 0);
+    rb_define_private_method(rb_cMusicSequence, "drain_cues", sequence_drain_cues, 0);
+    rb_define_singleton_method(rb_cMusicSequence, "attach", sequence_attach, 1);
+    rb_define_const(rb_cMusicSequence, "BAR_BEAT_TIME_FORMAT", rb_str_freeze(rb_str_new2(BAR_BEAT_TIME_FORMAT)));
+    rb_cMusicSequenceDetached = rb_define_class_under(rb_cMusicSequence, "Detached", rb_cObject);
+    rb_undef_alloc_func(rb_cMusicSequenceDetached);
     
     /* AudioToolbox::MusicTrack */
     rb_cMusicTrack = rb_define_class_under(rb_mAudioToolbox, "MusicTrack", rb_cObject);
     rb_define_singleton_method(rb_cMusicTrack, "new", track_new, -1);
     rb_define_method(rb_cMusicTrack, "initialize", track_init, -1);
+    rb_define_method(rb_cMusicTrack, "add", track_add, 2);
+    rb_define_method(rb_cMusicTrack, "add_all", track_add_all, 2);
     rb_define_method(rb_cMusicTrack, "add_midi_note_message", track_add_midi_note_message, 2);
     rb_define_method(rb_cMusicTrack, "add_midi_channel_message", track_add_midi_channel_message, 2);
     rb_define_method(rb_cMusicTrack, "add_extended_tempo_event", track_add_extended_tempo_event, 2);
+    rb_define_method(rb_cMusicTrack, "add_meta_event", track_add_meta_event, 2);
+    rb_define_method(rb_cMusicTrack, "add_midi_raw_data", track_add_midi_raw_data, 2);
+    rb_define_method(rb_cMusicTrack, "add_user_event", track_add_user_event, 2);
+    rb_define_method(rb_cMusicTrack, "pair_notes!", track_pair_notes, 0);
     rb_define_method(rb_cMusicTrack, "loop_info", track_get_loop_info, 0);
     rb_define_method(rb_cMusicTrack, "loop_info=", track_set_loop_info, 1);
     rb_define_method(rb_cMusicTrack, "offset", track_get_offset, 0);
@@ -1365,6 +8055,12 @@ Init_music_player ()
     rb_define_method(rb_cMusicTrack, "length", track_get_length, 0);
     rb_define_method(rb_cMusicTrack, "length=", track_set_length, 1);
     rb_define_method(rb_cMusicTrack, "resolution", track_get_resolution, 0);
+    rb_define_method(rb_cMusicTrack, "digest", track_get_digest, 0);
+    rb_define_method(rb_cMusicTrack, "==", track_equal, 1);
+    rb_define_method(rb_cMusicTrack, "diff", track_diff, 1);
+    rb_define_const(rb_cMusicTrack, "DIFF_FORMAT", rb_str_freeze(rb_str_new2(DIFF_RECORD_FORMAT)));
+    rb_define_const(rb_cMusicTrack, "DIFF_SIZE", INT2FIX(sizeof(DiffRecord)));
+    rb_define_private_method(rb_cMusicTrack, "each_internal", track_each_internal, 2);
     
     /* AudioToolbox::MusicSequence#tracks proxy */
     rb_cMusicTrackCollection = rb_define_class_under(rb_mAudioToolbox, "MusicTrackCollection", rb_cObject);
@@ -1397,6 +8093,28 @@ Init_music_player ()
     rb_define_method(rb_cMIDIChannelMessage, "data1", midi_channel_message_data1, 0);
     rb_define_method(rb_cMIDIChannelMessage, "data2", midi_channel_message_data2, 0);
     
+    /* AudioToolbox::MIDIMetaEvent */
+    rb_cMIDIMetaEvent = rb_define_class_under(rb_mAudioToolbox, "MIDIMetaEvent", rb_cObject);
+    rb_define_alloc_func(rb_cMIDIMetaEvent, payload_event_alloc);
+    rb_define_method(rb_cMIDIMetaEvent, "initialize", midi_meta_event_init, 1);
+    rb_define_method(rb_cMIDIMetaEvent, "meta_type", midi_meta_event_meta_type, 0);
+    rb_define_method(rb_cMIDIMetaEvent, "data", payload_event_data, 0);
+    rb_define_method(rb_cMIDIMetaEvent, "length", payload_event_length, 0);
+    
+    /* AudioToolbox::MIDIRawData */
+    rb_cMIDIRawData = rb_define_class_under(rb_mAudioToolbox, "MIDIRawData", rb_cObject);
+    rb_define_alloc_func(rb_cMIDIRawData, payload_event_alloc);
+    rb_define_method(rb_cMIDIRawData, "initialize", payload_event_init, 1);
+    rb_define_method(rb_cMIDIRawData, "data", payload_event_data, 0);
+    rb_define_method(rb_cMIDIRawData, "length", payload_event_length, 0);
+    
+    /* AudioToolbox::MusicUserEvent */
+    rb_cMusicUserEvent = rb_define_class_under(rb_mAudioToolbox, "MusicUserEvent", rb_cObject);
+    rb_define_alloc_func(rb_cMusicUserEvent, payload_event_alloc);
+    rb_define_method(rb_cMusicUserEvent, "initialize", payload_event_init, 1);
+    rb_define_method(rb_cMusicUserEvent, "data", payload_event_data, 0);
+    rb_define_method(rb_cMusicUserEvent, "length", payload_event_length, 0);
+    
     /* AudioToolbox::ExtendedTempoEvent */
     rb_cExtendedTempoEvent = rb_define_class_under(rb_mAudioToolbox, "ExtendedTempoEvent", rb_cObject);
     
@@ -1405,6 +8123,7 @@ Init_music_player ()
     rb_define_alloc_func(rb_cMusicEventIterator, iter_alloc);
     rb_define_method(rb_cMusicEventIterator, "initialize", iter_init, 1);
     rb_define_method(rb_cMusicEventIterator, "seek", iter_seek, 1);
+    rb_define_method(rb_cMusicEventIterator, "seek_bar", iter_seek_bar, 1);
     rb_define_method(rb_cMusicEventIterator, "next", iter_next, 0);
     rb_define_method(rb_cMusicEventIterator, "prev", iter_prev, 0);
     rb_define_method(rb_cMusicEventIterator, "current?", iter_has_current, 0);
@@ -1416,25 +8135,157 @@ Init_music_player ()
     rb_define_method(rb_cMusicEventIterator, "event=", iter_set_event, 1);
     rb_define_method(rb_cMusicEventIterator, "delete", iter_delete_event, 0);
     
+    /* AudioToolbox::MusicTimeline */
+    rb_cMusicTimeline = rb_define_class_under(rb_mAudioToolbox, "MusicTimeline", rb_cObject);
+    rb_define_alloc_func(rb_cMusicTimeline, timeline_alloc);
+    rb_define_method(rb_cMusicTimeline, "initialize", timeline_init_rb, 1);
+    rb_define_method(rb_cMusicTimeline, "seek", timeline_seek_rb, 1);
+    rb_define_method(rb_cMusicTimeline, "next", timeline_next_rb, 0);
+    rb_define_method(rb_cMusicTimeline, "current?", timeline_has_current, 0);
+    rb_define_method(rb_cMusicTimeline, "time", timeline_get_time, 0);
+    rb_define_method(rb_cMusicTimeline, "event", timeline_get_event, 0);
+    rb_define_method(rb_cMusicTimeline, "pass", timeline_get_pass, 0);
+    rb_define_method(rb_cMusicTimeline, "length", timeline_get_length, 0);
+    rb_define_private_method(rb_cMusicTimeline, "each_internal", timeline_each_internal, 2);
+    
+    /* AudioToolbox::MusicSequenceIterator */
+    rb_cMusicSequenceIterator = rb_define_class_under(rb_mAudioToolbox, "MusicSequenceIterator", rb_cObject);
+    rb_define_alloc_func(rb_cMusicSequenceIterator, seq_iter_alloc);
+    rb_define_const(rb_cMusicSequenceIterator, "RECORD_FORMAT", rb_str_freeze(rb_str_new2(EVENT_RECORD_FORMAT)));
+    rb_define_const(rb_cMusicSequenceIterator, "RECORD_SIZE", INT2FIX(sizeof(EventRecord)));
+    rb_define_method(rb_cMusicSequenceIterator, "initialize", seq_iter_init, -1);
+    rb_define_method(rb_cMusicSequenceIterator, "seek", seq_iter_seek, 1);
+    rb_define_method(rb_cMusicSequenceIterator, "next", seq_iter_next, 0);
+    rb_define_method(rb_cMusicSequenceIterator, "current?", seq_iter_has_current, 0);
+    rb_define_method(rb_cMusicSequenceIterator, "time", seq_iter_get_time, 0);
+    rb_define_method(rb_cMusicSequenceIterator, "event", seq_iter_get_event, 0);
+    rb_define_method(rb_cMusicSequenceIterator, "track_index", seq_iter_get_track_index, 0);
+    rb_define_method(rb_cMusicSequenceIterator, "read", seq_iter_read, 1);
+    rb_define_private_method(rb_cMusicSequenceIterator, "each_internal", seq_iter_each_internal, 1);
+    
+    /* AudioToolbox::MIDIOutput */
+    rb_cMIDIOutput = rb_define_class_under(rb_mAudioToolbox, "MIDIOutput", rb_cObject);
+    rb_define_alloc_func(rb_cMIDIOutput, output_alloc);
+    rb_define_method(rb_cMIDIOutput, "initialize", output_init, 1);
+    rb_define_method(rb_cMIDIOutput, "<<", output_add, 1);
+    rb_define_method(rb_cMIDIOutput, "flush", output_flush, 0);
+    rb_define_method(rb_cMIDIOutput, "close", output_close, 0);
+    rb_define_method(rb_cMIDIOutput, "closed?", output_is_closed, 0);
+    rb_define_method(rb_cMIDIOutput, "writes", output_get_writes, 0);
+    rb_define_method(rb_cMIDIOutput, "messages", output_get_messages, 0);
+    rb_define_method(rb_cMIDIOutput, "bytes_written", output_get_bytes_written, 0);
+    rb_define_method(rb_cMIDIOutput, "dropped", output_get_dropped, 0);
+    
+    /* AudioToolbox::MIDIStream */
+    rb_cMIDIStream = rb_define_class_under(rb_mAudioToolbox, "MIDIStream", rb_cObject);
+    rb_define_alloc_func(rb_cMIDIStream, midi_stream_alloc);
+    rb_define_method(rb_cMIDIStream, "initialize", midi_stream_init, -1);
+    rb_define_method(rb_cMIDIStream, "midi_endpoint=", midi_stream_set_midi_endpoint, 1);
+    rb_define_method(rb_cMIDIStream, "close", midi_stream_close, 0);
+    rb_define_method(rb_cMIDIStream, "closed?", midi_stream_is_closed, 0);
+    rb_define_method(rb_cMIDIStream, "tracks", midi_stream_get_tracks, 0);
+    rb_define_method(rb_cMIDIStream, "division", midi_stream_get_division, 0);
+    rb_define_method(rb_cMIDIStream, "length", midi_stream_get_length, 0);
+    rb_define_method(rb_cMIDIStream, "events", midi_stream_get_events, 0);
+    
+    /* AudioToolbox::MIDIRecorder */
+    rb_cMIDIRecorder = rb_define_class_under(rb_mAudioToolbox, "MIDIRecorder", rb_cObject);
+    rb_define_alloc_func(rb_cMIDIRecorder, recorder_alloc);
+    rb_define_method(rb_cMIDIRecorder, "initialize", recorder_init_rb, 3);
+    rb_define_private_method(rb_cMIDIRecorder, "start_internal", recorder_start_rb, 0);
+    rb_define_private_method(rb_cMIDIRecorder, "stop_internal", recorder_stop_rb, 0);
+    rb_define_private_method(rb_cMIDIRecorder, "close_internal", recorder_close_rb, 0);
+    rb_define_private_method(rb_cMIDIRecorder, "notify_fd", recorder_get_notify_fd, 0);
+    rb_define_method(rb_cMIDIRecorder, "recording?", recorder_is_recording, 0);
+    rb_define_method(rb_cMIDIRecorder, "drain", recorder_drain_rb, 0);
+    rb_define_method(rb_cMIDIRecorder, "overruns", recorder_get_overruns, 0);
+    
+    /* AudioToolbox::RenderCache */
+    rb_cRenderCache = rb_define_class_under(rb_mAudioToolbox, "RenderCache", rb_cObject);
+    rb_define_alloc_func(rb_cRenderCache, render_cache_alloc);
+    rb_define_method(rb_cRenderCache, "initialize", render_cache_init, -1);
+    rb_define_method(rb_cRenderCache, "max_size", render_cache_get_max_size, 0);
+    rb_define_method(rb_cRenderCache, "max_size=", render_cache_set_max_size, 1);
+    rb_define_method(rb_cRenderCache, "size", render_cache_get_size, 0);
+    rb_define_method(rb_cRenderCache, "count", render_cache_get_count, 0);
+    rb_define_method(rb_cRenderCache, "hits", render_cache_get_hits, 0);
+    rb_define_method(rb_cRenderCache, "misses", render_cache_get_misses, 0);
+    rb_define_method(rb_cRenderCache, "evictions", render_cache_get_evictions, 0);
+    rb_define_method(rb_cRenderCache, "clear", render_cache_clear, 0);
+    
+    /* AudioToolbox::MIDIFile */
+    rb_cMIDIFile = rb_define_class_under(rb_mAudioToolbox, "MIDIFile", rb_cObject);
+    rb_define_singleton_method(rb_cMIDIFile, "convert_internal", midi_file_convert_internal, 6);
+    
+    /* AudioToolbox::FileOperation */
+    rb_cFileOperation = rb_define_class_under(rb_mAudioToolbox, "FileOperation", rb_cObject);
+    rb_undef_alloc_func(rb_cFileOperation);
+    rb_define_method(rb_cFileOperation, "done?", file_op_is_done, 0);
+    rb_define_method(rb_cFileOperation, "cancel", file_op_cancel, 0);
+    rb_define_method(rb_cFileOperation, "progress", file_op_get_progress, 0);
+    rb_define_private_method(rb_cFileOperation, "notify_fd", file_op_get_notify_fd, 0);
+    rb_define_private_method(rb_cFileOperation, "result", file_op_result, 0);
+    
     /* Symbols */
+    rb_sBar = CSTR2SYM("bar");
     rb_sBeat = CSTR2SYM("beat");
     rb_sBpm = CSTR2SYM("bpm");
+    rb_sBytes = CSTR2SYM("bytes");
+    rb_sCache = CSTR2SYM("cache");
     rb_sChannel = CSTR2SYM("channel");
+    rb_sChannelPressure = CSTR2SYM("channel_pressure");
+    rb_sChannels = CSTR2SYM("channels");
+    rb_sControlChange = CSTR2SYM("control_change");
+    rb_sData = CSTR2SYM("data");
     rb_sData1 = CSTR2SYM("data1");
     rb_sData2 = CSTR2SYM("data2");
+    rb_sDenominator = CSTR2SYM("denominator");
     rb_sDuration = CSTR2SYM("duration");
+    rb_sError = CSTR2SYM("error");
+    rb_sEvents = CSTR2SYM("events");
+    rb_sFrom = CSTR2SYM("from");
+    rb_sKeyPressure = CSTR2SYM("key_pressure");
     rb_sNote = CSTR2SYM("note");
+    rb_sNotes = CSTR2SYM("notes");
+    rb_sNotesPerSecond = CSTR2SYM("notes_per_second");
     rb_sLength = CSTR2SYM("length");
     rb_sLoopInfo = CSTR2SYM("loop_info");
+    rb_sMaxPolyphony = CSTR2SYM("max_polyphony");
+    rb_sMeta = CSTR2SYM("meta");
+    rb_sMetaType = CSTR2SYM("meta_type");
     rb_sMute = CSTR2SYM("mute");
     rb_sNumber = CSTR2SYM("number");
+    rb_sNumerator = CSTR2SYM("numerator");
+    rb_sOldest = CSTR2SYM("oldest");
+    rb_sOutput = CSTR2SYM("output");
+    rb_sPacked = CSTR2SYM("packed");
+    rb_sPath = CSTR2SYM("path");
+    rb_sPitchBend = CSTR2SYM("pitch_bend");
+    rb_sPitches = CSTR2SYM("pitches");
+    rb_sPolyphony = CSTR2SYM("polyphony");
     rb_sPressure = CSTR2SYM("pressure");
     rb_sProgram = CSTR2SYM("program");
+    rb_sProgramChange = CSTR2SYM("program_change");
+    rb_sQuietest = CSTR2SYM("quietest");
+    rb_sRawData = CSTR2SYM("raw_data");
     rb_sReleaseVelocity = CSTR2SYM("release_velocity");
     rb_sSamp = CSTR2SYM("samp");
+    rb_sSampleRate = CSTR2SYM("sample_rate");
+    rb_sSeconds = CSTR2SYM("seconds");
     rb_sSecs = CSTR2SYM("secs");
     rb_sSolo = CSTR2SYM("solo");
     rb_sStatus = CSTR2SYM("status");
+    rb_sSteal = CSTR2SYM("steal");
+    rb_sTempo = CSTR2SYM("tempo");
+    rb_sThreads = CSTR2SYM("threads");
+    rb_sTo = CSTR2SYM("to");
+    rb_sTotalBytes = CSTR2SYM("total_bytes");
+    rb_sTotalTracks = CSTR2SYM("total_tracks");
+    rb_sTracks = CSTR2SYM("tracks");
+    rb_sType = CSTR2SYM("type");
+    rb_sUser = CSTR2SYM("user");
     rb_sValue = CSTR2SYM("value");
+    rb_sVelocities = CSTR2SYM("velocities");
     rb_sVelocity = CSTR2SYM("velocity");
+    rb_sWindow = CSTR2SYM("window");
 }
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "pair.h"
+#include <stdlib.h>
+#include <string.h>
+
+void
+note_pairs_init (NotePairs *pairs)
+{
+    memset(pairs->top, 0xFF, sizeof(pairs->top));
+    pairs->below = NULL;
+    pairs->capacity = 0;
+}
+
+void
+note_pairs_free (NotePairs *pairs)
+{
+    free(pairs->below);
+    note_pairs_init(pairs);
+}
+
+int
+note_pairs_reset (NotePairs *pairs, size_t count)
+{
+    uint32_t *below;
+    
+    memset(pairs->top, 0xFF, sizeof(pairs->top));
+    if (count > pairs->capacity) {
+        if (!(below = realloc(pairs->below, count * sizeof(uint32_t)))) return -1;
+        pairs->below = below;
+        pairs->capacity = count;
+    }
+    return 0;
+}
+
+uint32_t
+note_pairs_feed (NotePairs *pairs, uint32_t index, uint8_t status, uint8_t key, uint8_t velocity)
+{
+    uint8_t kind = status & 0xF0, channel = status & 0x0F;
+    uint32_t *top = &pairs->top[channel][key & 0x7F];
+    
+    if (kind == 0x90 && velocity > 0) {
+        pairs->below[index] = *top;
+        *top = index;
+        return NOTE_PAIRS_NONE;
+    }
+    if (kind == 0x80 || kind == 0x90) return note_pairs_pop(pairs, channel, key);
+    return NOTE_PAIRS_NONE;
+}
+
+uint32_t
+note_pairs_pop (NotePairs *pairs, uint8_t channel, uint8_t key)
+{
+    uint32_t *top = &pairs->top[channel & 0x0F][key & 0x7F], index = *top;
+    if (index != NOTE_PAIRS_NONE) *top = pairs->below[index];
+    return index;
+}
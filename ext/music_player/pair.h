@@ -0,0 +1,43 @@
+/*
+ * Pairs note ons with the note offs which end them, for turning the raw
+ * channel messages of a Standard MIDI File into notes with durations.
+ *
+ * Each channel and key has a stack of the note ons still sounding, threaded
+ * through an array with an entry per event. A note struck again before it
+ * is released nests inside the earlier one, so each note off ends the most
+ * recent note on of its key. A note on with velocity zero is a note off.
+ * Pairing is constant time per event and allocates nothing once the array
+ * has room for every event.
+ */
+
+#ifndef MUSIC_PLAYER_PAIR_H
+#define MUSIC_PLAYER_PAIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NOTE_PAIRS_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t top[16][128];  /* the newest note on sounding, or NOTE_PAIRS_NONE */
+    uint32_t *below;        /* for each note on, the one sounding before it */
+    size_t capacity;
+} NotePairs;
+
+void note_pairs_init (NotePairs *pairs);
+void note_pairs_free (NotePairs *pairs);
+
+/* Empty every stack and make room for count events. Returns -1 if the
+ * array could not be grown. */
+int note_pairs_reset (NotePairs *pairs, size_t count);
+
+/* Take the event at index, which must be below the count given to reset.
+ * Returns the index of the note on it ends if it is a note off, or
+ * NOTE_PAIRS_NONE. */
+uint32_t note_pairs_feed (NotePairs *pairs, uint32_t index, uint8_t status, uint8_t key, uint8_t velocity);
+
+/* Remove and return the newest note on of a key still sounding, or
+ * NOTE_PAIRS_NONE. */
+uint32_t note_pairs_pop (NotePairs *pairs, uint8_t channel, uint8_t key);
+
+#endif
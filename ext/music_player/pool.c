@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t count;
+    pool_job_fn fn;
+    void *ctx;
+    volatile int *cancel;
+} Pool;
+
+unsigned
+pool_default_threads (void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned) n : 1;
+}
+
+static void *
+pool_worker (void *arg)
+{
+    Pool *pool = (Pool *) arg;
+    size_t job;
+    
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        job = pool->next < pool->count && !(pool->cancel && *pool->cancel) ? pool->next++ : pool->count;
+        pthread_mutex_unlock(&pool->lock);
+        if (job == pool->count) return NULL;
+        pool->fn(pool->ctx, job);
+    }
+}
+
+void
+pool_run (unsigned threads, size_t count, pool_job_fn fn, void *ctx, volatile int *cancel)
+{
+    pthread_t *workers;
+    unsigned i, started = 0;
+    Pool pool;
+    
+    if (threads < 1) threads = 1;
+    if (threads > count) threads = count ? (unsigned) count : 1;
+    
+    pthread_mutex_init(&pool.lock, NULL);
+    pool.next = 0;
+    pool.count = count;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.cancel = cancel;
+    
+    /* If threads cannot be created, the caller simply does more of the work. */
+    workers = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    for (i = 0; workers && i < threads - 1; i++) {
+        if (pthread_create(&workers[started], NULL, pool_worker, &pool)) break;
+        started++;
+    }
+    pool_worker(&pool);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    
+    free(workers);
+    pthread_mutex_destroy(&pool.lock);
+}
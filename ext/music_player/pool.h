@@ -0,0 +1,23 @@
+/*
+ * A fork-join pool of POSIX threads for running independent jobs without
+ * the GVL. Jobs must not call into Ruby.
+ */
+
+#ifndef MUSIC_PLAYER_POOL_H
+#define MUSIC_PLAYER_POOL_H
+
+#include <stddef.h>
+
+typedef void (*pool_job_fn) (void *ctx, size_t job);
+
+/* Number of threads to use when the caller does not say. */
+unsigned pool_default_threads (void);
+
+/*
+ * Run jobs 0 to count - 1 on up to threads threads, including the calling
+ * one, and return when all have finished. Jobs not yet started when
+ * *cancel becomes non-zero are skipped.
+ */
+void pool_run (unsigned threads, size_t count, pool_job_fn fn, void *ctx, volatile int *cancel);
+
+#endif
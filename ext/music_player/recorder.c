@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "recorder.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MASK (RECORDER_RING_SIZE - 1)
+
+static int
+set_flags (int fd, int fl)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | fl) < 0) return -1;
+    return fcntl(fd, F_SETFD, FD_CLOEXEC);
+}
+
+static int
+open_pipe (int fds[2])
+{
+    if (pipe(fds) < 0) return -1;
+    if (set_flags(fds[0], O_NONBLOCK) < 0 || set_flags(fds[1], O_NONBLOCK) < 0) {
+        int saved = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int
+recorder_init (Recorder *rec)
+{
+    memset(rec, 0, sizeof(Recorder));
+    rec->fd = rec->wake[0] = rec->wake[1] = rec->notify[0] = rec->notify[1] = -1;
+    if (open_pipe(rec->wake) < 0) return -1;
+    if (open_pipe(rec->notify) < 0) {
+        int saved = errno;
+        recorder_close(rec);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int
+recorder_open (Recorder *rec, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return -1;
+    if (set_flags(fd, 0) < 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    rec->fd = fd;
+    rec->owned = 1;
+    return 0;
+}
+
+void
+recorder_attach (Recorder *rec, int fd)
+{
+    rec->fd = fd;
+    rec->owned = 0;
+}
+
+static void
+recorder_push (Recorder *rec, const RecorderEvent *ev)
+{
+    size_t head = rec->head;
+    uint8_t byte = 0;
+    
+    if (head - __atomic_load_n(&rec->tail, __ATOMIC_ACQUIRE) == RECORDER_RING_SIZE) {
+        rec->overruns++;
+        return;
+    }
+    rec->ring[head & RING_MASK] = *ev;
+    __atomic_store_n(&rec->head, head + 1, __ATOMIC_SEQ_CST);
+    
+    /* If the consumer had taken everything before this event it may be
+     * about to sleep, so wake it. Both sides publish their index before
+     * reading the other's, so at least one of them sees the event. */
+    if (__atomic_load_n(&rec->tail, __ATOMIC_SEQ_CST) == head && rec->notify[1] >= 0)
+        while (write(rec->notify[1], &byte, 1) < 0 && errno == EINTR);
+}
+
+size_t
+recorder_drain (Recorder *rec, RecorderEvent *out, size_t max)
+{
+    size_t tail = rec->tail, head, n = 0;
+    uint8_t buf[64];
+    
+    if (rec->notify[0] >= 0)
+        while (read(rec->notify[0], buf, sizeof(buf)) > 0);
+    
+    head = __atomic_load_n(&rec->head, __ATOMIC_SEQ_CST);
+    while (n < max && tail != head) {
+        out[n++] = rec->ring[tail & RING_MASK];
+        tail++;
+        if (tail == head) {
+            __atomic_store_n(&rec->tail, tail, __ATOMIC_SEQ_CST);
+            head = __atomic_load_n(&rec->head, __ATOMIC_SEQ_CST);
+        }
+    }
+    __atomic_store_n(&rec->tail, tail, __ATOMIC_SEQ_CST);
+    return n;
+}
+
+static void
+note_end (Recorder *rec, int channel, int note, uint8_t release, double beat)
+{
+    RecorderEvent ev;
+    
+    if (!rec->on_velocity[channel][note]) return;
+    ev.beat = rec->on_beat[channel][note];
+    ev.duration = (float) (beat - ev.beat);
+    ev.status = 0x90 | channel;
+    ev.data1 = note;
+    ev.data2 = rec->on_velocity[channel][note];
+    ev.release = release;
+    rec->on_velocity[channel][note] = 0;
+    recorder_push(rec, &ev);
+}
+
+static void
+message (Recorder *rec, double beat)
+{
+    int channel = rec->status & 0x0F, note = rec->data[0];
+    RecorderEvent ev;
+    
+    switch (rec->status & 0xF0) {
+    case 0x90:
+        if (rec->data[1]) {
+            /* A repeated note on ends the note already sounding. */
+            note_end(rec, channel, note, 0, beat);
+            rec->on_beat[channel][note] = beat;
+            rec->on_velocity[channel][note] = rec->data[1];
+            return;
+        }
+        note_end(rec, channel, note, 0, beat);
+        return;
+    case 0x80:
+        note_end(rec, channel, note, rec->data[1], beat);
+        return;
+    }
+    
+    ev.beat = beat;
+    ev.duration = 0.0f;
+    ev.status = rec->status;
+    ev.data1 = rec->data[0];
+    ev.data2 = rec->data[1];
+    ev.release = 0;
+    recorder_push(rec, &ev);
+}
+
+void
+recorder_parse (Recorder *rec, const uint8_t *bytes, size_t len, double beat)
+{
+    size_t i;
+    uint8_t b;
+    int needed;
+    
+    for (i = 0; i < len; i++) {
+        b = bytes[i];
+        if (b >= 0xF8) continue;            /* real time messages may appear anywhere */
+        if (b >= 0x80) {
+            rec->have = 0;
+            rec->sysex = b == 0xF0;
+            /* System common messages are skipped and cancel running status. */
+            rec->status = b < 0xF0 ? b : 0;
+            continue;
+        }
+        if (rec->sysex || !rec->status) continue;
+        
+        rec->data[rec->have++] = b;
+        needed = (rec->status & 0xF0) == 0xC0 || (rec->status & 0xF0) == 0xD0 ? 1 : 2;
+        if (rec->have == needed) {
+            if (needed == 1) rec->data[1] = 0;
+            message(rec, beat);
+            rec->have = 0;
+        }
+    }
+}
+
+static void *
+recorder_run (void *arg)
+{
+    Recorder *rec = (Recorder *) arg;
+    struct pollfd fds[2];
+    uint8_t buf[256];
+    ssize_t n;
+    int channel, note;
+    double beat;
+    
+    fds[0].fd = rec->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = rec->wake[0];
+    fds[1].events = POLLIN;
+    
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (!fds[0].revents) continue;
+        
+        n = read(rec->fd, buf, sizeof(buf));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (n <= 0) {
+            /* The source has closed; wait to be stopped. */
+            fds[0].fd = -1;
+            continue;
+        }
+        recorder_parse(rec, buf, n, rec->clock(rec->clock_ctx));
+    }
+    
+    beat = rec->clock(rec->clock_ctx);
+    for (channel = 0; channel < 16; channel++)
+        for (note = 0; note < 128; note++)
+            note_end(rec, channel, note, 0, beat);
+    return NULL;
+}
+
+int
+recorder_start (Recorder *rec, recorder_clock_fn clock, void *ctx)
+{
+    int err;
+    if (rec->running) return 0;
+    rec->clock = clock;
+    rec->clock_ctx = ctx;
+    if ((err = pthread_create(&rec->thread, NULL, recorder_run, rec))) {
+        errno = err;
+        return -1;
+    }
+    rec->running = 1;
+    return 0;
+}
+
+void
+recorder_stop (Recorder *rec)
+{
+    uint8_t byte = 0, buf[64];
+    if (!rec->running) return;
+    while (write(rec->wake[1], &byte, 1) < 0 && errno == EINTR);
+    pthread_join(rec->thread, NULL);
+    while (read(rec->wake[0], buf, sizeof(buf)) > 0);
+    rec->running = 0;
+}
+
+void
+recorder_close (Recorder *rec)
+{
+    int i;
+    recorder_stop(rec);
+    if (rec->owned && rec->fd >= 0) close(rec->fd);
+    rec->fd = -1;
+    for (i = 0; i < 2; i++) {
+        if (rec->wake[i] >= 0) close(rec->wake[i]);
+        if (rec->notify[i] >= 0) close(rec->notify[i]);
+        rec->wake[i] = rec->notify[i] = -1;
+    }
+}
@@ -0,0 +1,77 @@
+/*
+ * Live MIDI input from a file descriptor, such as an ALSA rawmidi device or
+ * a pipe.
+ *
+ * A dedicated thread reads and parses the byte stream, timestamps each
+ * message with a caller-supplied beat clock and pairs note ons with their
+ * note offs. Finished events are handed to a single consumer through a
+ * lock-free ring; the thread writes to the notify descriptor whenever the
+ * consumer may have found the ring empty, so the consumer can sleep on it.
+ */
+
+#ifndef MUSIC_PLAYER_RECORDER_H
+#define MUSIC_PLAYER_RECORDER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDER_RING_SIZE 4096     /* must be a power of two */
+
+typedef double (*recorder_clock_fn) (void *ctx);
+
+/* A note (status 0x9n) carrying its duration and release velocity, or any
+ * other channel message. */
+typedef struct {
+    double beat;
+    float duration;
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+    uint8_t release;
+} RecorderEvent;
+
+typedef struct {
+    int fd;
+    int owned;
+    int wake[2];
+    int notify[2];
+    pthread_t thread;
+    int running;
+    recorder_clock_fn clock;
+    void *clock_ctx;
+    
+    RecorderEvent ring[RECORDER_RING_SIZE];
+    size_t head;                /* written by the input thread */
+    size_t tail;                /* written by the consumer */
+    uint64_t overruns;
+    
+    /* Parser state */
+    uint8_t status;
+    uint8_t data[2];
+    int have;
+    int sysex;
+    
+    /* Sounding notes, by channel and key; a zero velocity means off. */
+    double on_beat[16][128];
+    uint8_t on_velocity[16][128];
+} Recorder;
+
+/* Return 0, or -1 and set errno. */
+int recorder_init (Recorder *rec);
+int recorder_open (Recorder *rec, const char *path);
+void recorder_attach (Recorder *rec, int fd);
+int recorder_start (Recorder *rec, recorder_clock_fn clock, void *ctx);
+
+/* Stop the input thread, ending any notes still held at the current beat. */
+void recorder_stop (Recorder *rec);
+void recorder_close (Recorder *rec);
+
+/* Take up to max events from the ring. Only one thread may drain. */
+size_t recorder_drain (Recorder *rec, RecorderEvent *out, size_t max);
+
+/* Feed bytes to the parser as if read from the source at the given beat.
+ * Must not be called while the input thread is running. */
+void recorder_parse (Recorder *rec, const uint8_t *bytes, size_t len, double beat);
+
+#endif
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "scheduler.h"
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct SchedulerThread {
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        /* the earliest deadline moved, or a task arrived */
+    pthread_cond_t idle;        /* a task returned */
+    SchedulerTask **heap;
+    size_t count;
+    size_t capacity;
+    size_t tasks;               /* in the heap or running */
+    SchedulerTask *running;
+} SchedulerThread;
+
+static SchedulerThread threads[SCHEDULER_MAX_THREADS];
+static unsigned thread_limit;
+static pthread_once_t threads_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t placement;   /* held from choosing a thread to pushing a task */
+static unsigned forks;              /* of the process, for tasks started before one */
+
+/* Only the forking thread survives in the child, so its scheduler starts
+ * afresh: no thread is started and every task is idle. Locks which were
+ * held at the fork are initialized again on first use. */
+static void
+scheduler_atfork_child (void)
+{
+    unsigned i;
+    
+    for (i = 0; i < SCHEDULER_MAX_THREADS; i++) {
+        threads[i].started = 0;
+        threads[i].count = 0;
+        threads[i].tasks = 0;
+        threads[i].running = NULL;
+    }
+    forks++;
+    threads_once = (pthread_once_t) PTHREAD_ONCE_INIT;
+}
+
+static void
+scheduler_init (void)
+{
+    static int registered;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i;
+    
+    thread_limit = n < 1 ? 1 : n > SCHEDULER_MAX_THREADS ? SCHEDULER_MAX_THREADS : (unsigned) n;
+    pthread_mutex_init(&placement, NULL);
+    for (i = 0; i < SCHEDULER_MAX_THREADS; i++) {
+        pthread_mutex_init(&threads[i].lock, NULL);
+        pthread_cond_init(&threads[i].wake, NULL);
+        pthread_cond_init(&threads[i].idle, NULL);
+    }
+    if (!registered) pthread_atfork(NULL, NULL, scheduler_atfork_child);
+    registered = 1;
+}
+
+double
+scheduler_now (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void
+scheduler_task_init (SchedulerTask *task, scheduler_fn fn, void *ctx)
+{
+    task->fn = fn;
+    task->ctx = ctx;
+    task->deadline = 0.0;
+    task->slot = 0;
+    task->thread = NULL;
+    task->forks = 0;
+    task->cancelled = 0;
+    task->hurry = 0;
+}
+
+static void
+heap_swap (SchedulerTask **heap, size_t a, size_t b)
+{
+    SchedulerTask *tmp = heap[a];
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->slot = a;
+    heap[b]->slot = b;
+}
+
+static void
+heap_sift_up (SchedulerThread *st, size_t i)
+{
+    for (; i > 0 && st->heap[i]->deadline < st->heap[(i - 1) / 2]->deadline; i = (i - 1) / 2)
+        heap_swap(st->heap, i, (i - 1) / 2);
+}
+
+static void
+heap_sift_down (SchedulerThread *st, size_t i)
+{
+    size_t least, left, right;
+    
+    for (;;) {
+        least = i;
+        left = 2 * i + 1;
+        right = left + 1;
+        if (left < st->count && st->heap[left]->deadline < st->heap[least]->deadline) least = left;
+        if (right < st->count && st->heap[right]->deadline < st->heap[least]->deadline) least = right;
+        if (least == i) return;
+        heap_swap(st->heap, i, least);
+        i = least;
+    }
+}
+
+/* The heap has room for every task of the thread, so this cannot fail. */
+static void
+heap_push (SchedulerThread *st, SchedulerTask *task)
+{
+    task->slot = st->count;
+    st->heap[st->count++] = task;
+    heap_sift_up(st, task->slot);
+    if (task->slot == 0) pthread_cond_signal(&st->wake);
+}
+
+static void
+heap_remove (SchedulerThread *st, size_t i)
+{
+    SchedulerTask *moved;
+    
+    if (--st->count == i) return;
+    moved = st->heap[i] = st->heap[st->count];
+    moved->slot = i;
+    heap_sift_up(st, i);
+    heap_sift_down(st, moved->slot);
+}
+
+static int
+heap_contains (const SchedulerThread *st, const SchedulerTask *task)
+{
+    return task->slot < st->count && st->heap[task->slot] == task;
+}
+
+static void *
+scheduler_main (void *arg)
+{
+    SchedulerThread *st = (SchedulerThread *) arg;
+    SchedulerTask *task;
+    struct timespec deadline;
+    double now, next, wait;
+    
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        if (st->count == 0) {
+            pthread_cond_wait(&st->wake, &st->lock);
+            continue;
+        }
+        task = st->heap[0];
+        now = scheduler_now();
+        if (task->deadline > now) {
+            /* Condition variables time out on the realtime clock. */
+            wait = task->deadline - now;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (time_t) wait;
+            deadline.tv_nsec += (long) ((wait - floor(wait)) * 1e9);
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&st->wake, &st->lock, &deadline);
+            continue;
+        }
+        
+        heap_remove(st, 0);
+        st->running = task;
+        task->hurry = 0;
+        pthread_mutex_unlock(&st->lock);
+        next = task->fn(task->ctx);
+        pthread_mutex_lock(&st->lock);
+        st->running = NULL;
+        
+        if (next >= 0.0 && !task->cancelled) {
+            task->deadline = task->hurry ? now : next;
+            heap_push(st, task);
+        } else {
+            __atomic_store_n(&task->thread, NULL, __ATOMIC_RELEASE);
+            st->tasks--;
+        }
+        pthread_cond_broadcast(&st->idle);
+    }
+    return NULL;
+}
+
+int
+scheduler_start (SchedulerTask *task, double deadline)
+{
+    SchedulerThread *st = NULL, *least = NULL;
+    SchedulerTask **heap;
+    size_t least_tasks = (size_t) -1;
+    unsigned i;
+    int err = 0;
+    
+    pthread_once(&threads_once, scheduler_init);
+    /* A thread not yet started counts as the least loaded. Tasks started
+     * at once each see the others, as the choice is held until the push. */
+    pthread_mutex_lock(&placement);
+    for (i = 0; i < thread_limit; i++) {
+        st = &threads[i];
+        pthread_mutex_lock(&st->lock);
+        if (!st->started || st->tasks < least_tasks) {
+            least = st;
+            least_tasks = st->started ? st->tasks : 0;
+        }
+        pthread_mutex_unlock(&st->lock);
+        if (!st->started) break;
+    }
+    st = least;
+    
+    pthread_mutex_lock(&st->lock);
+    if (st->tasks == st->capacity) {
+        size_t capacity = st->capacity ? st->capacity * 2 : 16;
+        if (!(heap = realloc(st->heap, capacity * sizeof(SchedulerTask *)))) {
+            err = ENOMEM;
+            goto done;
+        }
+        st->heap = heap;
+        st->capacity = capacity;
+    }
+    if (!st->started) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        err = pthread_create(&st->thread, &attr, scheduler_main, st);
+        pthread_attr_destroy(&attr);
+        if (err) goto done;
+        st->started = 1;
+    }
+    
+    __atomic_store_n(&task->thread, st, __ATOMIC_RELEASE);
+    task->forks = forks;
+    task->cancelled = 0;
+    task->hurry = 0;
+    task->deadline = deadline;
+    st->tasks++;
+    heap_push(st, task);
+    
+    done:
+    pthread_mutex_unlock(&st->lock);
+    pthread_mutex_unlock(&placement);
+    return err;
+}
+
+/* Lock the thread a task is on, or return NULL if it is idle. A thread is
+ * never freed, so it is safe to lock one the task has just left. The thread
+ * is read atomically, as it may be set or cleared under another's lock. */
+static SchedulerThread *
+scheduler_lock_task (SchedulerTask *task)
+{
+    SchedulerThread *st = __atomic_load_n(&task->thread, __ATOMIC_ACQUIRE);
+    
+    if (!st) return NULL;
+    /* Its thread did not survive the fork. */
+    if (task->forks != forks) {
+        __atomic_store_n(&task->thread, NULL, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    pthread_mutex_lock(&st->lock);
+    if (task->thread == st) return st;
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+void
+scheduler_reschedule (SchedulerTask *task, double deadline)
+{
+    SchedulerThread *st = scheduler_lock_task(task);
+    
+    if (!st) return;
+    if (st->running == task) {
+        task->hurry = 1;
+    } else if (heap_contains(st, task)) {
+        task->deadline = deadline;
+        heap_sift_up(st, task->slot);
+        heap_sift_down(st, task->slot);
+        if (task->slot == 0) pthread_cond_signal(&st->wake);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+void
+scheduler_cancel (SchedulerTask *task)
+{
+    SchedulerThread *st = scheduler_lock_task(task);
+    
+    if (!st) return;
+    task->cancelled = 1;
+    while (st->running == task)
+        pthread_cond_wait(&st->idle, &st->lock);
+    if (task->thread == st) {
+        if (heap_contains(st, task)) heap_remove(st, task->slot);
+        __atomic_store_n(&task->thread, NULL, __ATOMIC_RELEASE);
+        st->tasks--;
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+unsigned
+scheduler_threads (void)
+{
+    unsigned i, count = 0;
+    
+    pthread_once(&threads_once, scheduler_init);
+    for (i = 0; i < thread_limit; i++) {
+        pthread_mutex_lock(&threads[i].lock);
+        count += threads[i].started ? 1 : 0;
+        pthread_mutex_unlock(&threads[i].lock);
+    }
+    return count;
+}
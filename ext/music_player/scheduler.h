@@ -0,0 +1,61 @@
+/*
+ * A process-wide scheduler running timed tasks on a small, fixed pool of
+ * threads, so that many players can play at once without a thread each.
+ *
+ * Each thread keeps a binary min-heap of its tasks ordered by deadline and
+ * sleeps until the earliest is due, so the cost of scheduling grows with
+ * the rate at which tasks come due rather than with their number. A task
+ * runs on the least loaded thread when it is started and stays there until
+ * it finishes or is cancelled. Deadlines are in seconds on the monotonic
+ * clock of scheduler_now.
+ *
+ * Task functions run on a scheduler thread with no lock held, and must not
+ * call into Ruby or block for long, as other tasks wait on the same thread.
+ */
+
+#ifndef MUSIC_PLAYER_SCHEDULER_H
+#define MUSIC_PLAYER_SCHEDULER_H
+
+#include <stddef.h>
+
+/* Threads are started as tasks need them, up to the number of processors
+ * or this many, whichever is fewer. */
+#define SCHEDULER_MAX_THREADS 4
+
+/* Runs a task, returning its next deadline, or a negative number once the
+ * task is finished. */
+typedef double (*scheduler_fn) (void *ctx);
+
+struct SchedulerThread;
+
+typedef struct {
+    scheduler_fn fn;
+    void *ctx;
+    double deadline;
+    size_t slot;                    /* in its thread's heap */
+    struct SchedulerThread *thread; /* NULL while the task is idle */
+    unsigned forks;                 /* of the process when it was started */
+    int cancelled;
+    int hurry;                      /* run again as soon as it returns */
+} SchedulerTask;
+
+double scheduler_now (void);
+
+void scheduler_task_init (SchedulerTask *task, scheduler_fn fn, void *ctx);
+
+/* Schedule an idle task. Returns 0, or an errno value if no thread could
+ * take it. */
+int scheduler_start (SchedulerTask *task, double deadline);
+
+/* Bring a scheduled task's deadline forward, or push it back. */
+void scheduler_reschedule (SchedulerTask *task, double deadline);
+
+/* Remove a task, waiting for it to return if it is running; afterwards it
+ * is idle. Must not be called from a task function. */
+void scheduler_cancel (SchedulerTask *task);
+
+/* Threads started so far. A child process starts with none, and with the
+ * tasks of its parent idle. */
+unsigned scheduler_threads (void);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "signature.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Tolerance for a change which falls on a bar line. */
+#define SIGNATURE_EPSILON 1e-9
+
+static double
+signature_bar_beats (const Signature *sig)
+{
+    return sig->numerator * 4.0 / sig->denominator;
+}
+
+static double
+signature_unit (const Signature *sig)
+{
+    return 4.0 / sig->denominator;
+}
+
+int
+signature_map_init (SignatureMap *map)
+{
+    memset(map, 0, sizeof(SignatureMap));
+    return signature_map_push(map, 0.0, 4, 4);
+}
+
+void
+signature_map_free (SignatureMap *map)
+{
+    free(map->entries);
+    memset(map, 0, sizeof(SignatureMap));
+}
+
+int
+signature_map_push (SignatureMap *map, double beat, uint8_t numerator, uint8_t denominator)
+{
+    Signature *last, *entries;
+    double bars;
+    int64_t bar = 0;
+    
+    if (numerator == 0 || denominator == 0) return 0;
+    if (map->count > 0) {
+        last = &map->entries[map->count - 1];
+        if (beat <= last->beat + SIGNATURE_EPSILON) {
+            last->numerator = numerator;
+            last->denominator = denominator;
+            return 0;
+        }
+        bars = (beat - last->beat) / signature_bar_beats(last);
+        bar = last->bar + (int64_t) ceil(bars - SIGNATURE_EPSILON);
+        if (fabs(bars - round(bars)) < SIGNATURE_EPSILON &&
+            last->numerator == numerator && last->denominator == denominator)
+            return 0;
+    }
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 8;
+        entries = realloc(map->entries, capacity * sizeof(Signature));
+        if (!entries) return -1;
+        map->entries = entries;
+        map->capacity = capacity;
+    }
+    map->entries[map->count].beat = beat;
+    map->entries[map->count].bar = bar;
+    map->entries[map->count].numerator = numerator;
+    map->entries[map->count].denominator = denominator;
+    map->count++;
+    return 0;
+}
+
+void
+signature_map_bar_beat (const SignatureMap *map, double beat, uint16_t divisor, BarBeatTime *out)
+{
+    uint32_t lo = 0, hi = map->count, mid;
+    const Signature *sig;
+    int64_t ticks, per_bar, bars;
+    
+    /* Find the last entry at or before the beat. */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (map->entries[mid].beat <= beat) lo = mid;
+        else hi = mid;
+    }
+    sig = &map->entries[lo];
+    ticks = llround((beat - sig->beat) / signature_unit(sig) * divisor);
+    per_bar = (int64_t) sig->numerator * divisor;
+    
+    /* Rounding may carry a beat just short of the next entry onto it. */
+    if (lo + 1 < map->count &&
+        sig->beat + (double) ticks / divisor * signature_unit(sig) >= map->entries[lo + 1].beat - SIGNATURE_EPSILON) {
+        sig = &map->entries[lo + 1];
+        ticks = 0;
+    }
+    bars = ticks / per_bar;
+    if (ticks % per_bar < 0) bars--;
+    ticks -= bars * per_bar;
+    out->bar = (int32_t) (sig->bar + bars + 1);
+    out->beat = (uint16_t) (ticks / divisor + 1);
+    out->subbeat = (uint16_t) (ticks % divisor);
+}
+
+double
+signature_map_beats (const SignatureMap *map, const BarBeatTime *pos, uint16_t divisor)
+{
+    uint32_t lo = 0, hi = map->count, mid;
+    int64_t bar = (int64_t) pos->bar - 1;
+    const Signature *sig;
+    
+    /* Find the last entry at or before the bar. */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (map->entries[mid].bar <= bar) lo = mid;
+        else hi = mid;
+    }
+    sig = &map->entries[lo];
+    return sig->beat + (bar - sig->bar) * signature_bar_beats(sig) +
+           ((pos->beat - 1) + (double) pos->subbeat / divisor) * signature_unit(sig);
+}
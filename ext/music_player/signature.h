@@ -0,0 +1,52 @@
+/*
+ * An index of a sequence's time signatures, for converting between beats
+ * and bar:beat:subbeat positions.
+ *
+ * Each entry starts a new bar at its beat, so a change which falls within a
+ * bar cuts that bar short. Entries are in ascending order of both beat and
+ * bar, and the first is always at beat zero, so either conversion is a
+ * binary search followed by a little arithmetic. Beats count quarter notes,
+ * as elsewhere; the beats of a bar:beat position count the signature's
+ * denominator, as in CABarBeatTime.
+ */
+
+#ifndef MUSIC_PLAYER_SIGNATURE_H
+#define MUSIC_PLAYER_SIGNATURE_H
+
+#include <stdint.h>
+
+typedef struct {
+    double beat;            /* where the signature takes effect */
+    int64_t bar;            /* zero-based index of the bar starting there */
+    uint8_t numerator;
+    uint8_t denominator;    /* a power of two */
+} Signature;
+
+typedef struct {
+    Signature *entries;
+    uint32_t count;
+    uint32_t capacity;
+} SignatureMap;
+
+/* A position with a one-based bar and beat. Packed as "lSS". */
+typedef struct {
+    int32_t bar;
+    uint16_t beat;
+    uint16_t subbeat;
+} BarBeatTime;
+
+/* Start with 4/4 at beat zero. Returns -1 if the map could not be allocated. */
+int signature_map_init (SignatureMap *map);
+void signature_map_free (SignatureMap *map);
+
+/* Add a signature at beat, which must not precede the last one added.
+ * Returns -1 if the map could not be grown. */
+int signature_map_push (SignatureMap *map, double beat, uint8_t numerator, uint8_t denominator);
+
+/* The position of beat, with divisor subbeats to a beat. */
+void signature_map_bar_beat (const SignatureMap *map, double beat, uint16_t divisor, BarBeatTime *out);
+
+/* The beat of a position with divisor subbeats to a beat. */
+double signature_map_beats (const SignatureMap *map, const BarBeatTime *pos, uint16_t divisor);
+
+#endif
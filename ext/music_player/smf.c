@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "smf.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *
+smf_strerror (int err)
+{
+    switch (err) {
+    case SMF_OK:            return "Success.";
+    case SMF_ERR_IO:        return "Could not read or write the file.";
+    case SMF_ERR_NOMEM:     return "Out of memory.";
+    case SMF_ERR_NOT_SMF:   return "Not a Standard MIDI File.";
+    case SMF_ERR_SMPTE:     return "SMPTE time division is not supported.";
+    case SMF_ERR_TRUNCATED: return "The file is truncated.";
+    case SMF_ERR_BAD_EVENT: return "The file contains a malformed event.";
+    case SMF_ERR_CANCELLED: return "Cancelled.";
+    default:                return "Unknown error.";
+    }
+}
+
+void
+smf_init (SMF *smf)
+{
+    memset(smf, 0, sizeof(SMF));
+    smf->format = 1;
+    smf->division = 480;
+}
+
+static void
+smf_free_tracks (SMFTrack *tracks, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        free(tracks[i].events);
+    free(tracks);
+}
+
+void
+smf_free (SMF *smf)
+{
+    smf_free_tracks(smf->tracks, smf->track_count);
+    free(smf->bytes);
+    smf_init(smf);
+}
+
+size_t
+smf_event_count (const SMF *smf)
+{
+    size_t i, count = 0;
+    for (i = 0; i < smf->track_count; i++)
+        count += smf->tracks[i].count;
+    return count;
+}
+
+static SMFEvent *
+track_push (SMFTrack *track)
+{
+    SMFEvent *events;
+    size_t capacity;
+    
+    if (track->count == track->capacity) {
+        capacity = track->capacity ? track->capacity * 2 : 64;
+        if (!(events = realloc(track->events, capacity * sizeof(SMFEvent))))
+            return NULL;
+        track->events = events;
+        track->capacity = capacity;
+    }
+    return &track->events[track->count++];
+}
+
+static int
+bytes_push (SMF *smf, const uint8_t *data, uint32_t len, uint32_t *offset)
+{
+    uint8_t *bytes;
+    size_t capacity;
+    
+    if (smf->bytes_len + len > smf->bytes_cap) {
+        capacity = smf->bytes_cap ? smf->bytes_cap : 256;
+        while (capacity < smf->bytes_len + len) capacity *= 2;
+        if (!(bytes = realloc(smf->bytes, capacity)))
+            return SMF_ERR_NOMEM;
+        smf->bytes = bytes;
+        smf->bytes_cap = capacity;
+    }
+    memcpy(smf->bytes + smf->bytes_len, data, len);
+    *offset = (uint32_t) smf->bytes_len;
+    smf->bytes_len += len;
+    return SMF_OK;
+}
+
+/* Reading */
+
+static uint32_t
+read_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int
+read_vlq (const uint8_t **p, const uint8_t *end, uint32_t *value)
+{
+    uint32_t v = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        if (*p >= end) return SMF_ERR_TRUNCATED;
+        v = (v << 7) | (**p & 0x7F);
+        if (!(*(*p)++ & 0x80)) {
+            *value = v;
+            return SMF_OK;
+        }
+    }
+    return SMF_ERR_BAD_EVENT;
+}
+
+/* Bytes following a channel status byte. */
+static int
+channel_data_len (uint8_t status)
+{
+    return (status & 0xE0) == 0xC0 ? 1 : 2;
+}
+
+static int
+read_track (SMF *smf, SMFTrack *track, const uint8_t *p, const uint8_t *end)
+{
+    SMFEvent *ev;
+    uint32_t tick = 0, delta, len;
+    uint8_t status, running = 0;
+    int err;
+    
+    while (p < end) {
+        if ((err = read_vlq(&p, end, &delta))) return err;
+        tick += delta;
+        if (p >= end) return SMF_ERR_TRUNCATED;
+    
+        if (*p & 0x80) {
+            status = *p++;
+        } else if (running) {
+            status = running;
+        } else {
+            return SMF_ERR_BAD_EVENT;
+        }
+    
+        if (status == SMF_META) {
+            if (p >= end) return SMF_ERR_TRUNCATED;
+            if (*p == SMF_META_END_OF_TRACK) return SMF_OK;
+            if (!(ev = track_push(track))) return SMF_ERR_NOMEM;
+            ev->tick = tick;
+            ev->status = status;
+            ev->meta = *p++;
+            ev->data1 = ev->data2 = 0;
+            running = 0;
+        } else if (status == SMF_SYSEX || status == SMF_ESCAPE) {
+            if (!(ev = track_push(track))) return SMF_ERR_NOMEM;
+            ev->tick = tick;
+            ev->status = status;
+            ev->meta = ev->data1 = ev->data2 = 0;
+            running = 0;
+        } else if (status < 0xF0) {
+            if (end - p < channel_data_len(status)) return SMF_ERR_TRUNCATED;
+            if (!(ev = track_push(track))) return SMF_ERR_NOMEM;
+            ev->tick = tick;
+            ev->status = status;
+            ev->meta = 0;
+            ev->data1 = *p++ & 0x7F;
+            ev->data2 = channel_data_len(status) == 2 ? *p++ & 0x7F : 0;
+            ev->offset = ev->length = 0;
+            running = status;
+            continue;
+        } else {
+            /* System common and real-time messages cannot appear in a file. */
+            return SMF_ERR_BAD_EVENT;
+        }
+    
+        if ((err = read_vlq(&p, end, &len))) return err;
+        if ((uint32_t) (end - p) < len) return SMF_ERR_TRUNCATED;
+        if ((err = bytes_push(smf, p, len, &ev->offset))) return err;
+        ev->length = len;
+        p += len;
+    }
+    /* A missing end-of-track event is common enough to tolerate. */
+    return SMF_OK;
+}
+
+int
+smf_read (SMF *smf, const uint8_t *buf, size_t len)
+{
+    const uint8_t *p = buf, *end = buf + len;
+    uint32_t chunk_len;
+    uint16_t declared;
+    int err;
+    
+    smf_free(smf);
+    if (len < 14 || memcmp(p, "MThd", 4) || read_u32(p + 4) < 6)
+        return SMF_ERR_NOT_SMF;
+    
+    smf->format = (p[8] << 8) | p[9];
+    declared = (p[10] << 8) | p[11];
+    smf->division = (p[12] << 8) | p[13];
+    if (smf->division & 0x8000) return SMF_ERR_SMPTE;
+    if (smf->format > 2) return SMF_ERR_NOT_SMF;
+    if (read_u32(p + 4) > len - 8) return SMF_ERR_TRUNCATED;
+    p += 8 + read_u32(p + 4);
+    
+    if (!(smf->tracks = calloc(declared ? declared : 1, sizeof(SMFTrack))))
+        return SMF_ERR_NOMEM;
+    
+    while (smf->track_count < declared && end - p >= 8) {
+        chunk_len = read_u32(p + 4);
+        if ((size_t) (end - p - 8) < chunk_len) return SMF_ERR_TRUNCATED;
+        if (!memcmp(p, "MTrk", 4)) {
+            err = read_track(smf, &smf->tracks[smf->track_count++], p + 8, p + 8 + chunk_len);
+            if (err) return err;
+        }
+        p += 8 + chunk_len;
+    }
+    return smf->track_count == declared ? SMF_OK : SMF_ERR_TRUNCATED;
+}
+
+int
+smf_read_file (SMF *smf, const char *path)
+{
+    return smf_read_file_progress(smf, path, NULL);
+}
+
+/* Files are read in chunks of this many bytes, between progress updates. */
+#define SMF_READ_CHUNK (1 << 20)
+
+int
+smf_read_file_progress (SMF *smf, const char *path, SMFProgress *progress)
+{
+    FILE *in;
+    uint8_t *buf;
+    long len;
+    size_t done = 0, n;
+    int err = SMF_OK, sys_err = 0;
+    
+    if (!(in = fopen(path, "rb"))) return SMF_ERR_IO;
+    if (fseek(in, 0, SEEK_END) || (len = ftell(in)) < 0 || fseek(in, 0, SEEK_SET)) {
+        sys_err = errno;
+        fclose(in);
+        errno = sys_err;
+        return SMF_ERR_IO;
+    }
+    if (!(buf = malloc(len ? len : 1))) {
+        fclose(in);
+        return SMF_ERR_NOMEM;
+    }
+    if (progress) progress->total_bytes = len;
+    while (done < (size_t) len) {
+        if (progress && progress->cancel) {
+            err = SMF_ERR_CANCELLED;
+            break;
+        }
+        n = (size_t) len - done < SMF_READ_CHUNK ? (size_t) len - done : SMF_READ_CHUNK;
+        if (fread(buf + done, 1, n, in) != n) {
+            /* A file cut short while it is read leaves no errno. */
+            sys_err = ferror(in) ? errno : 0;
+            err = SMF_ERR_IO;
+            break;
+        }
+        done += n;
+        if (progress) progress->bytes = done;
+    }
+    fclose(in);
+    if (!err) err = smf_read(smf, buf, len);
+    free(buf);
+    if (err == SMF_ERR_IO) errno = sys_err;
+    return err;
+}
+
+/* Writing */
+
+static void
+write_u32 (uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void
+write_vlq (FILE *out, uint32_t v)
+{
+    uint8_t buf[5];
+    int n = 0;
+    buf[n++] = v & 0x7F;
+    while (v >>= 7) buf[n++] = 0x80 | (v & 0x7F);
+    while (n--) putc(buf[n], out);
+}
+
+static int
+write_track (const SMF *smf, const SMFTrack *track, FILE *out)
+{
+    uint8_t header[8];
+    const SMFEvent *ev;
+    uint32_t tick = 0;
+    uint8_t running = 0;
+    long start, finish;
+    size_t i;
+    
+    memcpy(header, "MTrk\0\0\0\0", 8);
+    if (fwrite(header, 1, 8, out) != 8 || (start = ftell(out)) < 0) return SMF_ERR_IO;
+    
+    for (i = 0; i < track->count; i++) {
+        ev = &track->events[i];
+        write_vlq(out, ev->tick - tick);
+        tick = ev->tick;
+    
+        if (ev->status == SMF_META) {
+            putc(SMF_META, out);
+            putc(ev->meta, out);
+            running = 0;
+        } else if (ev->status == SMF_SYSEX || ev->status == SMF_ESCAPE) {
+            putc(ev->status, out);
+            running = 0;
+        } else {
+            if (ev->status != running) putc(ev->status, out);
+            putc(ev->data1, out);
+            if (channel_data_len(ev->status) == 2) putc(ev->data2, out);
+            running = ev->status;
+            continue;
+        }
+        write_vlq(out, ev->length);
+        if (ev->length && fwrite(smf->bytes + ev->offset, 1, ev->length, out) != ev->length)
+            return SMF_ERR_IO;
+    }
+    putc(0, out);
+    putc(SMF_META, out);
+    putc(SMF_META_END_OF_TRACK, out);
+    putc(0, out);
+    
+    if ((finish = ftell(out)) < 0) return SMF_ERR_IO;
+    write_u32(header, (uint32_t) (finish - start));
+    if (fseek(out, start - 4, SEEK_SET) || fwrite(header, 1, 4, out) != 4 ||
+        fseek(out, finish, SEEK_SET))
+        return SMF_ERR_IO;
+    return SMF_OK;
+}
+
+static int
+write_smf (const SMF *smf, FILE *out, SMFProgress *progress)
+{
+    uint8_t header[14] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6 };
+    long written;
+    size_t i;
+    int err;
+    
+    header[8] = smf->format >> 8;
+    header[9] = smf->format;
+    header[10] = smf->track_count >> 8;
+    header[11] = smf->track_count;
+    header[12] = smf->division >> 8;
+    header[13] = smf->division;
+    if (fwrite(header, 1, 14, out) != 14) return SMF_ERR_IO;
+    if (progress) progress->total_tracks = smf->track_count;
+    
+    for (i = 0; i < smf->track_count; i++) {
+        if (progress && progress->cancel) return SMF_ERR_CANCELLED;
+        if ((err = write_track(smf, &smf->tracks[i], out))) return err;
+        if (progress) {
+            if ((written = ftell(out)) >= 0) progress->bytes = written;
+            progress->tracks = i + 1;
+        }
+    }
+    return ferror(out) ? SMF_ERR_IO : SMF_OK;
+}
+
+int
+smf_write (const SMF *smf, FILE *out)
+{
+    return write_smf(smf, out, NULL);
+}
+
+int
+smf_write_file (const SMF *smf, const char *path)
+{
+    return smf_write_file_progress(smf, path, NULL);
+}
+
+int
+smf_write_file_progress (const SMF *smf, const char *path, SMFProgress *progress)
+{
+    FILE *out;
+    int err, sys_err;
+    
+    if (!(out = fopen(path, "wb"))) return SMF_ERR_IO;
+    err = write_smf(smf, out, progress);
+    sys_err = errno;
+    if (fclose(out) && !err) {
+        err = SMF_ERR_IO;
+        sys_err = errno;
+    }
+    if (err == SMF_ERR_IO) errno = sys_err;
+    return err;
+}
+
+/* Building */
+
+int
+smf_add_tracks (SMF *smf, uint16_t count)
+{
+    SMFTrack *tracks;
+    
+    if (!count) return SMF_OK;
+    if ((size_t) smf->track_count + count > UINT16_MAX) return SMF_ERR_NOMEM;
+    if (!(tracks = realloc(smf->tracks, (smf->track_count + count) * sizeof(SMFTrack))))
+        return SMF_ERR_NOMEM;
+    memset(tracks + smf->track_count, 0, count * sizeof(SMFTrack));
+    smf->tracks = tracks;
+    smf->track_count += count;
+    return SMF_OK;
+}
+
+int
+smf_push_event (SMF *smf, SMFTrack *track, const SMFEvent *ev, const uint8_t *payload)
+{
+    SMFEvent *copy;
+    uint32_t offset = 0;
+    int err;
+    
+    if (ev->length && (err = bytes_push(smf, payload, ev->length, &offset))) return err;
+    if (!(copy = track_push(track))) return SMF_ERR_NOMEM;
+    *copy = *ev;
+    copy->offset = offset;
+    return SMF_OK;
+}
+
+static int
+is_note_off (const SMFEvent *ev)
+{
+    return (ev->status & 0xF0) == 0x80 || ((ev->status & 0xF0) == 0x90 && ev->data2 == 0);
+}
+
+/* Whether a must be written before b. */
+static int
+event_before (const SMFEvent *a, const SMFEvent *b)
+{
+    if (a->tick != b->tick) return a->tick < b->tick;
+    return is_note_off(a) && !is_note_off(b);
+}
+
+/* A bottom-up merge sort, which unlike qsort is stable. */
+int
+smf_sort_track (SMFTrack *track)
+{
+    SMFEvent *tmp, *src, *dst, *swap;
+    size_t n = track->count, width, lo, mid, hi, i, j, k;
+    
+    for (i = 1; i < n; i++)
+        if (event_before(&track->events[i], &track->events[i - 1])) break;
+    if (i >= n) return SMF_OK;
+    if (!(tmp = malloc(n * sizeof(SMFEvent)))) return SMF_ERR_NOMEM;
+    
+    src = track->events;
+    dst = tmp;
+    for (width = 1; width < n; width *= 2) {
+        for (lo = 0; lo < n; lo += 2 * width) {
+            mid = lo + width < n ? lo + width : n;
+            hi = lo + 2 * width < n ? lo + 2 * width : n;
+            i = lo;
+            j = mid;
+            k = lo;
+            while (i < mid && j < hi)
+                dst[k++] = event_before(&src[j], &src[i]) ? src[j++] : src[i++];
+            while (i < mid) dst[k++] = src[i++];
+            while (j < hi) dst[k++] = src[j++];
+        }
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != track->events) memcpy(track->events, src, n * sizeof(SMFEvent));
+    free(tmp);
+    return SMF_OK;
+}
+
+/* Transformations */
+
+void
+smf_requantize (SMF *smf, uint16_t division)
+{
+    uint64_t old = smf->division;
+    size_t i, j;
+    
+    if (!division || division == smf->division) return;
+    for (i = 0; i < smf->track_count; i++)
+        for (j = 0; j < smf->tracks[i].count; j++)
+            smf->tracks[i].events[j].tick =
+                (uint32_t) (((uint64_t) smf->tracks[i].events[j].tick * division + old / 2) / old);
+    smf->division = division;
+}
+
+/* Whether the head of track a must be taken before that of track b, by
+ * tick and then by track index. */
+static int
+head_before (const SMF *smf, const size_t *pos, size_t a, size_t b)
+{
+    uint32_t x = smf->tracks[a].events[pos[a]].tick, y = smf->tracks[b].events[pos[b]].tick;
+    return x != y ? x < y : a < b;
+}
+
+static void
+heap_sift_down (const SMF *smf, const size_t *pos, size_t *heap, size_t count, size_t i)
+{
+    size_t least, left, right, tmp;
+    
+    for (;;) {
+        least = i;
+        left = 2 * i + 1;
+        right = left + 1;
+        if (left < count && head_before(smf, pos, heap[left], heap[least])) least = left;
+        if (right < count && head_before(smf, pos, heap[right], heap[least])) least = right;
+        if (least == i) return;
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* Interleave all tracks by tick. Ties keep track order, then file order.
+ * The tracks with events left are kept in a min-heap on their next event. */
+static int
+merged_events (const SMF *smf, SMFTrack *merged)
+{
+    size_t *pos, *heap, i, top, count = 0, total = smf_event_count(smf);
+    
+    memset(merged, 0, sizeof(SMFTrack));
+    if (!(merged->events = malloc((total ? total : 1) * sizeof(SMFEvent))))
+        return SMF_ERR_NOMEM;
+    if (!(pos = calloc(smf->track_count ? 2 * smf->track_count : 1, sizeof(size_t)))) {
+        free(merged->events);
+        return SMF_ERR_NOMEM;
+    }
+    heap = pos + smf->track_count;
+    merged->capacity = total;
+    
+    for (i = 0; i < smf->track_count; i++)
+        if (smf->tracks[i].count) heap[count++] = i;
+    for (i = count / 2; i-- > 0; )
+        heap_sift_down(smf, pos, heap, count, i);
+    while (count) {
+        top = heap[0];
+        merged->events[merged->count++] = smf->tracks[top].events[pos[top]++];
+        if (pos[top] == smf->tracks[top].count) heap[0] = heap[--count];
+        heap_sift_down(smf, pos, heap, count, 0);
+    }
+    free(pos);
+    return SMF_OK;
+}
+
+int
+smf_merge_tracks (SMF *smf)
+{
+    SMFTrack *tracks;
+    int err;
+    
+    if (!(tracks = calloc(1, sizeof(SMFTrack)))) return SMF_ERR_NOMEM;
+    if ((err = merged_events(smf, tracks))) {
+        free(tracks);
+        return err;
+    }
+    smf_free_tracks(smf->tracks, smf->track_count);
+    smf->tracks = tracks;
+    smf->track_count = 1;
+    smf->format = 0;
+    return SMF_OK;
+}
+
+int
+smf_split_channels (SMF *smf)
+{
+    SMFTrack merged, *tracks;
+    SMFEvent *ev;
+    int slot[16], used = 0, ch;
+    size_t i;
+    int err;
+    
+    if ((err = merged_events(smf, &merged))) return err;
+    
+    for (ch = 0; ch < 16; ch++) slot[ch] = -1;
+    for (i = 0; i < merged.count; i++)
+        if (merged.events[i].status < 0xF0) slot[merged.events[i].status & 0x0F] = 0;
+    for (ch = 0; ch < 16; ch++)
+        if (slot[ch] == 0) slot[ch] = ++used;
+    
+    if (!(tracks = calloc(used + 1, sizeof(SMFTrack)))) {
+        free(merged.events);
+        return SMF_ERR_NOMEM;
+    }
+    for (i = 0; i < merged.count; i++) {
+        ev = &merged.events[i];
+        ev = track_push(&tracks[ev->status < 0xF0 ? slot[ev->status & 0x0F] : 0]);
+        if (!ev) {
+            free(merged.events);
+            smf_free_tracks(tracks, used + 1);
+            return SMF_ERR_NOMEM;
+        }
+        *ev = merged.events[i];
+    }
+    free(merged.events);
+    
+    smf_free_tracks(smf->tracks, smf->track_count);
+    smf->tracks = tracks;
+    smf->track_count = used + 1;
+    smf->format = 1;
+    return SMF_OK;
+}
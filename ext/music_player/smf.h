@@ -0,0 +1,114 @@
+/*
+ * Standard MIDI File reading and writing, independent of AudioToolbox.
+ *
+ * Files are decoded into per-track arrays of fixed-size events. Meta and
+ * SysEx payloads live in a single byte pool owned by the file and are
+ * referenced by offset and length.
+ */
+
+#ifndef MUSIC_PLAYER_SMF_H
+#define MUSIC_PLAYER_SMF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Status bytes for the events which are not channel messages. */
+#define SMF_META   0xFF
+#define SMF_SYSEX  0xF0
+#define SMF_ESCAPE 0xF7
+
+#define SMF_META_END_OF_TRACK 0x2F
+
+enum {
+    SMF_OK = 0,
+    SMF_ERR_IO,
+    SMF_ERR_NOMEM,
+    SMF_ERR_NOT_SMF,
+    SMF_ERR_SMPTE,
+    SMF_ERR_TRUNCATED,
+    SMF_ERR_BAD_EVENT,
+    SMF_ERR_CANCELLED
+};
+
+typedef struct {
+    uint32_t tick;
+    uint8_t status;
+    uint8_t meta;       /* meta event type, when status is SMF_META */
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t offset;    /* payload of meta and SysEx events */
+    uint32_t length;
+} SMFEvent;
+
+typedef struct {
+    SMFEvent *events;
+    size_t count;
+    size_t capacity;
+} SMFTrack;
+
+/*
+ * Progress of a file being read or written on another thread. The counters
+ * may be read at any time; setting cancel stops the read or write with
+ * SMF_ERR_CANCELLED at the next chunk or track. A reader counts bytes only,
+ * leaving tracks to the caller.
+ */
+typedef struct {
+    volatile size_t bytes;
+    volatile size_t total_bytes;
+    volatile uint32_t tracks;
+    volatile uint32_t total_tracks;
+    volatile int cancel;
+} SMFProgress;
+
+typedef struct {
+    uint16_t format;
+    uint16_t division;  /* ticks per quarter note */
+    SMFTrack *tracks;
+    uint16_t track_count;
+    uint8_t *bytes;
+    size_t bytes_len;
+    size_t bytes_cap;
+} SMF;
+
+const char *smf_strerror (int err);
+
+void smf_init (SMF *smf);
+void smf_free (SMF *smf);
+
+int smf_read (SMF *smf, const uint8_t *buf, size_t len);
+
+/* Reading or writing a file, errno is that of the failing call when
+ * SMF_ERR_IO is returned, or zero if there was none. */
+int smf_read_file (SMF *smf, const char *path);
+int smf_write (const SMF *smf, FILE *out);
+int smf_write_file (const SMF *smf, const char *path);
+
+/* As smf_read_file and smf_write_file, reporting to progress. */
+int smf_read_file_progress (SMF *smf, const char *path, SMFProgress *progress);
+int smf_write_file_progress (const SMF *smf, const char *path, SMFProgress *progress);
+
+/* Append count empty tracks. Pointers to existing tracks become invalid. */
+int smf_add_tracks (SMF *smf, uint16_t count);
+
+/* Append a copy of ev to a track, copying length bytes of payload for a
+ * meta or SysEx event. */
+int smf_push_event (SMF *smf, SMFTrack *track, const SMFEvent *ev, const uint8_t *payload);
+
+/* Order a track's events by tick. Simultaneous events keep their order,
+ * except that note offs come first. */
+int smf_sort_track (SMFTrack *track);
+
+size_t smf_event_count (const SMF *smf);
+
+/* Rescale every timestamp to a new resolution, rounding to the nearest tick. */
+void smf_requantize (SMF *smf, uint16_t division);
+
+/* Merge all tracks into one, as format 0. */
+int smf_merge_tracks (SMF *smf);
+
+/* Produce format 1 with a conductor track for meta and SysEx events followed
+ * by one track for each channel in use. */
+int smf_split_channels (SMF *smf);
+
+#endif
@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "stream.h"
+#include "smf.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STREAM_META_TEMPO   0x51
+#define STREAM_BUFFER       4096        /* bytes read at a time by a cursor */
+#define STREAM_SCAN_BUFFER  (1 << 16)   /* bytes read at a time while indexing */
+#define STREAM_DEFAULT_USECS 500000.0
+
+/* Reading */
+
+static uint32_t
+read_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static int
+read_at (int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+    ssize_t n;
+    do {
+        n = pread(fd, buf, len, (off_t) offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return SMF_ERR_IO;
+    return (size_t) n == len ? SMF_OK : SMF_ERR_TRUNCATED;
+}
+
+static void
+reader_start (StreamReader *r, uint64_t offset, uint64_t end, uint32_t tick, uint8_t running)
+{
+    r->end = end;
+    r->buf_offset = offset;
+    r->len = r->pos = 0;
+    r->tick = tick;
+    r->running = running;
+    r->done = offset >= end;
+}
+
+static uint64_t
+reader_offset (const StreamReader *r)
+{
+    return r->buf_offset + r->pos;
+}
+
+static int
+reader_fill (StreamReader *r)
+{
+    uint64_t offset = r->buf_offset + r->len;
+    size_t want;
+    ssize_t n;
+    
+    if (offset >= r->end) return SMF_ERR_TRUNCATED;
+    want = r->end - offset < r->cap ? (size_t) (r->end - offset) : r->cap;
+    do {
+        n = pread(r->fd, r->buf, want, (off_t) offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return SMF_ERR_IO;
+    if (n == 0) return SMF_ERR_TRUNCATED;
+    r->buf_offset = offset;
+    r->len = n;
+    r->pos = 0;
+    return SMF_OK;
+}
+
+static int
+reader_byte (StreamReader *r, uint8_t *b)
+{
+    int err;
+    if (r->pos == r->len && (err = reader_fill(r))) return err;
+    *b = r->buf[r->pos++];
+    return SMF_OK;
+}
+
+static int
+reader_skip (StreamReader *r, uint32_t n)
+{
+    uint64_t offset;
+    
+    if (n <= r->len - r->pos) {
+        r->pos += n;
+        return SMF_OK;
+    }
+    offset = reader_offset(r) + n;
+    if (offset > r->end) return SMF_ERR_TRUNCATED;
+    r->buf_offset = offset;
+    r->len = r->pos = 0;
+    return SMF_OK;
+}
+
+static int
+reader_vlq (StreamReader *r, uint32_t *value)
+{
+    uint32_t v = 0;
+    uint8_t b;
+    int i, err;
+    for (i = 0; i < 4; i++) {
+        if ((err = reader_byte(r, &b))) return err;
+        v = (v << 7) | (b & 0x7F);
+        if (!(b & 0x80)) {
+            *value = v;
+            return SMF_OK;
+        }
+    }
+    return SMF_ERR_BAD_EVENT;
+}
+
+/* Bytes following a channel status byte. */
+static int
+channel_data_len (uint8_t status)
+{
+    return (status & 0xE0) == 0xC0 ? 1 : 2;
+}
+
+/*
+ * Decode the next channel message or tempo change into ev, skipping other
+ * events. Sets done instead at the end of the track.
+ */
+static int
+reader_next (StreamReader *r, StreamEvent *ev)
+{
+    uint32_t delta, len;
+    uint8_t status, b, type = 0, tempo[3];
+    int err;
+    
+    while (!r->done) {
+        if (reader_offset(r) >= r->end) {
+            /* A missing end-of-track event is common enough to tolerate. */
+            r->done = 1;
+            break;
+        }
+        if ((err = reader_vlq(r, &delta))) return err;
+        r->tick += delta;
+        if ((err = reader_byte(r, &b))) return err;
+    
+        if (b & 0x80) {
+            status = b;
+        } else if (r->running) {
+            status = r->running;
+        } else {
+            return SMF_ERR_BAD_EVENT;
+        }
+    
+        if (status < 0xF0) {
+            if ((b & 0x80) && (err = reader_byte(r, &b))) return err;
+            ev->tick = r->tick;
+            ev->usecs = 0;
+            ev->status = status;
+            ev->data1 = b & 0x7F;
+            ev->data2 = 0;
+            if (channel_data_len(status) == 2) {
+                if ((err = reader_byte(r, &b))) return err;
+                ev->data2 = b & 0x7F;
+            }
+            r->running = status;
+            return SMF_OK;
+        }
+    
+        r->running = 0;
+        if (status == SMF_META) {
+            if ((err = reader_byte(r, &type))) return err;
+            if (type == SMF_META_END_OF_TRACK) {
+                r->done = 1;
+                break;
+            }
+        } else if (status != SMF_SYSEX && status != SMF_ESCAPE) {
+            /* System common and real-time messages cannot appear in a file. */
+            return SMF_ERR_BAD_EVENT;
+        }
+        if ((err = reader_vlq(r, &len))) return err;
+        if (status == SMF_META && type == STREAM_META_TEMPO && len == 3) {
+            if ((err = reader_byte(r, &tempo[0])) || (err = reader_byte(r, &tempo[1])) ||
+                (err = reader_byte(r, &tempo[2])))
+                return err;
+            ev->tick = r->tick;
+            ev->usecs = ((uint32_t) tempo[0] << 16) | ((uint32_t) tempo[1] << 8) | tempo[2];
+            ev->status = SMF_META;
+            ev->data1 = ev->data2 = 0;
+            if (ev->usecs) return SMF_OK;
+            continue;
+        }
+        if ((err = reader_skip(r, len))) return err;
+    }
+    return SMF_OK;
+}
+
+/* Indexing */
+
+static int
+track_mark (StreamTrack *track, const StreamReader *r)
+{
+    StreamMark *marks;
+    
+    if (track->mark_count == track->mark_capacity) {
+        uint32_t capacity = track->mark_capacity ? track->mark_capacity * 2 : 16;
+        if (!(marks = realloc(track->marks, capacity * sizeof(StreamMark)))) return SMF_ERR_NOMEM;
+        track->marks = marks;
+        track->mark_capacity = capacity;
+    }
+    marks = &track->marks[track->mark_count++];
+    marks->offset = reader_offset(r);
+    marks->tick = r->tick;
+    marks->running = r->running;
+    return SMF_OK;
+}
+
+/* Tempo changes are kept in order of tick, simultaneous ones in file order. */
+static int
+stream_push_tempo (Stream *stream, uint32_t tick, uint32_t usecs)
+{
+    StreamTempo *tempos;
+    uint32_t i;
+    
+    if (stream->tempo_count == stream->tempo_capacity) {
+        uint32_t capacity = stream->tempo_capacity ? stream->tempo_capacity * 2 : 16;
+        if (!(tempos = realloc(stream->tempos, capacity * sizeof(StreamTempo)))) return SMF_ERR_NOMEM;
+        stream->tempos = tempos;
+        stream->tempo_capacity = capacity;
+    }
+    for (i = stream->tempo_count; i > 0 && stream->tempos[i - 1].tick > tick; i--)
+        stream->tempos[i] = stream->tempos[i - 1];
+    stream->tempos[i].tick = tick;
+    stream->tempos[i].usecs = usecs;
+    stream->tempo_count++;
+    return SMF_OK;
+}
+
+static int
+stream_index_track (Stream *stream, StreamTrack *track, StreamReader *r)
+{
+    StreamEvent ev;
+    uint64_t count = 0;
+    int err;
+    
+    reader_start(r, track->start, track->end, 0, 0);
+    for (;;) {
+        if (count % STREAM_MARK_INTERVAL == 0 && count > 0 && (err = track_mark(track, r))) return err;
+        if ((err = reader_next(r, &ev))) return err;
+        if (r->done) break;
+        count++;
+        if (ev.status == SMF_META && (err = stream_push_tempo(stream, ev.tick, ev.usecs))) return err;
+        if (ev.tick > stream->length) stream->length = ev.tick;
+    }
+    stream->event_count += count;
+    return SMF_OK;
+}
+
+static int
+stream_index (Stream *stream)
+{
+    StreamReader r;
+    struct stat st;
+    uint8_t header[14];
+    uint64_t offset, size, chunk_len;
+    uint16_t declared;
+    int err = SMF_OK;
+    
+    if (fstat(stream->fd, &st)) return SMF_ERR_IO;
+    size = (uint64_t) st.st_size;
+    if (size < 14 || read_at(stream->fd, header, 14, 0) || memcmp(header, "MThd", 4) || read_u32(header + 4) < 6)
+        return SMF_ERR_NOT_SMF;
+    
+    stream->format = (header[8] << 8) | header[9];
+    declared = (header[10] << 8) | header[11];
+    stream->division = (header[12] << 8) | header[13];
+    if (stream->division & 0x8000) return SMF_ERR_SMPTE;
+    if (stream->format > 2 || stream->division == 0) return SMF_ERR_NOT_SMF;
+    offset = 8 + (uint64_t) read_u32(header + 4);
+    if (offset > size) return SMF_ERR_TRUNCATED;
+    
+    if (!(stream->tracks = calloc(declared ? declared : 1, sizeof(StreamTrack))))
+        return SMF_ERR_NOMEM;
+    memset(&r, 0, sizeof(StreamReader));
+    r.fd = stream->fd;
+    r.cap = STREAM_SCAN_BUFFER;
+    if (!(r.buf = malloc(r.cap))) return SMF_ERR_NOMEM;
+    
+    while (stream->track_count < declared && size - offset >= 8) {
+        if ((err = read_at(stream->fd, header, 8, offset))) break;
+        chunk_len = read_u32(header + 4);
+        if (size - offset - 8 < chunk_len) {
+            err = SMF_ERR_TRUNCATED;
+            break;
+        }
+        if (!memcmp(header, "MTrk", 4)) {
+            StreamTrack *track = &stream->tracks[stream->track_count++];
+            track->start = offset + 8;
+            track->end = offset + 8 + chunk_len;
+            if ((err = stream_index_track(stream, track, &r))) break;
+        }
+        offset += 8 + chunk_len;
+    }
+    free(r.buf);
+    if (err) return err;
+    return stream->track_count == declared ? SMF_OK : SMF_ERR_TRUNCATED;
+}
+
+static void
+stream_free (Stream *stream)
+{
+    uint16_t i;
+    if (stream->fd >= 0) close(stream->fd);
+    for (i = 0; i < stream->track_count; i++) free(stream->tracks[i].marks);
+    free(stream->tracks);
+    free(stream->tempos);
+    free(stream);
+}
+
+int
+stream_open (Stream **out, const char *path)
+{
+    Stream *stream;
+    int err, sys_errno;
+    
+    if (!(stream = calloc(1, sizeof(Stream)))) return SMF_ERR_NOMEM;
+    stream->refs = 1;
+    if ((stream->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        sys_errno = errno;
+        free(stream);
+        errno = sys_errno;
+        return SMF_ERR_IO;
+    }
+    if ((err = stream_index(stream))) {
+        sys_errno = errno;
+        stream_free(stream);
+        errno = sys_errno;
+        return err;
+    }
+    *out = stream;
+    return SMF_OK;
+}
+
+/* References are only taken and released by one thread at a time. */
+void
+stream_retain (Stream *stream)
+{
+    stream->refs++;
+}
+
+void
+stream_release (Stream *stream)
+{
+    if (--stream->refs == 0) stream_free(stream);
+}
+
+size_t
+stream_memsize (const Stream *stream)
+{
+    size_t size = sizeof(Stream) + stream->track_count * sizeof(StreamTrack) +
+        stream->tempo_capacity * sizeof(StreamTempo);
+    uint16_t i;
+    for (i = 0; i < stream->track_count; i++)
+        size += stream->tracks[i].mark_capacity * sizeof(StreamMark);
+    return size;
+}
+
+double
+stream_seconds (const Stream *stream, double beat, double *bpm)
+{
+    double secs = 0.0, at = 0.0, usecs = STREAM_DEFAULT_USECS, tempo_beat;
+    uint32_t i;
+    
+    for (i = 0; i < stream->tempo_count; i++) {
+        tempo_beat = (double) stream->tempos[i].tick / stream->division;
+        if (tempo_beat > beat) break;
+        secs += (tempo_beat - at) * usecs / 1e6;
+        at = tempo_beat;
+        usecs = stream->tempos[i].usecs;
+    }
+    if (bpm) *bpm = 6e7 / usecs;
+    return secs + (beat - at) * usecs / 1e6;
+}
+
+/* Cursors */
+
+static int
+cursor_less (const StreamCursor *cursor, uint16_t a, uint16_t b)
+{
+    const StreamCursorTrack *ta = &cursor->tracks[a], *tb = &cursor->tracks[b];
+    uint32_t tick_a = ta->events[ta->next].tick, tick_b = tb->events[tb->next].tick;
+    return tick_a < tick_b || (tick_a == tick_b && a < b);
+}
+
+static void
+cursor_sift_down (StreamCursor *cursor, uint16_t i)
+{
+    uint16_t *heap = cursor->heap, tmp;
+    uint32_t least, left, right, count = cursor->heap_count;
+    
+    for (;;) {
+        least = i;
+        left = 2 * (uint32_t) i + 1;
+        right = left + 1;
+        if (left < count && cursor_less(cursor, heap[left], heap[least])) least = left;
+        if (right < count && cursor_less(cursor, heap[right], heap[least])) least = right;
+        if (least == i) break;
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = (uint16_t) least;
+    }
+}
+
+static void
+cursor_sift_up (StreamCursor *cursor, uint16_t i)
+{
+    uint16_t *heap = cursor->heap, tmp, parent;
+    
+    while (i > 0) {
+        parent = (uint16_t) ((i - 1) / 2);
+        if (!cursor_less(cursor, heap[i], heap[parent])) break;
+        tmp = heap[i];
+        heap[i] = heap[parent];
+        heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+/* Decode the next window of a track's events, skipping any before tick. A
+ * track which cannot be read is treated as exhausted. */
+static void
+cursor_fill (StreamCursor *cursor, StreamCursorTrack *track, uint32_t tick)
+{
+    StreamEvent *ev;
+    int err;
+    
+    track->count = track->next = 0;
+    while (track->count < cursor->window && !track->reader.done) {
+        ev = &track->events[track->count];
+        if ((err = reader_next(&track->reader, ev))) {
+            if (!cursor->error) cursor->error = err;
+            track->reader.done = 1;
+            track->count = 0;
+            break;
+        }
+        if (!track->reader.done && ev->tick >= tick) track->count++;
+    }
+}
+
+int
+stream_cursor_init (StreamCursor *cursor, const Stream *stream, uint32_t window)
+{
+    uint16_t i;
+    
+    memset(cursor, 0, sizeof(StreamCursor));
+    cursor->stream = stream;
+    cursor->window = window ? window : STREAM_DEFAULT_WINDOW;
+    if (!(cursor->tracks = calloc(stream->track_count ? stream->track_count : 1, sizeof(StreamCursorTrack))) ||
+        !(cursor->heap = malloc((stream->track_count ? stream->track_count : 1) * sizeof(uint16_t))))
+        goto fail;
+    for (i = 0; i < stream->track_count; i++) {
+        StreamCursorTrack *track = &cursor->tracks[i];
+        track->reader.fd = stream->fd;
+        track->reader.cap = STREAM_BUFFER;
+        if (!(track->reader.buf = malloc(STREAM_BUFFER)) ||
+            !(track->events = malloc(cursor->window * sizeof(StreamEvent))))
+            goto fail;
+    }
+    return stream_cursor_seek(cursor, 0);
+    
+    fail:
+    stream_cursor_free(cursor);
+    return SMF_ERR_NOMEM;
+}
+
+void
+stream_cursor_free (StreamCursor *cursor)
+{
+    uint16_t i;
+    if (cursor->tracks) {
+        for (i = 0; i < cursor->stream->track_count; i++) {
+            free(cursor->tracks[i].reader.buf);
+            free(cursor->tracks[i].events);
+        }
+    }
+    free(cursor->tracks);
+    free(cursor->heap);
+    memset(cursor, 0, sizeof(StreamCursor));
+}
+
+size_t
+stream_cursor_memsize (const StreamCursor *cursor)
+{
+    if (!cursor->tracks) return 0;
+    return cursor->stream->track_count *
+        (sizeof(StreamCursorTrack) + STREAM_BUFFER + cursor->window * sizeof(StreamEvent) + sizeof(uint16_t));
+}
+
+int
+stream_cursor_seek (StreamCursor *cursor, uint32_t tick)
+{
+    const Stream *stream = cursor->stream;
+    const StreamTrack *track;
+    const StreamMark *mark;
+    StreamCursorTrack *ct;
+    uint32_t lo, hi, mid;
+    uint16_t i;
+    
+    cursor->error = SMF_OK;
+    cursor->heap_count = 0;
+    cursor->stale = 0;
+    for (i = 0; i < stream->track_count; i++) {
+        track = &stream->tracks[i];
+        ct = &cursor->tracks[i];
+    
+        /* Events before the last mark short of tick are all earlier. */
+        lo = 0;
+        hi = track->mark_count;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (track->marks[mid].tick < tick) lo = mid + 1;
+            else hi = mid;
+        }
+        if (lo > 0) {
+            mark = &track->marks[lo - 1];
+            reader_start(&ct->reader, mark->offset, track->end, mark->tick, mark->running);
+        } else {
+            reader_start(&ct->reader, track->start, track->end, 0, 0);
+        }
+        cursor_fill(cursor, ct, tick);
+        if (ct->count > 0) cursor->heap[cursor->heap_count++] = i;
+    }
+    for (i = cursor->heap_count / 2; i > 0; i--) cursor_sift_down(cursor, i - 1);
+    return cursor->error;
+}
+
+const StreamEvent *
+stream_cursor_current (const StreamCursor *cursor)
+{
+    const StreamCursorTrack *track;
+    if (cursor->heap_count == 0 || cursor->stale) return NULL;
+    track = &cursor->tracks[cursor->heap[0]];
+    return &track->events[track->next];
+}
+
+void
+stream_cursor_next (StreamCursor *cursor)
+{
+    StreamCursorTrack *track;
+    
+    if (cursor->heap_count == 0 || cursor->stale) return;
+    track = &cursor->tracks[cursor->heap[0]];
+    if (++track->next == track->count) {
+        if (cursor->defer && !track->reader.done) {
+            cursor->stale = cursor->heap[0] + 1;
+            track->count = 0;
+        } else {
+            cursor_fill(cursor, track, 0);
+        }
+    }
+    if (track->count == 0) cursor->heap[0] = cursor->heap[--cursor->heap_count];
+    cursor_sift_down(cursor, 0);
+}
+
+int
+stream_cursor_pending (const StreamCursor *cursor)
+{
+    return cursor->stale != 0;
+}
+
+void
+stream_cursor_refill (StreamCursor *cursor)
+{
+    uint16_t i;
+    
+    if (!cursor->stale) return;
+    i = cursor->stale - 1;
+    cursor->stale = 0;
+    cursor_fill(cursor, &cursor->tracks[i], 0);
+    if (cursor->tracks[i].count == 0) return;
+    cursor->heap[cursor->heap_count++] = i;
+    cursor_sift_up(cursor, cursor->heap_count - 1);
+}
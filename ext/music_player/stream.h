@@ -0,0 +1,135 @@
+/*
+ * Playback of a Standard MIDI File straight from disk, for files too large
+ * to load.
+ *
+ * Opening a stream scans the file once, keeping for each track a sparse
+ * index of marks, each the file offset, tick and running status at an
+ * event boundary, along with the file's tempo changes. Nothing else is kept.
+ * A cursor then decodes each track a bounded window of events at a time,
+ * merges the tracks through a heap ordered by the tick of their next event,
+ * and discards events as they are consumed. Seeking starts each track from
+ * its last mark before the target, so memory stays constant whatever the
+ * size of the file.
+ *
+ * Only channel messages and tempo changes are produced; other meta events
+ * and SysEx are skipped. Errors are the SMF_ERR codes of smf.h.
+ */
+
+#ifndef MUSIC_PLAYER_STREAM_H
+#define MUSIC_PLAYER_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A mark is kept every this many events of a track. */
+#define STREAM_MARK_INTERVAL 4096
+
+/* Events decoded ahead for each track, by default. */
+#define STREAM_DEFAULT_WINDOW 256
+
+typedef struct {
+    uint64_t offset;    /* of an event's delta time */
+    uint32_t tick;      /* of the event before it */
+    uint8_t running;
+} StreamMark;
+
+typedef struct {
+    uint64_t start;     /* of the track's events, after the chunk header */
+    uint64_t end;
+    StreamMark *marks;
+    uint32_t mark_count;
+    uint32_t mark_capacity;
+} StreamTrack;
+
+typedef struct {
+    uint32_t tick;
+    uint32_t usecs;     /* per quarter note */
+} StreamTempo;
+
+typedef struct {
+    int fd;
+    int refs;
+    uint16_t format;
+    uint16_t division;  /* ticks per quarter note */
+    StreamTrack *tracks;
+    uint16_t track_count;
+    StreamTempo *tempos;
+    uint32_t tempo_count;
+    uint32_t tempo_capacity;
+    uint32_t length;    /* tick of the last event */
+    uint64_t event_count;
+} Stream;
+
+/* An event as produced by a cursor. A tempo change has status SMF_META. */
+typedef struct {
+    uint32_t tick;
+    uint32_t usecs;
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+} StreamEvent;
+
+/* Reads one track through a buffer of its own. */
+typedef struct {
+    int fd;
+    uint64_t end;
+    uint64_t buf_offset;    /* of buf[0] */
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    uint32_t tick;
+    uint8_t running;
+    int done;
+} StreamReader;
+
+typedef struct {
+    StreamReader reader;
+    StreamEvent *events;    /* the window */
+    uint32_t count;
+    uint32_t next;
+} StreamCursorTrack;
+
+typedef struct {
+    const Stream *stream;
+    StreamCursorTrack *tracks;
+    uint16_t *heap;         /* track indices with events left */
+    uint16_t heap_count;
+    uint32_t window;
+    int error;              /* the first error met while decoding */
+    int defer;              /* leave refills to stream_cursor_refill */
+    uint16_t stale;         /* 1 + the track waiting for a refill, or 0 */
+} StreamCursor;
+
+/* Streams are reference counted, so that a player can keep reading one
+ * after the object which opened it has been collected. Returns an SMF_ERR
+ * code, setting errno for SMF_ERR_IO. */
+int stream_open (Stream **out, const char *path);
+void stream_retain (Stream *stream);
+void stream_release (Stream *stream);
+
+/* Bytes held by the index. */
+size_t stream_memsize (const Stream *stream);
+
+/* The time in seconds at beat, and the tempo in effect there. */
+double stream_seconds (const Stream *stream, double beat, double *bpm);
+
+int stream_cursor_init (StreamCursor *cursor, const Stream *stream, uint32_t window);
+void stream_cursor_free (StreamCursor *cursor);
+size_t stream_cursor_memsize (const StreamCursor *cursor);
+
+/* Position the cursor at the first event at or after tick. */
+int stream_cursor_seek (StreamCursor *cursor, uint32_t tick);
+
+/* The next event in time order, or NULL once every track is exhausted or
+ * while a refill is pending. */
+const StreamEvent *stream_cursor_current (const StreamCursor *cursor);
+void stream_cursor_next (StreamCursor *cursor);
+
+/* With defer set, stream_cursor_next does no I/O: a track whose window runs
+ * out is left pending until stream_cursor_refill reads its next window, so
+ * that the reads can be made outside whatever lock guards the consumer. */
+int stream_cursor_pending (const StreamCursor *cursor);
+void stream_cursor_refill (StreamCursor *cursor);
+
+#endif
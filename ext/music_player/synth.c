@@ -0,0 +1,344 @@
+/*
+ * Copyright (c) 2009 Jeremy Voorhis <jvoorhis@gmail.com>
+ */
+
+#include "synth.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNTH_GAIN 0.25
+
+int64_t
+synth_release_frames (uint32_t rate)
+{
+    return (int64_t) ceil(SYNTH_RELEASE_SECS * rate);
+}
+
+static int64_t
+synth_attack_frames (uint32_t rate)
+{
+    int64_t frames = (int64_t) ceil(SYNTH_ATTACK_SECS * rate);
+    return frames > 0 ? frames : 1;
+}
+
+int64_t
+synth_note_end (const SynthNote *note, uint32_t rate)
+{
+    return note->start + note->length + synth_release_frames(rate);
+}
+
+int
+synth_init (Synth *synth, uint32_t polyphony, uint32_t rate, SynthSteal steal)
+{
+    size_t n = polyphony;
+    char *p;
+    
+    memset(synth, 0, sizeof(Synth));
+    synth->polyphony = polyphony;
+    synth->rate = rate;
+    synth->steal = steal;
+    
+    /* One block for every array; the 8-byte arrays come first to keep the
+     * 4-byte arrays aligned, and the byte array last. */
+    p = (char *) malloc(n * (3 * sizeof(int64_t) + 3 * sizeof(double) + 9 * sizeof(float) +
+                             sizeof(uint32_t) + 1));
+    if (!p) return -1;
+    synth->storage = p;
+    synth->age = (int64_t *) p;         p += n * sizeof(int64_t);
+    synth->length = (int64_t *) p;      p += n * sizeof(int64_t);
+    synth->next = (int64_t *) p;        p += n * sizeof(int64_t);
+    synth->pitch = (double *) p;        p += n * sizeof(double);
+    synth->step = (double *) p;         p += n * sizeof(double);
+    synth->phase = (double *) p;        p += n * sizeof(double);
+    synth->velocity = (float *) p;      p += n * sizeof(float);
+    synth->gain = (float *) p;          p += n * sizeof(float);
+    synth->sine = (float *) p;          p += n * sizeof(float);
+    synth->cosine = (float *) p;        p += n * sizeof(float);
+    synth->rot_sine = (float *) p;      p += n * sizeof(float);
+    synth->rot_cosine = (float *) p;    p += n * sizeof(float);
+    synth->level = (float *) p;         p += n * sizeof(float);
+    synth->slope = (float *) p;         p += n * sizeof(float);
+    synth->id = (uint32_t *) p;         p += n * sizeof(uint32_t);
+    synth->channel = (uint8_t *) p;
+    synth_reset(synth, 0);
+    return 0;
+}
+
+void
+synth_free (Synth *synth)
+{
+    free(synth->storage);
+    synth->storage = NULL;
+    synth->polyphony = synth->active = 0;
+}
+
+void
+synth_reset (Synth *synth, int64_t frame)
+{
+    int c;
+    
+    synth->active = 0;
+    synth->clock = frame;
+    synth->stale = 0;
+    for (c = 0; c < SYNTH_CHANNELS; c++) {
+        synth->channels[c].volume = 127;
+        synth->channels[c].expression = 127;
+        synth->channels[c].bend = SYNTH_BEND_CENTRE;
+    }
+}
+
+/* The envelope, from zero to one, of voice v at its current age. The attack
+ * rises to one, or is cut short by the release, which falls linearly from
+ * wherever the attack reached. */
+static double
+voice_envelope (const Synth *synth, uint32_t v)
+{
+    int64_t a = synth->age[v], len = synth->length[v];
+    double attack = (double) synth_attack_frames(synth->rate);
+    double release = (double) synth_release_frames(synth->rate);
+    double peak = len < attack ? len / attack : 1.0;
+    
+    if (a < len) return a < attack ? a / attack : 1.0;
+    if (a >= len + release) return 0.0;
+    return peak * (1.0 - (a - len) / release);
+}
+
+/* Set the level, slope and next stage of voice v from its age. */
+static void
+voice_stage (Synth *synth, uint32_t v)
+{
+    int64_t a = synth->age[v], len = synth->length[v];
+    int64_t attack = synth_attack_frames(synth->rate), release = synth_release_frames(synth->rate);
+    double gain = synth->gain[v], peak = len < attack ? (double) len / attack : 1.0;
+    
+    synth->level[v] = (float) (gain * voice_envelope(synth, v));
+    if (a < attack && a < len) {
+        synth->slope[v] = (float) (gain / attack);
+        synth->next[v] = attack < len ? attack : len;
+    } else if (a < len) {
+        synth->slope[v] = 0.0f;
+        synth->next[v] = len;
+    } else {
+        synth->slope[v] = (float) (-gain * peak / release);
+        synth->next[v] = len + release;
+    }
+}
+
+/* Set the oscillator of voice v from its phase. */
+static void
+voice_phase (Synth *synth, uint32_t v)
+{
+    synth->sine[v] = (float) sin(synth->phase[v]);
+    synth->cosine[v] = (float) cos(synth->phase[v]);
+}
+
+static void
+voice_gain (Synth *synth, uint32_t v)
+{
+    const SynthChannel *ch = &synth->channels[synth->channel[v]];
+    synth->gain[v] = synth->velocity[v] * (ch->volume / 127.0f) * (ch->expression / 127.0f);
+}
+
+static void
+voice_step (Synth *synth, uint32_t v)
+{
+    const SynthChannel *ch = &synth->channels[synth->channel[v]];
+    double bend = ((int) ch->bend - SYNTH_BEND_CENTRE) / (double) SYNTH_BEND_CENTRE;
+    
+    synth->step[v] = synth->pitch[v] * pow(2.0, bend * SYNTH_BEND_RANGE / 12.0);
+    synth->rot_sine[v] = (float) sin(synth->step[v]);
+    synth->rot_cosine[v] = (float) cos(synth->step[v]);
+}
+
+static void
+voice_move (Synth *synth, uint32_t to, uint32_t from)
+{
+    synth->age[to] = synth->age[from];
+    synth->length[to] = synth->length[from];
+    synth->next[to] = synth->next[from];
+    synth->pitch[to] = synth->pitch[from];
+    synth->step[to] = synth->step[from];
+    synth->phase[to] = synth->phase[from];
+    synth->velocity[to] = synth->velocity[from];
+    synth->gain[to] = synth->gain[from];
+    synth->channel[to] = synth->channel[from];
+    synth->sine[to] = synth->sine[from];
+    synth->cosine[to] = synth->cosine[from];
+    synth->rot_sine[to] = synth->rot_sine[from];
+    synth->rot_cosine[to] = synth->rot_cosine[from];
+    synth->level[to] = synth->level[from];
+    synth->slope[to] = synth->slope[from];
+    synth->id[to] = synth->id[from];
+}
+
+static int
+voice_done (const Synth *synth, uint32_t v)
+{
+    return synth->age[v] >= synth->length[v] + synth_release_frames(synth->rate);
+}
+
+/* Free voice v, keeping the voices in use packed at the front. */
+static void
+voice_retire (Synth *synth, uint32_t v)
+{
+    synth->active--;
+    if (v != synth->active) voice_move(synth, v, synth->active);
+}
+
+static uint32_t
+synth_victim (const Synth *synth)
+{
+    uint32_t v, victim = 0;
+    double least = 2.0, env;
+    
+    for (v = 0; v < synth->active; v++) {
+        if (synth->steal == SYNTH_STEAL_OLDEST) {
+            if (synth->age[v] > synth->age[victim]) victim = v;
+        } else {
+            env = synth->gain[v] * voice_envelope(synth, v);
+            if (env < least) {
+                least = env;
+                victim = v;
+            }
+        }
+    }
+    return victim;
+}
+
+int64_t
+synth_note_on (Synth *synth, const SynthNote *note, uint32_t id)
+{
+    uint32_t v;
+    int64_t victim = -1;
+    double freq = 440.0 * pow(2.0, (note->note - 69) / 12.0);
+    
+    if (synth->polyphony == 0) return -1;
+    if (synth->active < synth->polyphony) {
+        v = synth->active++;
+    } else {
+        v = synth_victim(synth);
+        victim = synth->id[v];
+        synth->stolen++;
+    }
+    synth->id[v] = id;
+    synth->age[v] = synth->clock - note->start;
+    synth->length[v] = note->length;
+    synth->channel[v] = note->channel % SYNTH_CHANNELS;
+    synth->pitch[v] = 2.0 * M_PI * freq / synth->rate;
+    synth->velocity[v] = (float) (SYNTH_GAIN * note->velocity / 127.0);
+    voice_gain(synth, v);
+    voice_step(synth, v);
+    synth->phase[v] = fmod(synth->step[v] * synth->age[v], 2.0 * M_PI);
+    if (voice_done(synth, v)) {
+        voice_retire(synth, v);
+        return victim;
+    }
+    voice_stage(synth, v);
+    voice_phase(synth, v);
+    return victim;
+}
+
+void
+synth_cut (Synth *synth, uint32_t id)
+{
+    uint32_t v;
+    
+    for (v = 0; v < synth->active; v++) {
+        if (synth->id[v] != id) continue;
+        voice_retire(synth, v);
+        return;
+    }
+}
+
+void
+synth_control (Synth *synth, uint8_t channel, SynthControl control, uint16_t value)
+{
+    SynthChannel *ch = &synth->channels[channel % SYNTH_CHANNELS];
+    uint32_t v;
+    
+    switch (control) {
+    case SYNTH_VOLUME:     ch->volume = value & 0x7F; break;
+    case SYNTH_EXPRESSION: ch->expression = value & 0x7F; break;
+    case SYNTH_PITCH_BEND: ch->bend = value & 0x3FFF; break;
+    }
+    for (v = 0; v < synth->active; v++) {
+        if (synth->channel[v] != channel % SYNTH_CHANNELS) continue;
+        if (control == SYNTH_PITCH_BEND) {
+            /* The oscillator carries on from where it is at a new speed. */
+            voice_step(synth, v);
+        } else {
+            voice_gain(synth, v);
+            voice_stage(synth, v);
+        }
+    }
+}
+
+/* Render frames samples over every voice. No voice changes stage within
+ * the span, so each update is the same arithmetic on every voice. */
+static void
+synth_kernel (Synth *synth, float *out, uint32_t frames)
+{
+    float *restrict sine = synth->sine, *restrict cosine = synth->cosine;
+    const float *restrict rot_sine = synth->rot_sine, *restrict rot_cosine = synth->rot_cosine;
+    float *restrict level = synth->level;
+    const float *restrict slope = synth->slope;
+    uint32_t i, v, n = synth->active;
+    float s, c, sum;
+    
+    for (i = 0; i < frames; i++) {
+        sum = 0.0f;
+        for (v = 0; v < n; v++)
+            sum += sine[v] * level[v];
+        out[i] += sum;
+        for (v = 0; v < n; v++) {
+            s = sine[v];
+            c = cosine[v];
+            sine[v] = s * rot_cosine[v] + c * rot_sine[v];
+            cosine[v] = c * rot_cosine[v] - s * rot_sine[v];
+            level[v] += slope[v];
+        }
+    }
+}
+
+void
+synth_render (Synth *synth, float *out, uint32_t frames)
+{
+    uint32_t v, n;
+    int64_t left;
+    
+    while (frames > 0) {
+        if (out && synth->stale) {
+            for (v = 0; v < synth->active; v++) {
+                voice_stage(synth, v);
+                voice_phase(synth, v);
+            }
+            synth->stale = 0;
+        }
+        
+        /* Render up to the next change of stage of any voice. */
+        n = frames;
+        for (v = 0; v < synth->active; v++) {
+            left = synth->next[v] - synth->age[v];
+            if (left < n) n = (uint32_t) left;
+        }
+        if (out) {
+            synth_kernel(synth, out, n);
+            out += n;
+        } else if (synth->active > 0) {
+            synth->stale = 1;
+        }
+        for (v = 0; v < synth->active; v++) {
+            synth->age[v] += n;
+            synth->phase[v] = fmod(synth->phase[v] + synth->step[v] * n, 2.0 * M_PI);
+        }
+        synth->clock += n;
+        frames -= n;
+        
+        for (v = synth->active; v-- > 0; ) {
+            if (synth->age[v] < synth->next[v]) continue;
+            if (voice_done(synth, v)) voice_retire(synth, v);
+            else voice_stage(synth, v);
+        }
+    }
+}
@@ -0,0 +1,111 @@
+/*
+ * A minimal offline synthesizer for previews.
+ *
+ * Each note is a sine voice with a linear attack and release. Voices come
+ * from a preallocated pool of fixed polyphony; when every voice is busy, a
+ * new note steals the oldest or the quietest. The pool keeps its voices as
+ * parallel arrays, so that the per-frame oscillator and envelope update is
+ * a loop over plain float arrays which the compiler can vectorize.
+ *
+ * Channel volume, expression and pitch bend apply from the frame at which
+ * they are set, to the voices already sounding as well as later ones.
+ */
+
+#ifndef MUSIC_PLAYER_SYNTH_H
+#define MUSIC_PLAYER_SYNTH_H
+
+#include <stdint.h>
+
+#define SYNTH_ATTACK_SECS  0.005
+#define SYNTH_RELEASE_SECS 0.05
+
+typedef struct {
+    int64_t start;      /* first frame */
+    int64_t length;     /* frames until the note is released */
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+} SynthNote;
+
+typedef enum {
+    SYNTH_STEAL_OLDEST,
+    SYNTH_STEAL_QUIETEST
+} SynthSteal;
+
+typedef enum {
+    SYNTH_VOLUME,           /* controller 7, 0 to 127 */
+    SYNTH_EXPRESSION,       /* controller 11, 0 to 127 */
+    SYNTH_PITCH_BEND        /* 0 to 16383, centred on 8192 */
+} SynthControl;
+
+#define SYNTH_CHANNELS 16
+#define SYNTH_BEND_CENTRE 8192
+#define SYNTH_BEND_RANGE 2.0   /* semitones either way */
+
+typedef struct {
+    uint8_t volume;
+    uint8_t expression;
+    uint16_t bend;
+} SynthChannel;
+
+typedef struct {
+    uint32_t polyphony;
+    uint32_t active;        /* voices in use, always the first entries */
+    uint32_t rate;
+    SynthSteal steal;
+    int64_t clock;          /* frame of the next sample to render */
+    int stale;              /* oscillators must be recomputed from phases */
+    uint64_t stolen;
+    SynthChannel channels[SYNTH_CHANNELS];
+    
+    /* One entry per voice. */
+    int64_t *age;           /* frames since the note started */
+    int64_t *length;
+    int64_t *next;          /* age at which the envelope changes stage */
+    double *pitch;          /* unbent phase increment, in radians */
+    double *step;           /* phase increment, including the bend */
+    double *phase;
+    float *velocity;        /* gain for the note's velocity */
+    float *gain;            /* velocity gain scaled by the channel */
+    uint8_t *channel;
+    float *sine;            /* oscillator state: sine and cosine of the phase */
+    float *cosine;
+    float *rot_sine;        /* rotation applied to the oscillator per frame */
+    float *rot_cosine;
+    float *level;           /* gain times envelope */
+    float *slope;           /* change in level per frame */
+    uint32_t *id;           /* of the note sounding */
+    
+    void *storage;
+} Synth;
+
+/* Frames a note keeps sounding after it is released. */
+int64_t synth_release_frames (uint32_t rate);
+
+/* The frame after the note's last audible frame. */
+int64_t synth_note_end (const SynthNote *note, uint32_t rate);
+
+/* Returns -1 if the pool could not be allocated. */
+int synth_init (Synth *synth, uint32_t polyphony, uint32_t rate, SynthSteal steal);
+void synth_free (Synth *synth);
+
+/* Silence every voice, restore each channel's controllers to full volume
+ * and no bend, and move the clock to frame. */
+void synth_reset (Synth *synth, int64_t frame);
+
+/* Start a note at the clock, known to the pool by id. The note may have
+ * started earlier, in which case it sounds as it would by now. Returns the
+ * id of the note whose voice it stole, or -1. */
+int64_t synth_note_on (Synth *synth, const SynthNote *note, uint32_t id);
+
+/* Silence the note with id at once, as if its voice had been stolen. */
+void synth_cut (Synth *synth, uint32_t id);
+
+/* Set a channel controller at the clock. */
+void synth_control (Synth *synth, uint8_t channel, SynthControl control, uint16_t value);
+
+/* Add frames samples to out and advance the clock. A NULL out advances the
+ * clock without rendering. */
+void synth_render (Synth *synth, float *out, uint32_t frames);
+
+#endif
@@ -1,15 +1,379 @@
 $:.unshift File.join(File.dirname(__FILE__), '../ext/music_player')
 require 'thread'
+require 'io/wait'
+require 'fileutils'
 require 'music_player.bundle'
 
 module AudioToolbox
+  # Positions convert between beats and [bar, beat, subbeat], numbered from
+  # one as in CABarBeatTime, using the time signatures on the tempo track:
+  #
+  #   sequence.beats_to_bar_beat_time(7.25)         # => [3, 3, 240]
+  #   sequence.bar_beat_time_to_beats([3, 3, 240]) # => 7.25
+  #
+  # Subbeats divide a beat into 480 unless another divisor is given.
+  # #beats_to_bar_beat_times converts a String of packed doubles at once,
+  # returning BAR_BEAT_TIME_FORMAT records.
+  #
+  # A sequence cannot be shared or moved between Ractors, but its events
+  # can be handed over. #detach returns a frozen, shareable
+  # MusicSequence::Detached and closes the receiver, its tracks and their
+  # iterators; MusicSequence.attach wraps the events in a new sequence, once:
+  #
+  #   detached = sequence.detach
+  #   Ractor.new(detached) { |d| MusicSequence.attach(d).analyze }
+  #
+  # A sequence set on a player, recorded into or being scanned cannot be
+  # detached. The MIDI endpoint is not carried over.
+  #
+  # User events, or cues, run Ruby code as playback reaches them:
+  #
+  #   track.add 8.0, MusicUserEvent.new(:data => 'chorus')
+  #   sequence.on_user_event { |cue| lights.fade(cue.event.data) }
+  #
+  # The playback thread only copies each cue into a lock-free queue, so a
+  # slow handler never delays MIDI output. A dispatcher thread takes the
+  # cues in batches and calls the handler with a Cue for each. A handler
+  # which falls a whole queue behind loses cues, counted by #dropped_cues.
   class MusicSequence
+    # scheduled_at and dispatched_at are Process::CLOCK_MONOTONIC times.
+    # On a virtual clock a cue is scheduled when MusicPlayer#advance plays
+    # it. track is nil for the tempo track.
+    Cue = Struct.new(:event, :beat, :track, :scheduled_at, :dispatched_at) do
+      # Seconds from when the cue was due until its handler was called.
+      def latency
+        dispatched_at - scheduled_at
+      end
+    end
+    
     attr :tracks
     
     def load(path)
       @tracks.lock.synchronize do
         load_internal(path)
+        @tracks.reset
+      end
+    end
+    
+    def detach
+      detached = @tracks.lock.synchronize do
+        detach_internal
+      end
+      stop_dispatch
+      detached
+    end
+    
+    # Calls the block with a Cue for each user event played from now on,
+    # replacing any block given before, which still handles the cues already
+    # played. Without a block, stops dispatching once those are handled. May
+    # be called from within a handler.
+    def on_user_event(&handler)
+      enable_cues(!handler.nil?)
+      previous = stop_dispatch
+      return self unless handler
+      @cue_notify ||= IO.for_fd(cue_notify_fd, :autoclose => false)
+      stop, @dispatch_stop = IO.pipe
+      @dispatcher = Thread.new do
+        # Only one dispatcher drains the queue at a time.
+        previous.join if previous
+        begin
+          # Sleeps until cues arrive or the stop pipe is closed, which may
+          # have happened within the handler.
+          loop do
+            IO.select([@cue_notify, stop])
+            dispatch(handler)
+            break if IO.select([stop], nil, nil, 0)
+          end
+        ensure
+          stop.close
+        end
+      end
+      self
+    end
+    
+    # Iterates over the events of every audible track in time order. See
+    # MusicSequenceIterator.
+    def iterator(options=nil)
+      MusicSequenceIterator.new(self, options)
+    end
+    
+    private
+    
+    def dispatch(handler)
+      until (cues = drain_cues).empty?
+        cues.each_slice(4) do |event, beat, track, scheduled_at|
+          handler.call(Cue.new(event, beat, track, scheduled_at,
+                               Process.clock_gettime(Process::CLOCK_MONOTONIC)))
+        end
+      end
+    end
+    
+    # Tells the dispatcher to stop, by closing its stop pipe, and waits for
+    # it, unless it is the calling thread, which is returned to be waited
+    # for by the next one.
+    def stop_dispatch
+      return unless (dispatcher = @dispatcher)
+      @dispatcher = nil
+      @dispatch_stop.close
+      @dispatch_stop = nil
+      return dispatcher if dispatcher == Thread.current
+      dispatcher.join
+      nil
+    end
+  end
+  
+  # Merges the timelines of all tracks into a single stream ordered by time,
+  # honouring mute, solo, track offsets and loops. Events at the same time are
+  # ordered by track index, and the tempo track comes first unless the
+  # iterator was created with :tempo => false.
+  #
+  # #read returns up to n events packed as RECORD_FORMAT records of
+  # RECORD_SIZE bytes: time, value (a note's duration or the bpm of a tempo
+  # event), track index (-1 for the tempo track), event type, status, data1,
+  # data2 and data3 (a note's release velocity).
+  class MusicSequenceIterator
+    include Enumerable
+    
+    # Yields each event with its time and track index, starting from :from
+    # (or the beginning of the sequence). Accepts the same filter as
+    # MusicTrack#each.
+    def each(filter=nil, &block)
+      each_internal(filter, &block)
+    end
+  end
+  
+  # Playback milestones can be awaited rather than polled:
+  #
+  #   player.start
+  #   player.wait_until(16.0)   # => true once beat 16 is reached
+  #   player.wait_for_stop
+  #
+  # When the native engine plays the sequence, the waiting thread sleeps on a
+  # pipe the engine writes to as the beat comes due or playback stops. The
+  # wait uses IO#wait_readable, so under a Fiber scheduler only the calling
+  # fiber waits. A sequence played by AudioToolbox is checked every
+  # POLL_INTERVAL seconds instead.
+  class MusicPlayer
+    POLL_INTERVAL = 0.01
+    
+    # Waits until playback reaches beat, for at most timeout seconds if
+    # given. Returns true, or false if playback stopped short of the beat or
+    # the wait timed out.
+    def wait_until(beat, timeout=nil)
+      await(beat, timeout) { time >= beat }
+    end
+    
+    # Waits until playback stops, for at most timeout seconds if given.
+    # Returns true, or false if the wait timed out.
+    def wait_for_stop(timeout=nil)
+      await(nil, timeout) { !playing? }
+    end
+    
+    private
+    
+    def await(beat, timeout)
+      fd = watch(beat)
+      return poll(timeout) { yield } unless fd
+      begin
+        IO.for_fd(fd, :autoclose => false).wait_readable(timeout)
+      ensure
+        reached = unwatch(fd)
+      end
+      reached
+    end
+    
+    def poll(timeout)
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout if timeout
+      until yield
+        return false unless playing?
+        if deadline
+          left = deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          return false if left <= 0
+        end
+        sleep(deadline ? [left, POLL_INTERVAL].min : POLL_INTERVAL)
+      end
+      true
+    end
+  end
+  
+  # A portable MIDI destination which writes raw MIDI bytes to a file
+  # descriptor: an ALSA rawmidi device such as /dev/snd/midiC1D0, a FIFO, or
+  # any IO. A sequence whose midi_endpoint is a MIDIOutput is played by a
+  # native engine which writes all events due in the same scheduling tick
+  # with a single write.
+  class MIDIOutput
+    # Queues each message and writes them all at once.
+    def write(*messages)
+      messages.each { |message| self << message }
+      flush
+    end
+  end
+  
+  # A Standard MIDI File played straight from disk, for files too large to
+  # load into a MusicSequence:
+  #
+  #   stream = MIDIStream.new('installation.mid', :window => 256)
+  #   stream.midi_endpoint = MIDIOutput.new('/dev/snd/midiC1D0')
+  #   player.sequence = stream
+  #   player.time = 1024.0
+  #   player.start
+  #
+  # Opening the stream scans the file once, indexing each track every few
+  # thousand events. The player then decodes up to :window events ahead of
+  # the playhead for each track and merges the tracks as it goes, so memory
+  # does not grow with the file. Only channel messages and tempo changes
+  # are played.
+  class MIDIStream
+    # Opens a stream, closing it after the block if one is given.
+    def self.open(path, options = {})
+      stream = new(path, options)
+      return stream unless block_given?
+      begin
+        yield stream
+      ensure
+        stream.close
+      end
+    end
+  end
+  
+  # Records live MIDI from a file descriptor, such as an ALSA rawmidi device
+  # or a pipe, into a track:
+  #
+  #   recorder = MIDIRecorder.new('/dev/snd/midiC1D0', track, player)
+  #   recorder.record { player.start; sleep 30; player.stop }
+  #
+  # Input is read, timestamped by the player's clock and paired into notes
+  # on a native thread. A Ruby thread inserts the finished events into the
+  # track in batches whenever the input thread signals that some are ready.
+  class MIDIRecorder
+    def start
+      start_internal
+      @notify ||= IO.for_fd(notify_fd, :autoclose => false)
+      @drainer ||= Thread.new do
+        while recording?
+          IO.select([@notify], nil, nil, 0.1)
+          drain
+        end
+      end
+    end
+    
+    # Stops recording, ending any notes still held, and inserts everything
+    # recorded so far.
+    def stop
+      stop_internal
+      @drainer.join if @drainer
+      @drainer = nil
+      drain
+    end
+    
+    def record
+      start
+      yield self
+    ensure
+      stop
+    end
+    
+    def close
+      stop if recording?
+      close_internal
+    end
+  end
+  
+  # Keeps rendered audio between calls to MusicSequence#render, so that a
+  # render after an edit only synthesizes the segments the edit changed:
+  #
+  #   cache = RenderCache.new(32 * 1024 * 1024)
+  #   pcm = sequence.render(:cache => cache)
+  #
+  # Segments are evicted least recently used first once the sample data
+  # exceeds max_size bytes.
+  class RenderCache
+    def stats
+      { :hits => hits, :misses => misses, :evictions => evictions,
+        :count => count, :size => size, :max_size => max_size }
+    end
+  end
+  
+  # A load or save running on a native thread, as started by
+  # MusicSequence.load_async or MusicSequence#save_async:
+  #
+  #   op = MusicSequence.load_async('installation.mid')
+  #   op.progress # => {:bytes => 1048576, :total_bytes => 8388608, ...}
+  #   sequence = op.value
+  #
+  # #progress reports :bytes and :tracks processed so far, and their totals
+  # once known. Waiting in #join or #value sleeps on a pipe with
+  # IO#wait_readable, so under a Fiber scheduler only the calling fiber
+  # waits.
+  class FileOperation
+    # Waits for the operation to finish, for at most timeout seconds if
+    # given. Returns self, or nil if it is still running.
+    def join(timeout=nil)
+      @notify ||= IO.for_fd(notify_fd, :autoclose => false)
+      @notify.wait_readable(timeout) unless done?
+      done? ? self : nil
+    end
+    
+    # Waits for the operation to finish and returns the loaded or saved
+    # sequence. Raises if it failed or was cancelled.
+    def value
+      join
+      result
+    end
+  end
+  
+  # Standard MIDI File utilities which work on files directly, without
+  # loading them into a MusicSequence.
+  class MIDIFile
+    class << self
+      private :convert_internal
+    end
+    
+    DEFAULT_MEMORY = 256 * 1024 * 1024
+    
+    # Converts each file in paths concurrently and writes the result to the
+    # :output directory under the same name. A path may instead be given as
+    # [path, name] to write it to name, a path relative to :output whose
+    # directories are created as needed; two files may not share an output.
+    # Options:
+    #
+    #   :output         - the directory to write to (required)
+    #   :format         - 0 to merge all tracks into one, or 1 to keep tracks
+    #                     (splitting a format 0 file by channel)
+    #   :resolution     - ticks per quarter note to re-quantise timestamps to
+    #   :split_channels - split into a conductor track and a track per channel
+    #   :threads        - number of threads to use (defaults to one per CPU)
+    #   :memory         - approximate number of bytes to use for the files
+    #                     being converted (defaults to DEFAULT_MEMORY)
+    #
+    # Returns a Hash per file with :path, :output and :seconds, plus :tracks
+    # and :events on success or :error on failure.
+    def self.convert(paths, options)
+      output = options[:output] or
+        raise ArgumentError, "Expected :output to name a directory."
+      format = options[:format]
+      unless format.nil? || [0, 1].include?(format)
+        raise ArgumentError, "Expected :format to be 0 or 1."
+      end
+      resolution = options[:resolution]
+      unless resolution.nil? || (1..0x7FFF) === resolution
+        raise ArgumentError, "Expected :resolution to be in 1..32767."
+      end
+      if format == 0 && options[:split_channels]
+        raise ArgumentError, "Cannot split channels into a format 0 file."
+      end
+      
+      pairs = Array(paths).map do |path, name|
+        [path.to_s, File.join(output.to_s, name ? name.to_s : File.basename(path.to_s))]
+      end
+      clash = pairs.group_by { |_, out| File.expand_path(out) }.find { |_, group| group.size > 1 }
+      if clash
+        raise ArgumentError, "Expected one input per output, but #{clash[1].map(&:first).join(', ')} " \
+                             "would all be written to #{clash[0]}."
       end
+      pairs.each { |_, out| FileUtils.mkdir_p(File.dirname(out)) }
+      convert_internal(pairs, format, resolution, options[:split_channels],
+                       options[:threads], options[:memory] || DEFAULT_MEMORY)
     end
   end
   
@@ -45,7 +409,13 @@ module AudioToolbox
     def delete(track)
       @lock.synchronize do
         delete_internal(track)
-        @tracks.delete(track)
+        # The deleted track raises on #==, so find its wrapper by identity;
+        # if it was never wrapped, the later wrappers' places are unknown.
+        if (index = @tracks.index { |t| t.equal?(track) })
+          @tracks.delete_at(index)
+        else
+          @tracks.clear
+        end
         track.freeze
       end
       nil
@@ -54,39 +424,82 @@ module AudioToolbox
     def tempo
       @tempo ||= tempo_internal
     end
+    
+    # Forgets the tracks wrapped so far, which a load may have replaced.
+    # Called with the lock held.
+    def reset # :nodoc:
+      @tracks.clear
+      @tempo = nil
+    end
   end
   
+  # Two tracks are == when they hold the same events, whatever order events
+  # at the same time were added in; their properties are not compared.
+  #
+  # #diff(other) returns the differences as DIFF_FORMAT records of DIFF_SIZE
+  # bytes, in time order: time, value, the other track's value, op ('-' for
+  # an event only in this track, '+' for one only in other, '~' for one whose
+  # value, data2 or data3 differ), event type, status, data1, data2, data3,
+  # and the other track's data2 and data3. Fields are packed as for
+  # MusicSequenceIterator. Only the stretches of the tracks whose digests
+  # differ are read.
+  #
+  # #add and #add_all(times, messages) also take a channel message packed in
+  # an Integer as status << 16 | data1 << 8 | data2 (see
+  # MIDIChannelMessage#to_i), which is added without making any objects.
   class MusicTrack
     class << self
       private :new
     end
     
-    def add(time, message)
-      message.add(time, self)
-    end
-    
     def iterator
       MusicEventIterator.new(self)
     end
     
+    # A read-only view of the track as it plays back, with its offset applied
+    # and its loop unrolled. See MusicTimeline.
+    def timeline
+      MusicTimeline.new(self)
+    end
+    
     include Enumerable
     
-    def each
-      i = iterator
-      while i.current?
-        yield i.event
-        i.next
-      end
-      nil
+    # Yields each event in the track. An optional filter is evaluated natively
+    # against the raw event data, so events which do not match are never
+    # converted to Ruby objects:
+    #
+    #   track.each(:type => :note, :channel => 10, :note => 35..40,
+    #              :from => 0, :to => 16) { |ev| ... }
+    #
+    # :type may be :note, :channel (any channel message), :key_pressure,
+    # :control_change, :program_change, :channel_pressure, :pitch_bend or
+    # :tempo, or an Array of these. :channel and :note accept an Integer or a
+    # Range; :channel also accepts an Array. The time range is [from, to).
+    # With :packed => true, channel messages are yielded packed in Integers.
+    def each(filter=nil, &block)
+      each_internal(filter, false, &block)
     end
     
-    def each_with_time
-      i = iterator
-      while i.current?
-        yield [i.event, i.time]
-        i.next
-      end
-      nil
+    def each_with_time(filter=nil, &block)
+      each_internal(filter, true, &block)
+    end
+  end
+  
+  # Presents a looped track as one seekable stream of events. The first pass
+  # plays the whole track; each further pass repeats its last
+  # loop_info[:duration] beats. Times include the track offset. The track's
+  # properties are read when the timeline is created.
+  class MusicTimeline
+    include Enumerable
+    
+    # Accepts the same filter as MusicTrack#each. A :to time is required when
+    # the track loops indefinitely.
+    def each(filter=nil, &block)
+      each_internal(filter, false, &block)
+    end
+    
+    def each_with_time(filter=nil, &block)
+      each_internal(filter, true, &block)
     end
   end
   
@@ -117,6 +530,11 @@ module AudioToolbox
       status ^ mask
     end
     
+    # The message packed in an Integer, as accepted by MusicTrack#add.
+    def to_i
+      status << 16 | data1 << 8 | data2
+    end
+    
     def mask
       raise NotImplementedError, "Subclass responsibility."
     end
@@ -197,6 +615,45 @@ module AudioToolbox
     end
   end
   
+  # A meta event, such as a track name or time signature, whose data is a
+  # frozen binary String.
+  class MIDIMetaEvent
+    def ==(other)
+      self.class == other.class &&
+      meta_type  == other.meta_type &&
+      data       == other.data
+    end
+    
+    def add(time, track)
+      track.add_meta_event(time, self)
+    end
+  end
+  
+  # Bytes sent as they are, such as a SysEx message including its 0xF0.
+  class MIDIRawData
+    def ==(other)
+      self.class == other.class &&
+      data       == other.data
+    end
+    
+    def add(time, track)
+      track.add_midi_raw_data(time, self)
+    end
+  end
+  
+  # A cue point, whose data is a frozen binary String for the application.
+  # See MusicSequence#on_user_event.
+  class MusicUserEvent
+    def ==(other)
+      self.class == other.class &&
+      data       == other.data
+    end
+    
+    def add(time, track)
+      track.add_user_event(time, self)
+    end
+  end
+  
   class ExtendedTempoEvent
     attr :bpm
     
@@ -0,0 +1,107 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'tmpdir'
+
+class FileOperationTest < Test::Unit::TestCase
+  EXAMPLE = File.join(File.dirname(__FILE__), 'example.mid')
+  
+  def setup
+    @dir = Dir.mktmpdir
+    @sequence = MusicSequence.new
+    @sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => 120)
+    @track = @sequence.tracks.new
+    @track.add 0, MIDIProgramChangeMessage.new(:channel => 1, :program => 5)
+    8.times { |i| @track.add i, MIDINoteMessage.new(:note => 60 + i, :velocity => 80, :duration => 0.5) }
+  end
+  
+  def teardown
+    FileUtils.remove_entry(@dir)
+  end
+  
+  def test_load_async
+    op = MusicSequence.load_async(EXAMPLE)
+    assert_kind_of FileOperation, op
+    sequence = op.value
+    assert_kind_of MusicSequence, sequence
+    assert op.done?
+    assert_same sequence, op.value
+    
+    loaded = MusicSequence.new
+    loaded.load(EXAMPLE)
+    assert_equal loaded.tracks.size, sequence.tracks.size
+    assert_equal loaded.digest, sequence.digest
+    
+    size = File.size(EXAMPLE)
+    assert_equal({ :bytes => size, :total_bytes => size,
+                   :tracks => sequence.tracks.size + 1, :total_tracks => sequence.tracks.size + 1 },
+                 op.progress)
+  end
+  
+  def test_save_async
+    path = File.join(@dir, 'saved.mid')
+    op = @sequence.save_async(path)
+    # The file holds the sequence as it was when the save started.
+    @track.add 8, MIDINoteMessage.new(:note => 72)
+    assert_same @sequence, op.join.value
+    assert_equal File.size(path), op.progress[:bytes]
+    assert_nil op.progress[:total_bytes]
+    assert_equal 2, op.progress[:tracks]
+    
+    saved = MusicSequence.load_async(path).value
+    assert_equal 1, saved.tracks.size
+    times = []
+    saved.tracks[0].each_with_time { |ev, time| times << time }
+    assert_equal [0.0] + (0...8).to_a, times
+  end
+  
+  def test_round_trip
+    @sequence.tracks.new.add 0, MIDINoteMessage.new(:channel => 9, :note => 36)
+    path = File.join(@dir, 'round_trip.mid')
+    @sequence.save_async(path).value
+    assert_equal @sequence.digest, MusicSequence.load_async(path).value.digest
+  end
+  
+  def test_load_async__pairs_notes
+    # Two overlapping strikes of one key, the second released by a note on
+    # with velocity zero, then a note never released.
+    beat = [0x83, 0x60]
+    events = [0, 0x90, 60, 100, *beat, 0x90, 60, 80, *beat, 0x80, 60, 30, *beat, 0x90, 60, 0,
+              0, 0x90, 64, 90, *beat, 0xB0, 7, 100, 0, 0xFF, 0x2F, 0].pack('C*')
+    path = File.join(@dir, 'overlapping.mid')
+    File.open(path, 'wb') do |f|
+      f << ['MThd', 6, 0, 1, 480].pack('a4Nnnn') << ['MTrk', events.bytesize].pack('a4N') << events
+    end
+    
+    notes = []
+    MusicSequence.load_async(path).value.tracks[0].each_with_time(:type => :note) { |ev, time| notes << [time, ev] }
+    assert_equal [[0.0, MIDINoteMessage.new(:channel => 0, :note => 60, :velocity => 100, :duration => 3.0)],
+                  [1.0, MIDINoteMessage.new(:channel => 0, :note => 60, :velocity => 80,
+                                            :release_velocity => 30, :duration => 1.0)],
+                  [3.0, MIDINoteMessage.new(:channel => 0, :note => 64, :velocity => 90, :duration => 1.0)]],
+                 notes.sort_by { |time, ev| time }
+  end
+  
+  def test_join__timeout
+    op = MusicSequence.load_async(EXAMPLE)
+    assert_same op, op.join(5)
+    assert_same op, op.join(0)
+  end
+  
+  def test_cancel
+    op = @sequence.save_async(File.join(@dir, 'cancelled.mid'))
+    assert_same op, op.cancel
+    begin
+      op.value
+    rescue RuntimeError => e
+      assert_match(/Cancelled/, e.message)
+      assert !File.exist?(File.join(@dir, 'cancelled.mid'))
+    end
+  end
+  
+  def test_failures
+    assert_raise(Errno::ENOENT) { MusicSequence.load_async(File.join(@dir, 'missing.mid')).value }
+    bogus = File.join(@dir, 'bogus.mid')
+    File.open(bogus, 'w') { |f| f << 'not a midi file' }
+    assert_raise(RuntimeError) { MusicSequence.load_async(bogus).value }
+    assert_raise(Errno::ENOENT) { @sequence.save_async(File.join(@dir, 'missing', 'x.mid')).value }
+  end
+end
@@ -0,0 +1,104 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'tmpdir'
+
+class MIDIFileTest < Test::Unit::TestCase
+  EXAMPLE = File.join(File.dirname(__FILE__), 'example.mid')
+  
+  def setup
+    @dir = Dir.mktmpdir
+  end
+  
+  def teardown
+    FileUtils.remove_entry(@dir)
+  end
+  
+  def test_convert__format_0
+    result, = MIDIFile.convert([EXAMPLE], :output => @dir, :format => 0)
+    assert_nil result[:error]
+    assert_equal EXAMPLE, result[:path]
+    assert_equal File.join(@dir, 'example.mid'), result[:output]
+    assert_kind_of Float, result[:seconds]
+    assert_equal 1, result[:tracks]
+    assert_equal [0, 1], header(result[:output])[0, 2]
+    
+    copy_dir = File.join(@dir, 'copy')
+    Dir.mkdir(copy_dir)
+    copy, = MIDIFile.convert([EXAMPLE], :output => copy_dir)
+    assert_equal 2, copy[:tracks]
+    assert_equal copy[:events], result[:events], "Expected no events to be lost in the merge."
+  end
+  
+  def test_convert__format_1_from_format_0
+    merged, = MIDIFile.convert([EXAMPLE], :output => @dir, :format => 0)
+    split_dir = File.join(@dir, 'split')
+    Dir.mkdir(split_dir)
+    result, = MIDIFile.convert([merged[:output]], :output => split_dir, :format => 1)
+    assert_nil result[:error]
+    assert_equal 1, header(result[:output])[0]
+    assert result[:tracks] > 1, "Expected a conductor track and a track per channel."
+    assert_equal merged[:events], result[:events]
+  end
+  
+  def test_convert__resolution
+    result, = MIDIFile.convert([EXAMPLE], :output => @dir, :resolution => 96)
+    assert_nil result[:error]
+    assert_equal 96, header(result[:output])[2]
+  end
+  
+  def test_convert__running_status_across_meta
+    # Two note ons with the same status either side of a text event. Readers
+    # cancel running status at a meta event, so the second must restate it.
+    events = "\x00\x90\x3C\x40\x00\xFF\x01\x01x\x00\x90\x3E\x40\x00\xFF\x2F\x00".b
+    source = File.join(@dir, 'meta.mid')
+    File.open(source, 'wb') { |f| f << ['MThd', 6, 0, 1, 96, 'MTrk', events.size].pack('a4NnnnA4N') << events }
+    out = File.join(@dir, 'out')
+    again = File.join(@dir, 'again')
+    Dir.mkdir(out)
+    Dir.mkdir(again)
+    
+    result, = MIDIFile.convert([source], :output => out, :format => 0)
+    assert_nil result[:error]
+    assert_equal 3, result[:events]
+    reread, = MIDIFile.convert([result[:output]], :output => again, :format => 0)
+    assert_nil reread[:error]
+    assert_equal 3, reread[:events]
+  end
+  
+  def test_convert__failures
+    bogus = File.join(@dir, 'bogus.mid')
+    File.open(bogus, 'w') { |f| f << 'not a midi file' }
+    out = File.join(@dir, 'out')
+    Dir.mkdir(out)
+    results = MIDIFile.convert([bogus, File.join(@dir, 'missing.mid'), EXAMPLE], :output => out, :threads => 2)
+    assert_equal 3, results.size
+    assert_kind_of String, results[0][:error]
+    # The error of the failing open, not whatever the cleanup left in errno.
+    assert_equal Errno::ENOENT.new.message, results[1][:error]
+    assert_nil results[2][:error]
+    assert File.exist?(File.join(out, 'example.mid'))
+  end
+  
+  def test_convert__names
+    out = File.join(@dir, 'out')
+    results = MIDIFile.convert([[EXAMPLE, 'a/song.mid'], [EXAMPLE, 'b/song.mid']], :output => out)
+    assert_equal [File.join(out, 'a/song.mid'), File.join(out, 'b/song.mid')], results.map { |r| r[:output] }
+    assert results.all? { |r| r[:error].nil? && File.exist?(r[:output]) }
+    
+    assert_raise(ArgumentError) { MIDIFile.convert([[EXAMPLE, 'song.mid'], [EXAMPLE, './song.mid']], :output => out) }
+    assert_raise(ArgumentError) { MIDIFile.convert([EXAMPLE, EXAMPLE], :output => out) }
+  end
+  
+  def test_convert__options
+    assert_raise(ArgumentError) { MIDIFile.convert([EXAMPLE], :format => 0) }
+    assert_raise(ArgumentError) { MIDIFile.convert([EXAMPLE], :output => @dir, :format => 2) }
+    assert_raise(ArgumentError) { MIDIFile.convert([EXAMPLE], :output => @dir, :resolution => 0) }
+    assert_raise(ArgumentError) { MIDIFile.convert([EXAMPLE], :output => @dir, :format => 0, :split_channels => true) }
+  end
+  
+  private
+  
+  # Returns the format, track count and division of an SMF header.
+  def header(path)
+    File.open(path, 'rb') { |f| f.read(14) }.unpack('a4Nnnn')[2, 3]
+  end
+end
@@ -0,0 +1,78 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+
+class MIDIMetaEventTest < Test::Unit::TestCase
+  def test_initialization
+    assert_raise(ArgumentError) { MIDIMetaEvent.new(:data => 'x') }
+    assert_raise(ArgumentError) { MIDIMetaEvent.new(:meta_type => 3) }
+    assert_raise(ArgumentError) { MIDIMetaEvent.new(:meta_type => 128, :data => 'x') }
+    
+    name = 'Piano'
+    event = MIDIMetaEvent.new(:meta_type => 0x03, :data => name)
+    name << ' 2'
+    assert_equal 0x03, event.meta_type
+    assert_equal 'Piano', event.data
+    assert_equal 5, event.length
+    assert event.data.frozen?
+  end
+  
+  def test_eq
+    assert_equal MIDIMetaEvent.new(:meta_type => 1, :data => 'a'), MIDIMetaEvent.new(:meta_type => 1, :data => 'a')
+    assert_not_equal MIDIMetaEvent.new(:meta_type => 1, :data => 'a'), MIDIMetaEvent.new(:meta_type => 2, :data => 'a')
+    assert_not_equal MIDIMetaEvent.new(:meta_type => 1, :data => 'a'), MIDIRawData.new(:data => 'a')
+  end
+  
+  def test_add
+    track = MusicSequence.new.tracks.new
+    events = [MIDIMetaEvent.new(:meta_type => 0x03, :data => 'Lead'),
+              MIDIMetaEvent.new(:meta_type => 0x7F, :data => "\x00\x01\xFF".b),
+              MIDIMetaEvent.new(:meta_type => 0x01, :data => '')]
+    events.each_with_index { |event, i| track.add i, event }
+    track.add 3, MIDINoteMessage.new(:note => 60)
+    
+    read = track.to_enum(:each_with_time).to_a
+    assert_equal events.each_with_index.map { |event, i| [event, i.to_f] }, read[0, 3]
+    read[0, 3].each do |event, _|
+      assert event.data.frozen?
+      assert_equal Encoding::BINARY, event.data.encoding
+    end
+    assert_equal events, track.to_enum(:each, :type => :meta).to_a
+    assert_equal [], track.to_enum(:each, :type => :raw_data).to_a
+    assert_equal [events[1]], track.to_enum(:each, :type => :meta, :from => 1, :to => 2).to_a
+    assert_raise(ArgumentError) { track.add_meta_event 0, MIDIRawData.new(:data => 'x') }
+  end
+  
+  def test_iterator
+    track = MusicSequence.new.tracks.new
+    track.add 0, MIDINoteMessage.new(:note => 60)
+    iter = track.iterator
+    iter.event = MIDIMetaEvent.new(:meta_type => 0x06, :data => 'Verse')
+    assert_equal MIDIMetaEvent.new(:meta_type => 0x06, :data => 'Verse'), iter.event
+    assert_equal [MIDIMetaEvent.new(:meta_type => 0x06, :data => 'Verse')], track.to_enum(:each).to_a
+  end
+end
+
+class MIDIRawDataTest < Test::Unit::TestCase
+  SYSEX = "\xF0\x7E\x7F\x09\x01\xF7".b
+  
+  def test_initialization
+    assert_raise(ArgumentError) { MIDIRawData.new({}) }
+    raw = MIDIRawData.new(:data => SYSEX)
+    assert_equal SYSEX, raw.data
+    assert_equal 6, raw.length
+    assert raw.data.frozen?
+  end
+  
+  def test_add
+    track = MusicSequence.new.tracks.new
+    track.add 0, MIDIRawData.new(:data => SYSEX)
+    track.add 1, MIDIRawData.new(:data => "\xF0\x43\xF7".b)
+    assert_equal [MIDIRawData.new(:data => SYSEX), MIDIRawData.new(:data => "\xF0\x43\xF7".b)],
+                 track.to_enum(:each, :type => :raw_data).to_a
+    assert_equal 2, track.to_enum(:each, :type => [:raw_data, :meta]).count
+    
+    other = MusicSequence.new.tracks.new
+    other.add 0, MIDIRawData.new(:data => SYSEX)
+    other.add 1, MIDIRawData.new(:data => "\xF0\x43\xF7".b)
+    assert track == other
+  end
+end
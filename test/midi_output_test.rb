@@ -0,0 +1,190 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'timeout'
+require 'tmpdir'
+
+class MIDIOutputTest < Test::Unit::TestCase
+  def setup
+    @reader, @writer = IO.pipe
+    @output = MIDIOutput.new(@writer)
+  end
+  
+  def teardown
+    @output.close
+    @reader.close
+    @writer.close
+  end
+  
+  def test_flush__coalesces
+    @output << MIDIControlChangeMessage.new(:channel => 0, :number => 1, :value => 10)
+    @output << MIDIControlChangeMessage.new(:channel => 0, :number => 1, :value => 11)
+    @output << MIDINoteMessage.new(:channel => 1, :note => 60, :velocity => 100)
+    @output << "\xB0\x01\x0C".b
+    @output.flush
+    assert_equal 1, @output.writes
+    assert_equal 4, @output.messages
+    # Running status drops the repeated status byte of the second controller.
+    assert_equal "\xB0\x01\x0A\x01\x0B\x91\x3C\x64\xB0\x01\x0C".b, @reader.read_nonblock(64)
+    assert_equal 11, @output.bytes_written
+  end
+  
+  def test_close
+    @output.close
+    assert @output.closed?
+    assert_raise(IOError) { @output << MIDINoteMessage.new(:note => 60) }
+    assert !@writer.closed?, "Expected an IO given to the output to be left open."
+  end
+  
+  def test_path
+    Dir.mktmpdir do |dir|
+      fifo = File.join(dir, 'midi')
+      File.mkfifo(fifo)
+      assert_raise(Errno::ENXIO) { MIDIOutput.new(fifo) }
+      
+      reader = File.open(fifo, IO::RDONLY | IO::NONBLOCK)
+      output = MIDIOutput.new(fifo)
+      output << MIDIProgramChangeMessage.new(:channel => 2, :program => 5)
+      output.flush
+      assert_equal "\xC2\x05".b, reader.read_nonblock(8)
+      output.close
+      reader.close
+    end
+  end
+  
+  def test_playback
+    sequence = MusicSequence.new
+    sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    track = sequence.tracks.new
+    32.times { |i| track.add 0.0, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => i) }
+    track.add 0.0, MIDINoteMessage.new(:channel => 0, :note => 60, :velocity => 90, :duration => 0.5)
+    track.add 1.0, MIDINoteMessage.new(:channel => 0, :note => 62, :velocity => 90, :duration => 0.5)
+    sequence.midi_endpoint = @output
+    
+    player = MusicPlayer.new
+    player.sequence = sequence
+    player.start
+    assert player.playing?
+    Timeout.timeout(5) { sleep 0.01 while player.playing? }
+    assert player.time >= 1.5
+    
+    bytes = @reader.read_nonblock(1024).unpack('C*')
+    assert_equal [0xB0, 7, 0] + (1...32).map { |i| [7, i] }.flatten, bytes[0, 65]
+    assert_equal [0x90, 60, 90, 0x80, 60, 0, 0x90, 62, 90, 0x80, 62, 0], bytes[65..-1]
+    assert_equal 36, @output.messages
+    assert_equal 4, @output.writes, "Expected the events at each beat to be written together."
+  end
+  
+  def test_stop__releases_notes
+    sequence = MusicSequence.new
+    track = sequence.tracks.new
+    track.add 0.0, MIDINoteMessage.new(:channel => 3, :note => 64, :velocity => 80, :duration => 100)
+    sequence.midi_endpoint = @output
+    
+    player = MusicPlayer.new
+    player.sequence = sequence
+    player.start
+    Timeout.timeout(5) { sleep 0.01 while @output.messages.zero? }
+    player.stop
+    assert !player.playing?
+    assert_equal [0x93, 64, 80, 0x83, 64, 0], @reader.read_nonblock(64).unpack('C*')
+    assert player.time > 0.0
+    assert player.time < 100.0
+  end
+  
+  def test_collect__while_playing
+    3.times do
+      sequence = MusicSequence.new
+      track = sequence.tracks.new
+      1000.times { |i| track.add i * 0.01, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => i % 128) }
+      sequence.midi_endpoint = @output
+      player = MusicPlayer.new
+      player.sequence = sequence
+      player.start
+    end
+    # The sequences may go before their players, which stop playing them.
+    GC.start
+    GC.start
+    sleep 0.05
+    @reader.read_nonblock(65536) rescue IO::WaitReadable
+    assert !@output.closed?
+  end
+  
+  def test_playback__many_players
+    players = Array.new(50) do |i|
+      sequence = MusicSequence.new
+      sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+      sequence.tracks.new.add 0.1 * (i % 10), MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => i)
+      sequence.midi_endpoint = @output
+      player = MusicPlayer.new
+      player.sequence = sequence
+      player
+    end
+    players.each(&:start)
+    Timeout.timeout(5) { sleep 0.01 while players.any?(&:playing?) }
+    
+    # The players share a few scheduler threads rather than having one each.
+    assert MusicPlayer.scheduler_threads.between?(1, 4)
+    # Messages flushed together share a running status.
+    values = @reader.read_nonblock(1024).unpack('C*').reject { |b| b == 0xB0 }.each_slice(2).map(&:last)
+    assert_equal (0...50).to_a, values.sort
+  end
+  
+  def test_playback__after_fork
+    sequence = MusicSequence.new
+    sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    sequence.tracks.new.add 0.5, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 1)
+    sequence.midi_endpoint = @output
+    player = MusicPlayer.new
+    player.sequence = sequence
+    player.start
+    # The child has none of its parent's scheduler threads, and starts its own.
+    pid = fork do
+      threads = MusicPlayer.scheduler_threads
+      player.stop
+      player.time = 0.0
+      player.start
+      begin
+        Timeout.timeout(5) { sleep 0.01 while player.playing? }
+        exit!(threads.zero? ? 0 : 1)
+      rescue Timeout::Error
+        exit!(2)
+      end
+    end
+    Process.wait(pid)
+    assert_equal 0, $?.exitstatus
+    player.stop
+  end
+  
+  def test_playback__full_output
+    filler = 0
+    filler += @writer.write_nonblock('x' * 4096) while true rescue IO::WaitWritable
+    sequence = MusicSequence.new
+    sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    track = sequence.tracks.new
+    8.times { |i| track.add 0.1 * i, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => i) }
+    sequence.midi_endpoint = @output
+    player = MusicPlayer.new
+    player.sequence = sequence
+    player.start
+    
+    # Nobody reads the pipe, yet other players keep their time.
+    reader, writer = IO.pipe
+    other = MusicSequence.new
+    other.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    other.tracks.new.add 0.5, MIDIControlChangeMessage.new(:channel => 1, :number => 7, :value => 1)
+    other.midi_endpoint = output = MIDIOutput.new(writer)
+    players = Array.new(8) { MusicPlayer.new.tap { |p| p.sequence = other; p.start } }
+    Timeout.timeout(2) { sleep 0.01 while players.any?(&:playing?) }
+    assert_equal 8, output.messages
+    assert player.playing?, "Expected playback to wait for the reader."
+    
+    # Once the reader catches up the rest is written and playback ends.
+    @reader.read(filler)
+    Timeout.timeout(5) { sleep 0.01 while player.playing? }
+    assert_equal (0...8).to_a, @reader.read_nonblock(64).unpack('C*').reject { |b| b == 0xB0 }.each_slice(2).map(&:last)
+    assert_equal 0, @output.dropped
+  ensure
+    output.close if output
+    reader.close if reader
+    writer.close if writer
+  end
+end
@@ -0,0 +1,103 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'timeout'
+
+class MIDIRecorderTest < Test::Unit::TestCase
+  def setup
+    @sequence = MusicSequence.new
+    @track = @sequence.tracks.new
+    @player = MusicPlayer.new
+    @player.sequence = @sequence
+    @reader, @writer = IO.pipe
+    @recorder = MIDIRecorder.new(@reader, @track, @player)
+  end
+  
+  def teardown
+    @recorder.close
+    @reader.close
+    @writer.close unless @writer.closed?
+  end
+  
+  def test_record
+    @player.time = 2.0
+    @recorder.start
+    assert @recorder.recording?
+    @writer.write "\x90\x3C\x64\xB0\x07\x10".b
+    wait_for_events 1
+    
+    @player.time = 4.0
+    # Running status, and a real time clock byte in the middle of a message.
+    @writer.write "\x07\xF8\x11\x80\x3C\x40".b
+    wait_for_events 3
+    @recorder.stop
+    assert !@recorder.recording?
+    
+    events = recorded
+    assert_equal [2.0, 2.0, 4.0], events.map { |ev, time| time }
+    note = events.map { |ev, time| ev }.grep(MIDINoteMessage).first
+    assert_equal 60, note.note
+    assert_equal 100, note.velocity
+    assert_equal 64, note.release_velocity
+    assert_equal 2, note.duration
+    assert_equal [0x10, 0x11], events.map { |ev, time| ev }.grep(MIDIControlChangeMessage).map { |ev| ev.value }
+    assert_equal 0, @recorder.overruns
+  end
+  
+  def test_stop__ends_held_notes
+    @player.time = 1.0
+    @recorder.record do
+      @writer.write "\x91\x40\x50\x91\x41\x50\x91\x41\x00".b
+      wait_for_events 1
+      @player.time = 4.0
+    end
+    notes = recorded.map { |ev, time| ev }
+    assert_equal [[65, 0.0], [64, 3.0]], notes.map { |ev| [ev.note, ev.duration] }
+  end
+  
+  def test_note_on_without_velocity
+    @recorder.start
+    @writer.write "\x92\x30\x40\x30\x00".b
+    wait_for_events 1
+    @recorder.stop
+    (note, time), = recorded
+    assert_equal 2, note.channel
+    assert_equal 0, note.release_velocity
+  end
+  
+  def test_drain__while_playing
+    out_reader, out_writer = IO.pipe
+    output = MIDIOutput.new(out_writer)
+    @sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    2000.times { |i| @track.add i * 0.01, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => i % 128) }
+    @sequence.midi_endpoint = output
+    @player.start
+    # The engine plays the track the recorder overdubs into.
+    @recorder.record do
+      200.times { |i| @writer.write [0xB1, 1, i % 128].pack('C*') }
+      Timeout.timeout(5) do
+        until recorded.size >= 2200
+          out_reader.read_nonblock(65536) rescue IO::WaitReadable
+          sleep 0.001
+        end
+      end
+      assert @player.playing?
+    end
+    assert_equal 200, recorded.count { |ev, time| ev.channel == 1 }
+  ensure
+    @player.stop
+    output.close
+    out_reader.close
+    out_writer.close
+  end
+  
+  private
+  
+  def recorded
+    events = []
+    @track.each_with_time { |ev, time| events << [ev, time] }
+    events
+  end
+  
+  def wait_for_events(n)
+    Timeout.timeout(5) { sleep 0.005 until recorded.size >= n }
+  end
+end
@@ -0,0 +1,135 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'timeout'
+require 'tmpdir'
+
+class MIDIStreamTest < Test::Unit::TestCase
+  def setup
+    @dir = Dir.mktmpdir
+    @path = File.join(@dir, 'stream.mid')
+    @reader, @writer = IO.pipe
+    @output = MIDIOutput.new(@writer)
+  end
+  
+  def teardown
+    @output.close
+    @reader.close
+    @writer.close
+    FileUtils.remove_entry(@dir)
+  end
+  
+  def save(bpm = 600)
+    sequence = MusicSequence.new
+    sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => bpm)
+    yield sequence
+    sequence.save_async(@path).value
+  end
+  
+  def play(stream, from = nil)
+    stream.midi_endpoint = @output
+    player = MusicPlayer.new
+    player.sequence = stream
+    player.time = from if from
+    player.start
+    Timeout.timeout(5) { sleep 0.01 while player.playing? }
+    player
+  end
+  
+  # The channel messages in bytes, with running status expanded.
+  def messages(bytes)
+    status = nil
+    decoded = []
+    until bytes.empty?
+      status = bytes.shift if bytes.first >= 0x80
+      decoded << [status] + bytes.shift((0xC0..0xDF).include?(status) ? 1 : 2)
+    end
+    decoded
+  end
+  
+  def test_open
+    save do |sequence|
+      sequence.tracks.new.add 1, MIDINoteMessage.new(:note => 60, :duration => 1)
+      sequence.tracks.new.add 0, MIDIProgramChangeMessage.new(:channel => 1, :program => 5)
+    end
+    stream = MIDIStream.new(@path)
+    assert_equal 3, stream.tracks
+    assert_equal 480, stream.division
+    assert_equal 2.0, stream.length
+    assert_equal 4, stream.events
+    stream.close
+    assert stream.closed?
+    assert_raise(IOError) { stream.tracks }
+    MIDIStream.open(@path) { |opened| stream = opened }
+    assert stream.closed?
+    
+    assert_raise(Errno::ENOENT) { MIDIStream.new(File.join(@dir, 'missing.mid')) }
+    File.open(@path, 'w') { |f| f << 'not a midi file' }
+    assert_raise(RuntimeError) { MIDIStream.new(@path) }
+    assert_raise(ArgumentError) { MIDIStream.new(@path, :window => 0) }
+  end
+  
+  def test_playback
+    save do |sequence|
+      melody, bass = sequence.tracks.new, sequence.tracks.new
+      4.times { |i| melody.add i, MIDINoteMessage.new(:channel => 0, :note => 60 + i, :velocity => 90, :duration => 0.5) }
+      bass.add 0, MIDIProgramChangeMessage.new(:channel => 1, :program => 33)
+      bass.add 1.5, MIDINoteMessage.new(:channel => 1, :note => 36, :velocity => 70, :duration => 1)
+    end
+    # A window of two events has each track refilled as it is consumed.
+    player = play(MIDIStream.new(@path, :window => 2))
+    assert player.time >= 3.5
+    
+    bytes = @reader.read_nonblock(1024).unpack('C*')
+    assert_equal [0x90, 60, 90, 0xC1, 33, 0x80, 60, 0, 0x90, 61, 90, 0x80, 61, 0, 0x91, 36, 70,
+                  0x90, 62, 90, 0x80, 62, 0, 0x81, 36, 0, 0x90, 63, 90, 0x80, 63, 0], bytes
+  end
+  
+  def test_seek
+    save(6000) do |sequence|
+      track = sequence.tracks.new
+      10_000.times { |i| track.add i * 0.25, MIDIControlChangeMessage.new(:channel => 0, :number => 1, :value => i % 128) }
+    end
+    stream = MIDIStream.new(@path)
+    assert_equal 10_000, stream.events - 1
+    
+    # Starting well past the first mark of the index.
+    play(stream, 2499.0)
+    assert_equal (9996...10_000).map { |i| [0xB0, 1, i % 128] }, messages(@reader.read_nonblock(1024).unpack('C*'))
+  end
+  
+  def test_stop__releases_notes
+    save(120) do |sequence|
+      sequence.tracks.new.add 0, MIDINoteMessage.new(:channel => 3, :note => 64, :velocity => 80, :duration => 100)
+    end
+    stream = MIDIStream.new(@path)
+    stream.midi_endpoint = @output
+    player = MusicPlayer.new
+    player.sequence = stream
+    player.start
+    Timeout.timeout(5) { sleep 0.01 while @output.messages.zero? }
+    player.stop
+    assert !player.playing?
+    assert_equal [0x93, 64, 80, 0x83, 64, 0], @reader.read_nonblock(64).unpack('C*')
+  end
+  
+  def test_close__while_playing
+    save(120) do |sequence|
+      sequence.tracks.new.add 0.25, MIDINoteMessage.new(:channel => 0, :note => 60, :duration => 0.25)
+    end
+    stream = MIDIStream.new(@path)
+    stream.midi_endpoint = @output
+    player = MusicPlayer.new
+    player.sequence = stream
+    player.start
+    stream.close
+    Timeout.timeout(5) { sleep 0.01 while player.playing? }
+    assert_equal [0x90, 60, 64, 0x80, 60, 0], @reader.read_nonblock(64).unpack('C*')
+  end
+  
+  def test_start__requires_output
+    save { |sequence| sequence.tracks.new }
+    player = MusicPlayer.new
+    player.sequence = MIDIStream.new(@path)
+    assert_raise(ArgumentError) { player.start }
+    assert_raise(ArgumentError) { MIDIStream.new(@path).midi_endpoint = 1 }
+  end
+end
@@ -1,4 +1,5 @@
 require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'objspace'
 
 class MusicEventIteratorTest < Test::Unit::TestCase
   def setup
@@ -18,6 +19,17 @@ class MusicEventIteratorTest < Test::Unit::TestCase
     assert_equal @ev2, @iter.event
   end
   
+  def test_seek_bar
+    @track.add 4, ev3=MIDINoteMessage.new(:note => 72)
+    @iter.seek_bar(2)
+    assert_equal ev3, @iter.event
+    assert_equal 4.0, @iter.time
+    @iter.seek_bar(1)
+    assert_equal @ev1, @iter.event
+    @iter.seek_bar(3)
+    assert !@iter.current?
+  end
+  
   def test_current?
     assert @iter.current?
     @iter.next
@@ -157,4 +169,14 @@ class MusicEventIteratorTest < Test::Unit::TestCase
     assert !@iter.current?
     assert_nothing_raised { @iter.delete }
   end
+  
+  def test_delete__memsize
+    size = ObjectSpace.memsize_of(@sequence)
+    @iter.delete
+    smaller = ObjectSpace.memsize_of(@sequence)
+    assert smaller < size, "Expected the deleted event to be released."
+    @iter.delete
+    @iter.delete
+    assert_equal smaller - (size - smaller), ObjectSpace.memsize_of(@sequence)
+  end
 end
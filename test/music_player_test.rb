@@ -37,4 +37,122 @@ class MusicPlayerTest < Test::Unit::TestCase
       assert_equal 1.6, @player.play_rate_scalar
     end
   end
+  
+  def test_virtual_clock
+    @sequence.tracks.tempo.add 1.0, ExtendedTempoEvent.new(:bpm => 60)
+    @player.virtual_clock = true
+    @player.start
+    # Nothing is due between events, and time only passes when advanced.
+    assert_equal [[0.0, 0.0, 0xC0, 1, 0], [0.0, 0.0, 0x91, 60, 64]], records(@player.advance(0.25))
+    assert_equal [], records(@player.advance(0.2))
+    assert_equal 0.9, @player.time
+    assert_equal [[0.5, 1.0, 0x81, 60, 0], [0.5, 1.0, 0x91, 64, 64]], records(@player.advance(0.05))
+    
+    @player.play_rate_scalar = 2.0
+    assert_equal [[1.0, 2.0, 0x81, 64, 0], [1.0, 2.0, 0x91, 67, 64]], records(@player.advance(0.5))
+    @player.stop
+    assert_equal [[1.0, 2.0, 0x81, 67, 0]], records(@player.recorded)
+    
+    # A seek restarts from the new position at the current virtual time.
+    @track.loop_info = { :duration => 3.0, :number => 0 }
+    @player.time = 1.0
+    @player.start
+    assert_equal [[1.0, 1.0, 0x91, 64, 64]], records(@player.advance(0))
+    # An hour at double speed, at one note a second.
+    assert_equal 7200, records(@player.advance(3600)).count { |_, _, status| status == 0x91 }
+  end
+  
+  def test_virtual_clock__track_changes
+    @player.virtual_clock = true
+    @player.start
+    assert_equal [[0.0, 0.0, 0xC0, 1, 0], [0.0, 0.0, 0x91, 60, 64]], records(@player.advance(0.25))
+    # Deleting a track restarts playback, releasing its notes, and an event
+    # added ahead of the position is played.
+    track = @sequence.tracks.new
+    track.add 1.5, MIDINoteMessage.new(:note => 72)
+    @sequence.tracks.delete(@track)
+    assert @player.playing?
+    assert_equal [[0.25, 0.5, 0x81, 60, 0]], records(@player.recorded)
+    track.add 1.0, MIDINoteMessage.new(:note => 71)
+    assert_equal [[0.5, 1.0, 0x91, 71, 64], [0.75, 1.5, 0x91, 72, 64]], records(@player.advance(0.5))
+  end
+  
+  def test_virtual_clock__overdue
+    sequence = MusicSequence.new
+    track = sequence.tracks.new
+    # A note off falling before its note on is overdue once the note is played.
+    track.add 1.0, MIDINoteMessage.new(:note => 60, :duration => -0.5)
+    track.add 2.0, MIDINoteMessage.new(:note => 62)
+    @player.sequence = sequence
+    @player.virtual_clock = true
+    @player.start
+    assert_equal [[0.5, 1.0, 0x91, 60, 64], [0.25, 0.5, 0x81, 60, 0]], records(@player.advance(0.6))
+    assert_equal [[1.0, 2.0, 0x91, 62, 64]], records(@player.advance(0.6))
+    assert_in_delta 2.4, @player.time, 1e-9
+  end
+  
+  def test_virtual_clock__requires_virtual_clock
+    assert_raise(RuntimeError) { @player.advance(1) }
+    @player.virtual_clock = true
+    assert_raise(ArgumentError) { @player.advance(-1) }
+    @player.virtual_clock = false
+    assert !@player.virtual_clock
+  end
+  
+  def test_wait_until
+    @sequence.tracks.tempo.add 1.0, ExtendedTempoEvent.new(:bpm => 60)
+    @player.virtual_clock = true
+    @player.start
+    waiter = Thread.new { @player.wait_until(1.5) }
+    Thread.pass until waiter.stop?
+    @player.advance(0.25)
+    assert waiter.alive?
+    # Half a second reaches beat 1, and a further half beat takes as long at 60 bpm.
+    @player.advance(1.0)
+    assert_equal true, waiter.value
+    assert_equal true, @player.wait_until(1.5)
+    
+    assert_equal false, @player.wait_until(10, 0.05)
+    waiter = Thread.new { @player.wait_until(10) }
+    Thread.pass until waiter.stop?
+    @player.stop
+    assert_equal false, waiter.value
+    assert_equal false, @player.wait_until(10)
+    assert_raise(ArgumentError) { @player.wait_until('10') }
+  end
+  
+  def test_wait_for_stop
+    @player.virtual_clock = true
+    @player.start
+    assert_equal false, @player.wait_for_stop(0.05)
+    waiter = Thread.new { @player.wait_for_stop }
+    Thread.pass until waiter.stop?
+    @player.advance(10)
+    assert_equal true, waiter.value
+    assert !@player.playing?
+    assert_equal true, @player.wait_for_stop
+  end
+  
+  def test_wait__midi_output
+    reader, writer = IO.pipe
+    @sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    @sequence.midi_endpoint = output = MIDIOutput.new(writer)
+    @player.start
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    # Beat 1.5 falls between events, 0.15 seconds in at 600 bpm.
+    assert_equal true, @player.wait_until(1.5, 5)
+    assert_in_delta 0.15, Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, 0.05
+    assert @player.time >= 1.5
+    assert_equal true, @player.wait_for_stop(5)
+    assert !@player.playing?
+  ensure
+    output.close if output
+    reader.close
+    writer.close
+  end
+  
+  private
+    def records(packed)
+      packed.unpack(MusicPlayer::RECORD_FORMAT * (packed.size / MusicPlayer::RECORD_SIZE)).each_slice(5).to_a
+    end
 end
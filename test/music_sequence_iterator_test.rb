@@ -0,0 +1,85 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+
+class MusicSequenceIteratorTest < Test::Unit::TestCase
+  def setup
+    @sequence = MusicSequence.new
+    @sequence.tracks.tempo.add 0, @tempo=ExtendedTempoEvent.new(:bpm => 120)
+    @track1 = @sequence.tracks.new
+    @track2 = @sequence.tracks.new
+    @track1.add 0, @ev1=MIDINoteMessage.new(:note => 60)
+    @track1.add 2, @ev3=MIDINoteMessage.new(:note => 62)
+    @track2.add 1, @ev2=MIDINoteMessage.new(:note => 61)
+    @track2.add 2, @ev4=MIDIControlChangeMessage.new(:channel => 1, :number => 7, :value => 90)
+  end
+  
+  def test_merged_order
+    assert_equal [[@tempo, 0.0, nil], [@ev1, 0.0, 0], [@ev2, 1.0, 1],
+                  [@ev3, 2.0, 0], [@ev4, 2.0, 1]], merged
+  end
+  
+  def test_cursor
+    iter = @sequence.iterator(:tempo => false)
+    assert iter.current?
+    assert_equal @ev1, iter.event
+    assert_equal 0, iter.track_index
+    iter.seek(1.5)
+    assert_equal 2.0, iter.time
+    assert_equal @ev3, iter.event
+    iter.next
+    assert_equal 1, iter.track_index
+    iter.next
+    assert !iter.current?
+    assert_raise(EndOfTrack) { iter.next }
+  end
+  
+  def test_mute_solo_and_offset
+    @track2.offset = 10
+    assert_equal [@ev1, @ev3, @ev2, @ev4], merged(:tempo => false).map { |ev, time, index| ev }
+    @track1.mute = true
+    assert_equal [0.0, 11.0, 12.0], merged.map { |ev, time, index| time }
+    @track1.mute = false
+    @track1.solo = true
+    assert_equal [nil, 0, 0], merged.map { |ev, time, index| index }
+  end
+  
+  def test_loops
+    @track1.loop_info = { :duration => 3, :number => 2 }
+    notes = merged(:tempo => false).select { |ev, time, index| index == 0 }
+    assert_equal [0.0, 2.0, 3.0, 5.0], notes.map { |ev, time, index| time }
+  end
+  
+  def test_filter
+    events = []
+    @sequence.iterator.each(:type => :note, :from => 1) { |ev, time, index| events << ev }
+    assert_equal [@ev2, @ev3], events
+  end
+  
+  def test_read
+    iter = @sequence.iterator
+    packed = iter.read(3)
+    assert_equal 3 * MusicSequenceIterator::RECORD_SIZE, packed.size
+    records = packed.unpack(MusicSequenceIterator::RECORD_FORMAT * 3).each_slice(8).to_a
+    assert_equal [0.0, 120.0, -1, 3, 0, 0, 0, 0], records[0]
+    assert_equal [0.0, 1.0, 0, 6, 0x91, 60, 64, 0], records[1]
+    assert_equal 1.0, records[2][0]
+    
+    assert_equal 2 * MusicSequenceIterator::RECORD_SIZE, iter.read(10).size
+    assert_nil iter.read(10)
+  end
+  
+  def test_read__large_counts
+    track = @sequence.tracks.new
+    3000.times { |i| track.add i * 0.01, 0xB0070A }
+    iter = @sequence.iterator
+    # Only the events left are allocated for, however many are asked for.
+    assert_equal 3005 * MusicSequenceIterator::RECORD_SIZE, iter.read(1 << 40).size
+    assert_raise(ArgumentError) { @sequence.iterator.read(1 << 62) }
+  end
+  
+  private
+    def merged(options=nil)
+      events = []
+      @sequence.iterator(options).each { |ev, time, index| events << [ev, time, index] }
+      events
+    end
+end
@@ -1,4 +1,5 @@
 require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'objspace'
 require 'pathname'
 require 'tempfile'
 
@@ -48,5 +49,183 @@ class MusicSequenceTest < Test::Unit::TestCase
     assert_equal 2, @sequence.tracks.size
     assert_equal @track, @sequence.tracks[0]
     assert_not_equal @track, @sequence.tracks[1]
+  end  
+  
+  def test_load__reindexes
+    sequence = MusicSequence.new
+    tempo = sequence.tracks.tempo
+    assert_equal 0, tempo.to_enum(:each, :type => :tempo).count
+    digest = tempo.digest
+    sequence.load(File.join(File.dirname(__FILE__), 'example.mid'))
+    # The load wrote to the tempo track without going through the wrapper.
+    assert_equal 1, tempo.to_enum(:each, :type => :tempo).count
+    assert_not_equal digest, tempo.digest
+    assert_equal 1, sequence.tracks.tempo.to_enum(:each).count
+  end
+  def test_memsize
+    size = ObjectSpace.memsize_of(@sequence)
+    100.times { |i| @track.add i, MIDINoteMessage.new(:note => 60) }
+    grown = ObjectSpace.memsize_of(@sequence)
+    assert grown > size, "Expected the size of a sequence to grow with its events."
+    per_event = (grown - size) / 100
+    
+    @sequence.load(File.join(File.dirname(__FILE__), 'example.mid'))
+    loaded = ObjectSpace.memsize_of(@sequence)
+    assert loaded > grown
+    
+    @sequence.tracks.delete(@track)
+    assert_equal loaded - 104 * per_event, ObjectSpace.memsize_of(@sequence),
+      "Expected the deleted track's events to be released."
+  end
+  
+  def test_memsize__tracks
+    @sequence.tracks[0]
+    size = ObjectSpace.memsize_of(@sequence)
+    1000.times { @sequence.tracks[0] }
+    assert_equal size, ObjectSpace.memsize_of(@sequence),
+      "Expected wrappers for the same track to share its storage."
+    assert size > ObjectSpace.memsize_of(MusicSequence.new)
+  end
+  
+  def test_analyze
+    other = @sequence.tracks.new
+    other.add 0.5, MIDINoteMessage.new(:channel => 9, :note => 36, :velocity => 100, :duration => 1)
+    other.add 3.0, MIDINoteMessage.new(:channel => 9, :note => 36, :velocity => 90, :duration => 1)
+    
+    stats = @sequence.analyze
+    assert_equal 2, stats[:tracks]
+    assert_equal 6, stats[:events]
+    assert_equal 5, stats[:notes]
+    assert_equal 2, stats[:pitches][36]
+    assert_equal 1, stats[:pitches][60]
+    assert_equal 128, stats[:velocities].size
+    assert_equal 1, stats[:velocities][90]
+    # The notes are on the default channel, 1.
+    assert_equal [1, 3, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 0], stats[:channels]
+    # The kick at 0.5 overlaps the notes at 0 and 1.
+    assert_equal 2, stats[:max_polyphony]
+    # Four beats at 120 bpm.
+    assert_in_delta 2.0, stats[:seconds], 1e-9
+    assert_in_delta 2.5, stats[:notes_per_second], 1e-9
+    assert_equal stats, @sequence.analyze(:threads => 1)
+  end
+  
+  def test_detach
+    iter = @track.iterator
+    timeline = @track.timeline
+    detached = @sequence.detach
+    assert detached.frozen?
+    assert_raise(IOError) { @sequence.tracks.size }
+    assert_raise(IOError) { @track.to_enum(:each).to_a }
+    assert_raise(IOError) { iter.time }
+    assert_raise(IOError) { timeline.time }
+    assert_raise(IOError) { @sequence.detach }
+    
+    sequence = MusicSequence.attach(detached)
+    assert_equal 1, sequence.tracks.size
+    assert_equal [60, 64, 67], sequence.tracks[0].to_enum(:each, :type => :note).map(&:note)
+    assert_equal 120, sequence.tracks.tempo.to_enum(:each).first.bpm
+    assert_raise(ArgumentError) { MusicSequence.attach(detached) }
+  end
+  
+  def test_detach__in_use
+    player = MusicPlayer.new
+    player.sequence = @sequence
+    assert_raise(RuntimeError) { @sequence.detach }
+    player.sequence = MusicSequence.new
+    assert_raise(RuntimeError) { @track.each { @sequence.detach } }
+    assert_equal 1, @sequence.tracks.size
+    assert_nothing_raised { @sequence.detach }
+  end
+  
+  def test_detach__ractor
+    return unless defined?(Ractor)
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    detached = @sequence.detach
+    assert Ractor.shareable?(detached)
+    stats = Ractor.new(detached) { |d| MusicSequence.attach(d).analyze(:threads => 1) }.take
+    assert_equal 3, stats[:notes]
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+  end
+  
+  def test_digest
+    other = MusicSequence.new
+    other.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 120)
+    track = other.tracks.new
+    @track.each_with_time { |ev, time| track.add time, ev }
+    assert_equal @sequence.digest, other.digest
+    
+    other.tracks.tempo.add 4.0, ExtendedTempoEvent.new(:bpm => 90)
+    assert_not_equal @sequence.digest, other.digest
+    @tempo.add 4.0, ExtendedTempoEvent.new(:bpm => 90)
+    assert_equal @sequence.digest, other.digest
+    
+    other.tracks.new
+    assert_not_equal @sequence.digest, other.digest
+  end
+  
+  def test_bar_beat_time
+    # Without any time signature, bars are in 4/4.
+    assert_equal [1, 1, 0], @sequence.beats_to_bar_beat_time(0)
+    assert_equal [2, 2, 240], @sequence.beats_to_bar_beat_time(5.5)
+    assert_equal 5.5, @sequence.bar_beat_time_to_beats([2, 2, 240])
+    
+    # 3/4 from bar 1, 6/8 from bar 3, and 5/4 from halfway through bar 4,
+    # which cuts bar 4 short.
+    tmp = Tempfile.new('music_sequence_test.mid')
+    write_smf(tmp.path, [[0, 3, 2], [6, 6, 3], [10.5, 5, 2]])
+    @sequence.load(tmp.path)
+    assert_equal [{ :beat => 0.0, :bar => 1, :numerator => 3, :denominator => 4 },
+                  { :beat => 6.0, :bar => 3, :numerator => 6, :denominator => 8 },
+                  { :beat => 10.5, :bar => 5, :numerator => 5, :denominator => 4 }],
+                 @sequence.time_signatures
+    
+    assert_equal [2, 3, 0], @sequence.beats_to_bar_beat_time(5)
+    assert_equal [3, 3, 240], @sequence.beats_to_bar_beat_time(7.25)
+    assert_equal [3, 3, 2], @sequence.beats_to_bar_beat_time(7.25, 4)
+    assert_equal [4, 3, 0], @sequence.beats_to_bar_beat_time(10)
+    assert_equal [5, 2, 0], @sequence.beats_to_bar_beat_time(11.5)
+    assert_equal [0, 1, 0], @sequence.beats_to_bar_beat_time(-3)
+    
+    assert_equal 7.25, @sequence.bar_beat_time_to_beats([3, 3, 240])
+    assert_equal 7.25, @sequence.bar_beat_time_to_beats([3, 3, 2], 4)
+    assert_equal 10.0, @sequence.bar_beat_time_to_beats([4, 3])
+    assert_equal 10.5, @sequence.bar_beat_time_to_beats([5])
+    assert_equal 15.5, @sequence.bar_beat_time_to_beats([6])
+    
+    packed = @sequence.beats_to_bar_beat_times([0, 7.25, 11.5].pack('d*'))
+    assert_equal [1, 1, 0, 3, 3, 240, 5, 2, 0],
+                 packed.unpack(MusicSequence::BAR_BEAT_TIME_FORMAT * 3)
+    
+    assert_raise(ArgumentError) { @sequence.beats_to_bar_beat_time(1, 0) }
+    assert_raise(ArgumentError) { @sequence.beats_to_bar_beat_times('abc') }
+    assert_raise(ArgumentError) { @sequence.bar_beat_time_to_beats([]) }
+  ensure
+    tmp.close! if tmp
+  end
+  
+  private
+  
+  # Writes a format 1 SMF whose conductor track holds a time signature for
+  # each [beat, numerator, log2 of the denominator].
+  def write_smf(path, signatures)
+    last = 0
+    conductor = signatures.map do |beat, numerator, denominator|
+      tick = (beat * 480).round
+      delta, last = tick - last, tick
+      vlq(delta) + [0xFF, 0x58, 4, numerator, denominator, 24, 8].pack('C*')
+    end.join + [0, 0xFF, 0x2F, 0].pack('C*')
+    notes = [0, 0x90, 60, 100, 0x83, 0x60, 0x80, 60, 0, 0, 0xFF, 0x2F, 0].pack('C*')
+    File.open(path, 'wb') do |f|
+      f << ['MThd', 6, 1, 2, 480].pack('a4Nnnn')
+      [conductor, notes].each { |chunk| f << ['MTrk', chunk.size].pack('a4N') << chunk }
+    end
+  end
+  
+  def vlq(n)
+    bytes = [n & 0x7F]
+    bytes.unshift((n >>= 7) & 0x7F | 0x80) while n > 0x7F
+    bytes.pack('C*')
   end
 end
@@ -0,0 +1,72 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+
+class MusicTimelineTest < Test::Unit::TestCase
+  def setup
+    @sequence = MusicSequence.new
+    @track = @sequence.tracks.new
+    @notes = (0..3).map do |beat|
+      ev = MIDINoteMessage.new(:note => 60 + beat, :duration => 1)
+      @track.add beat, ev
+      ev
+    end
+  end
+  
+  def test_unlooped
+    @track.offset = 2.0
+    timeline = @track.timeline
+    assert_equal @notes, timeline.to_a
+    assert_equal [2.0, 3.0, 4.0, 5.0], times(timeline)
+    assert_equal 6.0, timeline.length
+  end
+  
+  def test_whole_track_loop
+    @track.loop_info = { :duration => 4, :number => 3 }
+    timeline = @track.timeline
+    assert_equal @notes * 3, timeline.to_a
+    assert_equal (0...12).map { |beat| beat.to_f }, times(timeline)
+    assert_equal 12.0, timeline.length
+  end
+  
+  def test_loop_repeats_end_of_track
+    @track.loop_info = { :duration => 2, :number => 3 }
+    timeline = @track.timeline
+    assert_equal @notes + @notes[2..3] * 2, timeline.to_a
+    assert_equal [0.0, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0], times(timeline)
+  end
+  
+  def test_seek
+    @track.offset = 1.0
+    @track.loop_info = { :duration => 4, :number => 3 }
+    timeline = @track.timeline
+    
+    timeline.seek(10.5)
+    assert_equal 2, timeline.pass
+    assert_equal 11.0, timeline.time
+    assert_equal @notes[2], timeline.event
+    timeline.next
+    timeline.next
+    assert !timeline.current?
+    assert_raise(EndOfTrack) { timeline.next }
+    
+    timeline.seek(100)
+    assert !timeline.current?
+  end
+  
+  def test_unbounded_loop
+    @track.loop_info = { :duration => 4, :number => 0 }
+    timeline = @track.timeline
+    assert_nil timeline.length
+    assert_raise(ArgumentError) { timeline.each {} }
+    
+    events = []
+    timeline.each(:from => 398, :to => 404, :note => 62..63) { |ev| events << ev }
+    assert_equal [@notes[2], @notes[3], @notes[2], @notes[3]], events
+  end
+  
+  private
+    def times(timeline)
+      times = []
+      timeline.each_with_time { |ev, time| times << time }
+      times
+    end
+end
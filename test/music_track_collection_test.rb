@@ -45,6 +45,16 @@ class MusicSequenceTracksEnumerableTest < Test::Unit::TestCase
     assert_equal 2, @sequence.tracks.size
   end
   
+  def test_delete__disposes
+    @track1.add 0.0, MIDINoteMessage.new(:note => 60)
+    digest = @track1.digest
+    @sequence.tracks.delete(@track1)
+    assert_raise(IOError) { @track1.digest }
+    assert_same @track2, @sequence.tracks[0]
+    # A track made afterwards, whatever its handle, starts out empty.
+    assert_not_equal digest, @sequence.tracks.new.digest
+  end
+  
   def test_tempo
     assert_kind_of MusicTrack, @sequence.tracks.tempo
     assert_equal @sequence.tracks.tempo, @sequence.tracks.tempo,
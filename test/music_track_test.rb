@@ -18,6 +18,31 @@ class MusicTrackTest < Test::Unit::TestCase
     end
   end
   
+  def test_add__packed
+    cc = MIDIControlChangeMessage.new(:channel => 10, :number => 32, :value => 1)
+    assert_equal 0xBA2001, cc.to_i
+    @track.add 0, cc.to_i
+    @track.add_all [1, 2], [0xBA2002, MIDINoteMessage.new(:note => 60)]
+    assert_equal [[cc, 0.0],
+                  [MIDIControlChangeMessage.new(:channel => 10, :number => 32, :value => 2), 1.0],
+                  [MIDINoteMessage.new(:note => 60), 2.0]], with_time({})
+    
+    assert_raise(ArgumentError) { @track.add 0, 0x7F0000 }
+    assert_raise(ArgumentError) { @track.add 0, 0xF00000 }
+    assert_raise(ArgumentError) { @track.add 0, 0xB08000 }
+    assert_raise(ArgumentError) { @track.add_all [0], [] }
+  end
+  
+  def test_each__packed
+    @track.add 0, MIDINoteMessage.new(:note => 60)
+    @track.add 1, 0xB00740
+    # Note ons and offs added as channel messages can be read back packed.
+    @track.add 2, 0x903C64
+    assert_equal [0xB00740, 0x903C64], filtered(:from => 1, :packed => true)
+    assert_equal [[0x903C64, 2.0]], with_time(:from => 2, :packed => true)
+    assert_kind_of MIDINoteMessage, filtered(:packed => true).first
+  end
+  
   def test_iterator
     assert_kind_of MusicEventIterator, @track.iterator
   end
@@ -30,6 +55,35 @@ class MusicTrackTest < Test::Unit::TestCase
     assert_equal [ev1, ev2, ev3], @track.map { |x| x }
   end
   
+  def test_each__filtered
+    @track.add 0, kick=MIDINoteMessage.new(:note => 35, :channel => 10)
+    @track.add 0, MIDINoteMessage.new(:note => 60, :channel => 1)
+    @track.add 1, cc=MIDIControlChangeMessage.new(:channel => 10, :number => 7, :value => 100)
+    @track.add 2, snare=MIDINoteMessage.new(:note => 40, :channel => 10)
+    @track.add 3, MIDINoteMessage.new(:note => 41, :channel => 10)
+    
+    assert_equal [kick, snare],
+      filtered(:type => :note, :channel => 10, :note => 35..40)
+    assert_equal [cc], filtered(:type => :channel)
+    assert_equal [cc, snare], filtered(:channel => [9, 10], :from => 1, :to => 3)
+    assert_equal [[snare, 2.0]], with_time(:note => 40)
+    
+    assert_raise(ArgumentError) { @track.each(:type => :bogus) {} }
+    assert_raise(ArgumentError) { @track.each(:channel => 16) {} }
+  end
+  
+  def test_each__filtered_after_edit
+    @track.add 0, MIDINoteMessage.new(:note => 60, :channel => 1)
+    # A complete scan indexes the track; later edits must still be found.
+    assert_equal [], filtered(:channel => 10)
+    @track.add 1, kick=MIDINoteMessage.new(:note => 35, :channel => 10)
+    assert_equal [kick], filtered(:channel => 10)
+    
+    iter = @track.iterator
+    iter.event = pb=MIDIPitchBendMessage.new(:channel => 3, :value => 64)
+    assert_equal [pb], filtered(:type => :pitch_bend, :channel => 3)
+  end
+  
   def test_loop_info
     assert_equal({ :duration => 0.0, :number => 1 }, @track.loop_info)
     @track.loop_info = { :duration => 100.0, :number => 42 }
@@ -89,4 +143,116 @@ class MusicTrackTest < Test::Unit::TestCase
     assert track.solo
     assert_equal 10, track.length
   end
+  
+  def test_digest
+    @track.add 0, MIDINoteMessage.new(:note => 60, :duration => 1)
+    @track.add 20, MIDINoteMessage.new(:note => 64, :duration => 1)
+    @track.add 40, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 100)
+    digest = @track.digest
+    
+    other = @sequence.tracks.new
+    @track.each_with_time { |ev, time| other.add time, ev }
+    assert_equal digest, other.digest
+    # Stable across processes and platforms.
+    assert_equal "6fcd15e53accad5a20fefe2a6edebdff", digest
+    
+    @track.add 21, MIDINoteMessage.new(:note => 67, :duration => 1)
+    assert_not_equal digest, @track.digest
+    iter = @track.iterator
+    iter.seek 21
+    iter.delete
+    assert_equal digest, @track.digest
+    
+    iter = @track.iterator
+    iter.seek 20
+    iter.time = 30
+    assert_not_equal digest, @track.digest
+    iter.time = 20
+    assert_equal digest, @track.digest
+    
+    @track.mute = true
+    assert_not_equal digest, @track.digest
+  end
+  
+  def test_pair_notes!
+    raw = lambda { |status, data1, data2| MIDIChannelMessage.new(:status => status, :data1 => data1, :data2 => data2) }
+    @track.add 0, raw[0x90, 60, 100]
+    @track.add 0, cc=MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 90)
+    # Struck again before its release, the note nests inside the first.
+    @track.add 1, raw[0x90, 60, 80]
+    @track.add 2, raw[0x80, 60, 30]
+    @track.add 3, raw[0x90, 60, 0]
+    @track.add 1, raw[0x91, 60, 70]
+    @track.add 1.5, raw[0x81, 60, 0]
+    @track.add 4, raw[0x80, 62, 0]
+    @track.add 4, raw[0x90, 64, 90]
+    
+    assert_equal 3, @track.pair_notes!
+    events = []
+    @track.each_with_time(:type => [:note, :control_change]) { |ev, time| events << [time, ev] }
+    assert_equal [[0.0, MIDINoteMessage.new(:channel => 0, :note => 60, :velocity => 100, :duration => 3.0)],
+                  [0.0, cc],
+                  [1.0, MIDINoteMessage.new(:channel => 0, :note => 60, :velocity => 80,
+                                            :release_velocity => 30, :duration => 1.0)],
+                  [1.0, MIDINoteMessage.new(:channel => 1, :note => 60, :velocity => 70, :duration => 0.5)]],
+                 events.sort_by { |time, ev| [time, ev.is_a?(MIDINoteMessage) ? 0 : 1, ev.channel] }
+    
+    # Unpaired note ons and offs are left for a later pass.
+    assert_equal 0, @track.pair_notes!
+    @track.add 5, raw[0x80, 64, 0]
+    assert_equal 1, @track.pair_notes!
+  end
+  
+  def test_equal
+    other = @sequence.tracks.new
+    assert_equal @track, other
+    assert_not_equal @track, nil
+    
+    # Events at one time may be added in any order.
+    @track.add 0, MIDINoteMessage.new(:channel => 0, :note => 60)
+    @track.add 0, MIDINoteMessage.new(:channel => 0, :note => 64)
+    other.add 0, MIDINoteMessage.new(:channel => 0, :note => 64)
+    other.add 0, MIDINoteMessage.new(:channel => 0, :note => 60)
+    assert_equal @track, other
+    
+    other.add 100, MIDINoteMessage.new(:channel => 0, :note => 67)
+    assert_not_equal @track, other
+    @track.add 100, MIDINoteMessage.new(:channel => 0, :note => 67, :velocity => 90)
+    assert_not_equal @track, other
+  end
+  
+  def test_diff
+    other = @sequence.tracks.new
+    [@track, other].each do |track|
+      40.times { |i| track.add i, MIDINoteMessage.new(:channel => 0, :note => 60 + i % 12) }
+    end
+    assert_equal '', @track.diff(other)
+    
+    @track.add 3, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 100)
+    other.add 20.5, MIDINoteMessage.new(:channel => 1, :note => 36, :duration => 0.5)
+    iter = other.iterator
+    iter.seek(35)
+    iter.event = MIDINoteMessage.new(:channel => 0, :note => 71, :velocity => 90, :duration => 2)
+    
+    packed = @track.diff(other)
+    assert_equal 3 * MusicTrack::DIFF_SIZE, packed.size
+    records = packed.unpack(MusicTrack::DIFF_FORMAT * 3).each_slice(11).to_a
+    assert_equal [[3.0, 0.0, 0.0, '-', 7, 0xB0, 7, 100, 0, 0, 0],
+                  [20.5, 0.0, 0.5, '+', 6, 0x91, 36, 0, 0, 64, 0],
+                  [35.0, 1.0, 2.0, '~', 6, 0x90, 71, 64, 0, 90, 0]], records
+    assert_raise(ArgumentError) { @track.diff(nil) }
+  end
+  
+  private
+    def filtered(filter)
+      events = []
+      @track.each(filter) { |ev| events << ev }
+      events
+    end
+    
+    def with_time(filter)
+      events = []
+      @track.each_with_time(filter) { |ev| events << ev }
+      events
+    end
 end
@@ -0,0 +1,117 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+require 'timeout'
+
+class MusicUserEventTest < Test::Unit::TestCase
+  def setup
+    @sequence = MusicSequence.new
+    @track = @sequence.tracks.new
+    @track.add 0.0, MIDINoteMessage.new(:note => 60)
+    @track.add 1.0, MusicUserEvent.new(:data => 'verse')
+    @track.add 2.0, MIDINoteMessage.new(:note => 64)
+    @track.add 3.0, MusicUserEvent.new(:data => 'x' * 100)
+  end
+  
+  def test_initialization
+    assert_raise(ArgumentError) { MusicUserEvent.new({}) }
+    event = MusicUserEvent.new(:data => 'chorus')
+    assert_equal 'chorus', event.data
+    assert_equal 6, event.length
+    assert event.data.frozen?
+  end
+  
+  def test_eq
+    assert_equal MusicUserEvent.new(:data => 'a'), MusicUserEvent.new(:data => 'a')
+    assert_not_equal MusicUserEvent.new(:data => 'a'), MusicUserEvent.new(:data => 'b')
+    assert_not_equal MusicUserEvent.new(:data => 'a'), MIDIRawData.new(:data => 'a')
+  end
+  
+  def test_add
+    assert_equal [MusicUserEvent.new(:data => 'verse'), MusicUserEvent.new(:data => 'x' * 100)],
+                 @track.to_enum(:each, :type => :user).to_a
+    assert_equal 2, @track.to_enum(:each, :type => :note).count
+    assert_raise(ArgumentError) { @track.add_user_event 0, MIDIRawData.new(:data => 'x') }
+    
+    iter = @track.iterator
+    iter.event = MusicUserEvent.new(:data => 'intro')
+    assert_equal MusicUserEvent.new(:data => 'intro'), iter.event
+  end
+  
+  def test_on_user_event__virtual_clock
+    player = MusicPlayer.new
+    player.virtual_clock = true
+    player.sequence = @sequence
+    cues = Queue.new
+    @sequence.on_user_event { |cue| cues << cue }
+    player.start
+    player.advance(2.0)
+    
+    cue = cues.pop
+    assert_equal MusicUserEvent.new(:data => 'verse'), cue.event
+    assert_equal 1.0, cue.beat
+    assert_equal 0, cue.track
+    assert cue.latency >= 0
+    # Longer payloads than fit in the queue are carried all the same.
+    cue = cues.pop
+    assert_equal 3.0, cue.beat
+    assert_equal 'x' * 100, cue.event.data
+    
+    # Without a handler cues are no longer queued.
+    @sequence.on_user_event
+    player.time = 0.0
+    player.start
+    player.advance(2.0)
+    sleep 0.05
+    assert cues.empty?
+    assert_equal 0, @sequence.dropped_cues
+  end
+  
+  def test_on_user_event__replaced_by_handler
+    player = MusicPlayer.new
+    player.virtual_clock = true
+    player.sequence = @sequence
+    8.times { |i| @track.add 4.0 + i, MusicUserEvent.new(:data => i.to_s) }
+    first, second = Queue.new, Queue.new
+    @sequence.on_user_event do |cue|
+      @sequence.on_user_event { |later| second << later.beat }
+      first << cue.beat
+    end
+    player.start
+    player.advance(1.0)
+    assert_equal 1.0, first.pop
+    player.advance(6.0)
+    
+    # The first handler's dispatcher has gone, so the second sees every cue.
+    assert_equal [3.0] + (4..11).map(&:to_f), Timeout.timeout(5) { Array.new(9) { second.pop } }
+    assert first.empty?
+    @sequence.on_user_event
+  end
+  
+  def test_on_user_event__slow_handler
+    reader, writer = IO.pipe
+    @sequence.tracks.tempo.add 0.0, ExtendedTempoEvent.new(:bpm => 600)
+    @sequence.midi_endpoint = output = MIDIOutput.new(writer)
+    player = MusicPlayer.new
+    player.sequence = @sequence
+    cues = []
+    @sequence.on_user_event { |cue| sleep 0.4; cues << cue }
+    player.start
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    # The first handler runs past the end at 600 bpm, but playback keeps time.
+    assert_equal true, player.wait_for_stop(5)
+    assert_in_delta 0.3, Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, 0.1
+    @sequence.on_user_event
+    assert_equal [1.0, 3.0], cues.map(&:beat)
+    assert cues.last.latency >= 0.15
+  ensure
+    output.close if output
+    reader.close
+    writer.close
+  end
+  
+  def test_on_user_event__detach
+    @sequence.on_user_event { }
+    detached = @sequence.detach
+    assert_raise(IOError) { @sequence.on_user_event { } }
+    assert_equal 2, MusicSequence.attach(detached).tracks[0].to_enum(:each, :type => :user).count
+  end
+end
@@ -0,0 +1,169 @@
+require File.join(File.dirname(__FILE__), 'test_helper.rb')
+
+class RenderCacheTest < Test::Unit::TestCase
+  RATE = 8000
+  
+  def setup
+    @sequence = MusicSequence.new
+    @sequence.tracks.tempo.add 0, ExtendedTempoEvent.new(:bpm => 120)
+    @track = @sequence.tracks.new
+    64.times { |i| @track.add i, MIDINoteMessage.new(:note => 48 + i % 24, :duration => 0.5) }
+    @cache = RenderCache.new
+  end
+  
+  def test_render
+    pcm = @sequence.render(:sample_rate => RATE)
+    # 64 beats at 120 bpm, plus the last note's release.
+    assert_equal 32 * RATE + (0.05 * RATE).ceil - RATE / 4, pcm.bytesize / 4
+    assert pcm.unpack('f*').any? { |x| x.abs > 0.1 }
+    assert_equal 4 * RATE * 4, @sequence.render(:sample_rate => RATE, :length => 8).bytesize
+  end
+  
+  def test_render__cached
+    uncached = @sequence.render(:sample_rate => RATE)
+    assert_equal uncached, @sequence.render(:sample_rate => RATE, :cache => @cache)
+    misses = @cache.misses
+    assert_equal 0, @cache.hits
+    assert_equal misses, @cache.count
+    
+    assert_equal uncached, @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal misses, @cache.hits
+    assert_equal misses, @cache.misses
+  end
+  
+  def test_render__after_edit
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    segments = @cache.misses
+    
+    iter = @track.iterator
+    iter.seek 40
+    iter.event = MIDINoteMessage.new(:note => 90, :duration => 0.5)
+    pcm = @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal 1, @cache.misses - segments
+    assert_equal @sequence.render(:sample_rate => RATE), pcm
+  end
+  
+  def test_render__after_tempo_change
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    segments = @cache.misses
+    
+    # Only segments after the change move.
+    @sequence.tracks.tempo.add 48, ExtendedTempoEvent.new(:bpm => 90)
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert @cache.hits >= segments / 2, "Expected segments before the tempo change to be reused."
+    assert @cache.misses > segments
+  end
+  
+  def test_eviction
+    @cache.max_size = 2 * 32768 * 4
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal 2, @cache.count
+    assert @cache.size <= @cache.max_size
+    assert @cache.evictions > 0
+    
+    @cache.clear
+    assert_equal 0, @cache.count
+    assert_equal 0, @cache.size
+  end
+  
+  def test_stats
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    stats = @cache.stats
+    assert_equal @cache.misses, stats[:misses]
+    assert_equal RenderCache.new(1024).max_size, 1024
+  end
+  
+  def test_render__polyphony
+    chord = MusicSequence.new
+    track = chord.tracks.new
+    track.add 0.5, MIDINoteMessage.new(:note => 60, :velocity => 20, :duration => 3.5)
+    track.add 0, MIDINoteMessage.new(:note => 64, :velocity => 120, :duration => 4)
+    track.add 1, MIDINoteMessage.new(:note => 67, :velocity => 120, :duration => 3)
+    
+    full = chord.render(:sample_rate => RATE)
+    assert_equal full, chord.render(:sample_rate => RATE, :polyphony => 3)
+    oldest = chord.render(:sample_rate => RATE, :polyphony => 2, :steal => :oldest)
+    quietest = chord.render(:sample_rate => RATE, :polyphony => 2, :steal => :quietest)
+    assert_not_equal full, oldest
+    assert_not_equal oldest, quietest
+    
+    # Stealing the quiet note removes less than stealing a loud one.
+    energy = lambda { |pcm| pcm.unpack('f*').inject(0) { |sum, x| sum + x * x } }
+    assert energy[quietest] > energy[oldest]
+    
+    assert_raise(ArgumentError) { chord.render(:polyphony => 0) }
+    assert_raise(ArgumentError) { chord.render(:steal => :newest) }
+  end
+  
+  def test_render__polyphony_cached
+    pcm = @sequence.render(:sample_rate => RATE, :polyphony => 1, :cache => @cache)
+    misses = @cache.misses
+    assert_equal pcm, @sequence.render(:sample_rate => RATE, :polyphony => 1)
+    # Segments rendered with a different pool are not reused.
+    @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal 2 * misses, @cache.misses
+  end
+  
+  def test_render__stolen_across_segments
+    sequence = MusicSequence.new
+    track = sequence.tracks.new
+    track.add 0, MIDINoteMessage.new(:note => 60, :duration => 16)
+    track.add 1, MIDINoteMessage.new(:note => 64, :duration => 1)
+    
+    # The long note loses its voice for good, not just in the first segment.
+    pcm = sequence.render(:sample_rate => RATE, :polyphony => 1).unpack('f*')
+    assert pcm[RATE, RATE / 2].any? { |x| x != 0.0 }
+    assert pcm[2 * RATE..-1].all? { |x| x == 0.0 }
+    assert_equal pcm, sequence.render(:sample_rate => RATE, :polyphony => 1, :cache => @cache).unpack('f*')
+  end
+  
+  def test_render__controllers_are_sample_accurate
+    sequence = MusicSequence.new
+    track = sequence.tracks.new
+    track.add 0, MIDINoteMessage.new(:channel => 0, :note => 69, :velocity => 127, :duration => 4)
+    # 4000 frames per beat at 120 bpm; this lands on frame 4001.
+    track.add 1.0003, MIDIControlChangeMessage.new(:channel => 0, :number => 7, :value => 0)
+    pcm = sequence.render(:sample_rate => RATE).unpack('f*')
+    
+    assert pcm[3990, 11].any? { |x| x.abs > 1e-3 }
+    assert pcm[4001, 12000].all? { |x| x == 0.0 }
+  end
+  
+  def test_render__pitch_bend
+    sequence = MusicSequence.new
+    track = sequence.tracks.new
+    track.add 0, MIDINoteMessage.new(:channel => 0, :note => 69, :velocity => 127, :duration => 4)
+    # Full bend up, two semitones: 14-bit value 16383, LSB first.
+    track.add 2, MIDIChannelMessage.new(:status => 0xE0, :data1 => 0x7F, :data2 => 0x7F)
+    pcm = sequence.render(:sample_rate => RATE).unpack('f*')
+    
+    crossings = lambda do |from|
+      (from...from + RATE / 2).count { |i| (pcm[i] < 0) != (pcm[i + 1] < 0) }
+    end
+    assert_in_delta 440, crossings[100], 2
+    assert_in_delta 440 * 2 ** (2 / 12.0), crossings[8000], 2
+  end
+  
+  def test_render__controllers_cached
+    @track.add 20, MIDIControlChangeMessage.new(:channel => 1, :number => 11, :value => 40)
+    pcm = @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal @sequence.render(:sample_rate => RATE), pcm
+    segments = @cache.misses
+    
+    # Every segment from the change on is affected.
+    iter = @track.iterator
+    iter.seek 20
+    iter.next until MIDIControlChangeMessage === iter.event
+    iter.event = MIDIControlChangeMessage.new(:channel => 1, :number => 11, :value => 80)
+    pcm = @sequence.render(:sample_rate => RATE, :cache => @cache)
+    assert_equal @sequence.render(:sample_rate => RATE), pcm
+    assert @cache.hits > 0
+    assert @cache.misses - segments < segments
+  end
+  
+  def test_render__unbounded_loop
+    @track.loop_info = { :duration => 4, :number => 0 }
+    assert_raise(ArgumentError) { @sequence.render }
+    assert_equal 16 * 44100 * 4, @sequence.render(:length => 32).bytesize
+  end
+end